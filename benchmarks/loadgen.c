@@ -0,0 +1,381 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+/**
+ * Load generator over loopback, with keep-alive and pipelined requests.
+ *
+ * By default it starts an onion server in process, one after another in O_ONE_LOOP,
+ * O_THREADED and O_POOL modes, and for each one reports requests per second and
+ * latency percentiles. With -u it loads any external server instead.
+ *
+ * Usage: onion-loadgen [-c connections] [-p pipeline] [-d seconds] [-m modes]
+ *                      [-P port] [-u host:port] [--quick]
+ *
+ * - -c connections  Concurrent keep-alive connections, each on its own thread. Default 16.
+ *                   O_ONE_LOOP serves a connection at a time, so it always uses one.
+ * - -p pipeline     Requests written at once on each connection before reading the answers. Default 1.
+ * - -d seconds      Duration of each run. Default 2.
+ * - -m modes        Comma separated list of one_loop, threaded and pool. Default all.
+ * - -P port         First port to listen at; each mode uses the next one. Default 8095.
+ * - -u host:port    Loads this server instead, with GET /.
+ * - --quick         Short runs with few connections, just to check it works.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/handler.h>
+#include <onion/handlers/static.h>
+
+typedef struct {
+  const char *name;
+  int flags;
+} loadgen_mode;
+
+static loadgen_mode modes[] = {
+  {"one_loop", O_ONE_LOOP},
+  {"threaded", O_THREADED},
+  {"pool", O_POOL},
+  {NULL, 0}
+};
+
+/// Options, and the shared state of a run.
+typedef struct {
+  const char *host;
+  const char *port;
+  const char *path;
+  int connections;
+  int pipeline;
+  double duration;
+  volatile int stop;
+} loadgen_run;
+
+/// Per connection results.
+typedef struct {
+  loadgen_run *run;
+  pthread_t thread;
+  long requests;
+  long errors;
+  double *latencies;            ///< In microseconds, one per request.
+  long nlatencies;
+  long latencies_size;
+} loadgen_client;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int connect_to(const char *host, const char *port) {
+  struct addrinfo hints, *res, *rp;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &res) != 0)
+    return -1;
+  int fd = -1;
+  for (rp = res; rp; rp = rp->ai_next) {
+    fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd >= 0) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+static void add_latency(loadgen_client * client, double us) {
+  if (client->nlatencies == client->latencies_size) {
+    client->latencies_size = client->latencies_size ? client->latencies_size * 2 : 4096;
+    client->latencies =
+        realloc(client->latencies, client->latencies_size * sizeof(double));
+  }
+  client->latencies[client->nlatencies++] = us;
+}
+
+/**
+ * @short Length of the first full response at data, or 0 if it is not complete yet. -1 on errors.
+ *
+ * If the server will close the connection after it, sets close.
+ */
+static long response_length(const char *data, size_t length, int *close) {
+  const char *end = memmem(data, length, "\r\n\r\n", 4);
+  if (!end)
+    return 0;
+  long headers = end + 4 - data;
+  long content_length = 0;
+  const char *p = data;
+  while (p < end) {
+    const char *eol = memchr(p, '\n', end - p);
+    if (!eol)
+      break;
+    if (strncasecmp(p, "Content-Length:", 15) == 0)
+      content_length = atol(p + 15);
+    else if (strncasecmp(p, "Connection: close", 17) == 0)
+      *close = 1;
+    p = eol + 1;
+  }
+  if (strncmp(data, "HTTP/1.", 7) != 0)
+    return -1;
+  if (headers + content_length > length)
+    return 0;
+  return headers + content_length;
+}
+
+static void *client_main(void *_client) {
+  loadgen_client *client = _client;
+  loadgen_run *run = client->run;
+  char request[256];
+  int request_length = snprintf(request, sizeof(request),
+                                "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                                run->path, run->host);
+  char *requests = malloc(request_length * run->pipeline);
+  int i;
+  for (i = 0; i < run->pipeline; i++)
+    memcpy(requests + i * request_length, request, request_length);
+
+  char buffer[64 * 1024];
+  size_t buffer_length = 0;
+  int fd = -1;
+  while (!run->stop) {
+    if (fd < 0) {
+      fd = connect_to(run->host, run->port);
+      if (fd < 0) {
+        client->errors++;
+        usleep(10000);
+        continue;
+      }
+      buffer_length = 0;
+    }
+    double start = now();
+    size_t total = request_length * run->pipeline;
+    if (write(fd, requests, total) != total) {
+      client->errors++;
+      close(fd);
+      fd = -1;
+      continue;
+    }
+    int pending = run->pipeline;
+    int closing = 0;
+    while (pending > 0) {
+      long length = response_length(buffer, buffer_length, &closing);
+      if (length > 0) {
+        add_latency(client, (now() - start) * 1e6);
+        client->requests++;
+        pending--;
+        memmove(buffer, buffer + length, buffer_length - length);
+        buffer_length -= length;
+        if (closing) {          // As O_ONE_LOOP does; the rest of the pipeline is lost.
+          close(fd);
+          fd = -1;
+          break;
+        }
+        continue;
+      }
+      ssize_t r = -1;
+      if (length == 0 && buffer_length < sizeof(buffer))
+        r = read(fd, buffer + buffer_length, sizeof(buffer) - buffer_length);
+      if (r == 0 && buffer_length == 0) {       // Closed between responses; not an error
+        close(fd);
+        fd = -1;
+        break;
+      }
+      if (r <= 0) {             // Closed, or a bad answer
+        client->errors++;
+        close(fd);
+        fd = -1;
+        break;
+      }
+      buffer_length += r;
+    }
+  }
+  if (fd >= 0)
+    close(fd);
+  free(requests);
+  return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double da = *(const double *)a, db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+/// Runs the clients against run->host and run->port, and prints the results.
+static int loadgen(loadgen_run * run, const char *name) {
+  loadgen_client *clients = calloc(run->connections, sizeof(loadgen_client));
+  int i;
+  run->stop = 0;
+  double start = now();
+  for (i = 0; i < run->connections; i++) {
+    clients[i].run = run;
+    pthread_create(&clients[i].thread, NULL, client_main, &clients[i]);
+  }
+  usleep(run->duration * 1e6);
+  run->stop = 1;
+  long requests = 0, errors = 0, nlatencies = 0;
+  for (i = 0; i < run->connections; i++) {
+    pthread_join(clients[i].thread, NULL);
+    requests += clients[i].requests;
+    errors += clients[i].errors;
+    nlatencies += clients[i].nlatencies;
+  }
+  double elapsed = now() - start;
+
+  double *latencies = malloc((nlatencies + 1) * sizeof(double));
+  long n = 0;
+  for (i = 0; i < run->connections; i++) {
+    memcpy(latencies + n, clients[i].latencies,
+           clients[i].nlatencies * sizeof(double));
+    n += clients[i].nlatencies;
+    free(clients[i].latencies);
+  }
+  qsort(latencies, n, sizeof(double), cmp_double);
+#define PERCENTILE(p) (n ? latencies[(long)((n - 1) * (p))] : 0)
+  printf("%-10s %6d %9d %12.0f %10.0f %10.0f %10.0f %10.0f %8ld\n", name,
+         run->connections, run->pipeline, requests / elapsed, PERCENTILE(0.5),
+         PERCENTILE(0.9), PERCENTILE(0.99), PERCENTILE(1.0), errors);
+#undef PERCENTILE
+  fflush(stdout);
+  free(latencies);
+  free(clients);
+  return requests > 0 ? 0 : 1;
+}
+
+/// Starts an onion server at the given mode, and loads it.
+static int loadgen_mode_run(loadgen_run * run, loadgen_mode * mode) {
+  onion *o = onion_new(mode->flags | O_DETACH_LISTEN | O_NO_SIGTERM);
+  onion_set_hostname(o, run->host);
+  onion_set_port(o, run->port);
+  onion_set_root_handler(o, onion_handler_static("Hello, World!\n", 200));
+  if (onion_listen(o) != 0) {
+    fprintf(stderr, "Could not listen at %s:%s\n", run->host, run->port);
+    onion_free(o);
+    return 1;
+  }
+  usleep(100000);
+
+  int connections = run->connections;
+  if (mode->flags == O_ONE_LOOP)
+    run->connections = 1;
+  int ret = loadgen(run, mode->name);
+  run->connections = connections;
+
+  onion_listen_stop(o);
+  onion_free(o);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  loadgen_run run;
+  memset(&run, 0, sizeof(run));
+  run.host = "127.0.0.1";
+  run.path = "/";
+  run.connections = 16;
+  run.pipeline = 1;
+  run.duration = 2;
+  const char *port = "8095";
+  const char *url = NULL;
+  const char *selected = NULL;
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--quick") == 0) {
+      run.duration = 0.2;
+      run.connections = 4;
+    } else if (i + 1 < argc && strcmp(argv[i], "-c") == 0)
+      run.connections = atoi(argv[++i]);
+    else if (i + 1 < argc && strcmp(argv[i], "-p") == 0)
+      run.pipeline = atoi(argv[++i]);
+    else if (i + 1 < argc && strcmp(argv[i], "-d") == 0)
+      run.duration = atof(argv[++i]);
+    else if (i + 1 < argc && strcmp(argv[i], "-m") == 0)
+      selected = argv[++i];
+    else if (i + 1 < argc && strcmp(argv[i], "-P") == 0)
+      port = argv[++i];
+    else if (i + 1 < argc && strcmp(argv[i], "-u") == 0)
+      url = argv[++i];
+    else {
+      fprintf(stderr,
+              "Usage: %s [-c connections] [-p pipeline] [-d seconds] [-m one_loop,threaded,pool] [-P port] [-u host:port] [--quick]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (run.connections < 1)
+    run.connections = 1;
+  if (run.pipeline < 1)
+    run.pipeline = 1;
+  // Do not log each request
+  setenv("ONION_LOG", "noinfo", 0);
+
+  printf("%-10s %6s %9s %12s %10s %10s %10s %10s %8s\n", "mode", "conns",
+         "pipeline", "req/s", "p50 us", "p90 us", "p99 us", "max us",
+         "errors");
+
+  int ret = 0;
+  if (url) {
+    char host[256];
+    snprintf(host, sizeof(host), "%s", url);
+    char *colon = strrchr(host, ':');
+    if (!colon) {
+      fprintf(stderr, "The url must be host:port\n");
+      return 1;
+    }
+    *colon = '\0';
+    run.host = host;
+    run.port = colon + 1;
+    return loadgen(&run, "external");
+  }
+
+  int nport = atoi(port);
+  loadgen_mode *mode;
+  for (mode = modes; mode->name; mode++) {
+    if (selected && !strstr(selected, mode->name))
+      continue;
+    char mode_port[16];
+    snprintf(mode_port, sizeof(mode_port), "%d", nport++);
+    run.port = mode_port;
+    ret |= loadgen_mode_run(&run, mode);
+  }
+  return ret;
+}
@@ -0,0 +1,514 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+/**
+ * In process micro benchmarks of the request parser, onion_dict, onion_url routing,
+ * onion_response_write, the codecs and the access log.
+ *
+ * Requests are written to and read from a buffer listen point, so there is no network
+ * nor syscalls involved.
+ *
+ * Usage: onion-microbench [--quick] [filter]
+ *
+ * Only the benchmarks whose name contains filter are run. With --quick each benchmark
+ * runs only a few iterations, just to check they work.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <onion/onion.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/handler.h>
+#include <onion/url.h>
+#include <onion/dict.h>
+#include <onion/block.h>
+#include <onion/codecs.h>
+#include <onion/low.h>
+#include <onion/log.h>
+#include <onion/access_log.h>
+#include <onion/sessions.h>
+#include <onion/sessions_mem.h>
+#include <onion/types_internal.h>
+#include <onion/handlers/static.h>
+
+#include "../tests/01-internal/buffer_listen_point.h"
+
+typedef void (*bench_fn) (void *data, long n);
+
+/// Seconds to run each benchmark.
+static double bench_time = 0.5;
+static const char *bench_filter = NULL;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double bench_run(bench_fn f, void *data, long n) {
+  double start = now();
+  f(data, n);
+  return now() - start;
+}
+
+/// Runs f with more and more iterations until it lasts about bench_time, and shows the time per iteration.
+static void bench(const char *name, bench_fn f, void *data) {
+  if (bench_filter && !strstr(name, bench_filter))
+    return;
+  long n = 1;
+  double t = bench_run(f, data, n);
+  while (t < bench_time / 10 && n < (1L << 40)) {
+    n *= 10;
+    t = bench_run(f, data, n);
+  }
+  if (t < bench_time && t > 0) {
+    n = n * (bench_time / t);
+    t = bench_run(f, data, n);
+  }
+  printf("%-36s %12.1f ns/op %14.0f ops/s\n", name, t * 1e9 / n, n / t);
+  fflush(stdout);
+}
+
+/// @{ @name Request parser and processing
+
+typedef struct {
+  onion *server;
+  onion_request *req;
+  const char *data;
+  size_t length;
+} request_bench;
+
+static void request_bench_init(request_bench * rb, onion_handler * root,
+                               const char *data) {
+  rb->server = onion_new(O_ONE_LOOP);
+  onion_add_listen_point(rb->server, NULL, NULL,
+                         onion_buffer_listen_point_new());
+  onion_set_root_handler(rb->server, root);
+  rb->req = onion_request_new(rb->server->listen_points[0]);
+  rb->data = data;
+  rb->length = strlen(data);
+}
+
+static void request_bench_free(request_bench * rb) {
+  onion_request_free(rb->req);
+  onion_free(rb->server);
+}
+
+static void bench_parse(void *data, long n) {
+  request_bench *rb = data;
+  long i;
+  for (i = 0; i < n; i++) {
+    if (onion_request_write(rb->req, rb->data, rb->length) !=
+        OCS_REQUEST_READY) {
+      fprintf(stderr, "Request not parsed\n");
+      exit(1);
+    }
+    onion_request_clean(rb->req);
+  }
+}
+
+static void bench_process(void *data, long n) {
+  request_bench *rb = data;
+  onion_block *out = onion_buffer_listen_point_get_buffer(rb->req);
+  long i;
+  for (i = 0; i < n; i++) {
+    onion_request_write(rb->req, rb->data, rb->length);
+    onion_request_process(rb->req);
+    onion_block_clear(out);
+  }
+}
+
+#define GET_SIMPLE "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n"
+#define GET_BROWSER "GET /some/path/index.html?query=value&other=1&more=2 HTTP/1.1\r\n" \
+  "Host: www.example.com\r\n" \
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n" \
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n" \
+  "Accept-Language: en-US,en;q=0.5\r\n" \
+  "Accept-Encoding: gzip, deflate, br\r\n" \
+  "Referer: https://www.example.com/\r\n" \
+  "Connection: keep-alive\r\n" \
+  "Cookie: sessionid=abcdefghijklmnopqrstuvwxyz012345; theme=dark; lang=en\r\n" \
+  "Upgrade-Insecure-Requests: 1\r\n" \
+  "Cache-Control: max-age=0\r\n\r\n"
+#define POST_FORM "POST /form HTTP/1.1\r\nHost: localhost\r\n" \
+  "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: 41\r\n\r\n" \
+  "name=onion&email=onion%40example.com&x=42"
+
+static void bench_requests() {
+  request_bench rb;
+  request_bench_init(&rb, onion_handler_static("Hello, World!\n", 200),
+                     GET_SIMPLE);
+  bench("parse GET, 1 header", bench_parse, &rb);
+  bench("process GET, static handler", bench_process, &rb);
+  request_bench_free(&rb);
+
+  request_bench_init(&rb, onion_handler_static("Hello, World!\n", 200),
+                     GET_BROWSER);
+  bench("parse GET, 10 headers and query", bench_parse, &rb);
+  bench("process GET, 10 headers and query", bench_process, &rb);
+  request_bench_free(&rb);
+
+  request_bench_init(&rb, onion_handler_static("Hello, World!\n", 200),
+                     POST_FORM);
+  bench("parse POST, urlencoded form", bench_parse, &rb);
+  request_bench_free(&rb);
+}
+
+static void bench_routing() {
+  onion_url *urls = onion_url_new();
+  char path[32];
+  int i;
+  for (i = 0; i < 32; i++) {
+    snprintf(path, sizeof(path), "route%d", i);
+    onion_url_add_static(urls, path, "route", 200);
+  }
+  onion_url_add_static(urls, "^regex/[0-9]+$", "regex", 200);
+
+  request_bench rb;
+  request_bench_init(&rb, onion_url_to_handler(urls),
+                     "GET /route0 HTTP/1.1\r\n\r\n");
+  bench("url, first of 33 routes", bench_process, &rb);
+  rb.data = "GET /route31 HTTP/1.1\r\n\r\n";
+  rb.length = strlen(rb.data);
+  bench("url, 32nd of 33 routes", bench_process, &rb);
+  rb.data = "GET /regex/1234 HTTP/1.1\r\n\r\n";
+  rb.length = strlen(rb.data);
+  bench("url, regex after 32 routes", bench_process, &rb);
+  request_bench_free(&rb);
+}
+
+/// @}
+
+/// @{ @name onion_dict
+
+static const char *dict_keys[] = {
+  "Host", "User-Agent", "Accept", "Accept-Language", "Accept-Encoding",
+  "Referer", "Connection", "Cookie", "Upgrade-Insecure-Requests",
+  "Cache-Control", "Content-Type", "Content-Length", "Authorization",
+  "If-None-Match", "If-Modified-Since", "X-Forwarded-For", NULL
+};
+
+static void bench_dict_add(void *data, long n) {
+  long i;
+  for (i = 0; i < n; i++) {
+    onion_dict *dict = onion_dict_new();
+    const char **key;
+    for (key = dict_keys; *key; key++)
+      onion_dict_add(dict, *key, "some value", OD_DUP_ALL);
+    onion_dict_free(dict);
+  }
+}
+
+static void bench_dict_get(void *data, long n) {
+  onion_dict *dict = data;
+  long i;
+  size_t total = 0;
+  for (i = 0; i < n; i++)
+    total += (size_t) onion_dict_get(dict, dict_keys[i & 15]);
+  if (!total)
+    fprintf(stderr, "Not found\n");
+}
+
+static void bench_dict_json(void *data, long n) {
+  long i;
+  for (i = 0; i < n; i++) {
+    onion_block *bl = onion_dict_to_json(data);
+    onion_dict_free(onion_dict_from_json(onion_block_data(bl)));
+    onion_block_free(bl);
+  }
+}
+
+static void bench_dict_binary(void *data, long n) {
+  long i;
+  for (i = 0; i < n; i++) {
+    onion_block *bl = onion_dict_to_binary(data);
+    onion_dict_free(onion_dict_from_binary(onion_block_data(bl),
+                                           onion_block_size(bl), 0));
+    onion_block_free(bl);
+  }
+}
+
+static void bench_dicts() {
+  bench("dict, new + 16 adds + free", bench_dict_add, NULL);
+  onion_dict *dict = onion_dict_new();
+  const char **key;
+  for (key = dict_keys; *key; key++)
+    onion_dict_add(dict, *key, "some value", 0);
+  bench("dict, get of 16 keys", bench_dict_get, dict);
+  onion_dict_free(dict);
+
+  // A session as the persistent session backends save and load it
+  dict = onion_dict_new();
+  char k[32], v[64];
+  int i;
+  for (i = 0; i < 20; i++) {
+    snprintf(k, sizeof(k), "key_%d", i);
+    snprintf(v, sizeof(v), "Some value for the session, %d", i);
+    onion_dict_add(dict, k, v, OD_DUP_ALL);
+  }
+  onion_dict *sub = onion_dict_new();
+  onion_dict_add(sub, "user", "me", 0);
+  onion_dict_add(sub, "lang", "en", 0);
+  onion_dict_add(dict, "profile", sub, OD_DICT | OD_FREE_VALUE);
+  bench("dict, json round trip of 21 keys", bench_dict_json, dict);
+  bench("dict, binary round trip of 21 keys", bench_dict_binary, dict);
+  onion_dict_free(dict);
+}
+
+/// @}
+
+/// @{ @name onion_response_write
+
+typedef struct {
+  request_bench rb;
+  int chunk;
+  int total;
+} response_bench;
+
+static void bench_response_write(void *data, long n) {
+  response_bench *wb = data;
+  onion_block *out = onion_buffer_listen_point_get_buffer(wb->rb.req);
+  char chunk[4096];
+  memset(chunk, 'x', sizeof(chunk));
+  long i;
+  for (i = 0; i < n; i++) {
+    onion_response *res = onion_response_new(wb->rb.req);
+    int written;
+    for (written = 0; written < wb->total; written += wb->chunk)
+      onion_response_write(res, chunk, wb->chunk);
+    onion_response_free(res);
+    onion_block_clear(out);
+  }
+}
+
+static void bench_responses() {
+  response_bench wb;
+  request_bench_init(&wb.rb, NULL, GET_SIMPLE);
+  onion_request_write(wb.rb.req, wb.rb.data, wb.rb.length);
+  wb.total = 16 * 1024;
+  wb.chunk = 16;
+  bench("response, 16 KB in 16 B writes", bench_response_write, &wb);
+  wb.chunk = 256;
+  bench("response, 16 KB in 256 B writes", bench_response_write, &wb);
+  wb.chunk = 4096;
+  bench("response, 16 KB in 4 KB writes", bench_response_write, &wb);
+  request_bench_free(&wb.rb);
+}
+
+/// @}
+
+/// @{ @name Codecs
+
+static char codec_text[1025];
+
+static void bench_quote(void *data, long n) {
+  long i;
+  for (i = 0; i < n; i++)
+    onion_low_free(onion_quote_new(codec_text));
+}
+
+static void bench_unquote(void *data, long n) {
+  const char *quoted = data;
+  size_t length = strlen(quoted) + 1;
+  char copy[4096];
+  long i;
+  for (i = 0; i < n; i++) {
+    memcpy(copy, quoted, length);
+    onion_unquote_inplace(copy);
+  }
+}
+
+static void bench_base64(void *data, long n) {
+  long i;
+  for (i = 0; i < n; i++)
+    onion_low_free(onion_base64_encode(codec_text, sizeof(codec_text) - 1));
+}
+
+static void bench_html_quote(void *data, long n) {
+  long i;
+  for (i = 0; i < n; i++) {
+    char *r = onion_html_quote(codec_text);
+    if (r)
+      onion_low_free(r);
+  }
+}
+
+static void bench_c_quote(void *data, long n) {
+  long i;
+  for (i = 0; i < n; i++)
+    onion_low_free(onion_c_quote_new(codec_text));
+}
+
+static void bench_codecs() {
+  const char *sample = "Some text, with <html> & \"quotes\"\n/path?a=b ";
+  size_t i;
+  for (i = 0; i < sizeof(codec_text) - 1; i++)
+    codec_text[i] = sample[i % strlen(sample)];
+  codec_text[sizeof(codec_text) - 1] = '\0';
+
+  bench("codecs, quote 1 KB", bench_quote, NULL);
+  char *quoted = onion_quote_new(codec_text);
+  bench("codecs, unquote 1 KB", bench_unquote, quoted);
+  onion_low_free(quoted);
+  bench("codecs, base64 encode 1 KB", bench_base64, NULL);
+  bench("codecs, html quote 1 KB", bench_html_quote, NULL);
+  bench("codecs, C quote 1 KB", bench_c_quote, NULL);
+}
+
+/// @}
+
+/// @{ @name Access log
+
+#define ACCESS_LOG_THREADS 4
+
+typedef struct {
+  request_bench rb;
+  onion_response *res;
+  onion_access_log *log;
+  long n;
+} access_log_bench;
+
+static void bench_access_log(void *data, long n) {
+  access_log_bench *ab = data;
+  long i;
+  for (i = 0; i < n; i++)
+    onion_access_log_response(ab->log, ab->rb.req, ab->res);
+}
+
+static void *bench_access_log_thread(void *data) {
+  access_log_bench *ab = data;
+  bench_access_log(ab, ab->n);
+  return NULL;
+}
+
+/// Same log from several threads, to see the cost of sharing it. Time is per request, not per thread.
+static void bench_access_log_threads(void *data, long n) {
+  access_log_bench *ab = data;
+  access_log_bench tab[ACCESS_LOG_THREADS];
+  pthread_t threads[ACCESS_LOG_THREADS];
+  int i;
+  for (i = 0; i < ACCESS_LOG_THREADS; i++) {
+    tab[i] = *ab;
+    tab[i].n = n / ACCESS_LOG_THREADS;
+    pthread_create(&threads[i], NULL, bench_access_log_thread, &tab[i]);
+  }
+  for (i = 0; i < ACCESS_LOG_THREADS; i++)
+    pthread_join(threads[i], NULL);
+}
+
+static void bench_access_logs() {
+  access_log_bench ab;
+  request_bench_init(&ab.rb, NULL, "GET /some/path/to/log HTTP/1.1\r\n\r\n");
+  onion_request_write(ab.rb.req, ab.rb.data, ab.rb.length);
+  ab.res = onion_response_new(ab.rb.req);
+  ab.log = onion_access_log_file("/dev/null", OAL_COMMON);
+  bench("access log, common to file", bench_access_log, &ab);
+  bench("access log, common, 4 threads", bench_access_log_threads, &ab);
+  onion_access_log_free(ab.log);
+  ab.log = onion_access_log_file("/dev/null", OAL_JSON);
+  bench("access log, json to file", bench_access_log, &ab);
+  onion_access_log_free(ab.log);
+  ab.log = onion_access_log_memory(1024);
+  bench("access log, to memory", bench_access_log, &ab);
+  onion_access_log_free(ab.log);
+  onion_response_free(ab.res);
+  request_bench_free(&ab.rb);
+}
+
+/// @}
+
+/// @{ @name Sessions
+
+#define SESSION_THREADS 4
+
+typedef struct {
+  onion_sessions *sessions;
+  long n;
+} session_bench;
+
+static void bench_session_create(void *data, long n) {
+  onion_sessions *sessions = data;
+  long i;
+  for (i = 0; i < n; i++) {
+    char *id = onion_sessions_create(sessions);
+    onion_sessions_remove(sessions, id);
+    onion_low_free(id);
+  }
+}
+
+static void *bench_session_create_thread(void *data) {
+  session_bench *sb = data;
+  bench_session_create(sb->sessions, sb->n);
+  return NULL;
+}
+
+/// Several threads as with O_POOL. Time is per session, not per thread.
+static void bench_session_create_threads(void *data, long n) {
+  session_bench sb[SESSION_THREADS];
+  pthread_t threads[SESSION_THREADS];
+  int i;
+  for (i = 0; i < SESSION_THREADS; i++) {
+    sb[i].sessions = data;
+    sb[i].n = n / SESSION_THREADS;
+    pthread_create(&threads[i], NULL, bench_session_create_thread, &sb[i]);
+  }
+  for (i = 0; i < SESSION_THREADS; i++)
+    pthread_join(threads[i], NULL);
+}
+
+static void bench_sessions() {
+  onion_sessions *sessions = onion_sessions_mem_new();
+  bench("session, create + remove", bench_session_create, sessions);
+  bench("session, create + remove, 4 threads", bench_session_create_threads,
+        sessions);
+  onion_sessions_free(sessions);
+}
+
+/// @}
+
+int main(int argc, char **argv) {
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--quick") == 0)
+      bench_time = 0.001;
+    else
+      bench_filter = argv[i];
+  }
+  // Do not log each request
+  setenv("ONION_LOG", "noinfo", 0);
+
+  bench_requests();
+  bench_routing();
+  bench_dicts();
+  bench_responses();
+  bench_codecs();
+  bench_access_logs();
+  bench_sessions();
+
+  return 0;
+}
@@ -0,0 +1,538 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+#ifndef ONION_COROUTINE_HPP
+#define ONION_COROUTINE_HPP
+
+// Coroutine handlers need C++20. With older standards this header is empty.
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include "handler.hpp"
+#include "request.hpp"
+#include "response.hpp"
+#include "exceptions.hpp"
+
+#include <onion/onion.h>
+#include <onion/poller.h>
+#include <onion/request.h>
+#include <onion/log.h>
+
+#include <coroutine>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define ONION_HAS_COROUTINES 1
+
+namespace Onion {
+  class Coroutine;
+
+        /**
+	 * @short Base for the awaitables that wait at the server poller.
+	 *
+	 * While the handler runs for the first time the request still belongs to the
+	 * poller thread, so the awaitable is not added to the poller until the request
+	 * is detached (see onion_request_set_yield_callback). From then on it is added
+	 * as soon as the coroutine suspends.
+	 */
+  class PollAwaiter {
+ public:
+        /**
+	 * @short State shared by all the coroutines of a request.
+	 *
+	 * Owns the C++ request and response passed to the handler, so they outlive
+	 * the handler call. Freed, and the request closed, when the handler finishes.
+	 */
+    class Context {
+      std::coroutine_handle <> root;
+      PollAwaiter *pending = nullptr;
+      bool detached = false;
+ public:
+      onion_request * c_req;
+      onion_response *c_res;
+      Request req;
+      Response res;
+      bool yielded = false;     ///< The handler returned OCS_YIELD, so the coroutine must finish the request.
+
+       Context(onion_request * _req, onion_response * _res):c_req(_req),
+          c_res(_res), req(_req), res(_res) {
+      }
+
+      void setRoot(std::coroutine_handle <> h) {
+        root = h;
+      }
+
+      /// Called by the awaiters when the coroutine suspends
+      void suspend(PollAwaiter * a) {
+        if (detached)
+          a->arm();
+        else
+          pending = a;
+      }
+
+      /// Yield callback; the request is not at the poller anymore.
+      static void detach(void *ctx_) {
+        Context *ctx = (Context *) ctx_;
+        ctx->detached = true;
+        PollAwaiter *a = ctx->pending;
+        ctx->pending = nullptr;
+        if (a)
+          a->arm();
+      }
+
+      /// Handles an exception thrown after the handler yielded.
+      void handleException(std::exception_ptr e) {
+        try {
+          std::rethrow_exception(e);
+        }
+        catch(HttpException & e) {
+          e.handle(req, res);
+        }
+        catch(const std::exception & e) {
+          ONION_ERROR("Catched exception: %s", e.what());
+        }
+        catch(...) {
+          ONION_ERROR("Catched unknown exception");
+        }
+      }
+
+      /// Frees everything related to this request, and closes the connection.
+      void finish() {
+        onion_request *r = c_req;
+        onion_response *s = c_res;
+        delete this;            // First, so the stream commits its data
+        onion_response_free(s);
+        onion_request_free(r);
+      }
+
+      /// Destroys the coroutines without resuming them, for example when the poller is freed.
+      void cancel() {
+        ONION_DEBUG("Cancelling coroutine handler for %p", c_req);
+        root.destroy();
+        finish();
+      }
+    };
+
+ protected:
+    int fd;
+    onion_poller_slot_type_e type;
+    Context *ctx = nullptr;
+    std::coroutine_handle <> handle;
+    bool ready = false;
+
+    /// Called at the slot shutdown, once the slot is out of the poller.
+    virtual void done() {
+    }
+ public:
+    PollAwaiter(int _fd, onion_poller_slot_type_e _type):fd(_fd), type(_type) {
+    }
+    virtual ~ PollAwaiter() {
+    }
+
+    bool await_ready() const noexcept {
+      return false;
+    }
+    template < typename P > void await_suspend(std::coroutine_handle < P > h) {
+      handle = h;
+      ctx = h.promise().context();
+      ctx->suspend(this);       // May resume right away at another thread; do not touch this after.
+    }
+    void await_resume() const noexcept {
+    }
+
+    /// Adds the slot to the poller.
+    void arm() {
+      onion *server = onion_request_get_server(ctx->c_req);
+      onion_poller *poller = server ? onion_get_poller(server) : NULL;
+      onion_poller_slot *slot =
+          poller ? onion_poller_slot_new(fd, &PollAwaiter::onReady, this) : NULL;
+      if (!slot) {
+        ONION_ERROR("Can not wait for fd %d at the poller", fd);
+        Context *c = ctx;
+        done();
+        c->cancel();
+        return;
+      }
+      onion_poller_slot_set_type(slot, type);
+      onion_poller_slot_set_shutdown(slot, &PollAwaiter::onShutdown, this);
+      onion_poller_add(poller, slot);
+    }
+ private:
+    static int onReady(void *a) {
+      ((PollAwaiter *) a)->ready = true;
+      return -1;                // Removes the slot, and then onShutdown resumes.
+    }
+    static void onShutdown(void *a_) {
+      PollAwaiter *a = (PollAwaiter *) a_;
+      a->done();
+      if (a->ready)
+        a->handle.resume();
+      else                      // Hang up, or the poller is being freed.
+        a->ctx->cancel();
+    }
+  };
+
+        /**
+	 * @short Suspends the coroutine until the fd is ready to read (or write).
+	 *
+	 * Only one coroutine may wait for a given fd at a time. If the fd hangs up, or
+	 * the server stops, the handler is destroyed without resuming it.
+	 *
+	 * \code
+	 *   co_await Onion::poll(fd);
+	 *   read(fd, ...);
+	 * \endcode
+	 */
+  inline PollAwaiter poll(int fd, onion_poller_slot_type_e type = O_POLL_READ) {
+    return PollAwaiter(fd, type);
+  }
+
+        /**
+	 * @short Suspends the coroutine for some time, without blocking the thread.
+	 */
+  class SleepAwaiter:public PollAwaiter {
+ protected:
+    virtual void done() {
+      close(fd);
+    }
+ public:
+    SleepAwaiter(std::chrono::milliseconds ms):PollAwaiter(timerfd_create
+                                                           (CLOCK_MONOTONIC,
+                                                            TFD_CLOEXEC |
+                                                            TFD_NONBLOCK),
+                                                           O_POLL_READ) {
+      long t = ms.count() > 0 ? ms.count() : 1;   // 0 would disarm it
+      struct itimerspec when = { {0, 0}, {t / 1000, (t % 1000) * 1000000} };
+      timerfd_settime(fd, 0, &when, NULL);
+    }
+  };
+
+        /**
+	 * @short Suspends the coroutine for the given time.
+	 *
+	 * \code
+	 *   co_await Onion::sleep_for(std::chrono::milliseconds(100));
+	 * \endcode
+	 */
+  inline SleepAwaiter sleep_for(std::chrono::milliseconds ms) {
+    return SleepAwaiter(ms);
+  }
+
+        /**
+	 * @short An event that other threads or requests can set to wake up a coroutine handler.
+	 *
+	 * It is an eventfd, so it can be set from any thread, or from a plain handler. Just one
+	 * coroutine may be waiting on it at a time. The event is cleared when the waiter resumes.
+	 *
+	 * \code
+	 *   Onion::Event ev;
+	 *   ...
+	 *   co_await ev.wait();  // At a coroutine handler
+	 *   ...
+	 *   ev.set();            // Anywhere else
+	 * \endcode
+	 */
+  class Event {
+    int fd;
+
+    class Awaiter:public PollAwaiter {
+ protected:
+      virtual void done() {
+        if (ready) {
+          eventfd_t v;
+          eventfd_read(fd, &v);
+        }
+      }
+ public:
+      Awaiter(int fd):PollAwaiter(fd, O_POLL_READ) {
+      }
+    };
+ public:
+    Event():fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+    }
+    ~Event() {
+      close(fd);
+    }
+    Event(const Event &) = delete;
+    Event & operator=(const Event &) = delete;
+
+    /// Wakes up the waiter, now or when it waits.
+    void set() {
+      eventfd_write(fd, 1);
+    }
+    /// Awaitable that resumes once the event is set.
+    Awaiter wait() {
+      return Awaiter(fd);
+    }
+  };
+
+        /**
+	 * @short Return type of the coroutine handlers.
+	 *
+	 * The handler runs as normal until the first co_await that needs to wait. Then it returns
+	 * OCS_YIELD to the server, and keeps running later from the poller threads. If it never
+	 * waits, it is just as a normal handler.
+	 *
+	 * Once it yielded, when the handler co_returns the response is finished and the connection
+	 * closed, as with other OCS_YIELD handlers, so no keep alive. Exceptions are handled as at
+	 * normal handlers before the first wait, and just logged (or Onion::HttpException written)
+	 * after.
+	 *
+	 * \code
+	 *   url.add("slow", [](Onion::Request &req, Onion::Response &res) -> Onion::Coroutine {
+	 *     co_await Onion::sleep_for(std::chrono::seconds(1));
+	 *     res<<"Done";
+	 *     co_return OCS_PROCESSED;
+	 *   });
+	 * \endcode
+	 *
+	 * Request and response are valid for the whole handler, but other references passed to
+	 * the coroutine, or captured by a lambda, must outlive it.
+	 */
+  class Coroutine {
+ public:
+    struct promise_type;
+    typedef std::coroutine_handle < promise_type > handle_type;
+    typedef PollAwaiter::Context Context;
+
+    /// At the end it frees the request, if the handler already yielded.
+    struct FinalAwaiter {
+      bool await_ready() const noexcept {
+        return false;
+      }
+      void await_suspend(handle_type h) noexcept {
+        Context *ctx = h.promise().ctx;
+        if (ctx && ctx->yielded) {
+          std::exception_ptr e = h.promise().exception;
+          if (e)
+            ctx->handleException(e);
+          h.destroy();
+          ctx->finish();
+        }
+      }
+      void await_resume() const noexcept {
+      }
+    };
+
+    struct promise_type {
+      Context *ctx = nullptr;
+      onion_connection_status status = OCS_PROCESSED;
+      std::exception_ptr exception;
+
+      Coroutine get_return_object() {
+        return Coroutine(handle_type::from_promise(*this));
+      }
+      std::suspend_always initial_suspend() noexcept {
+        return {
+        };
+      }
+      FinalAwaiter final_suspend() noexcept {
+        return {
+        };
+      }
+      void return_value(onion_connection_status s) {
+        status = s;
+      }
+      void unhandled_exception() {
+        exception = std::current_exception();
+      }
+      Context *context() {
+        return ctx;
+      }
+    };
+ private:
+    handle_type h;
+    explicit Coroutine(handle_type _h):h(_h) {
+    }
+ public:
+    Coroutine(Coroutine && o):h(std::exchange(o.h, nullptr)) {
+    }
+    Coroutine(const Coroutine &) = delete;
+    ~Coroutine() {
+      if (h)
+        h.destroy();
+    }
+
+    /// Releases the coroutine handle, to be managed by the handler.
+    handle_type release() {
+      return std::exchange(h, nullptr);
+    }
+  };
+
+        /**
+	 * @short A coroutine that returns a value, to be co_await'ed from a handler or another Task.
+	 *
+	 * It does not run until awaited, and can use the same awaitables as the handlers.
+	 *
+	 * \code
+	 *   Onion::Task<std::string> fetch(int fd){
+	 *     co_await Onion::poll(fd);
+	 *     ...
+	 *     co_return data;
+	 *   }
+	 *
+	 *   ...
+	 *   std::string data = co_await fetch(fd);
+	 * \endcode
+	 */
+  template < typename T > class Task {
+ public:
+    struct promise_base {
+      PollAwaiter::Context * ctx = nullptr;
+      std::coroutine_handle <> continuation;
+      std::exception_ptr exception;
+
+      std::suspend_always initial_suspend() noexcept {
+        return {
+        };
+      }
+      struct FinalAwaiter {
+        bool await_ready() const noexcept {
+          return false;
+        }
+        template < typename P >
+            std::coroutine_handle <>
+            await_suspend(std::coroutine_handle < P > h) noexcept {
+          return h.promise().continuation;
+        }
+        void await_resume() const noexcept {
+        }
+      };
+      FinalAwaiter final_suspend() noexcept {
+        return {
+        };
+      }
+      void unhandled_exception() {
+        exception = std::current_exception();
+      }
+      PollAwaiter::Context * context() {
+        return ctx;
+      }
+    };
+    struct promise_value:promise_base {
+      T value;
+      void return_value(T v) {
+        value = std::move(v);
+      }
+      T result() {
+        return std::move(value);
+      }
+    };
+    struct promise_void:promise_base {
+      void return_void() {
+      }
+      void result() {
+      }
+    };
+    struct promise_type:std::conditional < std::is_void < T >::value,
+        promise_void, promise_value >::type {
+      Task get_return_object() {
+        return Task(std::coroutine_handle < promise_type >::from_promise(*this));
+      }
+    };
+ private:
+    std::coroutine_handle < promise_type > h;
+    explicit Task(std::coroutine_handle < promise_type > _h):h(_h) {
+    }
+ public:
+    Task(Task && o):h(std::exchange(o.h, nullptr)) {
+    }
+    Task(const Task &) = delete;
+    ~Task() {
+      if (h)
+        h.destroy();
+    }
+
+    bool await_ready() const noexcept {
+      return false;
+    }
+    template < typename P >
+        std::coroutine_handle <> await_suspend(std::coroutine_handle < P >
+                                               parent) {
+      h.promise().ctx = parent.promise().context();
+      h.promise().continuation = parent;
+      return h;
+    }
+    T await_resume() {
+      if (h.promise().exception)
+        std::rethrow_exception(h.promise().exception);
+      return h.promise().result();
+    }
+  };
+
+        /**
+	 * @short Creates a Handler from a coroutine.
+	 *
+	 * The function signature is Onion::Coroutine (Onion::Request&, Onion::Response&).
+	 */
+  class HandlerCoroutine:public HandlerBase {
+ public:
+    typedef std::function < Coroutine(Request &, Response &) >
+        fn_t;
+ private:
+    fn_t fn;
+ public:
+    HandlerCoroutine(fn_t _fn):fn(_fn) {
+    }
+    virtual onion_connection_status operator() (Request & req,
+                                                Response & res) {
+      Coroutine::Context * ctx =
+          new Coroutine::Context(req.c_handler(), res.c_handler());
+      Coroutine::handle_type h;
+      try {
+        h = fn(ctx->req, ctx->res).release();
+      }
+      catch( ...) {
+        delete ctx;
+        throw;
+      }
+      h.promise().ctx = ctx;
+      ctx->setRoot(h);
+      h.resume();
+
+      if (h.done()) {           // Did not need to wait
+        onion_connection_status status = h.promise().status;
+        std::exception_ptr e = h.promise().exception;
+        h.destroy();
+        delete ctx;
+        if (e)
+          std::rethrow_exception(e);
+        return status;
+      }
+      ctx->yielded = true;
+      ctx->res.flush();         // Commits the put area, as the response is flushed on return
+      onion_request_set_yield_callback(ctx->c_req, &Coroutine::Context::detach,
+                                       ctx);
+      return OCS_YIELD;
+    }
+  };
+}
+
+#endif
+#endif
@@ -145,8 +145,13 @@ onion_dict *Onion::Dict::c_handler() const noexcept {
 namespace Onion {
   void add_to_map(std::map < std::string, std::string > *ret, const char *key,
                   const char *value, int flags) {
-    if ((flags & OD_DICT) == 0)
-      (*ret)[key] = value;
+    if ((flags & OD_DICT) != 0)
+      return;
+    // Visited in key order, so new keys go at the end. Repeated keys keep the last value.
+    if (!ret->empty() && ret->rbegin()->first == key)
+      ret->rbegin()->second = value;
+    else
+      ret->emplace_hint(ret->end(), key, value);
   } Dict::operator  std::map < std::string, std::string > () {
     std::map < std::string, std::string > ret;
 
@@ -30,8 +30,40 @@
 #include <onion/block.h>
 #include <map>
 #include <memory>
+#include <cstring>
+#include <type_traits>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 namespace Onion {
+#if __cplusplus >= 201703L
+        /**
+	 * @short NUL terminated version of a std::string_view, to use as key at the C API.
+	 * 
+	 * Short keys are copied at the stack, so there is no allocation.
+	 */
+  class cstring_key {
+    char small[128];
+    std::string large;
+    const char *str;
+ public:
+     explicit cstring_key(std::string_view k) {
+      if (k.size() < sizeof(small)) {
+        memcpy(small, k.data(), k.size());
+        small[k.size()] = '\0';
+        str = small;
+      } else {
+        large.assign(k);
+        str = large.c_str();
+      }
+    }
+    const char *c_str() const noexcept {
+      return str;
+    }
+  };
+#endif
+
         /**
 	 * @short Wrapper for onion_dict, manages hierachical dictionaries.
 	 * 
@@ -129,12 +161,60 @@ namespace Onion {
 		 * @short Try to get a key, if not existant, throws an key_not_found exception.
 		 */
     std::string operator[](const std::string & k)const {
-      const char *r = onion_dict_get(ptr.get(), k.c_str());
+      return (*this)[k.c_str()];
+    }
+
+    std::string operator[](const char *k) const {
+      const char *r = onion_dict_get(ptr.get(), k);
       if (!r)
         throw key_not_found {
         k};
        return r;
     }
+
+#if __cplusplus >= 201703L
+    std::string operator[](std::string_view k) const {
+      return (*this)[cstring_key(k).c_str()];
+    }
+
+            /**
+		 * @short Gets a value without copying it, or a default value.
+		 * 
+		 * The view points into the dictionary, so it is valid while the key is not
+		 * removed or replaced.
+		 */
+    std::string_view getView(const char *k, std::string_view def = {
+                             }) const noexcept {
+      const char *r = onion_dict_get(ptr.get(), k);
+      return (!r) ? def : std::string_view(r);
+    }
+
+    std::string_view getView(std::string_view k, std::string_view def = {
+                             }) const noexcept {
+      return getView(cstring_key(k).c_str(), def);
+    }
+
+    bool has(std::string_view k) const noexcept {
+      return onion_dict_get(ptr.get(), cstring_key(k).c_str()) != nullptr;
+    }
+
+    bool has(const char *k) const noexcept {
+      return onion_dict_get(ptr.get(), k) != nullptr;
+    }
+
+            /**
+		 * @short Calls fn(std::string_view key, std::string_view value) for each string element, in key order.
+		 * 
+		 * There are no copies, so it is the fastest way to go over all the elements. Subdictionaries
+		 * are skipped.
+		 */
+    template < typename F > void forEach(F && fn) const {
+      onion_dict_preorder(ptr.get(),
+                          (void *)&Dict::forEachHelper <
+                          typename std::remove_reference < F >::type >,
+                          (void *)&fn);
+    }
+#endif
                 /**
 		 * @short Assings the reference to the dictionary.
 		 */ Dict & operator=(const Dict & o);
@@ -262,6 +342,18 @@ namespace Onion {
 		 * @short Returns the C onion_dict handler, to be able to use C functions.
 		 */
     onion_dict *c_handler() const noexcept;
+
+#if __cplusplus >= 201703L
+ private:
+    template < typename F > static void forEachHelper(void *fn,
+                                                      const char *key,
+                                                      const void *value,
+                                                      int flags) {
+      if (!(flags & OD_DICT))
+        (*static_cast < F * >(fn)) (std::string_view(key),
+                                    std::string_view((const char *)value));
+    }
+#endif
   };
 }
 
@@ -54,8 +54,8 @@ namespace Onion {
       return str;
     }
     /// How to handle this exception type. May be a redirect, or just plain show this message.
-    virtual onion_connection_status handle(Onion::Request & req,
-                                           Onion::Response & res);
+    virtual onion_connection_status handle(Request & req,
+                                           Response & res);
   };
 
         /**
@@ -29,6 +29,9 @@
 #include <string>
 #include <onion/request.h>
 #include <onion/low.h>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 namespace Onion {
         /**
@@ -43,9 +46,68 @@ namespace Onion {
     }
                 /**
 		 * @short Gets some datastraight from the headers.
+		 * 
+		 * Throws Dict::key_not_found if not present.
 		 */ std::string operator[] (const std::string & h) {
-      return headers()[h];
+      const char *r = onion_request_get_header(ptr, h.c_str());
+      if (!r)
+        throw Dict::key_not_found(h);
+      return r;
+    }
+
+#if __cplusplus >= 201703L
+    /// @{ @name Accessors without copies. Views are valid while the request is.
+
+                /**
+		 * @short Gets a header, or def if not present.
+		 */
+    std::string_view headerView(std::string_view key, std::string_view def = {
+                                }) const noexcept {
+      return view(onion_request_get_header(ptr, cstring_key(key).c_str()), def);
+    }
+                /**
+		 * @short Gets a query value, or def if not present.
+		 */
+    std::string_view queryView(std::string_view key, std::string_view def = {
+                               }) const noexcept {
+      return view(onion_request_get_query(ptr, cstring_key(key).c_str()), def);
+    }
+                /**
+		 * @short Gets a post value, or def if not present.
+		 */
+    std::string_view postView(std::string_view key, std::string_view def = {
+                              }) const noexcept {
+      return view(onion_request_get_post(ptr, cstring_key(key).c_str()), def);
+    }
+                /**
+		 * @short Gets a cookie, or def if not present.
+		 */
+    std::string_view cookieView(std::string_view key, std::string_view def = {
+                                }) const noexcept {
+      return view(onion_request_get_cookie(ptr, cstring_key(key).c_str()), def);
+    }
+                /**
+		 * @short Gets a session value, or def if not present. Valid until the session changes.
+		 */
+    std::string_view sessionView(std::string_view key, std::string_view def = {
+                                 }) const noexcept {
+      return view(onion_request_get_session(ptr, cstring_key(key).c_str()),
+                  def);
+    }
+                /**
+		 * @short Current path, as path()
+		 */
+    std::string_view pathView() const noexcept {
+      return view(onion_request_get_path(ptr), {});
     }
+                /**
+		 * @short Full path, as fullpath()
+		 */
+    std::string_view fullpathView() const noexcept {
+      return view(onion_request_get_fullpath(ptr), {});
+    }
+    /// @}
+#endif
                 /**
 		 * @short Returns the headers dictionary.
 		 */ const Dict headers() const {
@@ -211,6 +273,13 @@ namespace Onion {
 		 */ onion_request *c_handler() {
       return ptr;
     }
+
+#if __cplusplus >= 201703L
+ private:
+    static std::string_view view(const char *r, std::string_view def) noexcept {
+      return r ? std::string_view(r) : def;
+    }
+#endif
   };
 }
 
@@ -27,6 +27,11 @@
 #include <onion/log.h>
 #include <onion/response.h>
 #include <ostream>
+#include <string>
+#include <utility>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 namespace Onion {
         /**
@@ -37,37 +42,112 @@ namespace Onion {
 	* \code
 	*   res<<"OK";
 	* \endcode
+	*
+	* The stream writes directly into the output buffer of the C response, so formatting
+	* is done in place, without a call per char.
 	*/
   class Response:public std::ostream {
                 /**
 		* @short Buffer management for Onion::Response
+		*
+		* The put area is the free space at the onion_response buffer. Written data is
+		* commited back before any other use of the C response.
 		*/
     class ResponseBuf:public std::streambuf {
-      Response *res;
+      onion_response *ptr;
  public:
-       ResponseBuf(Response * _res):res(_res) {
-      } virtual int overflow(int c = traits_type::eof()) {
-        char C = c;
-         res->write(&C, 1);
-         return traits_type::not_eof(c);
-      } std::streamsize xsputn(const char *data, std::streamsize s) {
-        return res->write(data, s);
-    }};
+       ResponseBuf(onion_response * _ptr):ptr(_ptr) {
+      }
+
+      /// Commits the written data, and releases the put area.
+      void release() {
+        if (pbase()) {
+          onion_response_buffer_commit(ptr, pptr() - pbase());
+          setp(nullptr, nullptr);
+        }
+      }
+
+      /// Gets free space at the C response buffer as put area. False on HEAD or error.
+      bool acquire() {
+        size_t available;
+        char *buffer = onion_response_buffer_reserve(ptr, &available);
+        if (!buffer || !available)
+          return false;
+        setp(buffer, buffer + available);
+        return true;
+      }
+ protected:
+      virtual int overflow(int c = traits_type::eof()) {
+        release();
+        if (traits_type::eq_int_type(c, traits_type::eof()))
+          return traits_type::not_eof(c);
+        if (acquire()) {
+          *pptr() = traits_type::to_char_type(c);
+          pbump(1);
+        }
+        return traits_type::not_eof(c);
+      }
+
+      virtual std::streamsize xsputn(const char *data, std::streamsize s) {
+        if (epptr() - pptr() >= s) {    // Fits at current put area
+          traits_type::copy(pptr(), data, s);
+          pbump(s);
+          return s;
+        }
+        release();
+        ssize_t w = onion_response_write(ptr, data, s);
+        if (w < 0)              // On HEAD nothing is written, but it is not an error
+          return s;
+        acquire();
+        return w;
+      }
+
+      virtual int sync() {
+        release();
+        return 0;
+      }
+    };
 
     onion_response *ptr;
     ResponseBuf resbuf;
  public:
- Response(onion_response * _ptr):ptr(_ptr), resbuf(this) {
+ Response(onion_response * _ptr):std::ostream(nullptr), ptr(_ptr), resbuf(_ptr) {
       init(&resbuf);
     }
 
+    ~Response() {
+      resbuf.release();
+    }
+
                 /**
 		 * @short Writes some data straigth to the response.
 		 */
     int write(const char *data, int len) {
+      resbuf.release();
       return onion_response_write(ptr, data, len);
     }
 
+    int write(const std::string & data) {
+      return write(data.data(), data.size());
+    }
+
+#if __cplusplus >= 201703L
+    int write(std::string_view data) {
+      return write(data.data(), data.size());
+    }
+#endif
+
+                /**
+		 * @short Writes printf formatted data.
+		 *
+		 * Formats straight into the output buffer when it fits.
+		 */
+    template < typename ... Args >
+        int printf(const char *fmt, Args && ... args) {
+      resbuf.release();
+      return onion_response_printf(ptr, fmt, std::forward < Args > (args)...);
+    }
+
                 /**
 		 * @short Sets a header on the response.
 		 */
@@ -126,13 +206,17 @@ namespace Onion {
 		 * occasions user may want to force write in a specific moment.
 		 */
     void writeHeaders() {
+      resbuf.release();
       onion_response_write_headers(ptr);
     }
 
                 /**
 		 * @short Gets the C handelr to use onion_response C functions.
+		 *
+		 * Already streamed data is commited, so it can be used safely.
 		 */
     onion_response *c_handler() {
+      resbuf.release();
       return ptr;
     }
   };
@@ -26,6 +26,7 @@
 
 #include "onion.hpp"
 #include "handler.hpp"
+#include "coroutine.hpp"
 #include <onion/url.h>
 #include <onion/log.h>
 #include <onion/onion.h>
@@ -123,6 +124,22 @@ namespace Onion {
 		 */
      Url & add(const std::string & url, HandlerFunction::fn_t fn);
 
+#ifdef ONION_HAS_COROUTINES
+                /**
+		 * @short Adds an url that calls a C++20 coroutine.
+		 * 
+		 * Example:
+		 * 
+		 *   url.add("", [](Onion::Request &req, Onion::Response &res) -> Onion::Coroutine {
+		 *     co_await Onion::sleep_for(std::chrono::milliseconds(100));
+		 *     co_return OCS_PROCESSED;
+		 *   });
+		 */
+     Url & add(const std::string & url, HandlerCoroutine::fn_t fn) {
+      return add(url, (Handler &&) Handler::make < HandlerCoroutine > (fn));
+    }
+#endif
+
                 /**
 		 * @short Adds an url that calls a C++ method.
 		 * 
@@ -0,0 +1,650 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "access_log.h"
+#include "types_internal.h"
+#include "request.h"
+#include "metrics.h"
+#include "low.h"
+#include "log.h"
+
+/**
+ * @defgroup access_log Access log. Logs each finished request to a file or to memory.
+ *
+ * Set it with onion_set_access_log; then each response, when freed, fills an
+ * onion_access_log_entry and passes it to the sink. The client address is
+ * formatted numerically, with no reverse lookups.
+ *
+ * The file sink formats the line at the calling thread, and appends it to a buffer of
+ * that thread, with no locks. A background thread drains all the buffers each second,
+ * and a thread whose buffer is full writes it itself. On SIGHUP the file is reopened,
+ * so it works with logrotate.
+ */
+
+/// Size of the file buffer, and of each thread buffer. Power of 2.
+#define ONION_ACCESS_LOG_BUFFER_SIZE (64 * 1024)
+/// Max seconds an entry waits at the buffer.
+#define ONION_ACCESS_LOG_FLUSH_INTERVAL 1
+
+/// Incremented on each SIGHUP. File logs reopen when it changes.
+static volatile sig_atomic_t onion_access_log_hup = 0;
+
+static void onion_access_log_sighup(int _) {
+  onion_access_log_hup++;
+}
+
+/// Installs the SIGHUP handler, unless the program has already set one.
+static void onion_access_log_sighup_install() {
+  struct sigaction sa;
+  if (sigaction(SIGHUP, NULL, &sa) != 0 || sa.sa_handler != SIG_DFL)
+    return;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = onion_access_log_sighup;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGHUP, &sa, NULL);
+}
+
+/// @{ @name Line formatting. Hand written, as snprintf is most of the cost.
+
+static char *onion_access_log_append(char *p, const char *str) {
+  while (*str)
+    *p++ = *str++;
+  return p;
+}
+
+static char *onion_access_log_append_uint(char *p, uint64_t n) {
+  char tmp[20];
+  int i = 0;
+  do {
+    tmp[i++] = '0' + n % 10;
+    n /= 10;
+  } while (n);
+  while (i)
+    *p++ = tmp[--i];
+  return p;
+}
+
+/// Escapes quotes, backslashes and control chars, as \u00XX for JSON, or \xXX.
+static char *onion_access_log_append_escaped(char *p, const char *str,
+                                             int json) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (; *str; str++) {
+    unsigned char c = *str;
+    if (c == '"' || c == '\\') {
+      *p++ = '\\';
+      *p++ = c;
+    } else if (c < 0x20 || c == 0x7F) {
+      p = onion_access_log_append(p, json ? "\\u00" : "\\x");
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 0x0F];
+    } else
+      *p++ = c;
+  }
+  return p;
+}
+
+/// Dates of the last formatted second, per thread, so strftime is called once per second.
+static __thread time_t onion_access_log_date_t = -1;
+static __thread char onion_access_log_date_common[32];
+static __thread char onion_access_log_date_json[32];
+
+static void onion_access_log_dates(time_t t) {
+  if (t == onion_access_log_date_t)
+    return;
+  struct tm tm;
+  localtime_r(&t, &tm);
+  strftime(onion_access_log_date_common, sizeof(onion_access_log_date_common),
+           "%d/%b/%Y:%H:%M:%S %z", &tm);
+  gmtime_r(&t, &tm);
+  strftime(onion_access_log_date_json, sizeof(onion_access_log_date_json),
+           "%Y-%m-%dT%H:%M:%SZ", &tm);
+  onion_access_log_date_t = t;
+}
+
+/**
+ * @short Formats an entry as a log line.
+ * @ingroup access_log
+ *
+ * With OAL_COMMON it uses the common log format, adding the latency in microseconds:
+ *
+ * @code
+ *   127.0.0.1 - - [16/Oct/2026:14:33:48 +0200] "GET /index.html HTTP/1.1" 200 1234 87
+ * @endcode
+ *
+ * With OAL_JSON it is a JSON object per line:
+ *
+ * @code
+ *   {"time":"2026-10-16T12:33:48Z","client":"127.0.0.1","method":"GET","path":"/index.html","protocol":"HTTP/1.1","code":200,"bytes":1234,"latency_us":87}
+ * @endcode
+ *
+ * @param line Where to write it, at least ONION_ACCESS_LOG_LINE_SIZE bytes. It is NUL terminated.
+ * @returns The length of the line, with the ending newline.
+ */
+int onion_access_log_format(const onion_access_log_entry * entry, int flags,
+                            char *line) {
+  char *p = line;
+  onion_access_log_dates(entry->time);
+  if (flags & OAL_JSON) {
+    p = onion_access_log_append(p, "{\"time\":\"");
+    p = onion_access_log_append(p, onion_access_log_date_json);
+    p = onion_access_log_append(p, "\",\"client\":\"");
+    p = onion_access_log_append(p, entry->client);
+    p = onion_access_log_append(p, "\",\"method\":\"");
+    p = onion_access_log_append(p, entry->method);
+    p = onion_access_log_append(p, "\",\"path\":\"");
+    p = onion_access_log_append_escaped(p, entry->path, 1);
+    p = onion_access_log_append(p, "\",\"protocol\":\"");
+    p = onion_access_log_append(p, entry->protocol);
+    p = onion_access_log_append(p, "\",\"code\":");
+    p = onion_access_log_append_uint(p, entry->code);
+    p = onion_access_log_append(p, ",\"bytes\":");
+    p = onion_access_log_append_uint(p, entry->bytes);
+    p = onion_access_log_append(p, ",\"latency_us\":");
+    p = onion_access_log_append_uint(p, entry->latency_us);
+    p = onion_access_log_append(p, "}\n");
+  } else {
+    p = onion_access_log_append(p, entry->client);
+    p = onion_access_log_append(p, " - - [");
+    p = onion_access_log_append(p, onion_access_log_date_common);
+    p = onion_access_log_append(p, "] \"");
+    p = onion_access_log_append(p, entry->method);
+    *p++ = ' ';
+    p = onion_access_log_append_escaped(p, entry->path, 0);
+    *p++ = ' ';
+    p = onion_access_log_append(p, entry->protocol);
+    p = onion_access_log_append(p, "\" ");
+    p = onion_access_log_append_uint(p, entry->code);
+    *p++ = ' ';
+    p = onion_access_log_append_uint(p, entry->bytes);
+    *p++ = ' ';
+    p = onion_access_log_append_uint(p, entry->latency_us);
+    *p++ = '\n';
+  }
+  *p = '\0';
+  return p - line;
+}
+
+/// @}
+
+/**
+ * @short Fills the entry for a finished request, and writes it to the log.
+ * @ingroup access_log
+ *
+ * Called at onion_response_free, if the server has an access log.
+ */
+void onion_access_log_response(onion_access_log * log, onion_request * req,
+                               onion_response * res) {
+  onion_access_log_entry entry;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  entry.time = ts.tv_sec;
+  entry.method = onion_request_methods[req->flags & OR_METHODS];
+  if (!entry.method)
+    entry.method = "-";
+  entry.protocol = (req->flags & OR_HTTP11) ? "HTTP/1.1" : "HTTP/1.0";
+  entry.code = res->code;
+  entry.bytes = res->sent_bytes_total;
+  entry.latency_us =
+      req->process_start ? (onion_metrics_now() -
+                            req->process_start) / 1000 : 0;
+
+  const struct sockaddr_storage *addr = &req->connection.cli_addr;
+  const char *client = NULL;
+  if (req->connection.cli_len && addr->ss_family == AF_INET)
+    client =
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr,
+                  entry.client, sizeof(entry.client));
+  else if (req->connection.cli_len && addr->ss_family == AF_INET6)
+    client =
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)addr)->sin6_addr,
+                  entry.client, sizeof(entry.client));
+  if (!client)
+    strcpy(entry.client, "-");
+
+  const char *path = req->fullpath ? req->fullpath : "-";
+  size_t length = strlen(path);
+  if (length >= sizeof(entry.path))
+    length = sizeof(entry.path) - 1;
+  memcpy(entry.path, path, length);
+  entry.path[length] = '\0';
+
+  log->write(log, &entry);
+}
+
+/// @{ @name File access log
+
+#ifdef HAVE_PTHREADS
+/**
+ * Per thread buffer of a file log. A single producer single consumer byte ring: the
+ * owner thread appends at head, and whoever has the log mutex drains from tail.
+ */
+typedef struct onion_access_log_file_buffer_t {
+  unsigned int head;            ///< Only written by the owner thread.
+  unsigned int tail;            ///< Only written with the log mutex.
+  int in_use;                   ///< 0 once the owner thread exits, so another one can take it.
+  struct onion_access_log_file_buffer_t *next;
+  char data[ONION_ACCESS_LOG_BUFFER_SIZE];
+} onion_access_log_file_buffer;
+#endif
+
+typedef struct onion_access_log_file_data_t {
+  char *filename;
+  int flags;
+  int fd;
+  sig_atomic_t hup;             ///< Value of onion_access_log_hup when opened.
+#ifdef HAVE_PTHREADS
+  uint64_t id;                  ///< Never reused, so the thread local cache never points to a freed log.
+  pthread_key_t key;            ///< Buffer of each thread.
+  onion_access_log_file_buffer *buffers;        ///< All the buffers. Changed with the mutex.
+  pthread_mutex_t mutex;        ///< Drains the buffers and writes to the file.
+  pthread_cond_t cond;
+  pthread_t thread;
+  int stop;
+#else
+  time_t last_write;
+#endif
+  size_t length;
+  char buffer[ONION_ACCESS_LOG_BUFFER_SIZE];    ///< Lines being written. With threads, drained from the per thread buffers.
+} onion_access_log_file_data;
+
+static void onion_access_log_file_open(onion_access_log_file_data * data) {
+  data->hup = onion_access_log_hup;
+  data->fd =
+      open(data->filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (data->fd < 0)
+    ONION_ERROR("Could not open access log file %s", data->filename);
+}
+
+/// Writes the buffer, and reopens the file if there was a SIGHUP. Must have the mutex.
+static void onion_access_log_file_write_buffer(onion_access_log_file_data *
+                                               data) {
+  const char *p = data->buffer;
+  size_t length = data->length;
+  while (data->fd >= 0 && length > 0) {
+    ssize_t w = write(data->fd, p, length);
+    if (w <= 0) {
+      ONION_ERROR("Error writing to access log file %s", data->filename);
+      break;
+    }
+    p += w;
+    length -= w;
+  }
+  data->length = 0;
+  if (data->hup != onion_access_log_hup) {
+    if (data->fd >= 0)
+      close(data->fd);
+    onion_access_log_file_open(data);
+  }
+}
+
+#ifdef HAVE_PTHREADS
+/// Source of onion_access_log_file_data ids. 0 is never used.
+static uint64_t onion_access_log_file_last_id = 0;
+/// Buffer of the last file log this thread wrote to. Most programs have only one.
+static __thread uint64_t onion_access_log_current_id = 0;
+static __thread onion_access_log_file_buffer *onion_access_log_current_buffer =
+    NULL;
+
+/// At thread exit, leaves the buffer to the next thread. Pending lines are still written.
+static void onion_access_log_file_buffer_release(void *buffer) {
+  __atomic_store_n(&((onion_access_log_file_buffer *) buffer)->in_use, 0,
+                   __ATOMIC_RELEASE);
+}
+
+/// Gets the buffer of this thread, reusing a drained one of an exited thread or creating it.
+static onion_access_log_file_buffer
+    *onion_access_log_file_buffer_get(onion_access_log_file_data * data) {
+  onion_access_log_file_buffer *buffer = pthread_getspecific(data->key);
+  if (!buffer) {
+    pthread_mutex_lock(&data->mutex);
+    buffer = data->buffers;
+    while (buffer && (__atomic_load_n(&buffer->in_use, __ATOMIC_ACQUIRE) ||
+                      buffer->head != buffer->tail))
+      buffer = buffer->next;
+    if (!buffer) {
+      buffer = onion_low_calloc(1, sizeof(onion_access_log_file_buffer));
+      buffer->next = data->buffers;
+      data->buffers = buffer;
+    }
+    buffer->in_use = 1;
+    pthread_mutex_unlock(&data->mutex);
+    pthread_setspecific(data->key, buffer);
+  }
+  onion_access_log_current_id = data->id;
+  onion_access_log_current_buffer = buffer;
+  return buffer;
+}
+
+/// Moves the pending lines of a thread buffer to the file buffer, writing it as it fills. Must have the mutex.
+static void onion_access_log_file_buffer_drain(onion_access_log_file_data *
+                                               data,
+                                               onion_access_log_file_buffer *
+                                               buffer) {
+  unsigned int head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+  unsigned int tail = buffer->tail;
+  while (tail != head) {
+    size_t offset = tail & (ONION_ACCESS_LOG_BUFFER_SIZE - 1);
+    size_t length = head - tail;
+    if (length > ONION_ACCESS_LOG_BUFFER_SIZE - offset)
+      length = ONION_ACCESS_LOG_BUFFER_SIZE - offset;
+    if (length > sizeof(data->buffer) - data->length)
+      length = sizeof(data->buffer) - data->length;
+    memcpy(data->buffer + data->length, buffer->data + offset, length);
+    data->length += length;
+    tail += length;
+    if (data->length == sizeof(data->buffer))
+      onion_access_log_file_write_buffer(data);
+  }
+  __atomic_store_n(&buffer->tail, tail, __ATOMIC_RELEASE);
+}
+
+/// Drains all the thread buffers, and writes. Must have the mutex.
+static void onion_access_log_file_drain(onion_access_log_file_data * data) {
+  onion_access_log_file_buffer *buffer;
+  for (buffer = data->buffers; buffer; buffer = buffer->next)
+    onion_access_log_file_buffer_drain(data, buffer);
+  onion_access_log_file_write_buffer(data);
+}
+
+/**
+ * Appends the line to the buffer of this thread, with no locks. Only if it is full the
+ * thread takes the mutex and writes its own buffer, so under load there is one lock
+ * and write per buffer, not per request.
+ */
+static void onion_access_log_file_write(onion_access_log * log,
+                                        const onion_access_log_entry * entry) {
+  onion_access_log_file_data *data = log->data;
+  char line[ONION_ACCESS_LOG_LINE_SIZE];
+  unsigned int length = onion_access_log_format(entry, data->flags, line);
+
+  onion_access_log_file_buffer *buffer = onion_access_log_current_buffer;
+  if (__builtin_expect(onion_access_log_current_id != data->id, 0))
+    buffer = onion_access_log_file_buffer_get(data);
+  unsigned int head = buffer->head;
+  if (ONION_ACCESS_LOG_BUFFER_SIZE -
+      (head - __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE)) < length) {
+    pthread_mutex_lock(&data->mutex);
+    onion_access_log_file_buffer_drain(data, buffer);
+    onion_access_log_file_write_buffer(data);
+    pthread_mutex_unlock(&data->mutex);
+  }
+  size_t offset = head & (ONION_ACCESS_LOG_BUFFER_SIZE - 1);
+  size_t first = ONION_ACCESS_LOG_BUFFER_SIZE - offset;
+  if (first > length)
+    first = length;
+  memcpy(buffer->data + offset, line, first);
+  memcpy(buffer->data, line + first, length - first);
+  __atomic_store_n(&buffer->head, head + length, __ATOMIC_RELEASE);
+}
+
+static void onion_access_log_file_flush(onion_access_log * log) {
+  onion_access_log_file_data *data = log->data;
+  pthread_mutex_lock(&data->mutex);
+  onion_access_log_file_drain(data);
+  pthread_mutex_unlock(&data->mutex);
+}
+
+/// Drains the thread buffers each second, so entries do not wait for them to fill.
+static void *onion_access_log_file_main(void *_data) {
+  onion_access_log_file_data *data = _data;
+  pthread_mutex_lock(&data->mutex);
+  while (!data->stop) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ONION_ACCESS_LOG_FLUSH_INTERVAL;
+    pthread_cond_timedwait(&data->cond, &data->mutex, &until);
+    onion_access_log_file_drain(data);
+  }
+  pthread_mutex_unlock(&data->mutex);
+  return NULL;
+}
+#else
+static void onion_access_log_file_write(onion_access_log * log,
+                                        const onion_access_log_entry * entry) {
+  onion_access_log_file_data *data = log->data;
+  char line[ONION_ACCESS_LOG_LINE_SIZE];
+  int length = onion_access_log_format(entry, data->flags, line);
+
+  if (data->length + length > sizeof(data->buffer))
+    onion_access_log_file_write_buffer(data);
+  memcpy(data->buffer + data->length, line, length);
+  data->length += length;
+  // No background thread, so written as soon as the second changes.
+  if (entry->time != data->last_write) {
+    onion_access_log_file_write_buffer(data);
+    data->last_write = entry->time;
+  }
+}
+
+static void onion_access_log_file_flush(onion_access_log * log) {
+  onion_access_log_file_write_buffer(log->data);
+}
+#endif
+
+static void onion_access_log_file_free(onion_access_log * log) {
+  onion_access_log_file_data *data = log->data;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&data->mutex);
+  data->stop = 1;
+  pthread_cond_signal(&data->cond);
+  pthread_mutex_unlock(&data->mutex);
+  pthread_join(data->thread, NULL);
+  onion_access_log_file_drain(data);
+  while (data->buffers) {
+    onion_access_log_file_buffer *next = data->buffers->next;
+    onion_low_free(data->buffers);
+    data->buffers = next;
+  }
+  pthread_key_delete(data->key);
+  pthread_mutex_destroy(&data->mutex);
+  pthread_cond_destroy(&data->cond);
+#else
+  onion_access_log_file_write_buffer(data);
+#endif
+  if (data->fd >= 0)
+    close(data->fd);
+  onion_low_free(data->filename);
+  onion_low_free(data);
+  onion_low_free(log);
+}
+
+/**
+ * @short Creates an access log that writes to a file.
+ * @ingroup access_log
+ *
+ * Each thread formats its lines into a buffer of its own, with no locks, and a background
+ * thread writes them in batches, at least each second. So lines of different threads may
+ * be written slightly out of order. On SIGHUP the file is closed and opened again, so it
+ * can be rotated; the handler is only installed if the program has not set its own for
+ * SIGHUP.
+ *
+ * @param filename File to append to. Created if it does not exist.
+ * @param flags OAL_COMMON or OAL_JSON.
+ * @returns The access log, or NULL if the file can not be opened.
+ */
+onion_access_log *onion_access_log_file(const char *filename, int flags) {
+  onion_access_log_file_data *data =
+      onion_low_calloc(1, sizeof(onion_access_log_file_data));
+  data->filename = onion_low_strdup(filename);
+  data->flags = flags;
+  onion_access_log_file_open(data);
+  if (data->fd < 0) {
+    onion_low_free(data->filename);
+    onion_low_free(data);
+    return NULL;
+  }
+#ifdef HAVE_PTHREADS
+  data->id = __atomic_add_fetch(&onion_access_log_file_last_id, 1,
+                                __ATOMIC_RELAXED);
+  pthread_key_create(&data->key, onion_access_log_file_buffer_release);
+  pthread_mutex_init(&data->mutex, NULL);
+  pthread_cond_init(&data->cond, NULL);
+  if (onion_low_pthread_create
+      (&data->thread, NULL, onion_access_log_file_main, data) != 0) {
+    ONION_ERROR("Could not create the access log thread");
+    pthread_key_delete(data->key);
+    pthread_mutex_destroy(&data->mutex);
+    pthread_cond_destroy(&data->cond);
+    close(data->fd);
+    onion_low_free(data->filename);
+    onion_low_free(data);
+    return NULL;
+  }
+#endif
+  onion_access_log_sighup_install();
+
+  onion_access_log *log = onion_low_calloc(1, sizeof(onion_access_log));
+  log->data = data;
+  log->write = onion_access_log_file_write;
+  log->flush = onion_access_log_file_flush;
+  log->free = onion_access_log_file_free;
+  return log;
+}
+
+/// @}
+
+/// @{ @name Memory access log
+
+typedef struct onion_access_log_memory_data_t {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_t mutex;
+#endif
+  int size;
+  uint64_t count;               ///< Entries ever written; the next goes at count % size.
+  onion_access_log_entry entries[];
+} onion_access_log_memory_data;
+
+static void onion_access_log_memory_write(onion_access_log * log,
+                                          const onion_access_log_entry *
+                                          entry) {
+  onion_access_log_memory_data *data = log->data;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&data->mutex);
+#endif
+  data->entries[data->count % data->size] = *entry;
+  data->count++;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&data->mutex);
+#endif
+}
+
+static void onion_access_log_memory_free(onion_access_log * log) {
+  onion_access_log_memory_data *data = log->data;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_destroy(&data->mutex);
+#endif
+  onion_low_free(data);
+  onion_low_free(log);
+}
+
+/**
+ * @short Creates an access log that keeps the last entries in memory.
+ * @ingroup access_log
+ *
+ * Older entries are overwritten. Read them with onion_access_log_memory_get.
+ *
+ * @param size Number of entries to keep.
+ */
+onion_access_log *onion_access_log_memory(int size) {
+  if (size <= 0)
+    size = 1;
+  onion_access_log_memory_data *data =
+      onion_low_calloc(1,
+                       sizeof(onion_access_log_memory_data) +
+                       size * sizeof(onion_access_log_entry));
+  data->size = size;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_init(&data->mutex, NULL);
+#endif
+
+  onion_access_log *log = onion_low_calloc(1, sizeof(onion_access_log));
+  log->data = data;
+  log->write = onion_access_log_memory_write;
+  log->free = onion_access_log_memory_free;
+  return log;
+}
+
+/**
+ * @short Copies the latest entries of a memory access log.
+ * @ingroup access_log
+ *
+ * @param entries Where to copy them, oldest first.
+ * @param n Max number of entries to copy.
+ * @returns The number of entries copied. 0 if it is not a memory access log.
+ */
+int onion_access_log_memory_get(onion_access_log * log,
+                                onion_access_log_entry * entries, int n) {
+  if (log->write != onion_access_log_memory_write)
+    return 0;
+  onion_access_log_memory_data *data = log->data;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&data->mutex);
+#endif
+  uint64_t available = data->count < data->size ? data->count : data->size;
+  if (n > available)
+    n = available;
+  uint64_t i;
+  for (i = data->count - n; i < data->count; i++)
+    *entries++ = data->entries[i % data->size];
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&data->mutex);
+#endif
+  return n;
+}
+
+/// @}
+
+/**
+ * @short Writes any pending entries.
+ * @ingroup access_log
+ */
+void onion_access_log_flush(onion_access_log * log) {
+  if (log->flush)
+    log->flush(log);
+}
+
+/**
+ * @short Flushes and frees the access log.
+ * @ingroup access_log
+ *
+ * Normally not needed, as the server frees it at onion_free.
+ */
+void onion_access_log_free(onion_access_log * log) {
+  if (log->free)
+    log->free(log);
+}
@@ -0,0 +1,87 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+#ifndef ONION_ACCESS_LOG_H
+#define ONION_ACCESS_LOG_H
+
+#include <stdint.h>
+#include <time.h>
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Max path length kept at the access log entries, longer ones are truncated.
+#define ONION_ACCESS_LOG_PATH_SIZE 256
+/// Size of the client address at the entries. Enough for IPv6.
+#define ONION_ACCESS_LOG_CLIENT_SIZE 48
+/// Max size of a formatted line, with the worst case path escaping.
+#define ONION_ACCESS_LOG_LINE_SIZE (ONION_ACCESS_LOG_PATH_SIZE * 6 + 256)
+
+  /**
+   * @short A finished request, as written to the access log.
+   * @ingroup access_log
+   */
+  struct onion_access_log_entry_t {
+    time_t time;                ///< When the response finished.
+    const char *method;         ///< Static string, as "GET".
+    const char *protocol;       ///< Static string, as "HTTP/1.1".
+    int code;                   ///< Response code.
+    uint64_t bytes;             ///< Bytes sent, headers included.
+    uint64_t latency_us;        ///< Time since the request processing started.
+    char client[ONION_ACCESS_LOG_CLIENT_SIZE];  ///< Numeric client address, or "-" if unknown.
+    char path[ONION_ACCESS_LOG_PATH_SIZE];      ///< Full path of the request.
+  };
+
+  /// Formats of the access log files.
+  enum onion_access_log_flags_e {
+    OAL_COMMON = 0,             ///< Common log format, plus the latency in microseconds.
+    OAL_JSON = 1,               ///< One JSON object per line.
+  };
+
+/// Creates an access log that writes to the given file, in batches. Reopened on SIGHUP.
+  onion_access_log *onion_access_log_file(const char *filename, int flags);
+/// Creates an access log that keeps the last size entries in memory.
+  onion_access_log *onion_access_log_memory(int size);
+/// Copies up to n of the latest entries of a memory access log, oldest first. Returns how many.
+  int onion_access_log_memory_get(onion_access_log * log,
+                                  onion_access_log_entry * entries, int n);
+
+/// Writes any pending entries.
+  void onion_access_log_flush(onion_access_log * log);
+/// Flushes and frees the access log.
+  void onion_access_log_free(onion_access_log * log);
+
+/// Formats an entry as a log line, into at least ONION_ACCESS_LOG_LINE_SIZE bytes. Returns its length.
+  int onion_access_log_format(const onion_access_log_entry * entry, int flags,
+                              char *line);
+
+/// Internal. Logs the finished request, called at onion_response_free.
+  void onion_access_log_response(onion_access_log * log, onion_request * req,
+                                 onion_response * res);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -244,22 +244,46 @@ char *onion_base64_encode(const char *orig, int length) {
   return ret;
 }
 
+/// Value of each hex digit, or -1 if not an hex digit. Used to decode %XX escapes without strtol.
+static const signed char onion_unquote_hex[256] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
 /**
  * @short Performs unquote inplace.
  * @ingroup codecs
  *
  * It can be inplace as char position is always at least in the same on the destination than in the origin
+ *
+ * Malformed escapes (not followed by two hex digits) are copied as is.
  */
 void onion_unquote_inplace(char *str) {
   char *r = str;
   char *w = str;
-  char tmp[3] = { 0, 0, 0 };
   while (*r) {
     if (*r == '%') {
-      r++;
-      tmp[0] = *r++;
-      tmp[1] = *r;
-      *w = strtol(tmp, (char **)NULL, 16);
+      int h = onion_unquote_hex[(unsigned char)r[1]];
+      int l = (h >= 0) ? onion_unquote_hex[(unsigned char)r[2]] : -1;
+      if (l >= 0) {
+        *w = (h << 4) | l;
+        r += 2;
+      } else
+        *w = '%';
     } else if (*r == '+') {
       *w = ' ';
     } else {
@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #include "log.h"
 #include "dict.h"
@@ -36,6 +37,14 @@
 
 /// @defgroup dict Dict.
 
+/// Last generation given to a modified dict. @see onion_dict_generation
+static uint64_t onion_dict_last_generation = 0;
+
+/// Returns a new generation, bigger than all the previous ones, for a just modified dict.
+static uint64_t onion_dict_next_generation() {
+  return __atomic_add_fetch(&onion_dict_last_generation, 1, __ATOMIC_RELAXED);
+}
+
 /// @private
 typedef struct onion_dict_node_data_t {
   const char *key;
@@ -212,6 +221,7 @@ void onion_dict_free(onion_dict * dict) {
 #endif
     if (dict->root)
       onion_dict_node_free(dict->root);
+    onion_low_free(dict->binary_data);
     onion_low_free(dict);
   }
 }
@@ -373,6 +383,7 @@ void onion_dict_add(onion_dict * dict, const char *key, const void *value,
   dict->root =
       onion_dict_node_add(dict, dict->root,
                           onion_dict_node_new(key, value, flags));
+  dict->generation = onion_dict_next_generation();
 }
 
 /// Frees the memory, if necesary of key and value
@@ -450,6 +461,7 @@ static onion_dict_node *onion_dict_node_remove(const onion_dict * d,
  */
 int onion_dict_remove(onion_dict * dict, const char *key) {
   dict->root = onion_dict_node_remove(dict, dict->root, key);
+  dict->generation = onion_dict_next_generation();
   return 1;
 }
 
@@ -546,6 +558,40 @@ static int onion_dict_node_count(const onion_dict_node * node) {
   return c;
 }
 
+static uint64_t onion_dict_node_generation(const onion_dict_node * node) {
+  uint64_t g = 0, c;
+  if (node->data.flags & OD_DICT)
+    g = onion_dict_generation(node->data.value);
+  if (node->left && (c = onion_dict_node_generation(node->left)) > g)
+    g = c;
+  if (node->right && (c = onion_dict_node_generation(node->right)) > g)
+    g = c;
+  return g;
+}
+
+/**
+ * @short Returns the modification generation of the dict
+ * @memberof onion_dict_t
+ * @ingroup dict
+ *
+ * Any add or remove, also on the dicts inside this one, changes the generation.
+ * It allows to know if a dict was modified since some moment, for example to
+ * save sessions only when changed.
+ *
+ * Generations come from a process wide counter, and this returns the latest of
+ * this dict and the ones inside, so it never goes back to a previous value.
+ *
+ * Values changed inplace by the user are not detected.
+ */
+uint64_t onion_dict_generation(const onion_dict * dict) {
+  if (!dict)
+    return 0;
+  uint64_t g = dict->generation, c;
+  if (dict->root && (c = onion_dict_node_generation(dict->root)) > g)
+    g = c;
+  return g;
+}
+
 /**
  * @short Counts elements
  * @memberof onion_dict_t
@@ -830,3 +876,194 @@ static onion_dict *onion_dict_from_json_(const char **_data) {
   onion_dict_free(ret);
   return NULL;
 }
+
+/// Magic at the start of binary encoded dicts. Can not be mistaken with json, that starts with {.
+#define ONION_DICT_BINARY_MAGIC "ODB\001"
+/// Max nesting on binary decoding, to avoid stack exhaustion on crafted data.
+#define ONION_DICT_BINARY_MAX_DEPTH 64
+
+enum onion_dict_binary_type_e {
+  ONION_DICT_BINARY_STRING = 0,
+  ONION_DICT_BINARY_DICT = 1,
+};
+
+/// Status while encoding a (sub)dict.
+typedef struct onion_dict_binary_encoder_t {
+  onion_block *block;
+  uint32_t count;
+} onion_dict_binary_encoder;
+
+static void onion_dict_binary_add_dict(onion_block * block,
+                                       const onion_dict * dict);
+
+/// Little endian, so the data can be shared between machines.
+static void onion_dict_binary_add_uint32(onion_block * block, uint32_t n) {
+  char tmp[4] = { n & 0x0FF, (n >> 8) & 0x0FF, (n >> 16) & 0x0FF,
+    (n >> 24) & 0x0FF
+  };
+  onion_block_add_data(block, tmp, 4);
+}
+
+/// Strings are written with its length and the final \0, so they can be used inplace at decoding.
+static void onion_dict_binary_add_string(onion_block * block, const char *str) {
+  size_t l = strlen(str);
+  onion_dict_binary_add_uint32(block, l);
+  onion_block_add_data(block, str, l + 1);
+}
+
+static void onion_dict_binary_preorder(onion_dict_binary_encoder * enc,
+                                       const char *key, const void *value,
+                                       int flags) {
+  enc->count++;
+  if (flags & OD_DICT) {
+    onion_block_add_char(enc->block, ONION_DICT_BINARY_DICT);
+    onion_dict_binary_add_string(enc->block, key);
+    onion_dict_binary_add_dict(enc->block, value);
+  } else {
+    onion_block_add_char(enc->block, ONION_DICT_BINARY_STRING);
+    onion_dict_binary_add_string(enc->block, key);
+    onion_dict_binary_add_string(enc->block, value);
+  }
+}
+
+/// Writes the count and the elements. Count is written at the end, as it is known after the walk.
+static void onion_dict_binary_add_dict(onion_block * block,
+                                       const onion_dict * dict) {
+  int count_pos = onion_block_size(block);
+  onion_dict_binary_add_uint32(block, 0);
+  onion_dict_binary_encoder enc = { block, 0 };
+  if (dict && dict->root)
+    onion_dict_node_preorder(dict->root, (void *)onion_dict_binary_preorder,
+                             &enc);
+  unsigned char *count = (unsigned char *)block->data + count_pos;
+  count[0] = enc.count & 0x0FF;
+  count[1] = (enc.count >> 8) & 0x0FF;
+  count[2] = (enc.count >> 16) & 0x0FF;
+  count[3] = (enc.count >> 24) & 0x0FF;
+}
+
+/**
+ * @short Converts a dict to a compact binary representation
+ * @memberof onion_dict_t
+ * @ingroup dict
+ *
+ * Strings are stored length prefixed, and nested dicts are supported. It is much faster to
+ * create and to parse than JSON, so it is the prefered format to store dicts, as at
+ * session backends.
+ *
+ * @returns an onion_block with the binary data.
+ * @see onion_dict_from_binary
+ */
+onion_block *onion_dict_to_binary(const onion_dict * dict) {
+  onion_block *block = onion_block_new();
+  onion_block_add_data(block, ONION_DICT_BINARY_MAGIC, 4);
+  onion_dict_binary_add_dict(block, dict);
+  return block;
+}
+
+/// Status while decoding
+typedef struct onion_dict_binary_decoder_t {
+  const char *pos;
+  const char *end;
+} onion_dict_binary_decoder;
+
+static int onion_dict_binary_read_uint32(onion_dict_binary_decoder * dec,
+                                         uint32_t * n) {
+  if (dec->end - dec->pos < 4)
+    return -1;
+  const unsigned char *p = (const unsigned char *)dec->pos;
+  *n = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+  dec->pos += 4;
+  return 0;
+}
+
+/// Returns a pointer to the string inside the data, or NULL if invalid.
+static const char *onion_dict_binary_read_string(onion_dict_binary_decoder *
+                                                 dec) {
+  uint32_t l;
+  if (onion_dict_binary_read_uint32(dec, &l) < 0)
+    return NULL;
+  if ((size_t)(dec->end - dec->pos) <= l || dec->pos[l] != '\0')
+    return NULL;
+  const char *ret = dec->pos;
+  dec->pos += l + 1;
+  return ret;
+}
+
+static onion_dict *onion_dict_from_binary_(onion_dict_binary_decoder * dec,
+                                           int depth) {
+  uint32_t count;
+  if (depth > ONION_DICT_BINARY_MAX_DEPTH
+      || onion_dict_binary_read_uint32(dec, &count) < 0)
+    return NULL;
+  onion_dict *ret = onion_dict_new();
+  while (count--) {
+    if (dec->pos >= dec->end)
+      goto error;
+    char type = *dec->pos++;
+    const char *key = onion_dict_binary_read_string(dec);
+    if (!key)
+      goto error;
+    if (type == ONION_DICT_BINARY_DICT) {
+      onion_dict *sub = onion_dict_from_binary_(dec, depth + 1);
+      if (!sub)
+        goto error;
+      onion_dict_add(ret, key, sub, OD_DICT | OD_FREE_VALUE | OD_REPLACE);
+    } else if (type == ONION_DICT_BINARY_STRING) {
+      const char *value = onion_dict_binary_read_string(dec);
+      if (!value)
+        goto error;
+      onion_dict_add(ret, key, value, OD_REPLACE);
+    } else
+      goto error;
+  }
+  return ret;
+ error:
+  onion_dict_free(ret);
+  return NULL;
+}
+
+/**
+ * @short Creates a dict from its binary representation
+ * @memberof onion_dict_t
+ * @ingroup dict
+ *
+ * Keys and values are not copied, but point inside data, so decoding needs just the
+ * allocations for the dict nodes. Depending on flags:
+ *
+ * - 0: data is used as is, and must be kept while the dict is in use.
+ * - OD_FREE_VALUE: the dict takes ownership of data, that must be onion_low_malloc'd, and
+ *   frees it with the dict. Also if there is an error.
+ * - OD_DUP_VALUE: data is copied once, and that copy is freed with the dict.
+ *
+ * Nested dicts also point inside data, so they can not be used after the main dict is freed.
+ *
+ * @returns The new dict, or NULL if data is not a valid binary dict, for example if its JSON.
+ * @see onion_dict_to_binary
+ */
+onion_dict *onion_dict_from_binary(const char *data, size_t size, int flags) {
+  if (!data)
+    return NULL;
+  if ((flags & OD_DUP_VALUE) == OD_DUP_VALUE) {
+    char *copy = onion_low_malloc(size);
+    memcpy(copy, data, size);
+    data = copy;
+  }
+  onion_dict *ret = NULL;
+  if (size >= 4 && memcmp(data, ONION_DICT_BINARY_MAGIC, 4) == 0) {
+    onion_dict_binary_decoder dec = { data + 4, data + size };
+    ret = onion_dict_from_binary_(&dec, 0);
+    if (ret && dec.pos != dec.end) {
+      ONION_DEBUG("Invalid binary dict, not ends at end");
+      onion_dict_free(ret);
+      ret = NULL;
+    }
+  }
+  if (flags & OD_FREE_VALUE) {
+    if (ret)
+      ret->binary_data = (char *)data;
+    else
+      onion_low_free((char *)data);
+  }
+  return ret;
+}
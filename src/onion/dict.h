@@ -26,6 +26,7 @@
 
 #include "types.h"
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -101,6 +102,9 @@ extern "C" {
 /// Counts elements
   int onion_dict_count(const onion_dict * dict);
 
+/// Modification generation, changes on any add or remove. Useful to check if changed.
+  uint64_t onion_dict_generation(const onion_dict * dict);
+
 /// @{ @name lock management
 /// Locks for reading. Several can read, one can write.
   void onion_dict_lock_read(const onion_dict * dict);
@@ -114,6 +118,11 @@ extern "C" {
   onion_block *onion_dict_to_json(onion_dict * dict);
 /// Converts a C string into a dictionary
   onion_dict *onion_dict_from_json(const char *data);
+/// Converts a dict into a compact binary onion_block
+  onion_block *onion_dict_to_binary(const onion_dict * dict);
+/// Converts binary data, as from onion_dict_to_binary, into a dict. Keys and values point inside data.
+  onion_dict *onion_dict_from_binary(const char *data, size_t size,
+                                     int flags);
 
 #ifdef __cplusplus
 }
@@ -67,8 +67,8 @@ onion_connection_status onion_handler_handle(onion_handler * handler,
       res = handler->handler(handler->priv_data, request, response);
       ONION_DEBUG0("Result: %d", res);
       if (res) {
-        // write pending data.
-        if (!(response->flags & OR_HEADER_SENT)
+        // write pending data. If yielding, there may be more later, so the length is unknown.
+        if (!(response->flags & OR_HEADER_SENT) && res != OCS_YIELD
             && response->buffer_pos < sizeof(response->buffer))
           onion_response_set_length(response, response->buffer_pos);
         onion_response_flush(response);
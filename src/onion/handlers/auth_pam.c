@@ -54,7 +54,7 @@ int onion_handler_auth_pam_handler(onion_handler_auth_pam_data * d,
   if (onion_request_get_session(request, "pam_logged_in"))
     return onion_handler_handle(d->inside, request, res);
 
-  const char *o = onion_request_get_header(request, "Authorization");
+  const char *o = onion_request_get_header_id(request, OH_AUTHORIZATION);
   char *auth = NULL;
   char *username = NULL;
   char *passwd = NULL;
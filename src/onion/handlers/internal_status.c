@@ -25,6 +25,10 @@
 #include <onion/dict.h>
 #include <onion/types.h>
 #include <onion/types_internal.h>
+#include <onion/metrics.h>
+#include <onion/response.h>
+#include <onion/request.h>
+#include <string.h>
 
 static void header_write(onion_response * res, const char *key,
                          const char *value, int flags) {
@@ -39,9 +43,39 @@ static void header_write(onion_response * res, const char *key,
 //   onion_response_write0(res, "</ul></li>");
 // }
 
+/// Ends with the given suffix
+static int ends_with(const char *str, const char *suffix) {
+  size_t l = strlen(str), ls = strlen(suffix);
+  return l >= ls && strcmp(str + l - ls, suffix) == 0;
+}
+
 static onion_connection_status onion_internal_handler(void *_,
                                                       onion_request * req,
                                                       onion_response * res) {
+  const char *format = onion_request_get_query(req, "format");
+  const char *path = onion_request_get_path(req);
+  if (!format && path) {
+    if (ends_with(path, "json"))
+      format = "json";
+    else if (ends_with(path, "metrics"))
+      format = "prometheus";
+  }
+  if (format) {
+    onion_metrics m;
+    onion_metrics_get(&m);
+    if (strcmp(format, "json") == 0) {
+      onion_response_set_header(res, "Content-Type", "application/json");
+      onion_metrics_write_json(&m, res);
+      return OCS_PROCESSED;
+    }
+    if (strcmp(format, "prometheus") == 0) {
+      onion_response_set_header(res, "Content-Type",
+                                "text/plain; version=0.0.4");
+      onion_metrics_write_prometheus(&m, res);
+      return OCS_PROCESSED;
+    }
+  }
+
   onion_request_get_session_dict(req);
   onion_response_write_headers(res);
 
@@ -60,6 +94,18 @@ static onion_connection_status onion_internal_handler(void *_,
   onion_dict_preorder(res->headers, header_write, res);
   onion_response_write0(res, "</ul>");
 
+  onion_metrics m;
+  onion_metrics_get(&m);
+  onion_response_printf(res,
+                        "<h1>Server</h1><ul><li><b>Requests</b> = %lu</li>"
+                        "<li><b>Active connections</b> = %ld</li>"
+                        "<li><b>Latency p50/p99</b> = %lu/%lu &micro;s</li></ul>"
+                        "<p>Also as <a href=\"?format=json\">JSON</a> and <a href=\"?format=prometheus\">Prometheus</a>.</p>",
+                        (unsigned long)m.requests,
+                        (long)(m.connections_opened - m.connections_closed),
+                        (unsigned long)onion_metrics_percentile(&m, 0.5),
+                        (unsigned long)onion_metrics_percentile(&m, 0.99));
+
   // Sessions
 //   onion_response_write0(res,"<h1>Sessions and data</h1><ul>");
 //   onion_dict_preorder( req->connection.listen_point->server->sessions->sessions, session_write, res);
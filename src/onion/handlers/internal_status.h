@@ -30,7 +30,7 @@
 extern "C" {
 #endif
 
-/// Creates an auth handler that do not allow to pass unless user is authenticated using a pam name.
+/// Creates a handler that shows the request data and server metrics. With ?format=json or ?format=prometheus, or paths ending in json or metrics, just the metrics.
   onion_handler *onion_internal_status();
 
 #ifdef __cplusplus
@@ -181,7 +181,7 @@ onion_connection_status onion_webdav_move(const char *filename,
                                           onion_webdav * wd,
                                           onion_request * req,
                                           onion_response * res) {
-  const char *dest = onion_request_get_header(req, "Destination");
+  const char *dest = onion_request_get_header_id(req, OH_DESTINATION);
   if (!dest)
     return OCS_INTERNAL_ERROR;
   const char *dest_orig = dest;
@@ -584,7 +584,7 @@ onion_connection_status onion_webdav_propfind(const char *filename,
   ONION_DEBUG0("PROPFIND; pathbase %s", basepath);
   int depth;
   {
-    const char *depths = onion_request_get_header(req, "Depth");
+    const char *depths = onion_request_get_header_id(req, OH_DEPTH);
     if (!depths) {
       ONION_ERROR("Missing Depth header on webdav request");
       return OCS_INTERNAL_ERROR;
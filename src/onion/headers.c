@@ -0,0 +1,127 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+#include <string.h>
+#include <strings.h>
+
+#include "headers.h"
+
+/**
+ * @short Names of the well known headers, in onion_header_e order.
+ * @ingroup request
+ */
+static const char *onion_header_names[OH_COUNT] = {
+  "Host",
+  "Content-Length",
+  "Content-Type",
+  "Connection",
+  "Cookie",
+  "Upgrade",
+  "Authorization",
+  "Accept-Language",
+  "Range",
+  "If-None-Match",
+  "Sec-Websocket-Key",
+  "Sec-Websocket-Protocol",
+  "Sec-Websocket-Version",
+  "Destination",
+  "Depth",
+  "Transfer-Encoding",
+  "Date",
+  "Server",
+  "Location",
+  "Etag",
+  "Set-Cookie",
+};
+
+/**
+ * @short Returns the only well known header that may have that name
+ * @ingroup request
+ *
+ * Length and first letter are enough to tell all the well known headers
+ * apart, so only the returned candidate has to be compared.
+ */
+static onion_header onion_header_candidate(const char *name, size_t l) {
+  char c = name[0] | 0x20;      // ASCII lowercase
+  switch (l) {
+  case 4:
+    return c == 'h' ? OH_HOST : c == 'd' ? OH_DATE : c ==
+        'e' ? OH_ETAG : OH_UNKNOWN;
+  case 5:
+    return c == 'r' ? OH_RANGE : c == 'd' ? OH_DEPTH : OH_UNKNOWN;
+  case 6:
+    return c == 'c' ? OH_COOKIE : c == 's' ? OH_SERVER : OH_UNKNOWN;
+  case 7:
+    return c == 'u' ? OH_UPGRADE : OH_UNKNOWN;
+  case 8:
+    return c == 'l' ? OH_LOCATION : OH_UNKNOWN;
+  case 10:
+    return c == 'c' ? OH_CONNECTION : c == 's' ? OH_SET_COOKIE : OH_UNKNOWN;
+  case 11:
+    return c == 'd' ? OH_DESTINATION : OH_UNKNOWN;
+  case 12:
+    return c == 'c' ? OH_CONTENT_TYPE : OH_UNKNOWN;
+  case 13:
+    return c == 'a' ? OH_AUTHORIZATION : c ==
+        'i' ? OH_IF_NONE_MATCH : OH_UNKNOWN;
+  case 14:
+    return c == 'c' ? OH_CONTENT_LENGTH : OH_UNKNOWN;
+  case 15:
+    return c == 'a' ? OH_ACCEPT_LANGUAGE : OH_UNKNOWN;
+  case 17:
+    return c == 's' ? OH_SEC_WEBSOCKET_KEY : c ==
+        't' ? OH_TRANSFER_ENCODING : OH_UNKNOWN;
+  case 21:
+    return c == 's' ? OH_SEC_WEBSOCKET_VERSION : OH_UNKNOWN;
+  case 22:
+    return c == 's' ? OH_SEC_WEBSOCKET_PROTOCOL : OH_UNKNOWN;
+  }
+  return OH_UNKNOWN;
+}
+
+/**
+ * @short Returns the well known header id for that name
+ * @ingroup request
+ *
+ * Comparison is case insensitive, as HTTP header names are.
+ *
+ * @returns The header id, or OH_UNKNOWN if its not a well known header.
+ */
+onion_header onion_header_id(const char *name) {
+  onion_header id = onion_header_candidate(name, strlen(name));
+  if (id != OH_UNKNOWN && strcasecmp(onion_header_names[id], name) != 0)
+    return OH_UNKNOWN;
+  return id;
+}
+
+/**
+ * @short Returns the canonical name for a well known header
+ * @ingroup request
+ *
+ * @returns The name, or NULL if id is not valid.
+ */
+const char *onion_header_name(onion_header id) {
+  if (id < 0 || id >= OH_COUNT)
+    return NULL;
+  return onion_header_names[id];
+}
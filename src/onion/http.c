@@ -22,12 +22,15 @@
 */
 
 #include <stdlib.h>
+#include <stdbool.h>
 
 #include "types.h"
 #include "http.h"
 #include "types_internal.h"
 #include "listen_point.h"
 #include "request.h"
+#include "block.h"
+#include "low.h"
 #include "log.h"
 
 /// @defgroup http HTTP. Specific bits for http listen points. Mostly used internally.
@@ -70,26 +73,130 @@ static ssize_t onion_http_read(onion_request * con, char *data, size_t len) {
   return read(con->connection.fd, data, len);
 }
 
+/// Maximum pending output while processing pipelined requests. Bigger writes flush it and go directly.
+#define ONION_HTTP_WRITE_BATCH_MAX (64 * 1024)
+
+/**
+ * @short Writes all the data, retrying on partial writes.
+ * @memberof onion_http_t
+ * @ingroup http
+ */
+static int onion_http_write_all(onion_request * con, const char *data,
+                                size_t len) {
+  while (len > 0) {
+    ssize_t w = write(con->connection.fd, data, len);
+    if (w <= 0)
+      return -1;
+    data += w;
+    len -= w;
+  }
+  return 0;
+}
+
+/// Connection whose pipelined output this thread is batching. Yielded requests may write from
+/// other threads, and those must never see the batch.
+static __thread onion_request *onion_http_batching = NULL;
+
+/**
+ * @short Writes the pending pipelined output, and keeps the batch open.
+ * @memberof onion_http_t
+ * @ingroup http
+ *
+ * @returns 0 on success, -1 on error.
+ */
+static int onion_http_write_batch_flush(onion_request * con) {
+  onion_block *batch = con->connection.write_batch;
+  int r = onion_http_write_all(con, batch->data, batch->size);
+  onion_block_clear(batch);
+  return r;
+}
+
+/**
+ * @short Writes the pending pipelined output and stops batching
+ * @memberof onion_http_t
+ * @ingroup http
+ *
+ * Must be called before writing directly to the fd, as with sendfile, so order is kept.
+ *
+ * @returns 0 on success, -1 on error.
+ */
+int onion_http_write_batch_end(onion_request * con) {
+  if (onion_http_batching != con || !con->connection.write_batch)
+    return 0;
+  int r = onion_http_write_batch_flush(con);
+  onion_block_free(con->connection.write_batch);
+  con->connection.write_batch = NULL;
+  onion_http_batching = NULL;
+  return r;
+}
+
 /**
  * @short HTTP client has data ready to be readen
  * @memberof onion_http_t
  * @ingroup http
+ *
+ * All the complete requests at the read data are processed, one after another (HTTP/1.1
+ * pipelining). While there are more requests to process the responses are kept in memory,
+ * and written together when done. A request that yields ends the batch before it is handed
+ * off, at onion_request_process.
  */
 int onion_http_read_ready(onion_request * con) {
-  char buffer[1500];
-  ssize_t len = con->connection.listen_point->read(con, buffer, sizeof(buffer));
+  if (!con->connection.read_buffer) {
+    con->connection.read_buffer_size =
+        con->connection.listen_point->server->read_buffer_size;
+    con->connection.read_buffer =
+        onion_low_malloc(con->connection.read_buffer_size);
+  }
+  char *buffer = con->connection.read_buffer;
+  ssize_t len = con->connection.listen_point->read(con, buffer,
+                                                   con->connection.
+                                                   read_buffer_size);
 
   if (len <= 0)
     return OCS_CLOSE_CONNECTION;
 
-  onion_connection_status st = onion_request_write(con, buffer, len);
-  if (st != OCS_NEED_MORE_DATA) {
-    if (st == OCS_REQUEST_READY)
+  // Only plain HTTP batches; HTTPS writes are already records by GnuTLS.
+  bool can_batch = (con->connection.listen_point->write == onion_http_write);
+  onion_connection_status st = OCS_NEED_MORE_DATA;
+  size_t pos = 0;
+  while (pos < len) {
+    size_t consumed;
+    st = onion_request_write_partial(con, buffer + pos, len - pos, &consumed);
+    pos += consumed;
+    if (st == OCS_NEED_MORE_DATA)
+      break;
+    if (st == OCS_REQUEST_READY) {
+      if (can_batch && pos < len && !con->connection.write_batch) {
+        con->connection.write_batch = onion_block_new();
+        onion_http_batching = con;
+      }
       st = onion_request_process(con);  // May give error to the connection, or yield or whatever.
-    if (st < 0)
-      return st;
+    }
+    if (st != OCS_KEEP_ALIVE || con->websocket)
+      break;
+  }
+  if (pos < len) {
+    if (con->websocket)
+      ONION_DEBUG("Ignoring %d bytes after websocket upgrade",
+                  (int)(len - pos));
+    else if (st == OCS_YIELD) {
+      // A yielded request ends its connection, so the pipelined requests after it can not be
+      // answered. Tell the client with Connection: Close, so it retries them. Its still safe
+      // to touch the request, as it is detached when this returns.
+      ONION_INFO
+          ("Closing connection after a yielded request, %d pipelined bytes not processed",
+           (int)(len - pos));
+      onion_request_set_no_keep_alive(con);
+    } else if (st != OCS_NEED_MORE_DATA)
+      ONION_DEBUG("Closing connection, %d pipelined bytes not processed",
+                  (int)(len - pos));
   }
 
+  if (onion_http_write_batch_end(con) < 0)
+    return OCS_CLOSE_CONNECTION;
+  if (st < 0)
+    return st;
+
   return OCS_PROCESSED;
 }
 
@@ -97,7 +204,20 @@ int onion_http_read_ready(onion_request * con) {
  * @short Write dat to the HTTP client
  * @memberof onion_http_t
  * @ingroup http
+ *
+ * If there are pipelined requests in process, it is just kept to be written later. Only
+ * the thread processing them uses the batch.
  */
 ssize_t onion_http_write(onion_request * con, const char *data, size_t len) {
+  onion_block *batch =
+      (onion_http_batching == con) ? con->connection.write_batch : NULL;
+  if (batch) {
+    if (batch->size + len <= ONION_HTTP_WRITE_BATCH_MAX) {
+      onion_block_add_data(batch, data, len);
+      return len;
+    }
+    if (onion_http_write_batch_flush(con) < 0)
+      return -1;
+  }
   return write(con->connection.fd, data, len);
 }
@@ -26,6 +26,7 @@
 #endif
 #include <sys/socket.h>
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <netdb.h>
@@ -38,19 +39,26 @@
 #include "poller.h"
 #include "request.h"
 #include "listen_point.h"
+#include "metrics.h"
 
 #ifndef SOCK_CLOEXEC
 #define SOCK_CLOEXEC 0
 #define accept4(a,b,c,d) accept(a,b,c);
 #endif
 
-#ifdef HAVE_SYSTEMD
-#include <systemd/sd-daemon.h>
-#endif
-
 /// @defgroup listen_point Listen Point. Allows to listen at several ports with different protocols, and to add new protocols.
 
 static int onion_listen_point_read_ready(onion_request * req);
+static void onion_listen_point_overloaded(onion_request * req);
+static void onion_listen_point_socket_init(onion_request * req, int clientfd);
+static int onion_listen_point_accept_socket(onion_listen_point * op,
+                                            struct sockaddr_storage *cli_addr,
+                                            socklen_t * cli_len);
+static int onion_listen_point_new_connection(onion_listen_point * op, int fd,
+                                             struct sockaddr_storage *cli_addr,
+                                             socklen_t cli_len);
+// Admission control, at onion.c
+int onion_admit_connection(onion * server, onion_request * req);
 
 /**
  * @short Creates an empty listen point.
@@ -87,6 +95,61 @@ void onion_listen_point_free(onion_listen_point * op) {
   onion_low_free(op);
 }
 
+/**
+ * @short Adds a new connection to the poller, or answers 503 if over the server limits.
+ * @memberof onion_listen_point_t
+ * @ingroup listen_point
+ *
+ * @returns 0 if added or rejected, <0 if it could not get a poller slot.
+ */
+static int onion_listen_point_add_connection(onion_request * req) {
+  onion *server = req->connection.listen_point->server;
+  if (onion_admit_connection(server, req) < 0) {
+    onion_listen_point_overloaded(req);
+    onion_request_free(req);
+    return 0;
+  }
+  onion_poller_slot *slot = onion_poller_slot_new(req->connection.fd,
+                                                  (void *)
+                                                  onion_listen_point_read_ready,
+                                                  req);
+  if (!slot)
+    return -1;
+  onion_poller_slot_set_timeout(slot, server->timeout);
+  onion_poller_slot_set_shutdown(slot, (void *)onion_request_free, req);
+  // Any poller thread may get it.
+  onion_poller_add(server->poller, slot);
+  return 0;
+}
+
+/**
+ * @short Creates the request for an already accepted connection, and adds it.
+ * @memberof onion_listen_point_t
+ * @ingroup listen_point
+ *
+ * Listen points with request_init, as TLS, do their own setup with the fd already set.
+ *
+ * @returns 0 if added, rejected or failed its init, <0 if it could not get a poller slot.
+ */
+static int onion_listen_point_new_connection(onion_listen_point * op, int fd,
+                                             struct sockaddr_storage *cli_addr,
+                                             socklen_t cli_len) {
+  onion_request *req = onion_request_new(NULL);
+  req->connection.listen_point = op;
+  req->connection.fd = fd;
+  memcpy(&req->connection.cli_addr, cli_addr, cli_len);
+  req->connection.cli_len = cli_len;
+  if (op->request_init) {
+    if (op->request_init(req) < 0) {
+      ONION_DEBUG("Invalid request, closing");
+      onion_request_free(req);
+      return 0;
+    }
+  } else
+    onion_listen_point_socket_init(req, fd);
+  return onion_listen_point_add_connection(req);
+}
+
 /**
  * @short Called when a new connection appears on the listenfd
  * @memberof onion_listen_point_t
@@ -94,6 +157,9 @@ void onion_listen_point_free(onion_listen_point * op) {
  *
  * When the new connection appears, creates the request and adds it to the pollers.
  *
+ * For socket listen points it accepts all the pending connections, up to the server
+ * accept_batch, so bursts do not wait for one poller wakeup each.
+ *
  * It returns always 1 as any <0 would detach from the poller and close the listen point,
  * and not accepting a request does not mean the connection point is corrupted. If a
  * connection point may become corrupted should be the connection point itself who detaches
@@ -103,31 +169,59 @@ void onion_listen_point_free(onion_listen_point * op) {
  * @returns 1 always. The poller needs one to keep listening for connections.
  */
 int onion_listen_point_accept(onion_listen_point * op) {
-  onion_request *req = onion_request_new(op);
-  if (req) {
-    if (req->connection.fd > 0) {
-      onion_poller_slot *slot = onion_poller_slot_new(req->connection.fd,
-                                                      (void *)
-                                                      onion_listen_point_read_ready,
-                                                      req);
-      if (!slot)
-        return 1;
-      onion_poller_slot_set_timeout(slot,
-                                    req->connection.listen_point->server->
-                                    timeout);
-      onion_poller_slot_set_shutdown(slot, (void *)onion_request_free, req);
-      onion_poller_add(req->connection.listen_point->server->poller, slot);
-      return 1;
+  // Before reading the listenfd, so onion_drain either waits for this or it is already -1.
+  __atomic_add_fetch(&op->accepting, 1, __ATOMIC_SEQ_CST);
+  if (op->listen) {             // Not a socket, and may block, so only one.
+    onion_request *req = onion_request_new(op);
+    if (req && req->connection.fd > 0)
+      onion_listen_point_add_connection(req);
+    else if (req) {
+      // No fd. This could mean error, or not fd based. Normally error would not return a req.
+      onion_request_free(req);
+      ONION_ERROR("Error creating connection");
+    }
+  } else {
+    // Socket listen points are non blocking at the poller, so drain all pending connections
+    // at once. The request is only created for a real connection, not for the last try that
+    // finds none.
+    int i;
+    for (i = 0; i < op->server->accept_batch; i++) {
+      struct sockaddr_storage cli_addr;
+      socklen_t cli_len = sizeof(cli_addr);
+      int fd = onion_listen_point_accept_socket(op, &cli_addr, &cli_len);
+      if (fd < 0)               // No more pending, or error.
+        break;
+      if (onion_listen_point_new_connection(op, fd, &cli_addr, cli_len) < 0)
+        break;
     }
-    // No fd. This could mean error, or not fd based. Normally error would not return a req.
-    onion_request_free(req);
-    ONION_ERROR("Error creating connection");
-    return 1;
   }
+  __atomic_sub_fetch(&op->accepting, 1, __ATOMIC_SEQ_CST);
 
   return 1;
 }
 
+/**
+ * @short Called with a connection already accepted from the listenfd
+ * @memberof onion_listen_point_t
+ * @ingroup listen_point
+ *
+ * Pollers that accept at the kernel, as io_uring with multishot accept, call it instead
+ * of onion_listen_point_accept, saving the accept syscall. Only for socket listen points
+ * without their own request_init, as TLS ones.
+ *
+ * @param op The listen point
+ * @param fd The new connection
+ * @returns 1 always, as onion_listen_point_accept.
+ */
+int onion_listen_point_accepted(onion_listen_point * op, int fd) {
+  struct sockaddr_storage cli_addr;
+  socklen_t cli_len = sizeof(cli_addr);
+  if (getpeername(fd, (struct sockaddr *)&cli_addr, &cli_len) < 0)
+    cli_len = 0;                // Already gone; the first read will fail.
+  onion_listen_point_new_connection(op, fd, &cli_addr, cli_len);
+  return 1;
+}
+
 /**
  * @short Stops listening the listen point
  * @memberof onion_listen_point_t
@@ -149,6 +243,18 @@ void onion_listen_point_listen_stop(onion_listen_point * op) {
   }
 }
 
+/// System max listen backlog, from /proc/sys/net/core/somaxconn, or SOMAXCONN if unknown.
+static int onion_listen_point_somaxconn() {
+  int backlog = 0;
+  FILE *f = fopen("/proc/sys/net/core/somaxconn", "r");
+  if (f) {
+    if (fscanf(f, "%d", &backlog) != 1)
+      backlog = 0;
+    fclose(f);
+  }
+  return backlog > 0 ? backlog : SOMAXCONN;
+}
+
 /**
  * @short Starts the listening phase for this listen point for sockets.
  * @memberof onion_listen_point_t
@@ -164,21 +270,6 @@ int onion_listen_point_listen(onion_listen_point * op) {
     op->listen(op);
     return 0;
   }
-#ifdef HAVE_SYSTEMD
-  if (op->server->flags & O_SYSTEMD) {
-    int n = sd_listen_fds(0);
-    ONION_DEBUG("Checking if have systemd sockets: %d", n);
-    if (n > 0) {                // If 0, normal startup. Else use the first LISTEN_FDS.
-      ONION_DEBUG("Using systemd sockets");
-      if (n > 1) {
-        ONION_WARNING
-            ("Get more than one systemd socket descriptor. Using only the first.");
-      }
-      op->listenfd = SD_LISTEN_FDS_START + 0;
-      return 0;
-    }
-  }
-#endif
 
   struct addrinfo hints;
   struct addrinfo *result, *rp;
@@ -239,12 +330,40 @@ int onion_listen_point_listen(onion_listen_point * op) {
   ONION_DEBUG("Listening to %s:%s, fd %d", address, &address[32], sockfd);
 #endif
   freeaddrinfo(result);
-  listen(sockfd, 5);            // queue of only 5.
+  int backlog = op->server ? op->server->listen_backlog : 0;
+  if (backlog <= 0)
+    backlog = onion_listen_point_somaxconn();
+  if (listen(sockfd, backlog) < 0)
+    ONION_ERROR("Could not listen: %s", strerror(errno));
 
   op->listenfd = sockfd;
   return 0;
 }
 
+/**
+ * @short Answers the pre-rendered 503 to a new connection over the server limits.
+ * @memberof onion_listen_point_t
+ * @ingroup listen_point
+ *
+ * It does not wait for the request nor for the answer to be sent; the connection is closed
+ * right after. Secure listen points would need the TLS handshake, so they are just closed.
+ */
+static void onion_listen_point_overloaded(onion_request * req) {
+  onion *server = req->connection.listen_point->server;
+  int fd = req->connection.fd;
+  onion_metrics_connection_rejected();
+  if (req->connection.listen_point->secure)
+    return;
+  // Discard what already arrived, as closing with unread data resets the connection
+  // and the client may lose the answer.
+  char discard[1024];
+  if (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) < 0)
+    ONION_DEBUG0("Nothing to discard from %d", fd);
+  if (send(fd, server->overload_response, server->overload_response_length,
+           MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    ONION_DEBUG("Could not send the overload answer: %s", strerror(errno));
+}
+
 /**
  * @short This listen point has data ready to read; calls the listen_point read_ready
  * @memberof onion_listen_point_t
@@ -264,6 +383,21 @@ static int onion_listen_point_read_ready(onion_request * req) {
   return req->connection.listen_point->read_ready(req);
 }
 
+/// Sets the new connection fd at the request, with the server timeout.
+static void onion_listen_point_socket_init(onion_request * req, int clientfd) {
+  onion *server = req->connection.listen_point->server;
+  req->connection.fd = clientfd;
+
+  /// Thanks to Andrew Victor for pointing that without this client may block HTTPS connection. It could lead to DoS if occupies all connections.
+  {
+    struct timeval t;
+    t.tv_sec = server->timeout / 1000;
+    t.tv_usec = (server->timeout % 1000) * 1000;
+
+    setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(struct timeval));
+  }
+}
+
 /**
  * @short Default implementation that initializes the request from a socket
  * @memberof onion_listen_point_t
@@ -275,42 +409,54 @@ static int onion_listen_point_read_ready(onion_request * req) {
  * @returns <0 if error opening the connection
  */
 int onion_listen_point_request_init_from_socket(onion_request * req) {
-  onion_listen_point *op = req->connection.listen_point;
-  int listenfd = op->listenfd;
+  if (req->connection.fd < 0) { // Else already accepted, as by onion_listen_point_accept
+    req->connection.cli_len = sizeof(req->connection.cli_addr);
+    int clientfd =
+        onion_listen_point_accept_socket(req->connection.listen_point,
+                                         &req->connection.cli_addr,
+                                         &req->connection.cli_len);
+    if (clientfd < 0)
+      return -1;
+    req->connection.fd = clientfd;
+  }
+  onion_listen_point_socket_init(req, req->connection.fd);
+  return 0;
+}
+
+/**
+ * @short Accepts a pending connection from the listen socket.
+ * @memberof onion_listen_point_t
+ * @ingroup listen_point
+ *
+ * @returns The new connection fd, or <0 if none pending or error.
+ */
+static int onion_listen_point_accept_socket(onion_listen_point * op,
+                                            struct sockaddr_storage *cli_addr,
+                                            socklen_t * cli_len) {
+  int listenfd = __atomic_load_n(&op->listenfd, __ATOMIC_SEQ_CST);    // onion_drain may close it
   if (listenfd < 0) {
     ONION_DEBUG("Listen point closed, no request allowed");
     return -1;
   }
   /// Follows default socket implementation. If your protocol is socket based, just use it.
 
-  req->connection.cli_len = sizeof(req->connection.cli_addr);
-
   int set_cloexec = SOCK_CLOEXEC == 0;
-  int clientfd = accept4(listenfd, (struct sockaddr *)&req->connection.cli_addr,
-                         &req->connection.cli_len, SOCK_CLOEXEC);
+  int clientfd = accept4(listenfd, (struct sockaddr *)cli_addr, cli_len,
+                         SOCK_CLOEXEC);
   if (clientfd < 0) {
     ONION_DEBUG("Second try? errno %d, clientfd %d", errno, clientfd);
     if (errno == ENOSYS) {
-      clientfd = accept(listenfd, (struct sockaddr *)&req->connection.cli_addr,
-                        &req->connection.cli_len);
+      clientfd = accept(listenfd, (struct sockaddr *)cli_addr, cli_len);
     }
     ONION_DEBUG("How was it? errno %d, clientfd %d", errno, clientfd);
     if (clientfd < 0) {
-      ONION_ERROR("Error accepting connection: %s", strerror(errno), errno);
-      onion_listen_point_request_close_socket(req);
+      if (errno == EINVAL)      // Not listening anymore, as stopped or drained
+        ONION_DEBUG("Listen socket %d stopped", listenfd);
+      else if (errno != EAGAIN && errno != EWOULDBLOCK)        // Else no more pending at a non blocking listen
+        ONION_ERROR("Error accepting connection: %s", strerror(errno), errno);
       return -1;
     }
   }
-  req->connection.fd = clientfd;
-
-  /// Thanks to Andrew Victor for pointing that without this client may block HTTPS connection. It could lead to DoS if occupies all connections.
-  {
-    struct timeval t;
-    t.tv_sec = op->server->timeout / 1000;
-    t.tv_usec = (op->server->timeout % 1000) * 1000;
-
-    setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(struct timeval));
-  }
 
   if (set_cloexec) {            // Good compiler know how to cut this out
     int flags = fcntl(clientfd, F_GETFD);
@@ -324,7 +470,7 @@ int onion_listen_point_request_init_from_socket(onion_request * req) {
   }
 
   ONION_DEBUG0("New connection, socket %d", clientfd);
-  return 0;
+  return clientfd;
 }
 
 /**
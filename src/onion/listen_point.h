@@ -35,6 +35,7 @@ extern "C" {
   void onion_listen_point_listen_stop(onion_listen_point * op);
   void onion_listen_point_free(onion_listen_point *);
   int onion_listen_point_accept(onion_listen_point *);
+  int onion_listen_point_accepted(onion_listen_point * op, int fd);
   int onion_listen_point_request_init_from_socket(onion_request * op);
   void onion_listen_point_request_close_socket(onion_request * oc);
 #ifdef __cplusplus
@@ -30,10 +30,11 @@
 #include <syslog.h>
 #include <unistd.h>
 #include "utils.h"
+#include "low.h"
 
 #ifdef HAVE_PTHREADS
 #include <pthread.h>
-#include <unistd.h>
+#include <stdint.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #endif
@@ -58,6 +59,8 @@ void onion_log_syslog(onion_log_level level, const char *filename, int lineno,
                       const char *fmt, ...);
 void onion_log_stderr(onion_log_level level, const char *filename, int lineno,
                       const char *fmt, ...);
+void onion_log_async(onion_log_level level, const char *filename, int lineno,
+                     const char *fmt, ...);
 
 static void onion_init_logging() {
   if (!onion_log_flags) {
@@ -75,6 +78,8 @@ static void onion_init_logging() {
         onion_log_flags |= OF_NOCOLOR;
       if (strstr(ol, "syslog")) // Switch to syslog
         onion_log = onion_log_syslog;
+      else if (strstr(ol, "async"))
+        onion_log = onion_log_async;
     }
   }
 #ifndef HAVE_PTHREADS
@@ -120,8 +125,40 @@ void (*onion_log) (onion_log_level level, const char *filename, int lineno,
  * When compiled in release mode (no __DEBUG__ defined), DEBUG and DEBUG0 are not compiled so they do
  * not incurr in any performance penalty.
  */
-void onion_log_stderr(onion_log_level level, const char *filename, int lineno,
-                      const char *fmt, ...) {
+static const char *onion_log_levelstr[] =
+    { "DEBUG0", "DEBUG", "INFO", "WARNING", "ERROR", "UNKNOWN" };
+static const char *onion_log_levelcolor[] =
+    { "\033[34m", "\033[01;34m", "\033[0m", "\033[01;33m", "\033[31m",
+  "\033[01;31m"
+};
+
+#define ONION_LOG_LEVELS (sizeof(onion_log_levelstr) / sizeof(onion_log_levelstr[0]))
+
+/// Size of a formatted log line.
+#define ONION_LOG_LINE_SIZE 256
+
+/// Formatted date of the last logged second, per thread, so strftime is called once per second.
+static __thread time_t onion_log_datetime_t = -1;
+static __thread char onion_log_datetime[32];
+
+static const char *onion_log_datetime_get(time_t t) {
+  if (t != onion_log_datetime_t) {
+    struct tm result;
+    localtime_r(&t, &result);
+    strftime(onion_log_datetime, sizeof(onion_log_datetime),
+             "%Y-%m-%d %H:%M:%S", &result);
+    onion_log_datetime_t = t;
+  }
+  return onion_log_datetime;
+}
+
+/**
+ * @short Checks the level and file filters.
+ *
+ * Returns the basename of the file, or NULL if the message must not be logged.
+ */
+static const char *onion_log_filter(onion_log_level level,
+                                    const char *filename) {
 #ifdef HAVE_PTHREADS
   pthread_once(&is_logging_initialized, onion_init_logging);
 #else
@@ -132,7 +169,7 @@ void onion_log_stderr(onion_log_level level, const char *filename, int lineno,
     if (((level == O_INFO) && ((onion_log_flags & OF_NOINFO) == OF_NOINFO)) ||
         ((level == O_DEBUG)
          && ((onion_log_flags & OF_NODEBUG) == OF_NODEBUG))) {
-      return;
+      return NULL;
     }
   }
 
@@ -140,69 +177,87 @@ void onion_log_stderr(onion_log_level level, const char *filename, int lineno,
 
 #ifdef __DEBUG__
   if ((level == O_DEBUG0) && (!debug0 || !strstr(debug0, filename))) {
-    return;
+    return NULL;
   }
 #endif
+  return filename;
+}
 
-  const char *levelstr[] =
-      { "DEBUG0", "DEBUG", "INFO", "WARNING", "ERROR", "UNKNOWN" };
-  const char *levelcolor[] =
-      { "\033[34m", "\033[01;34m", "\033[0m", "\033[01;33m", "\033[31m",
-    "\033[01;31m"
-  };
-  char strout[256];
-  ssize_t strout_length = 0;
-
-  if (level > (sizeof(levelstr) / sizeof(levelstr[0])) - 1)
-    level = (sizeof(levelstr) / sizeof(levelstr[0])) - 1;
+/// Writes the line prefix: thread, color, date, level and place. Returns its length.
+static int onion_log_prefix(char *strout, onion_log_level level,
+                            unsigned int pid, time_t t, const char *filename,
+                            int lineno) {
+  int strout_length = 0;
+  if (level > ONION_LOG_LEVELS - 1)
+    level = ONION_LOG_LEVELS - 1;
 
 #ifdef HAVE_PTHREADS
-  int pid = (unsigned long long)pthread_self();
   if (!(onion_log_flags & OF_NOCOLOR))
     strout_length +=
         sprintf(strout + strout_length, "\033[%dm[%04X]%s ",
-                31 + ((unsigned int)(pid)) % 7, pid, levelcolor[level]);
+                31 + pid % 7, pid, onion_log_levelcolor[level]);
   else
     strout_length += sprintf(strout + strout_length, "[%04X] ", pid);
 #else
   if (!(onion_log_flags & OF_NOCOLOR))
-    strout_length += sprintf(strout + strout_length, "%s", levelcolor[level]);
+    strout_length +=
+        sprintf(strout + strout_length, "%s", onion_log_levelcolor[level]);
 #endif
 
-  char datetime[32];
-  time_t t;
-  struct tm result;
-  t = time(NULL);
-  localtime_r(&t, &result);
-  strftime(datetime, sizeof(datetime), "%Y-%m-%d %H:%M:%S", &result);
-
-  strout_length += sprintf(strout + strout_length, "[%s] [%s %s:%d] ", datetime, levelstr[level], filename, lineno);    // I dont know why basename is char *. Please somebody tell me.
+  strout_length += sprintf(strout + strout_length, "[%s] [%s %s:%d] ", onion_log_datetime_get(t), onion_log_levelstr[level], filename, lineno);      // I dont know why basename is char *. Please somebody tell me.
+  return strout_length;
+}
 
-  va_list ap;
-  va_start(ap, fmt);
-  // this one is the only one that MUST be checked for size, as before logically
-  // can be no less than sizeof(strout), and his check ensures there is space for
-  // following adds
-  {
-    size_t maxsize = sizeof(strout) - strout_length - 6;
-    size_t total_size = vsnprintf(strout + strout_length, maxsize, fmt, ap);
-    if (total_size > maxsize) { // Message too long, truncates it
-      strout_length += maxsize;
-      strout[strout_length - 1] = '.';
-      strout[strout_length - 2] = '.';
-      strout[strout_length - 3] = '.';
-    } else {
-      strout_length += total_size;
-    }
+/**
+ * @short Finishes a line after the message was written with at most maxsize bytes.
+ *
+ * total_size is the full size of the message; if longer it is marked as truncated.
+ * Returns the final line length.
+ */
+static int onion_log_line_end(char *strout, int strout_length,
+                              size_t total_size, size_t maxsize) {
+  if (total_size > maxsize) {   // Message too long, truncates it
+    strout_length += maxsize;
+    strout[strout_length - 1] = '.';
+    strout[strout_length - 2] = '.';
+    strout[strout_length - 3] = '.';
+  } else {
+    strout_length += total_size;
   }
 
-  va_end(ap);
   if (!(onion_log_flags & OF_NOCOLOR))
     strout_length += sprintf(strout + strout_length, "\033[0m\n");
   else
     strout_length += sprintf(strout + strout_length, "\n");
 
   strout[strout_length] = '\0';
+  return strout_length;
+}
+
+static unsigned int onion_log_thread_id() {
+#ifdef HAVE_PTHREADS
+  return (unsigned long long)pthread_self();
+#else
+  return 0;
+#endif
+}
+
+/// Formats and writes a line at the calling thread.
+static void onion_log_vstderr(onion_log_level level, const char *filename,
+                              int lineno, const char *fmt, va_list ap) {
+  char strout[ONION_LOG_LINE_SIZE];
+  int strout_length =
+      onion_log_prefix(strout, level, onion_log_thread_id(), time(NULL),
+                       filename, lineno);
+
+  // this one is the only one that MUST be checked for size, as before logically
+  // can be no less than sizeof(strout), and his check ensures there is space for
+  // following adds
+  size_t maxsize = sizeof(strout) - strout_length - 6;
+  size_t total_size = vsnprintf(strout + strout_length, maxsize, fmt, ap);
+  strout_length =
+      onion_log_line_end(strout, strout_length, total_size, maxsize);
+
   // Use of write instead of fwrite, as it shoukd be atomic with kernel doing the
   // job, but fwrite can have an internal mutex. Both should do atomic
   // writes anyway, and performance tests show no diference on Linux 4.4.3
@@ -210,6 +265,359 @@ void onion_log_stderr(onion_log_level level, const char *filename, int lineno,
   ((void)(w));                  // w unused, no prob.
 }
 
+/**
+ * @short Logs to stderr.
+ * @ingroup log
+ *
+ * It can be affected also by the environment variable ONION_LOG, with one or several of:
+ *
+ * - "nocolor"  -- then output will be without colors.
+ * - "syslog"   -- Switchs the logging to syslog.
+ * - "async"    -- Switchs the logging to onion_log_async.
+ * - "noinfo"   -- Do not show info lines.
+ * - "nodebug"  -- When in debug mode, do not show debug lines.
+ *
+ * Also for DEBUG0 level, it must be explictly set with the environmental variable ONION_DEBUG0, set
+ * to the names of the files to allow DEBUG0 debug info. For example:
+ *
+ *   export ONION_DEBUG0="onion.c url.c"
+ *
+ * It is thread safe.
+ *
+ * When compiled in release mode (no __DEBUG__ defined), DEBUG and DEBUG0 are not compiled so they do
+ * not incurr in any performance penalty.
+ */
+void onion_log_stderr(onion_log_level level, const char *filename, int lineno,
+                      const char *fmt, ...) {
+  filename = onion_log_filter(level, filename);
+  if (!filename)
+    return;
+
+  va_list ap;
+  va_start(ap, fmt);
+  onion_log_vstderr(level, filename, lineno, fmt, ap);
+  va_end(ap);
+}
+
+/**
+ * @{ @name Asynchronous logging
+ *
+ * The calling thread only formats the message itself into a record of its own ring buffer;
+ * the date, prefix and the write to stderr are done by a background thread, in batches.
+ *
+ * Each thread has a single producer single consumer ring, so pushing a record needs no locks
+ * nor atomic read-modify-write. If the ring is full the record is dropped, and the logger
+ * thread reports how many were lost.
+ *
+ * The message must be formatted at the caller, as the arguments may not be alive later.
+ */
+
+#ifdef HAVE_PTHREADS
+
+/// Records per thread ring. Power of 2.
+#define ONION_LOG_RING_SIZE 256
+/// Size of the message at a record. Longer than fits in a line, so truncation is as with onion_log_stderr.
+#define ONION_LOG_RECORD_MSG_SIZE 224
+/// Time the logger thread waits when there is nothing to write, in ms.
+#define ONION_LOG_ASYNC_WAIT 5
+#define ONION_LOG_CACHE_LINE 64
+
+typedef struct onion_log_record_t {
+  time_t t;
+  const char *filename;         ///< Basename at the source, so static.
+  int lineno;
+  unsigned int pid;
+  int level;
+  int length;                   ///< Length of the full message, even if longer than msg.
+  char msg[ONION_LOG_RECORD_MSG_SIZE];
+} onion_log_record;
+
+typedef struct onion_log_ring_t {
+  /// Next record to write. Only written by the owner thread.
+  unsigned int head __attribute__ ((aligned(ONION_LOG_CACHE_LINE)));
+  /// Records dropped as the ring was full. Only written by the owner thread.
+  unsigned int dropped;
+  /// Next record to read. Only written by the logger thread.
+  unsigned int tail __attribute__ ((aligned(ONION_LOG_CACHE_LINE)));
+  /// Dropped records already reported. Only used by the logger thread.
+  unsigned int dropped_reported;
+  int in_use;
+  struct onion_log_ring_t *next;
+  onion_log_record records[ONION_LOG_RING_SIZE];
+} __attribute__ ((aligned(ONION_LOG_CACHE_LINE))) onion_log_ring;
+
+enum onion_log_async_state_e {
+  OLA_STOPPED = 0,
+  OLA_RUNNING = 1,
+  OLA_FINISHED = 2,             ///< After onion_log_async_stop; logs synchronously.
+};
+
+static onion_log_ring *onion_log_rings = NULL;
+static __thread onion_log_ring *onion_log_current_ring = NULL;
+static pthread_key_t onion_log_ring_key;
+static pthread_once_t onion_log_ring_key_once = PTHREAD_ONCE_INIT;
+/// Protects the ring list, the state and the writing, so onion_log_async_flush can also drain.
+static pthread_mutex_t onion_log_async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t onion_log_async_thread;
+static int onion_log_async_state = OLA_STOPPED;
+static int onion_log_async_atfork_registered = 0;
+
+/// At thread exit, leaves the ring to the next thread. Pending records are still written.
+static void onion_log_ring_release(void *ring) {
+  __atomic_store_n(&((onion_log_ring *) ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void onion_log_ring_key_init() {
+  pthread_key_create(&onion_log_ring_key, onion_log_ring_release);
+}
+
+/// Writes the full buffer, retrying on partial writes.
+static void onion_log_write_all(const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t w = write(2, data, length);
+    if (w <= 0)
+      return;
+    data += w;
+    length -= w;
+  }
+}
+
+/// Writes all pending records, in batches. Must have the mutex. Returns the number of records.
+static int onion_log_async_drain() {
+  char batch[16 * 1024];
+  size_t batch_length = 0;
+  int count = 0;
+  onion_log_ring *ring;
+  for (ring = onion_log_rings; ring; ring = ring->next) {
+    unsigned int tail = ring->tail;
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (; tail != head; tail++) {
+      if (sizeof(batch) - batch_length < ONION_LOG_LINE_SIZE) {
+        onion_log_write_all(batch, batch_length);
+        batch_length = 0;
+      }
+      onion_log_record *rec = &ring->records[tail & (ONION_LOG_RING_SIZE - 1)];
+      char *strout = batch + batch_length;
+      int strout_length = onion_log_prefix(strout, rec->level, rec->pid,
+                                           rec->t, rec->filename,
+                                           rec->lineno);
+      size_t maxsize = ONION_LOG_LINE_SIZE - strout_length - 6;
+      snprintf(strout + strout_length, maxsize, "%s", rec->msg);
+      batch_length +=
+          onion_log_line_end(strout, strout_length, rec->length, maxsize);
+      count++;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    unsigned int dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->dropped_reported) {
+      if (sizeof(batch) - batch_length < ONION_LOG_LINE_SIZE) {
+        onion_log_write_all(batch, batch_length);
+        batch_length = 0;
+      }
+      char *strout = batch + batch_length;
+      int strout_length = onion_log_prefix(strout, O_WARNING,
+                                           onion_log_thread_id(), time(NULL),
+                                           "log.c", __LINE__);
+      size_t maxsize = ONION_LOG_LINE_SIZE - strout_length - 6;
+      size_t total_size = snprintf(strout + strout_length, maxsize,
+                                   "%u log messages dropped, as the log buffer was full",
+                                   dropped - ring->dropped_reported);
+      batch_length +=
+          onion_log_line_end(strout, strout_length, total_size, maxsize);
+      ring->dropped_reported = dropped;
+    }
+  }
+  if (batch_length)
+    onion_log_write_all(batch, batch_length);
+  return count;
+}
+
+static void *onion_log_async_main(void *_) {
+  struct timespec wait = { 0, ONION_LOG_ASYNC_WAIT * 1000000 };
+  for (;;) {
+    pthread_mutex_lock(&onion_log_async_mutex);
+    int running = (onion_log_async_state == OLA_RUNNING);
+    int count = onion_log_async_drain();
+    pthread_mutex_unlock(&onion_log_async_mutex);
+    if (!running)
+      break;
+    if (!count)
+      nanosleep(&wait, NULL);
+  }
+  return NULL;
+}
+
+/// Keeps the state consistent for the child while forking.
+static void onion_log_async_atfork_prepare() {
+  pthread_mutex_lock(&onion_log_async_mutex);
+}
+
+static void onion_log_async_atfork_parent() {
+  pthread_mutex_unlock(&onion_log_async_mutex);
+}
+
+/**
+ * @short At a forked child only the forking thread exists, so the logger thread is started again on next message.
+ *
+ * Pending records are discarded, as the parent writes them. All rings are free, and
+ * this thread registers again, which starts the logger thread.
+ */
+static void onion_log_async_atfork_child() {
+  onion_log_ring *ring;
+  for (ring = onion_log_rings; ring; ring = ring->next) {
+    ring->tail = ring->head;
+    ring->dropped_reported = ring->dropped;
+    ring->in_use = 0;
+  }
+  onion_log_current_ring = NULL;
+  if (onion_log_async_state == OLA_RUNNING)
+    onion_log_async_state = OLA_STOPPED;
+  pthread_mutex_unlock(&onion_log_async_mutex);
+}
+
+/// Gets the ring of this thread, creating it and the logger thread as needed. NULL if stopped.
+static onion_log_ring *onion_log_ring_register() {
+  pthread_once(&onion_log_ring_key_once, onion_log_ring_key_init);
+  pthread_mutex_lock(&onion_log_async_mutex);
+  if (onion_log_async_state == OLA_FINISHED) {
+    pthread_mutex_unlock(&onion_log_async_mutex);
+    return NULL;
+  }
+  if (onion_log_async_state == OLA_STOPPED) {
+    if (!onion_log_async_atfork_registered) {
+      pthread_atfork(onion_log_async_atfork_prepare,
+                     onion_log_async_atfork_parent,
+                     onion_log_async_atfork_child);
+      onion_log_async_atfork_registered = 1;
+      atexit(onion_log_async_stop);
+    }
+    if (pthread_create(&onion_log_async_thread, NULL, onion_log_async_main,
+                       NULL) != 0) {
+      onion_log_async_state = OLA_FINISHED;
+      pthread_mutex_unlock(&onion_log_async_mutex);
+      return NULL;
+    }
+    onion_log_async_state = OLA_RUNNING;
+  }
+  // Reuses only drained rings, so the new thread does not start with a full one.
+  onion_log_ring *ring = onion_log_rings;
+  while (ring && (__atomic_load_n(&ring->in_use, __ATOMIC_ACQUIRE) ||
+                  ring->head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)))
+    ring = ring->next;
+  if (ring) {
+    ring->in_use = 1;
+  } else {
+    // Aligned by hand, as malloc only ensures 16 bytes. Never freed, as any thread may still use it.
+    char *mem = onion_low_calloc(1,
+                                 sizeof(onion_log_ring) +
+                                 ONION_LOG_CACHE_LINE);
+    if (!mem) {
+      pthread_mutex_unlock(&onion_log_async_mutex);
+      return NULL;
+    }
+    ring =
+        (onion_log_ring *) (((uintptr_t) mem + ONION_LOG_CACHE_LINE) &
+                            ~(uintptr_t) (ONION_LOG_CACHE_LINE - 1));
+    ring->in_use = 1;
+    ring->next = onion_log_rings;
+    onion_log_rings = ring;
+  }
+  pthread_mutex_unlock(&onion_log_async_mutex);
+  pthread_setspecific(onion_log_ring_key, ring);
+  onion_log_current_ring = ring;
+  return ring;
+}
+#endif
+
+/**
+ * @short Logs to stderr from a background thread.
+ * @ingroup log
+ *
+ * To use it set onion_log to it, or set the ONION_LOG environment variable to "async". It
+ * follows the same formatting and filters as onion_log_stderr.
+ *
+ * The calling thread only formats the message into its own ring buffer, and does not
+ * block nor do any syscall. The logger thread is created at the first message, and
+ * at exit the pending messages are written.
+ *
+ * If a thread logs faster than the messages can be written, new messages are dropped
+ * and a warning tells how many.
+ *
+ * Without pthreads it is the same as onion_log_stderr.
+ */
+void onion_log_async(onion_log_level level, const char *filename, int lineno,
+                     const char *fmt, ...) {
+  filename = onion_log_filter(level, filename);
+  if (!filename)
+    return;
+
+  va_list ap;
+  va_start(ap, fmt);
+#ifdef HAVE_PTHREADS
+  onion_log_ring *ring = onion_log_current_ring;
+  if (__builtin_expect(ring == NULL, 0))
+    ring = onion_log_ring_register();
+  else if (__builtin_expect
+           (__atomic_load_n(&onion_log_async_state, __ATOMIC_RELAXED) ==
+            OLA_FINISHED, 0))
+    ring = NULL;
+  if (ring) {
+    unsigned int head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+        ONION_LOG_RING_SIZE) {
+      __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    } else {
+      onion_log_record *rec = &ring->records[head & (ONION_LOG_RING_SIZE - 1)];
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME_COARSE, &ts);        // No need for more than seconds.
+      rec->t = ts.tv_sec;
+      rec->filename = filename;
+      rec->lineno = lineno;
+      rec->pid = onion_log_thread_id();
+      rec->level = level;
+      int length = vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+      rec->length = length < 0 ? 0 : length;
+      __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+  } else
+#endif
+    onion_log_vstderr(level, filename, lineno, fmt, ap);
+  va_end(ap);
+}
+
+/**
+ * @short Writes now all the pending asynchronous log messages.
+ * @ingroup log
+ */
+void onion_log_async_flush() {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&onion_log_async_mutex);
+  onion_log_async_drain();
+  pthread_mutex_unlock(&onion_log_async_mutex);
+#endif
+}
+
+/**
+ * @short Stops the asynchronous logger thread, writing all pending messages.
+ * @ingroup log
+ *
+ * It is called at exit. Later calls to onion_log_async log synchronously.
+ */
+void onion_log_async_stop() {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&onion_log_async_mutex);
+  int running = (onion_log_async_state == OLA_RUNNING);
+  __atomic_store_n(&onion_log_async_state, OLA_FINISHED, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&onion_log_async_mutex);
+  if (running)
+    pthread_join(onion_log_async_thread, NULL);
+  onion_log_async_flush();
+#endif
+}
+
+/// @}
+
 /**
  * @short Performs the log to the syslog
  * @ingroup log
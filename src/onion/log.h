@@ -82,6 +82,13 @@ extern "C" {
                         const char *fmt, ...);
   void onion_log_syslog(onion_log_level level, const char *filename, int lineno,
                         const char *fmt, ...);
+/// Logs to stderr, but formats and writes from a background thread. Set onion_log to it to use it.
+  void onion_log_async(onion_log_level level, const char *filename, int lineno,
+                       const char *fmt, ...);
+/// Writes now all the pending asynchronous log messages.
+  void onion_log_async_flush();
+/// Writes all pending asynchronous log messages and stops its thread. Called at exit.
+  void onion_log_async_stop();
 
 #ifdef __cplusplus
 }
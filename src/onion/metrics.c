@@ -0,0 +1,384 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "response.h"
+#include "low.h"
+#include "log.h"
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+/**
+ * @defgroup metrics Metrics. Request, connection and poller counters.
+ *
+ * Each thread updates its own counters, so there are no locks nor atomic read-modify-write
+ * at the hot path; just relaxed stores into a cache line padded block. Readers sum all the
+ * blocks at onion_metrics_get.
+ *
+ * When a thread exits its block is kept, with its counts, and reused by the next new thread.
+ */
+
+#define ONION_METRICS_CACHE_LINE 64
+
+/// Counters of a thread. Only written by that thread.
+typedef struct onion_metrics_shard_t {
+  onion_metrics m;
+  int in_use;
+  struct onion_metrics_shard_t *next;
+} __attribute__ ((aligned(ONION_METRICS_CACHE_LINE))) onion_metrics_shard;
+
+/// Single writer, so a relaxed load and store is enough, and much cheaper than an atomic add.
+#define ONION_METRICS_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define ONION_METRICS_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static onion_metrics_shard *onion_metrics_shards = NULL;
+
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t onion_metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t onion_metrics_key;
+static pthread_once_t onion_metrics_key_once = PTHREAD_ONCE_INIT;
+static __thread onion_metrics_shard *onion_metrics_current = NULL;
+
+/// At thread exit, leaves the shard ready for the next thread.
+static void onion_metrics_shard_release(void *shard) {
+  __atomic_store_n(&((onion_metrics_shard *) shard)->in_use, 0,
+                   __ATOMIC_RELEASE);
+}
+
+static void onion_metrics_key_init() {
+  pthread_key_create(&onion_metrics_key, onion_metrics_shard_release);
+}
+
+/// Gets a free shard for this thread, or creates a new one.
+static onion_metrics_shard *onion_metrics_shard_register() {
+  pthread_once(&onion_metrics_key_once, onion_metrics_key_init);
+  pthread_mutex_lock(&onion_metrics_mutex);
+  onion_metrics_shard *shard = onion_metrics_shards;
+  while (shard && shard->in_use)
+    shard = shard->next;
+  if (shard) {
+    shard->in_use = 1;
+  } else {
+    // Aligned by hand, as malloc only ensures 16 bytes. Never freed, as the counts are totals.
+    char *mem =
+        onion_low_calloc(1,
+                         sizeof(onion_metrics_shard) +
+                         ONION_METRICS_CACHE_LINE);
+    shard =
+        (onion_metrics_shard *) (((uintptr_t) mem + ONION_METRICS_CACHE_LINE) &
+                                 ~(uintptr_t) (ONION_METRICS_CACHE_LINE - 1));
+    shard->in_use = 1;
+    shard->next = onion_metrics_shards;
+    __atomic_store_n(&onion_metrics_shards, shard, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&onion_metrics_mutex);
+  pthread_setspecific(onion_metrics_key, shard);
+  onion_metrics_current = shard;
+  return shard;
+}
+
+static inline onion_metrics_shard *onion_metrics_shard_get() {
+  if (__builtin_expect(onion_metrics_current != NULL, 1))
+    return onion_metrics_current;
+  return onion_metrics_shard_register();
+}
+#else
+static onion_metrics_shard onion_metrics_single_shard;
+
+static inline onion_metrics_shard *onion_metrics_shard_get() {
+  if (!onion_metrics_shards) {
+    onion_metrics_single_shard.in_use = 1;
+    onion_metrics_shards = &onion_metrics_single_shard;
+  }
+  return onion_metrics_shards;
+}
+#endif
+
+/// Log-linear bucket for the given latency: four buckets per power of two.
+static int onion_metrics_bucket(uint64_t us) {
+  if (us < 4)
+    return us;
+  int e = 63 - __builtin_clzll(us);
+  int b = (e - 1) * 4 + ((us >> (e - 2)) & 3);
+  return b < ONION_METRICS_LATENCY_BUCKETS ? b :
+      ONION_METRICS_LATENCY_BUCKETS - 1;
+}
+
+/**
+ * @short Upper limit, not included, in microseconds of the given latency bucket.
+ * @ingroup metrics
+ */
+uint64_t onion_metrics_bucket_limit(int b) {
+  if (b < 4)
+    return b + 1;
+  int e = b / 4 + 1;
+  return (1ull << e) + (uint64_t) (b % 4 + 1) * (1ull << (e - 2));
+}
+
+/**
+ * @short Monotonic time, in nanoseconds.
+ * @ingroup metrics
+ */
+uint64_t onion_metrics_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @short A request was processed. Start is the onion_metrics_now() when it started.
+ * @ingroup metrics
+ *
+ * Yielded requests are counted, but not their latency, as they are still in process.
+ */
+void onion_metrics_request_done(uint64_t start, int yielded) {
+  onion_metrics_shard *s = onion_metrics_shard_get();
+  ONION_METRICS_ADD(s->m.requests, 1);
+  if (yielded) {
+    ONION_METRICS_ADD(s->m.requests_yielded, 1);
+    return;
+  }
+  uint64_t us = (onion_metrics_now() - start) / 1000;
+  ONION_METRICS_ADD(s->m.latency[onion_metrics_bucket(us)], 1);
+  ONION_METRICS_ADD(s->m.latency_count, 1);
+  ONION_METRICS_ADD(s->m.latency_sum_us, us);
+}
+
+/**
+ * @short A response was finished.
+ * @ingroup metrics
+ */
+void onion_metrics_response_done(int code, uint64_t bytes) {
+  onion_metrics_shard *s = onion_metrics_shard_get();
+  int c = code / 100;
+  if (c < 1 || c > 5)
+    c = 0;
+  ONION_METRICS_ADD(s->m.responses[c], 1);
+  ONION_METRICS_ADD(s->m.bytes_sent, bytes);
+}
+
+/// @ingroup metrics
+void onion_metrics_connection_opened() {
+  onion_metrics_shard *s = onion_metrics_shard_get();
+  ONION_METRICS_ADD(s->m.connections_opened, 1);
+}
+
+/// @ingroup metrics
+void onion_metrics_connection_closed() {
+  onion_metrics_shard *s = onion_metrics_shard_get();
+  ONION_METRICS_ADD(s->m.connections_closed, 1);
+}
+
+/// @ingroup metrics
+void onion_metrics_connection_rejected() {
+  onion_metrics_shard *s = onion_metrics_shard_get();
+  ONION_METRICS_ADD(s->m.connections_rejected, 1);
+}
+
+/// @ingroup metrics
+void onion_metrics_request_rejected() {
+  onion_metrics_shard *s = onion_metrics_shard_get();
+  ONION_METRICS_ADD(s->m.requests_rejected, 1);
+}
+
+/// @ingroup metrics
+void onion_metrics_poller_wakeup(int nevents) {
+  onion_metrics_shard *s = onion_metrics_shard_get();
+  ONION_METRICS_ADD(s->m.poller_wakeups, 1);
+  ONION_METRICS_ADD(s->m.poller_events, nevents);
+}
+
+/**
+ * @short Sums the counters of all the threads.
+ * @ingroup metrics
+ *
+ * Counters are read without stopping the writers, so the result is not an exact snapshot,
+ * but each counter is consistent by itself.
+ */
+void onion_metrics_get(onion_metrics * m) {
+  memset(m, 0, sizeof(*m));
+  onion_metrics_shard *s =
+      __atomic_load_n(&onion_metrics_shards, __ATOMIC_ACQUIRE);
+  for (; s; s = s->next) {
+    m->threads++;
+    m->requests += ONION_METRICS_READ(s->m.requests);
+    m->requests_yielded += ONION_METRICS_READ(s->m.requests_yielded);
+    int i;
+    for (i = 0; i < 6; i++)
+      m->responses[i] += ONION_METRICS_READ(s->m.responses[i]);
+    m->bytes_sent += ONION_METRICS_READ(s->m.bytes_sent);
+    m->connections_opened += ONION_METRICS_READ(s->m.connections_opened);
+    m->connections_closed += ONION_METRICS_READ(s->m.connections_closed);
+    m->connections_rejected += ONION_METRICS_READ(s->m.connections_rejected);
+    m->requests_rejected += ONION_METRICS_READ(s->m.requests_rejected);
+    m->poller_wakeups += ONION_METRICS_READ(s->m.poller_wakeups);
+    m->poller_events += ONION_METRICS_READ(s->m.poller_events);
+    m->latency_count += ONION_METRICS_READ(s->m.latency_count);
+    m->latency_sum_us += ONION_METRICS_READ(s->m.latency_sum_us);
+    for (i = 0; i < ONION_METRICS_LATENCY_BUCKETS; i++)
+      m->latency[i] += ONION_METRICS_READ(s->m.latency[i]);
+  }
+}
+
+/**
+ * @short Latency, in microseconds, below which are the given fraction of the requests.
+ * @ingroup metrics
+ *
+ * It is the upper limit of the bucket, so up to 25% more than the real value.
+ */
+uint64_t onion_metrics_percentile(const onion_metrics * m, double fraction) {
+  uint64_t total = 0;
+  int i;
+  for (i = 0; i < ONION_METRICS_LATENCY_BUCKETS; i++)
+    total += m->latency[i];
+  if (!total)
+    return 0;
+  uint64_t target = fraction * total;
+  if (target < fraction * total || target < 1)  // Rounds up
+    target++;
+  uint64_t acc = 0;
+  for (i = 0; i < ONION_METRICS_LATENCY_BUCKETS; i++) {
+    acc += m->latency[i];
+    if (acc >= target)
+      return onion_metrics_bucket_limit(i);
+  }
+  return onion_metrics_bucket_limit(ONION_METRICS_LATENCY_BUCKETS - 1);
+}
+
+static const char *onion_metrics_classes[6] =
+    { "other", "1xx", "2xx", "3xx", "4xx", "5xx" };
+
+/**
+ * @short Writes the metrics as a JSON object.
+ * @ingroup metrics
+ */
+void onion_metrics_write_json(const onion_metrics * m, onion_response * res) {
+  onion_response_printf(res,
+                        "{\"threads\":%d,\"requests\":%lu,\"requests_yielded\":%lu,\"requests_rejected\":%lu,\"responses\":{",
+                        m->threads, (unsigned long)m->requests,
+                        (unsigned long)m->requests_yielded,
+                        (unsigned long)m->requests_rejected);
+  int i;
+  for (i = 1; i < 7; i++)       // others at the end
+    onion_response_printf(res, "%s\"%s\":%lu", i == 1 ? "" : ",",
+                          onion_metrics_classes[i % 6],
+                          (unsigned long)m->responses[i % 6]);
+  onion_response_printf(res,
+                        "},\"bytes_sent\":%lu,\"connections\":{\"active\":%ld,\"total\":%lu,\"rejected\":%lu},"
+                        "\"poller\":{\"wakeups\":%lu,\"events\":%lu},",
+                        (unsigned long)m->bytes_sent,
+                        (long)(m->connections_opened - m->connections_closed),
+                        (unsigned long)m->connections_opened,
+                        (unsigned long)m->connections_rejected,
+                        (unsigned long)m->poller_wakeups,
+                        (unsigned long)m->poller_events);
+  onion_response_printf(res,
+                        "\"latency_us\":{\"count\":%lu,\"sum\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu}}",
+                        (unsigned long)m->latency_count,
+                        (unsigned long)m->latency_sum_us,
+                        (unsigned long)onion_metrics_percentile(m, 0.5),
+                        (unsigned long)onion_metrics_percentile(m, 0.9),
+                        (unsigned long)onion_metrics_percentile(m, 0.99),
+                        (unsigned long)onion_metrics_percentile(m, 0.999));
+}
+
+/**
+ * @short Writes the metrics in the Prometheus text exposition format.
+ * @ingroup metrics
+ *
+ * The latency histogram is written with a bucket per power of two of microseconds.
+ */
+void onion_metrics_write_prometheus(const onion_metrics * m,
+                                    onion_response * res) {
+  onion_response_printf(res,
+                        "# HELP onion_requests_total Processed requests.\n"
+                        "# TYPE onion_requests_total counter\n"
+                        "onion_requests_total %lu\n"
+                        "# HELP onion_requests_yielded_total Requests whose handler yielded.\n"
+                        "# TYPE onion_requests_yielded_total counter\n"
+                        "onion_requests_yielded_total %lu\n"
+                        "# HELP onion_requests_rejected_total Requests answered 503, over the server limit.\n"
+                        "# TYPE onion_requests_rejected_total counter\n"
+                        "onion_requests_rejected_total %lu\n"
+                        "# HELP onion_responses_total Responses by status code class.\n"
+                        "# TYPE onion_responses_total counter\n",
+                        (unsigned long)m->requests,
+                        (unsigned long)m->requests_yielded,
+                        (unsigned long)m->requests_rejected);
+  int i;
+  for (i = 1; i < 7; i++)
+    onion_response_printf(res, "onion_responses_total{code=\"%s\"} %lu\n",
+                          onion_metrics_classes[i % 6],
+                          (unsigned long)m->responses[i % 6]);
+  onion_response_printf(res,
+                        "# HELP onion_response_bytes_total Bytes sent by responses.\n"
+                        "# TYPE onion_response_bytes_total counter\n"
+                        "onion_response_bytes_total %lu\n"
+                        "# HELP onion_connections_active Open connections.\n"
+                        "# TYPE onion_connections_active gauge\n"
+                        "onion_connections_active %ld\n"
+                        "# HELP onion_connections_total Accepted connections.\n"
+                        "# TYPE onion_connections_total counter\n"
+                        "onion_connections_total %lu\n"
+                        "# HELP onion_connections_rejected_total Connections answered 503 at accept, over the server limits.\n"
+                        "# TYPE onion_connections_rejected_total counter\n"
+                        "onion_connections_rejected_total %lu\n"
+                        "# HELP onion_poller_wakeups_total Times the poller returned events.\n"
+                        "# TYPE onion_poller_wakeups_total counter\n"
+                        "onion_poller_wakeups_total %lu\n"
+                        "# HELP onion_poller_events_total Events handled by the poller.\n"
+                        "# TYPE onion_poller_events_total counter\n"
+                        "onion_poller_events_total %lu\n"
+                        "# HELP onion_metrics_threads Threads reporting metrics.\n"
+                        "# TYPE onion_metrics_threads gauge\n"
+                        "onion_metrics_threads %d\n"
+                        "# HELP onion_request_duration_seconds Request processing time.\n"
+                        "# TYPE onion_request_duration_seconds histogram\n",
+                        (unsigned long)m->bytes_sent,
+                        (long)(m->connections_opened - m->connections_closed),
+                        (unsigned long)m->connections_opened,
+                        (unsigned long)m->connections_rejected,
+                        (unsigned long)m->poller_wakeups,
+                        (unsigned long)m->poller_events, m->threads);
+  uint64_t acc = 0;
+  for (i = 0; i < ONION_METRICS_LATENCY_BUCKETS; i++) {
+    acc += m->latency[i];
+    if (i % 4 == 3)             // Limits at powers of two
+      onion_response_printf(res,
+                            "onion_request_duration_seconds_bucket{le=\"%g\"} %lu\n",
+                            onion_metrics_bucket_limit(i) / 1e6,
+                            (unsigned long)acc);
+  }
+  onion_response_printf(res,
+                        "onion_request_duration_seconds_bucket{le=\"+Inf\"} %lu\n"
+                        "onion_request_duration_seconds_sum %g\n"
+                        "onion_request_duration_seconds_count %lu\n",
+                        (unsigned long)acc, m->latency_sum_us / 1e6,
+                        (unsigned long)m->latency_count);
+}
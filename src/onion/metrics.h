@@ -0,0 +1,91 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+#ifndef ONION_METRICS_H
+#define ONION_METRICS_H
+
+#include <stdint.h>
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Number of latency buckets. Four per power of two of microseconds, up to 2^27 us (about 134 s). Slower go to the last one.
+#define ONION_METRICS_LATENCY_BUCKETS 104
+
+  /**
+   * @short Aggregated server metrics, as returned by onion_metrics_get.
+   * @ingroup metrics
+   *
+   * All counters are totals since the program started, for all the servers.
+   */
+  struct onion_metrics_t {
+    int threads;                ///< Number of threads that reported metrics.
+    uint64_t requests;          ///< Processed requests.
+    uint64_t requests_yielded;  ///< Requests whose handler returned OCS_YIELD.
+    uint64_t responses[6];      ///< Responses by code class: [2] is 2xx and so on. [0] for others.
+    uint64_t bytes_sent;        ///< Bytes written by responses, headers included.
+    uint64_t connections_opened;        ///< Connections (requests objects) created.
+    uint64_t connections_closed;        ///< Connections freed. The difference are the active ones.
+    uint64_t connections_rejected;      ///< Connections answered 503 at accept, over the server limits.
+    uint64_t requests_rejected; ///< Requests answered 503, over the server limit of requests in process.
+    uint64_t poller_wakeups;    ///< Times the poller returned with events.
+    uint64_t poller_events;     ///< Events handled by the poller. Divided by wakeups is the mean queue depth.
+    uint64_t latency_count;     ///< Requests at the latency histogram.
+    uint64_t latency_sum_us;    ///< Sum of the latencies, in microseconds.
+    uint64_t latency[ONION_METRICS_LATENCY_BUCKETS];    ///< Latency histogram. @see onion_metrics_bucket_limit
+  };
+
+  typedef struct onion_metrics_t onion_metrics;
+
+/// Sums the counters of all the threads.
+  void onion_metrics_get(onion_metrics * metrics);
+/// Upper limit, in microseconds, of the given latency bucket.
+  uint64_t onion_metrics_bucket_limit(int bucket);
+/// Latency, in microseconds, below which are the given fraction (0-1) of the requests.
+  uint64_t onion_metrics_percentile(const onion_metrics * metrics,
+                                    double fraction);
+
+/// Writes the metrics as a JSON object.
+  void onion_metrics_write_json(const onion_metrics * metrics,
+                                onion_response * res);
+/// Writes the metrics in the Prometheus text format.
+  void onion_metrics_write_prometheus(const onion_metrics * metrics,
+                                      onion_response * res);
+
+/// @{ @name Internal. Called by the server to update the current thread counters.
+  uint64_t onion_metrics_now();
+  void onion_metrics_request_done(uint64_t start, int yielded);
+  void onion_metrics_response_done(int code, uint64_t bytes);
+  void onion_metrics_connection_opened();
+  void onion_metrics_connection_closed();
+  void onion_metrics_connection_rejected();
+  void onion_metrics_request_rejected();
+  void onion_metrics_poller_wakeup(int nevents);
+/// @}
+
+#ifdef __cplusplus
+}
+#endif
+#endif
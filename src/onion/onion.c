@@ -148,6 +148,11 @@ onion_url_add_url(url, ...); // Nesting
 #include <string.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 //#define HAVE_PTHREADS
 #ifdef HAVE_PTHREADS
@@ -163,10 +168,15 @@ onion_url_add_url(url, ...); // Nesting
 #include "poller.h"
 #include "listen_point.h"
 #include "sessions.h"
+#include "access_log.h"
 #include "mime.h"
 #include "http.h"
 #include "https.h"
 
+#ifdef HAVE_SYSTEMD
+#include <systemd/sd-daemon.h>
+#endif
+
 static int onion_default_error(void *handler, onion_request * req,
                                onion_response * res);
 // Import it here as I need it to know if we have a HTTP port.
@@ -179,6 +189,15 @@ ssize_t onion_https_write(onion_request * req, const char *data, size_t len);
 #define SOCK_CLOEXEC 0
 #endif
 
+/// Environment variable with the listen sockets passed by onion_handoff, as "3,4,-1".
+#define ONION_LISTEN_FDS "ONION_LISTEN_FDS"
+/// Max listen sockets passed by onion_handoff.
+#define ONION_LISTEN_FDS_MAX 64
+/// Idle keep alive connections are closed after this many ms when draining.
+#define ONION_DRAIN_IDLE_TIMEOUT 1000
+
+extern char **environ;
+
 /// Used by onion_sigterm handler. Only takes into account last onion.
 static onion *last_onion = NULL;
 static void shutdown_server(int _);
@@ -237,6 +256,9 @@ onion *onion_new(int flags) {
                         NULL);
   o->max_post_size = 1024 * 1024;       // 1MB
   o->max_file_size = 1024 * 1024 * 1024;        // 1GB
+  o->read_buffer_size = ONION_READ_BUFFER_SIZE;
+  o->accept_batch = ONION_ACCEPT_BATCH;
+  onion_set_overload_retry_after(o, 1);
 #ifdef HAVE_PTHREADS
   o->flags |= O_THREADS_AVAILABLE;
   o->nthreads = 8;
@@ -283,6 +305,10 @@ void onion_free(onion * onion) {
   onion_mime_set(NULL);
   if (onion->sessions)
     onion_sessions_free(onion->sessions);
+  if (onion->access_log)
+    onion_access_log_free(onion->access_log);
+  if (onion->ip_connections)
+    onion_low_free(onion->ip_connections);
 
   {
 #ifdef HAVE_PTHREADS
@@ -346,6 +372,8 @@ void *onion_client_data(onion * server) {
 static bool shutdown_server_first_call = true;
 static void shutdown_server(int _) {
   if (shutdown_server_first_call) {
+    // Before stopping, as onion_listen may return and clean it meanwhile.
+    shutdown_server_first_call = false;
     if (last_onion) {
       onion_listen_stop(last_onion);
       ONION_INFO("Exiting onion listening (SIG%s)",
@@ -355,7 +383,6 @@ static void shutdown_server(int _) {
     ONION_ERROR("Aborting as onion does not stop listening.");
     abort();
   }
-  shutdown_server_first_call = false;
 }
 
 #ifdef HAVE_PTHREADS
@@ -429,6 +456,79 @@ long onion_count_poller_threads(void) {
 }
 #endif
 
+/// Checks the fd is an open listen socket, and sets it to close on exec again.
+static int onion_listen_inherited_fd_check(int fd) {
+  int accepting = 0;
+  socklen_t len = sizeof(accepting);
+  if (fd < 0)                   // Not a socket listen point at the old process.
+    return -1;
+  if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) < 0
+      || !accepting) {
+    ONION_WARNING("Inherited fd %d is not a listen socket. Ignoring it.", fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+  return fd;
+}
+
+/**
+ * @short Gets the listen sockets inherited from onion_handoff, or systemd if O_SYSTEMD.
+ * @ingroup onion
+ *
+ * They are in the order of the listen points, and -1 for the ones that must open their own.
+ * If there are no listen points, an HTTP one is created for each socket. Extra sockets
+ * are not used.
+ *
+ * @returns The number of sockets at fds.
+ */
+static int onion_listen_inherited_fds(onion * o, int *fds, int max) {
+  int n = 0;
+  const char *env = getenv(ONION_LISTEN_FDS);
+  if (env) {
+    char *end;
+    while (n < max && *env) {
+      fds[n++] = onion_listen_inherited_fd_check(strtol(env, &end, 10));
+      if (end == env || (*end != ',' && *end != '\0')) {
+        ONION_ERROR("Invalid %s value", ONION_LISTEN_FDS);
+        n = 0;
+        break;
+      }
+      env = *end ? end + 1 : end;
+    }
+    unsetenv(ONION_LISTEN_FDS);       // Already used; closed at onion_listen_stop.
+  }
+#ifdef HAVE_SYSTEMD
+  else if (o->flags & O_SYSTEMD) {
+    int nsd = sd_listen_fds(0);
+    ONION_DEBUG("Checking if have systemd sockets: %d", nsd);
+    for (n = 0; n < nsd && n < max; n++)
+      fds[n] = onion_listen_inherited_fd_check(SD_LISTEN_FDS_START + n);
+  }
+#endif
+  if (n == 0)
+    return 0;
+
+  int npoints = 0;
+  if (o->listen_points)
+    while (o->listen_points[npoints])
+      npoints++;
+  if (npoints == 0) {
+    int i;
+    for (i = 0; i < n; i++)
+      onion_add_listen_point(o, NULL, NULL, onion_http_new());
+    ONION_DEBUG("Created %d HTTP listen points for the inherited sockets", n);
+  } else if (n > npoints) {
+    ONION_WARNING("Inherited %d listen sockets, but only %d listen points.", n,
+                  npoints);
+    int i;
+    for (i = npoints; i < n; i++)
+      if (fds[i] >= 0)
+        close(fds[i]);
+    n = npoints;
+  }
+  return n;
+}
+
 /**
  * @short Performs the listening with the given mode
  * @ingroup onion
@@ -452,19 +552,27 @@ int onion_listen(onion * o) {
   }
 #endif
 
+  /// Start listening, with the inherited sockets if any.
+  int inherited[ONION_LISTEN_FDS_MAX];
+  int ninherited = onion_listen_inherited_fds(o, inherited, ONION_LISTEN_FDS_MAX);
   if (!o->listen_points) {
     onion_add_listen_point(o, NULL, NULL, onion_http_new());
     ONION_DEBUG("Created default HTTP listen port");
   }
-  /// Start listening
   size_t successful_listened_points = 0;
   onion_listen_point **lp = o->listen_points;
-  while (*lp) {
+  int i;
+  for (i = 0; *lp; i++, lp++) {
+    if (i < ninherited && inherited[i] >= 0 && !(*lp)->listen) {
+      ONION_DEBUG("Using inherited listen socket %d", inherited[i]);
+      (*lp)->listenfd = inherited[i];
+      successful_listened_points++;
+      continue;
+    }
     int listen_result = onion_listen_point_listen(*lp);
     if (!listen_result) {
       successful_listened_points++;
     }
-    lp++;
   }
   if (!successful_listened_points) {
     ONION_ERROR("There are no available listen points");
@@ -499,10 +607,23 @@ int onion_listen(onion * o) {
     while (*listen_points) {
       onion_listen_point *p = *listen_points;
       ONION_DEBUG("Adding listen point fd %d to poller", p->listenfd);
+      if (!p->listen && p->listenfd >= 0) {
+        // Accepts until there are no more pending, so it must not block.
+        int fl = fcntl(p->listenfd, F_GETFL);
+        if (fl < 0 || fcntl(p->listenfd, F_SETFL, fl | O_NONBLOCK) < 0)
+          ONION_ERROR("Could not set the listen socket as non blocking");
+      }
       onion_poller_slot *slot =
           onion_poller_slot_new(p->listenfd, (void *)onion_listen_point_accept,
                                 p);
-      onion_poller_slot_set_type(slot, O_POLL_ALL);
+      // Non blocking sockets accept all the pending connections on each event.
+      onion_poller_slot_set_type(slot,
+                                 p->listen ? O_POLL_ALL : O_POLL_READ |
+                                 O_POLL_OTHER | O_POLL_LISTEN);
+      // Plain sockets may be accepted by the poller itself, as io_uring does.
+      if (!p->listen && !p->request_init)
+        onion_poller_slot_set_accept(slot,
+                                     (void *)onion_listen_point_accepted);
       onion_poller_add(o->poller, slot);
       listen_points++;
     }
@@ -584,6 +705,119 @@ void onion_listen_stop(onion * server) {
 #endif	/* end HAVE_PTHREADS */
 }
 
+/**
+ * @short Starts a new process of the program, that gets the listen sockets.
+ * @ingroup onion
+ *
+ * For restarts and upgrades without closing the listen sockets, so no connection is
+ * refused. The new process is executed with argv and the current environment; argv[0]
+ * is the path of the program. It inherits the listen sockets, listed at the
+ * ONION_LISTEN_FDS environment variable in the order of the listen points, and its
+ * onion_listen uses them instead of opening new ones. So it must add the same listen
+ * points, in the same order.
+ *
+ * Both processes accept connections until this one calls onion_drain.
+ *
+ * @returns The pid of the new process, or -1 on error.
+ */
+pid_t onion_handoff(onion * server, char *const argv[]) {
+  if (!(server->flags & O_LISTENING)) {
+    ONION_ERROR("Only listening servers can hand off their listen sockets");
+    return -1;
+  }
+  char fds[ONION_LISTEN_FDS_MAX * 12 + sizeof(ONION_LISTEN_FDS) + 1];
+  size_t pos = snprintf(fds, sizeof(fds), "%s=", ONION_LISTEN_FDS);
+  int nfds = 0;
+  onion_listen_point **lp;
+  for (lp = server->listen_points; *lp && nfds < ONION_LISTEN_FDS_MAX; lp++) {
+    int fd = (*lp)->listen ? -1 : (*lp)->listenfd;      // Only sockets
+    pos += snprintf(fds + pos, sizeof(fds) - pos, "%s%d", nfds ? "," : "", fd);
+    nfds++;
+  }
+
+  // Environment built now, as after fork only async signal safe calls are allowed.
+  int nenv = 0;
+  while (environ[nenv])
+    nenv++;
+  char **env = onion_low_malloc(sizeof(char *) * (nenv + 2));
+  int i, n = 0;
+  for (i = 0; i < nenv; i++)
+    if (strncmp(environ[i], ONION_LISTEN_FDS "=",
+                sizeof(ONION_LISTEN_FDS)) != 0)
+      env[n++] = environ[i];
+  env[n++] = fds;
+  env[n] = NULL;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    for (lp = server->listen_points; *lp; lp++)
+      if (!(*lp)->listen && (*lp)->listenfd >= 0)
+        fcntl((*lp)->listenfd, F_SETFD, 0);     // Not closed on exec
+    execve(argv[0], argv, env);
+    _exit(127);
+  }
+  onion_low_free(env);
+  if (pid < 0)
+    ONION_ERROR("Could not start the new process: %s", strerror(errno));
+  else
+    ONION_INFO("Started %s (pid %d) with the listen sockets", argv[0], pid);
+  return pid;
+}
+
+/**
+ * @short Stops accepting connections, and waits for the open ones to finish.
+ * @ingroup onion
+ *
+ * The listen sockets are removed from the poller and, once no thread is accepting on
+ * them, closed, but not shut down, so a process started with onion_handoff keeps
+ * accepting on them. The requests in process finish, but their
+ * connections are not kept alive after them, and idle keep alive connections are closed
+ * after ONION_DRAIN_IDLE_TIMEOUT ms. After that, or after timeout_ms, the listen is
+ * stopped as with onion_listen_stop, closing any connection still open.
+ *
+ * Only connections accepted at the poller are waited for. It waits for the handlers, so
+ * must not be called from one.
+ *
+ * @returns The number of connections still open at the timeout, 0 if all finished.
+ */
+int onion_drain(onion * server, int timeout_ms) {
+  if (!(server->flags & O_LISTENING))
+    return 0;
+  server->flags |= O_DRAINING;
+  onion_listen_point **lp;
+  for (lp = server->listen_points; *lp; lp++) {
+    onion_listen_point *op = *lp;
+    if (op->listen || op->listenfd < 0) // Not a socket; stopped at onion_listen_stop.
+      continue;
+    int fd = op->listenfd;
+    // Threads that did not read it yet will not accept; the ones that did are waited for,
+    // so the fd is not closed, and maybe reused, under them.
+    __atomic_store_n(&op->listenfd, -1, __ATOMIC_SEQ_CST);
+    onion_poller_remove(server->poller, fd);
+    while (__atomic_load_n(&op->accepting, __ATOMIC_SEQ_CST) > 0)
+      usleep(1000);
+    close(fd);
+  }
+  onion_poller_shorten_timeouts(server->poller, ONION_DRAIN_IDLE_TIMEOUT);
+
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int open;
+  while ((open = __atomic_load_n(&server->connections, __ATOMIC_RELAXED)) > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - start.tv_sec) * 1000 +
+        (now.tv_nsec - start.tv_nsec) / 1000000 >= timeout_ms)
+      break;
+    usleep(10000);
+  }
+  if (open > 0)
+    ONION_WARNING("Drain timeout with %d connections still open", open);
+
+  onion_listen_stop(server);
+  server->flags &= ~O_DRAINING;
+  return open;
+}
+
 /**
  * @short Sets the root handler
  * @ingroup onion
@@ -691,6 +925,173 @@ void onion_set_timeout(onion * onion, int timeout) {
   onion->timeout = timeout;
 }
 
+/**
+ * @short Sets the backlog of the listen sockets.
+ * @ingroup onion
+ *
+ * It is the number of connections the kernel keeps waiting to be accepted; when full new
+ * connections are dropped, and clients retry after a second or more. By default, or if 0,
+ * it is the system maximum at /proc/sys/net/core/somaxconn.
+ *
+ * Must be set before onion_listen.
+ */
+void onion_set_listen_backlog(onion * onion, int backlog) {
+  onion->listen_backlog = backlog;
+}
+
+/**
+ * @short Sets the maximum number of connections accepted each time a listen socket is ready.
+ * @ingroup onion
+ *
+ * On each wakeup of the listen socket, pending connections are accepted until there are no
+ * more or this limit is reached, and added to the poller, where any of the poller threads
+ * can process them. Default is ONION_ACCEPT_BATCH, 64. With 1 it accepts one per wakeup.
+ */
+void onion_set_accept_batch(onion * onion, int accept_batch) {
+  onion->accept_batch = accept_batch > 0 ? accept_batch : 1;
+}
+
+/**
+ * @short Limits the open connections of the server.
+ * @ingroup onion
+ *
+ * Over the limits new connections are answered with an already rendered 503 Service
+ * Unavailable with Retry-After, and closed, instead of waiting at the poller for a free
+ * thread. So overloads are answered fast, and the accepted connections keep their latency.
+ *
+ * Only connections accepted at the poller (O_POLL, O_POOL, O_THREADED) are counted. Must
+ * be set before onion_listen.
+ *
+ * @param max Max open connections, 0 no limit.
+ * @param per_ip Max open connections from a single client address, 0 no limit. Addresses
+ *   are hashed into ONION_ADMISSION_IP_SLOTS counters, so rarely two share the limit.
+ */
+void onion_set_max_connections(onion * server, int max, int per_ip) {
+  server->max_connections = max > 0 ? max : 0;
+  server->max_connections_per_ip = per_ip > 0 ? per_ip : 0;
+  if (server->max_connections_per_ip && !server->ip_connections)
+    server->ip_connections =
+        onion_low_calloc(ONION_ADMISSION_IP_SLOTS, sizeof(int));
+}
+
+/**
+ * @short Limits the requests in process at once.
+ * @ingroup onion
+ *
+ * Requests over the limit are answered with a 503 Service Unavailable with Retry-After,
+ * without calling the handlers, and the connection is closed. Yielded requests count until
+ * they finish. Default, or 0, no limit.
+ */
+void onion_set_max_requests(onion * server, int max) {
+  server->max_requests = max > 0 ? max : 0;
+}
+
+/**
+ * @short Sets the seconds of the Retry-After of the 503 answers when over the limits. Default 1.
+ * @ingroup onion
+ *
+ * @see onion_set_max_connections onion_set_max_requests
+ */
+void onion_set_overload_retry_after(onion * server, int seconds) {
+  snprintf(server->retry_after, sizeof(server->retry_after), "%d",
+           seconds > 0 ? seconds : 0);
+  server->overload_response_length =
+      snprintf(server->overload_response, sizeof(server->overload_response),
+               "HTTP/1.1 503 Service Unavailable\r\n"
+               "Retry-After: %s\r\n"
+               "Content-Type: text/plain\r\n"
+               "Content-Length: %d\r\n"
+               "Connection: close\r\n\r\n" ONION_OVERLOAD_MESSAGE,
+               server->retry_after, (int)sizeof(ONION_OVERLOAD_MESSAGE) - 1);
+}
+
+/// Counter of the client address of the request, for the per address limit.
+static int onion_admission_ip_slot(onion_request * req) {
+  const unsigned char *addr;
+  int len;
+  struct sockaddr_storage *sa = &req->connection.cli_addr;
+  if (sa->ss_family == AF_INET) {
+    addr = (const unsigned char *)&((struct sockaddr_in *)sa)->sin_addr;
+    len = 4;
+  } else if (sa->ss_family == AF_INET6) {
+    addr = (const unsigned char *)&((struct sockaddr_in6 *)sa)->sin6_addr;
+    len = 16;
+  } else                        // Unix sockets and others, all the same client.
+    return 0;
+  uint32_t hash = 2166136261u;  // FNV-1a
+  int i;
+  for (i = 0; i < len; i++)
+    hash = (hash ^ addr[i]) * 16777619u;
+  return hash % ONION_ADMISSION_IP_SLOTS;
+}
+
+/**
+ * @short Counts a new connection, and checks the server limits.
+ * @ingroup onion
+ *
+ * Always counted, as onion_drain waits for them to close.
+ *
+ * @returns 0 if admitted, <0 if over the limits; then it is not counted and should be closed.
+ * @see onion_set_max_connections
+ */
+int onion_admit_connection(onion * server, onion_request * req) {
+  int n = __atomic_add_fetch(&server->connections, 1, __ATOMIC_RELAXED);
+  if (server->max_connections && n > server->max_connections) {
+    __atomic_sub_fetch(&server->connections, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  int slot = 0;
+  if (server->max_connections_per_ip && server->ip_connections) {
+    slot = onion_admission_ip_slot(req);
+    n = __atomic_add_fetch(&server->ip_connections[slot], 1, __ATOMIC_RELAXED);
+    if (n > server->max_connections_per_ip) {
+      __atomic_sub_fetch(&server->ip_connections[slot], 1, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&server->connections, 1, __ATOMIC_RELAXED);
+      return -1;
+    }
+  }
+  req->connection.admitted = slot + 1;
+  return 0;
+}
+
+/// Uncounts a connection admitted with onion_admit_connection. Called when the request is freed.
+void onion_release_connection(onion * server, onion_request * req) {
+  if (!req->connection.admitted)
+    return;
+  if (server->ip_connections)
+    __atomic_sub_fetch(&server->ip_connections[req->connection.admitted - 1], 1,
+                       __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&server->connections, 1, __ATOMIC_RELAXED);
+  req->connection.admitted = 0;
+}
+
+/**
+ * @short Counts a request starting its process at the server limit.
+ * @ingroup onion
+ *
+ * @returns 0 if admitted, <0 if over the limit and must be answered with a 503.
+ * @see onion_set_max_requests
+ */
+int onion_admit_request(onion * server, onion_request * req) {
+  if (!server->max_requests)
+    return 0;
+  if (__atomic_add_fetch(&server->requests, 1, __ATOMIC_RELAXED) >
+      server->max_requests) {
+    __atomic_sub_fetch(&server->requests, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  req->flags |= OR_IN_FLIGHT;
+  return 0;
+}
+
+/// Uncounts a request admitted with onion_admit_request, once processed.
+void onion_release_request(onion * server, onion_request * req) {
+  if (!(req->flags & OR_IN_FLIGHT))
+    return;
+  __atomic_sub_fetch(&server->requests, 1, __ATOMIC_RELAXED);
+  req->flags &= ~OR_IN_FLIGHT;
+}
+
 /**
  * @short Sets the maximum number of threads to use for requests. default 16.
  * @ingroup onion
@@ -908,6 +1309,22 @@ void onion_set_max_file_size(onion * server, size_t max_size) {
   server->max_file_size = max_size;
 }
 
+/**
+ * @short Set the size of the read buffer of each connection
+ *
+ * Each read from the client reads at most this size, and all the complete
+ * requests in it are processed back to back (pipelining). Bigger buffers mean less
+ * reads for pipelining clients, at the cost of memory per connection.
+ *
+ * It only affects new connections.
+ *
+ * @param server The onion server
+ * @param size The size in bytes, by default 16KB.
+ */
+void onion_set_read_buffer_size(onion * server, size_t size) {
+  server->read_buffer_size = size;
+}
+
 /**
  * @short Sets a new sessions backend.
  *
@@ -927,3 +1344,24 @@ void onion_set_session_backend(onion * server,
   onion_sessions_free(server->sessions);
   server->sessions = sessions_backend;
 }
+
+/**
+ * @short Sets the access log, where each finished request is written.
+ *
+ * By default there is none, and requests are logged with ONION_INFO. The server owns
+ * it, and frees it at onion_free or when another one is set.
+ *
+ * Example:
+ *
+ * @code
+ *   onion_set_access_log(server, onion_access_log_file("access.log", OAL_COMMON));
+ * @endcode
+ *
+ * @param server The onion server
+ * @param access_log The new access log, or NULL to remove it.
+ */
+void onion_set_access_log(onion * server, onion_access_log * access_log) {
+  if (server->access_log)
+    onion_access_log_free(server->access_log);
+  server->access_log = access_log;
+}
@@ -24,6 +24,8 @@
 #ifndef ONION_ONION_H
 #define ONION_ONION_H
 
+#include <sys/types.h>
+
 #include "request.h"
 #include "response.h"
 #include "handler.h"
@@ -52,6 +54,12 @@ extern "C" {
 /// Stops the listening
   void onion_listen_stop(onion * server);
 
+/// Starts a new process of the program with argv, that inherits the listen sockets. Returns its pid.
+  pid_t onion_handoff(onion * server, char *const argv[]);
+
+/// Stops accepting, and waits up to timeout_ms for the open connections to finish. Then stops the listening.
+  int onion_drain(onion * server, int timeout_ms);
+
 /// Removes the allocated data (also free the client data, if one was given).
   void onion_free(onion * onion);
 
@@ -95,6 +103,21 @@ extern "C" {
 /// Sets the maximum number of threads to use for requests. default 16.
   void onion_set_max_threads(onion * onion, int max_threads);
 
+/// Sets the backlog of the listen sockets. Default, or 0, is the system max (somaxconn).
+  void onion_set_listen_backlog(onion * onion, int backlog);
+
+/// Sets the max connections accepted on each listen socket wakeup. Default ONION_ACCEPT_BATCH.
+  void onion_set_accept_batch(onion * onion, int accept_batch);
+
+/// Limits the open connections, in total and per client address; over them they get a 503. 0 no limit.
+  void onion_set_max_connections(onion * server, int max, int per_ip);
+
+/// Limits the requests in process at once; over it they get a 503. 0 no limit.
+  void onion_set_max_requests(onion * server, int max);
+
+/// Sets the Retry-After seconds of the 503 answers when over the limits. Default 1.
+  void onion_set_overload_retry_after(onion * server, int seconds);
+
 /// Sets this user as soon as listen starts.
   void onion_set_user(onion * server, const char *username);
 
@@ -110,10 +133,16 @@ extern "C" {
 /// Set the maximum post FILE size
   void onion_set_max_file_size(onion * server, size_t max_size);
 
+/// Set the size of the read buffer of each connection
+  void onion_set_read_buffer_size(onion * server, size_t size);
+
 /// Set a new session backend
   void onion_set_session_backend(onion * server,
                                  onion_sessions * sessions_backend);
 
+/// Set the access log, where each finished request is written
+  void onion_set_access_log(onion * server, onion_access_log * access_log);
+
 #ifdef HAVE_PTHREADS
 // Gives the number of listening threads created.
   long onion_count_listen_threads(void);
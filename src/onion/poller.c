@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <stdint.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/timerfd.h>
@@ -41,6 +42,7 @@
 #include "types.h"
 #include "poller.h"
 #include "low.h"
+#include "metrics.h"
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/eventfd.h>
@@ -69,8 +71,11 @@ struct onion_poller_t {
   int timerfd;                  ///< fd to set up timeouts
   time_t current_timeout_limit; ///< Currently set limit in seconds
 
+  time_t last_timer_check;      ///< Last time the slots were checked for timeouts, at most once per second.
+
   int n;
   char stop;
+  size_t max_events;            ///< Events per epoll_wait and thread. 0 is automatic.
 #ifdef HAVE_PTHREADS
   pthread_mutex_t mutex;
   int npollers;
@@ -92,6 +97,8 @@ struct onion_poller_slot_t {
 
   time_t timeout;
   time_t timeout_limit;         ///< Limit in seconds for use with time function.
+  unsigned int generation;      ///< Changes each time the slot is created or removed, to detect stale events.
+  char listen;                  ///< O_POLL_LISTEN. May be removed by other threads while at its function.
 
   onion_poller_slot *next;
 };
@@ -146,6 +153,19 @@ static time_t onion_time() {
   return t.tv_sec;
 }
 
+/// Epoll data for the slot: the fd and the generation. The slot may be removed while the event waits at a thread queue.
+static uint64_t onion_poller_slot_event_data(onion_poller_slot * el) {
+  return ((uint64_t) el->generation << 32) | (uint32_t) el->fd;
+}
+
+/// Slot for the given event, or NULL if it was removed (or removed and reused) since the event was returned.
+static onion_poller_slot *onion_poller_event_slot(struct epoll_event *ev) {
+  onion_poller_slot *el = &onion_poller_static.slots[(uint32_t) ev->data.u64];
+  if (el->generation != (unsigned int)(ev->data.u64 >> 32))
+    return NULL;
+  return el;
+}
+
 /**
  * @short Creates a new slot for the poller, for input data to be ready.
  * @memberof onion_poller_slot_t
@@ -165,7 +185,9 @@ onion_poller_slot *onion_poller_slot_new(int fd, int (*f) (void *), void *data)
     return NULL;
   }
   onion_poller_slot *el = &onion_poller_static.slots[fd];
+  unsigned int generation = el->generation + 1;
   *el = onion_poller_static.empty_slot;
+  el->generation = generation;
   el->fd = fd;
   el->f = f;
   el->data = data;
@@ -220,27 +242,53 @@ void onion_poller_slot_set_timeout(onion_poller_slot * el, int timeout) {
   ONION_DEBUG0("Set timeout to %d, %d s", el->timeout_limit, el->timeout);
 }
 
-/// Sets the type of the poller
-/// @ingroup poller
+/**
+ * @short Sets the type of the poller
+ * @ingroup poller
+ *
+ * By default slots are one shot: only one thread gets the event, and the slot is
+ * armed again after the function returns.
+ *
+ * O_POLL_LISTEN is for non blocking listen sockets, and O_POLL_OTHER then only adds
+ * errors. Here it is also one shot: all the threads wait at the same epoll, so a level
+ * triggered slot would wake several of them for a single connection (EPOLLEXCLUSIVE
+ * only helps when the fd is at several epolls). The function accepts all the pending
+ * connections before the slot is armed again.
+ *
+ * With O_POLL_EDGE the slot is edge triggered and never disarmed, so the function must
+ * read until EAGAIN, and be ready to be called from several threads at the same time.
+ */
 void onion_poller_slot_set_type(onion_poller_slot * el,
                                 onion_poller_slot_type_e type) {
-  el->type = EPOLLONESHOT | EPOLLHUP;
+  el->listen = (type & O_POLL_LISTEN) ? 1 : 0;
+  if (type & O_POLL_EDGE)
+    el->type = EPOLLET | EPOLLHUP;
+  else
+    el->type = EPOLLONESHOT | EPOLLHUP;
   if (type & O_POLL_READ)
     el->type |= EPOLLIN;
   if (type & O_POLL_WRITE)
     el->type |= EPOLLOUT;
   if (type & O_POLL_OTHER)
-    el->type |= EPOLLERR | EPOLLPRI;
+    el->type |= (type & O_POLL_LISTEN) ? EPOLLERR : EPOLLERR | EPOLLPRI;
   ONION_DEBUG0("Setting type to %d, %d", el->fd, el->type);
 }
 
+/**
+ * @short Sets a function to call with each accepted connection
+ * @ingroup poller
+ *
+ * Not used with epoll: f accepts itself.
+ */
+void onion_poller_slot_set_accept(onion_poller_slot * el,
+                                  int (*accepted) (void *data, int fd)) {
+}
+
 static int onion_poller_stop_helper(void *p) {
   onion_poller_stop(p);
   return 1;
 }
 
-static time_t onion_poller_last_time = 0;
-
 static int onion_poller_timer(void *p_);
 
 static void onion_poller_timer_check(onion_poller * p, time_t timelimit) {
@@ -264,8 +312,8 @@ static int onion_poller_timer(void *p_) {
   time_t next_timeout = ctime + (24 * 60 * 60); // At least once per day
 
   // Do this only once per second max.
-  if (ctime != onion_poller_last_time) {
-    onion_poller_last_time = ctime;
+  if (ctime != p->last_timer_check) {
+    p->last_timer_check = ctime;
     pthread_mutex_lock(&p->mutex);
     onion_poller_slot *next = p->head;
     while (next) {
@@ -281,6 +329,8 @@ static int onion_poller_timer(void *p_) {
       }
     }
     pthread_mutex_unlock(&p->mutex);
+  } else {                      // Not checked now, so check again next second.
+    next_timeout = ctime + 1;
   }
   // Atomic store.
   // Try until set if <= next_timeout.
@@ -304,6 +354,35 @@ static int onion_poller_timer(void *p_) {
   return 1;
 }
 
+/**
+ * @short Shortens the timeouts of the slots waiting for data.
+ * @memberof onion_poller_t
+ * @ingroup poller
+ *
+ * Slots with a longer timeout get this one, counting from now, so idle connections are
+ * closed soon, as when draining the server. Slots being processed now keep theirs, and
+ * slots without timeout are not affected. Rounded to seconds.
+ */
+void onion_poller_shorten_timeouts(onion_poller * p, int timeout_ms) {
+  time_t timeout = timeout_ms / 1000;
+  time_t limit = onion_time() + timeout;
+  pthread_mutex_lock(&p->mutex);
+  onion_poller_slot *el;
+  for (el = p->head; el; el = el->next) {
+    if (el->timeout <= 0)
+      continue;
+    if (el->timeout > timeout)
+      el->timeout = timeout > 0 ? timeout : 1;
+    time_t current = el->timeout_limit;
+    // Fails if a thread has just got an event for it, and set it to INT_MAX.
+    if (current != INT_MAX && current > limit)
+      __sync_bool_compare_and_swap(&el->timeout_limit, current, limit);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  p->last_timer_check = 0;      // Check now, even if already checked this second.
+  onion_poller_timer(p);
+}
+
 #ifndef EFD_CLOEXEC
 #define EFD_CLOEXEC 0
 #endif
@@ -415,7 +494,7 @@ int onion_poller_add(onion_poller * poller, onion_poller_slot * el) {
   struct epoll_event ev;
   memset(&ev, 0, sizeof(ev));
   ev.events = el->type;
-  ev.data.ptr = el;
+  ev.data.u64 = onion_poller_slot_event_data(el);
   if (epoll_ctl(poller->fd, EPOLL_CTL_ADD, el->fd, &ev) < 0) {
     ONION_ERROR("Error add descriptor to listen to. %s", strerror(errno));
     return 1;
@@ -445,6 +524,7 @@ int onion_poller_remove(onion_poller * poller, int fd) {
     ONION_DEBUG0("Removed from head %p", el);
 
     poller->head = el->next;
+    el->generation++;
     pthread_mutex_unlock(&poller->mutex);
 
     onion_poller_slot_free(el);
@@ -455,6 +535,7 @@ int onion_poller_remove(onion_poller * poller, int fd) {
       ONION_DEBUG0("Removed from tail %p", el);
       onion_poller_slot *t = el->next;
       el->next = t->next;
+      t->generation++;
 
       if (poller->head->next == NULL) { // This means only eventfd is here.
         ONION_DEBUG0("Removed last, stopping poll");
@@ -489,8 +570,19 @@ onion_poller_slot *onion_poller_get(onion_poller * poller, int fd) {
   return NULL;
 }
 
-// Max of events per loop. If not al consumed for next, so no prob.  right number uses less memory, and makes less calls.
-static size_t onion_poller_max_events = 1;
+/// Events per epoll_wait when there is only one polling thread, and the queue size is automatic.
+#define ONION_POLLER_MAX_EVENTS 32
+
+/// Events to get at each epoll_wait. If automatic, only batch when no other thread could take them.
+static size_t onion_poller_queue_size(onion_poller * p) {
+  if (p->max_events)
+    return p->max_events;
+#ifdef HAVE_PTHREADS
+  if (__atomic_load_n(&p->npollers, __ATOMIC_RELAXED) > 1)
+    return 1;
+#endif
+  return ONION_POLLER_MAX_EVENTS;
+}
 
 /**
  * @short Do the event polling.
@@ -502,7 +594,8 @@ static size_t onion_poller_max_events = 1;
  * If no fd to poll, returns.
  */
 void onion_poller_poll(onion_poller * p) {
-  struct epoll_event event[onion_poller_max_events];
+  struct epoll_event *event = NULL;
+  size_t nevents = 0;
   ONION_DEBUG("Start polling");
 #ifdef HAVE_PTHREADS
   pthread_mutex_lock(&p->mutex);
@@ -521,12 +614,21 @@ void onion_poller_poll(onion_poller * p) {
   char stop = !p->stop && p->head;
 #endif
   while (stop) {
-    int nfds = epoll_wait(p->fd, event, onion_poller_max_events, -1);
+    size_t max_events = onion_poller_queue_size(p);
+    if (max_events != nevents) {        // This thread queue
+      onion_low_free(event);
+      event = onion_low_malloc(sizeof(struct epoll_event) * max_events);
+      nevents = max_events;
+    }
+    int nfds = epoll_wait(p->fd, event, nevents, -1);
+    if (nfds > 0)
+      onion_metrics_poller_wakeup(nfds);
 
     if (nfds < 0) {             // This is normally closed p->fd
       //ONION_DEBUG("Some error happened"); // Also spurious wakeups... gdb is to blame sometimes or any other.
       if (p->fd < 0 || !p->head) {
         ONION_DEBUG("Finishing the epoll as finished: %s", strerror(errno));
+        onion_low_free(event);
 #ifdef HAVE_PTHREADS
         pthread_mutex_lock(&p->mutex);
         p->npollers--;
@@ -536,9 +638,16 @@ void onion_poller_poll(onion_poller * p) {
       }
     }
     int i;
+    // No timeout while waiting at this queue: the data is already here, and the
+    // timer would shut down the connection before its handler is called.
+    for (i = 0; i < nfds; i++) {
+      onion_poller_slot *el = onion_poller_event_slot(&event[i]);
+      if (el)
+        el->timeout_limit = INT_MAX;
+    }
     for (i = 0; i < nfds; i++) {
-      onion_poller_slot *el = (onion_poller_slot *) event[i].data.ptr;
-      if (!el)
+      onion_poller_slot *el = onion_poller_event_slot(&event[i]);
+      if (!el)                  // Removed by a previous handler
         continue;
       // Call the callback
       //ONION_DEBUG("Calling callback for fd %d (%X %X)", el->fd, event[i].events);
@@ -546,8 +655,6 @@ void onion_poller_poll(onion_poller * p) {
       if (event[i].events & (EPOLLRDHUP | EPOLLHUP)) {
         n = -1;
       } else {                  // I also take care of the timeout, no timeout when on the handler, it should handle it itself.
-        el->timeout_limit = INT_MAX;
-
 #ifdef __DEBUG0__
         char **bs = backtrace_symbols((void *const *)&el->f, 1);
         ONION_DEBUG0("Calling handler: %s (%d)", bs[0], el->fd);
@@ -563,15 +670,21 @@ void onion_poller_poll(onion_poller * p) {
       }
       if (n < 0) {
         onion_poller_remove(p, el->fd);
-      } else {
+      } else if (el->type & EPOLLONESHOT) {     // Others are still armed
         ONION_DEBUG0("Re setting poller %d", el->fd);
         event[i].events = el->type;
-        if (p->fd >= 0) {
+        // Removed meanwhile, and its fd may be closed and reused. Checked with the mutex
+        // for listen slots, as onion_drain removes them from other threads.
+        if (el->listen)
+          pthread_mutex_lock(&p->mutex);
+        if (p->fd >= 0 && onion_poller_event_slot(&event[i])) {
           int e = epoll_ctl(p->fd, EPOLL_CTL_MOD, el->fd, &event[i]);
-          if (e < 0) {
+          if (e < 0 && errno != ENOENT) {
             ONION_ERROR("Error resetting poller, %s", strerror(errno));
           }
         }
+        if (el->listen)
+          pthread_mutex_unlock(&p->mutex);
       }
     }
 #ifdef HAVE_PTHREADS
@@ -582,6 +695,7 @@ void onion_poller_poll(onion_poller * p) {
     stop = !p->stop && p->head;
 #endif
   }
+  onion_low_free(event);
   ONION_DEBUG("Finished polling fds");
 #ifdef HAVE_PTHREADS
   pthread_mutex_lock(&p->mutex);
@@ -635,18 +749,20 @@ void onion_poller_stop(onion_poller * p) {
  *
  * If the value is high and some request processing is slow, the requests
  * after that one will have to wait until processed, which increases
- * latency. On the other hand, it requests are fast, using the queue is
- * faster than another call to epoll_wait.
+ * latency, as other threads can not take them. On the other hand, if requests
+ * are fast, using the queue is faster than another call to epoll_wait.
+ *
+ * While at the queue the slots do not time out, and slots removed by a previous
+ * handler of the queue are skipped.
  *
  * In non contention cases, where onion is mostly waiting for requests,
  * it makes no difference.
  *
- * WARNING! Just now there apears to be a bug on timeout management, and
- * changing this level increases the probability of hitting it.
+ * It is read by each thread before each epoll_wait, so it can be changed at any time.
  *
- * Default: 1.
+ * Default: 0, automatic: 1 if several threads are polling, ONION_POLLER_MAX_EVENTS (32)
+ * if only one.
  */
 void onion_poller_set_queue_size_per_thread(onion_poller * poller, size_t count) {
-  assert(count > 0);
-  onion_poller_max_events = count;
+  poller->max_events = count;
 }
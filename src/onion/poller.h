@@ -35,7 +35,9 @@ extern "C" {
     O_POLL_READ = 1,
     O_POLL_WRITE = 2,
     O_POLL_OTHER = 4,
-    O_POLL_ALL = 7
+    O_POLL_ALL = 7,
+    O_POLL_LISTEN = 8,          ///< Non blocking listen socket, whose function accepts all the pending connections. Any polling thread may get it: one shot at epoll, at every ring or loop at io_uring, libev and libevent.
+    O_POLL_EDGE = 16,           ///< Edge triggered, not rearmed. The function must read until EAGAIN.
   };
 
   typedef enum onion_poller_slot_type_e onion_poller_slot_type_e;
@@ -50,16 +52,19 @@ extern "C" {
                                       void (*shutdown) (void *), void *data);
 /// Sets the timeout for this slot. Current implementation takes ms, but then it rounds to seconds.
   void onion_poller_slot_set_timeout(onion_poller_slot * el, int timeout_ms);
-/// Sets the polling type: read/write/other. O_POLL_READ | O_POLL_WRITE | O_POLL_OTHER
+/// Sets the polling type: read/write/other. O_POLL_READ | O_POLL_WRITE | O_POLL_OTHER, and optionally O_POLL_LISTEN or O_POLL_EDGE
   void onion_poller_slot_set_type(onion_poller_slot * el,
                                   onion_poller_slot_type_e type);
+/// For listen sockets. Pollers that accept at the kernel call accepted with each new connection, instead of f.
+  void onion_poller_slot_set_accept(onion_poller_slot * el,
+                                    int (*accepted) (void *data, int fd));
 
 /// Create a new poller
   onion_poller *onion_poller_new(int aprox_n);
 /// Frees the poller. It first stops it.
   void onion_poller_free(onion_poller *);
 
-/// Sets the max events per thread queue size.
+/// Sets the max events per thread queue size. 0 is automatic.
   void onion_poller_set_queue_size_per_thread(onion_poller * poller,
                                               size_t count);
 
@@ -69,6 +74,8 @@ extern "C" {
   onion_poller_slot *onion_poller_get(onion_poller * poller, int fd);
 /// Removes a fd from the poller
   int onion_poller_remove(onion_poller * poller, int fd);
+/// Slots waiting with a longer timeout get this one, from now. To close idle connections when draining.
+  void onion_poller_shorten_timeouts(onion_poller * poller, int timeout_ms);
 
 /// Do the polling. If on several threads, this is done in every thread.
   void onion_poller_poll(onion_poller *);
@@ -23,47 +23,124 @@
 
 #include <ev.h>
 #include <stdlib.h>
-#include <semaphore.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "poller.h"
 #include "log.h"
 #include "low.h"
+#include "metrics.h"
 
-struct onion_poller_t {
+/**
+ * @short Poller implemented with libev
+ * @ingroup poller
+ *
+ * Each polling thread has its own loop. Slots added from a polling thread stay
+ * at its loop, so the connections accepted by a thread are processed by it.
+ * Slots added from other threads go to the loops in turn.
+ *
+ * libev loops are not thread safe, so each has a mutex, held by its thread
+ * except while waiting for events. Other threads take it to change the
+ * watchers, and wake the loop with an ev_async.
+ *
+ * O_POLL_LISTEN slots, as the listen sockets, are at all the loops, so any
+ * idle thread can accept. A connection may wake several of them; the ones that
+ * find nothing to accept just get EAGAIN.
+ */
+
+/// Max number of loops, one per polling thread.
+#define ONION_POLLER_MAX_LOOPS 256
+
+typedef struct onion_poller_loop_t onion_poller_loop;
+
+/// Loop of a polling thread.
+struct onion_poller_loop_t {
+  onion_poller *poller;
   struct ev_loop *loop;
-  sem_t sem;
+  ev_async wakeup;              ///< Sent from other threads after changes, and to stop.
+  pthread_mutex_t mutex;        ///< Held by the polling thread but while waiting.
+  char running;                 ///< Some thread is polling it.
+  volatile char shorten;        ///< Slot timeouts were shortened; restart its timers.
+};
+
+struct onion_poller_t {
+  pthread_mutex_t mutex;
+  onion_poller_loop loops[ONION_POLLER_MAX_LOOPS];
+  int nloops;
+  int next_loop;                ///< For slots added from other threads.
+  int npollers;
+  onion_poller_slot *head;      ///< All the slots.
   volatile int stop;
 };
 
+/// Watchers of a slot at a loop.
+typedef struct {
+  ev_io io;
+  ev_timer timer;
+  onion_poller_loop *loop;
+} onion_poller_watcher;
+
 struct onion_poller_slot_t {
   int fd;
   int timeout;
   int type;
-  ev_io ev;
+  char all_loops;               ///< O_POLL_LISTEN, at all the loops.
   void *data;
   int (*f) (void *);
   void *shutdown_data;
   void (*shutdown) (void *);
   onion_poller *poller;
+  onion_poller_watcher w;       ///< At its loop. No loop until some thread polls.
+  onion_poller_watcher *ws;     ///< One per loop, for all_loops slots.
+  onion_poller_slot *next;
 };
 
+/// Loop of the current thread, if it is polling.
+static __thread onion_poller_loop *onion_poller_current_loop = NULL;
+
 /// Create a new slot for the poller
 onion_poller_slot *onion_poller_slot_new(int fd, int (*f) (void *), void *data) {
   onion_poller_slot *ret = onion_low_calloc(1, sizeof(onion_poller_slot));
   ret->fd = fd;
   ret->f = f;
   ret->data = data;
-  ret->type = EV_READ | EV_WRITE;
+  ret->type = EV_READ;
 
   return ret;
 }
 
+/// Stops the watchers, and wakes the loop if it is another thread.
+static void onion_poller_watcher_stop(onion_poller_watcher * w) {
+  onion_poller_loop *loop = w->loop;
+  if (!loop)
+    return;
+  pthread_mutex_lock(&loop->mutex);
+  ev_io_stop(loop->loop, &w->io);
+  ev_timer_stop(loop->loop, &w->timer);
+  pthread_mutex_unlock(&loop->mutex);
+  if (loop != onion_poller_current_loop)
+    ev_async_send(loop->loop, &loop->wakeup);
+  w->loop = NULL;
+}
+
+/// Removes the slot from all the loops.
+static void onion_poller_slot_del(onion_poller_slot * el) {
+  onion_poller_watcher_stop(&el->w);
+  if (el->ws) {
+    int i;
+    for (i = 0; i < ONION_POLLER_MAX_LOOPS; i++)
+      onion_poller_watcher_stop(&el->ws[i]);
+    onion_low_free(el->ws);
+    el->ws = NULL;
+  }
+}
+
 /// Cleans a poller slot. Do not call if already on the poller (onion_poller_add). Use onion_poller_remove instead.
 void onion_poller_slot_free(onion_poller_slot * el) {
-  if (el->poller)
-    ev_io_stop(el->poller->loop, &el->ev);
+  onion_poller_slot_del(el);
   if (el->shutdown)
     el->shutdown(el->shutdown_data);
+  onion_low_free(el);
 }
 
 /// Sets the shutdown function for this poller slot
@@ -73,108 +150,305 @@ void onion_poller_slot_set_shutdown(onion_poller_slot * el,
   el->shutdown_data = data;
 }
 
-/// Sets the timeout for this slot. Current implementation takes ms, but then it rounds to seconds.
+/// Sets the timeout for this slot, since the last event. On timeout the slot is removed.
 void onion_poller_slot_set_timeout(onion_poller_slot * el, int timeout_ms) {
   el->timeout = timeout_ms;
 }
 
-/// Sets the polling type: read/write/other. O_POLL_READ | O_POLL_WRITE | O_POLL_OTHER
-void onion_poller_slot_set_type(onion_poller_slot * el, int type) {
+/// Sets the polling type: read/write/other. O_POLL_READ | O_POLL_WRITE | O_POLL_OTHER, and O_POLL_LISTEN. libev has no edge triggering.
+void onion_poller_slot_set_type(onion_poller_slot * el,
+                                onion_poller_slot_type_e type) {
   el->type = 0;
   if (type & O_POLL_READ)
     el->type |= EV_READ;
   if (type & O_POLL_WRITE)
     el->type |= EV_WRITE;
+  el->all_loops = (type & O_POLL_LISTEN) ? 1 : 0;
+}
+
+/// Not used with libev: f accepts itself.
+void onion_poller_slot_set_accept(onion_poller_slot * el,
+                                  int (*accepted) (void *data, int fd)) {
+}
+
+static void io_callback(struct ev_loop *loop, ev_io * io, int revents) {
+  onion_poller_slot *s = io->data;
+  onion_poller_watcher *w = (onion_poller_watcher *) io;
+  onion_metrics_poller_wakeup(1);      // Called per event, so wakeups are events here.
+  int res = s->f(s->data);
+  if (res < 0)
+    onion_poller_remove(s->poller, s->fd);
+  else if (s->timeout > 0 && w->loop)
+    ev_timer_again(loop, &w->timer);
+}
+
+/// On timeout it is closed, as with epoll.
+static void timeout_callback(struct ev_loop *loop, ev_timer * timer,
+                             int revents) {
+  onion_poller_slot *s = timer->data;
+  onion_poller_remove(s->poller, s->fd);
+}
+
+/// Adds the slot to the loop.
+static void onion_poller_slot_attach(onion_poller_slot * el,
+                                     onion_poller_loop * loop,
+                                     onion_poller_watcher * w) {
+  w->loop = loop;
+  ev_io_init(&w->io, io_callback, el->fd, el->type);
+  w->io.data = el;
+  ev_init(&w->timer, timeout_callback);
+  w->timer.repeat = el->timeout / 1000.0;
+  w->timer.data = el;
+
+  pthread_mutex_lock(&loop->mutex);
+  ev_io_start(loop->loop, &w->io);
+  if (el->timeout > 0)
+    ev_timer_again(loop->loop, &w->timer);
+  pthread_mutex_unlock(&loop->mutex);
+  if (loop != onion_poller_current_loop)
+    ev_async_send(loop->loop, &loop->wakeup);
+}
+
+/// Restarts the timers of the slots at this loop, after onion_poller_shorten_timeouts. Has the loop mutex.
+static void onion_poller_loop_restart_timers(onion_poller_loop * loop) {
+  onion_poller *p = loop->poller;
+  int index = loop - p->loops;
+  pthread_mutex_lock(&p->mutex);
+  onion_poller_slot *el;
+  for (el = p->head; el; el = el->next) {
+    onion_poller_watcher *w = el->ws ? &el->ws[index] : &el->w;
+    if (w->loop != loop || el->timeout <= 0
+        || w->timer.repeat <= el->timeout / 1000.0)
+      continue;
+    w->timer.repeat = el->timeout / 1000.0;
+    ev_timer_again(loop->loop, &w->timer);
+  }
+  pthread_mutex_unlock(&p->mutex);
+}
+
+static void onion_poller_loop_wakeup(struct ev_loop *l, ev_async * w,
+                                     int revents) {
+  onion_poller_loop *loop = w->data;
+  if (loop->shorten) {
+    loop->shorten = 0;
+    onion_poller_loop_restart_timers(loop);
+  }
+  if (loop->poller->stop)
+    ev_break(l, EVBREAK_ALL);
+}
+
+static void onion_poller_loop_release(struct ev_loop *l) {
+  onion_poller_loop *loop = ev_userdata(l);
+  pthread_mutex_unlock(&loop->mutex);
+}
+
+static void onion_poller_loop_acquire(struct ev_loop *l) {
+  onion_poller_loop *loop = ev_userdata(l);
+  pthread_mutex_lock(&loop->mutex);
+}
+
+/// Gets a stopped loop, or a new one, for a new polling thread. Must have the poller mutex.
+static onion_poller_loop *onion_poller_loop_get(onion_poller * p) {
+  int i;
+  for (i = 0; i < p->nloops; i++)
+    if (!p->loops[i].running)
+      return &p->loops[i];
+  if (p->nloops == ONION_POLLER_MAX_LOOPS)
+    return NULL;
+
+  onion_poller_loop *loop = &p->loops[p->nloops];
+  loop->poller = p;
+  loop->loop = ev_loop_new(EVFLAG_AUTO);
+  if (!loop->loop)
+    return NULL;
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&loop->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  ev_set_userdata(loop->loop, loop);
+  ev_set_loop_release_cb(loop->loop, onion_poller_loop_release,
+                         onion_poller_loop_acquire);
+  ev_async_init(&loop->wakeup, onion_poller_loop_wakeup);
+  loop->wakeup.data = loop;
+  ev_async_start(loop->loop, &loop->wakeup);
+  int index = p->nloops++;
+
+  // Slots for all, and the ones added before any thread polled.
+  onion_poller_slot *el;
+  for (el = p->head; el; el = el->next) {
+    if (el->all_loops)
+      onion_poller_slot_attach(el, loop, &el->ws[index]);
+    else if (!el->w.loop)
+      onion_poller_slot_attach(el, loop, &el->w);
+  }
+  return loop;
 }
 
 /// Create a new poller
 onion_poller *onion_poller_new(int aprox_n) {
   onion_poller *ret = onion_low_calloc(1, sizeof(onion_poller));
-  ret->loop = ev_default_loop(0);
-  sem_init(&ret->sem, 0, 1);
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&ret->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
   return ret;
 }
 
 /// Frees the poller. It first stops it.
 void onion_poller_free(onion_poller * p) {
-  onion_low_free(p);
-}
-
-static void event_callback(struct ev_loop *loop, ev_io * w, int revents) {
-  onion_poller_slot *s = w->data;
-  int res = s->f(s->data);
-  if (res < 0) {
-    onion_poller_slot_free(s);
+  p->stop = 1;
+  pthread_mutex_lock(&p->mutex);
+  if (p->npollers > 0) {
+    pthread_mutex_unlock(&p->mutex);
+    ONION_WARNING
+        ("When cleaning the poller object, some poller is still active; not freeing memory");
+    return;
+  }
+  onion_poller_slot *next = p->head;
+  p->head = NULL;
+  while (next) {
+    onion_poller_slot *tnext = next->next;
+    onion_poller_slot_free(next);
+    next = tnext;
   }
+  int i;
+  for (i = 0; i < p->nloops; i++) {
+    ev_async_stop(p->loops[i].loop, &p->loops[i].wakeup);
+    ev_loop_destroy(p->loops[i].loop);
+    pthread_mutex_destroy(&p->loops[i].mutex);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  pthread_mutex_destroy(&p->mutex);
+  onion_low_free(p);
 }
 
-/// Adds a slot to the poller
+/// Adds a slot to the poller. From a polling thread, to its own loop.
 int onion_poller_add(onion_poller * poller, onion_poller_slot * el) {
   el->poller = poller;
-
-  // normally would use ev_io_init bellow, but gcc on F18+ give a
-  // "dereferencing type-punned pointer will break strict-aliasing rules" error
-  // So the macro must be expanded and this is what we get. In the future this may
-  // give bugs on libevent if this changes.
-
-  //ev_io_init(&el->ev, event_callback, el->fd, el->type);
-  // expands to ev_init + ev_io_set. ev_init expand more or less as bellow
-
-  //ev_init(&el->ev, event_callback);
-  {
-    ev_watcher *ew = (void *)(&el->ev); // ew must exit to prevent the before mentioned error.
-    ew->active = 0;
-    ew->pending = 0;
-    ew->priority = 0;
-    el->ev.cb = event_callback;
+  onion_poller_loop *loop = NULL;
+  int nloops = 0;
+  pthread_mutex_lock(&poller->mutex);
+  el->next = poller->head;
+  poller->head = el;
+  if (el->all_loops) {
+    el->ws =
+        onion_low_calloc(ONION_POLLER_MAX_LOOPS, sizeof(onion_poller_watcher));
+    nloops = poller->nloops;    // Newer ones attach it themselves.
+  } else {
+    loop = onion_poller_current_loop;
+    if (!loop || loop->poller != poller) {
+      loop = NULL;
+      if (poller->nloops) {     // Else waits for the first polling thread.
+        loop = &poller->loops[poller->next_loop % poller->nloops];
+        poller->next_loop++;
+      }
+    }
+    el->w.loop = loop;          // So a new polling thread does not adopt it.
   }
+  pthread_mutex_unlock(&poller->mutex);
 
-  ev_io_set(&el->ev, el->fd, el->type);
-
-  el->ev.data = el;
-//      if (el->timeout>0){
-//              event_add(el->ev, &tv);
-//      }
-//      else{
-//              event_add(el->ev, NULL);
-//      }
-  ev_io_start(poller->loop, &el->ev);
+  // Loop mutexes are taken after the poller one is released, as callbacks hold
+  // their loop mutex and may take the poller one to remove.
+  int i;
+  for (i = 0; i < nloops; i++)
+    onion_poller_slot_attach(el, &poller->loops[i], &el->ws[i]);
+  if (loop)
+    onion_poller_slot_attach(el, loop, &el->w);
   return 1;
 }
 
 /// Removes a fd from the poller
 int onion_poller_remove(onion_poller * poller, int fd) {
-  ONION_ERROR("FIXME!! not removing fd %d", fd);
-  return -1;
+  pthread_mutex_lock(&poller->mutex);
+  onion_poller_slot **prev = &poller->head;
+  while (*prev && (*prev)->fd != fd)
+    prev = &(*prev)->next;
+  onion_poller_slot *el = *prev;
+  if (el)
+    *prev = el->next;
+  pthread_mutex_unlock(&poller->mutex);
+
+  if (!el) {
+    ONION_WARNING("Trying to remove unknown fd from poller %d", fd);
+    return 0;
+  }
+  onion_poller_slot_free(el);
+  return 0;
 }
 
 /// Gets the poller to do some modifications as change shutdown
 onion_poller_slot *onion_poller_get(onion_poller * poller, int fd) {
-  ONION_ERROR("Not implemented! Use epoll poller.");
-  return NULL;
+  pthread_mutex_lock(&poller->mutex);
+  onion_poller_slot *el = poller->head;
+  while (el && el->fd != fd)
+    el = el->next;
+  pthread_mutex_unlock(&poller->mutex);
+  return el;
 }
 
-/// Do the polling. If on several threads, this is done in every thread.
+/// Do the polling. If on several threads, this is done in every thread, each with its own loop.
 void onion_poller_poll(onion_poller * poller) {
-  ev_default_fork();
-  ev_loop_fork(poller->loop);
-
-  poller->stop = 0;
-  while (!poller->stop) {
-    sem_wait(&poller->sem);
-    ev_run(poller->loop, EVLOOP_ONESHOT);
-    sem_post(&poller->sem);
+  pthread_mutex_lock(&poller->mutex);
+  onion_poller_loop *loop = onion_poller_loop_get(poller);
+  if (!loop) {
+    pthread_mutex_unlock(&poller->mutex);
+    ONION_ERROR("Could not create an event loop for this thread");
+    return;
   }
+  if (poller->npollers++ == 0)
+    poller->stop = 0;
+  loop->running = 1;
+  pthread_mutex_unlock(&poller->mutex);
+
+  onion_poller_current_loop = loop;
+  pthread_mutex_lock(&loop->mutex);
+  while (!poller->stop)
+    ev_run(loop->loop, 0);
+  pthread_mutex_unlock(&loop->mutex);
+  onion_poller_current_loop = NULL;
+
+  pthread_mutex_lock(&poller->mutex);
+  loop->running = 0;
+  poller->npollers--;
+  pthread_mutex_unlock(&poller->mutex);
 }
 
-/// Stops the polling. This only marks the flag, and should be cancelled with pthread_cancel.
+/// Stops the polling at all the threads.
 void onion_poller_stop(onion_poller * poller) {
+  pthread_mutex_lock(&poller->mutex);
   poller->stop = 1;
-  ev_break(poller->loop, EVBREAK_ALL);
+  int i;
+  for (i = 0; i < poller->nloops; i++)
+    ev_async_send(poller->loops[i].loop, &poller->loops[i].wakeup);
+  pthread_mutex_unlock(&poller->mutex);
+}
+
+/**
+ * @short Slots with a longer timeout get this one, counting from now. For idle connections when draining.
+ *
+ * Each loop restarts its timers at its own thread, as the callbacks, so the mutexes are
+ * taken in the same order.
+ */
+void onion_poller_shorten_timeouts(onion_poller * poller, int timeout_ms) {
+  if (timeout_ms < 1)
+    timeout_ms = 1;
+  pthread_mutex_lock(&poller->mutex);
+  onion_poller_slot *el;
+  for (el = poller->head; el; el = el->next)
+    if (el->timeout > timeout_ms)
+      el->timeout = timeout_ms;
+  int i;
+  for (i = 0; i < poller->nloops; i++) {
+    poller->loops[i].shorten = 1;
+    ev_async_send(poller->loops[i].loop, &poller->loops[i].wakeup);
+  }
+  pthread_mutex_unlock(&poller->mutex);
 }
 
 // Not implemented for libev
 void onion_poller_set_queue_size_per_thread(onion_poller * poller, size_t count) {
   ONION_WARNING
-      ("onion_poller_queue_size_per_thread only used with epoll polling, not libev.");
+      ("onion_poller_queue_size_per_thread only used with epoll and io_uring polling, not libev.");
 }
@@ -24,15 +24,47 @@
 #include <event2/event.h>
 #include <event2/thread.h>
 #include <stdlib.h>
-#include <semaphore.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "poller.h"
 #include "log.h"
 #include "low.h"
+#include "metrics.h"
 
-struct onion_poller_t {
+/**
+ * @short Poller implemented with libevent
+ * @ingroup poller
+ *
+ * Each polling thread has its own event base. Slots added from a polling thread
+ * stay at its base, so the connections accepted by a thread are processed by it.
+ * Slots added from other threads go to the bases in turn; libevent wakes the base.
+ *
+ * O_POLL_LISTEN slots, as the listen sockets, are at all the bases, so any
+ * idle thread can accept. A connection may wake several of them; the ones that
+ * find nothing to accept just get EAGAIN.
+ */
+
+/// Max number of event bases, one per polling thread.
+#define ONION_POLLER_MAX_LOOPS 256
+
+typedef struct onion_poller_loop_t onion_poller_loop;
+
+/// Event base of a polling thread.
+struct onion_poller_loop_t {
+  onion_poller *poller;
   struct event_base *base;
-  sem_t sem;
+  struct event *wakeup;         ///< Activated from other threads to stop.
+  char running;                 ///< Some thread is polling it.
+};
+
+struct onion_poller_t {
+  pthread_mutex_t mutex;
+  onion_poller_loop loops[ONION_POLLER_MAX_LOOPS];
+  int nloops;
+  int next_loop;                ///< For slots added from other threads.
+  int npollers;
+  onion_poller_slot *head;      ///< All the slots.
   volatile int stop;
 };
 
@@ -40,32 +72,54 @@ struct onion_poller_slot_t {
   int fd;
   int timeout;
   int type;
-  struct event *ev;
+  char all_loops;               ///< O_POLL_LISTEN, at all the bases.
   void *data;
   int (*f) (void *);
   void *shutdown_data;
   void (*shutdown) (void *);
+  onion_poller *poller;
+  struct event *ev;             ///< At its base. NULL until some thread polls.
+  struct event **evs;           ///< One per base, for all_loops slots.
+  onion_poller_slot *next;
 };
 
 typedef struct onion_poller_slot_t onion_poller_slot;
 
+/// Base of the current thread, if it is polling.
+static __thread onion_poller_loop *onion_poller_current_loop = NULL;
+
 /// Create a new slot for the poller
 onion_poller_slot *onion_poller_slot_new(int fd, int (*f) (void *), void *data) {
   onion_poller_slot *ret = onion_low_calloc(1, sizeof(onion_poller_slot));
   ret->fd = fd;
   ret->f = f;
   ret->data = data;
-  ret->type = EV_READ | EV_WRITE | EV_PERSIST;
+  ret->type = EV_READ | EV_PERSIST;
 
   return ret;
 }
 
+/// Removes the slot from all the bases.
+static void onion_poller_slot_del(onion_poller_slot * el) {
+  if (el->ev)
+    event_free(el->ev);
+  el->ev = NULL;
+  if (el->evs) {
+    int i;
+    for (i = 0; i < ONION_POLLER_MAX_LOOPS; i++)
+      if (el->evs[i])
+        event_free(el->evs[i]);
+    onion_low_free(el->evs);
+    el->evs = NULL;
+  }
+}
+
 /// Cleans a poller slot. Do not call if already on the poller (onion_poller_add). Use onion_poller_remove instead.
 void onion_poller_slot_free(onion_poller_slot * el) {
-  if (el->ev)
-    event_del(el->ev);
+  onion_poller_slot_del(el);
   if (el->shutdown)
     el->shutdown(el->shutdown_data);
+  onion_low_free(el);
 }
 
 /// Sets the shutdown function for this poller slot
@@ -75,18 +129,87 @@ void onion_poller_slot_set_shutdown(onion_poller_slot * el,
   el->shutdown_data = data;
 }
 
-/// Sets the timeout for this slot. Current implementation takes ms, but then it rounds to seconds.
+/// Sets the timeout for this slot, since the last event. On timeout the slot is removed.
 void onion_poller_slot_set_timeout(onion_poller_slot * el, int timeout_ms) {
   el->timeout = timeout_ms;
 }
 
-/// Sets the polling type: read/write/other. O_POLL_READ | O_POLL_WRITE | O_POLL_OTHER
-void onion_poller_slot_set_type(onion_poller_slot * el, int type) {
+/// Sets the polling type: read/write/other. O_POLL_READ | O_POLL_WRITE | O_POLL_OTHER, and O_POLL_LISTEN or O_POLL_EDGE
+void onion_poller_slot_set_type(onion_poller_slot * el,
+                                onion_poller_slot_type_e type) {
   el->type = EV_PERSIST;
   if (type & O_POLL_READ)
     el->type |= EV_READ;
   if (type & O_POLL_WRITE)
     el->type |= EV_WRITE;
+  if (type & O_POLL_EDGE)
+    el->type |= EV_ET;
+  el->all_loops = (type & O_POLL_LISTEN) ? 1 : 0;
+}
+
+/// Not used with libevent: f accepts itself.
+void onion_poller_slot_set_accept(onion_poller_slot * el,
+                                  int (*accepted) (void *data, int fd)) {
+}
+
+static void event_callback(evutil_socket_t fd, short evtype, void *e) {
+  onion_poller_slot *s = e;
+  onion_metrics_poller_wakeup(1);      // Called per event, so wakeups are events here.
+  int res = -1;
+  if (!(evtype & EV_TIMEOUT))   // On timeout it is closed, as with epoll.
+    res = s->f(s->data);
+  if (res < 0)
+    onion_poller_remove(s->poller, s->fd);
+}
+
+/// Adds the slot to the base. Must have the poller mutex.
+static void onion_poller_slot_attach(onion_poller_slot * el,
+                                     onion_poller_loop * loop,
+                                     struct event **ev) {
+  *ev = event_new(loop->base, el->fd, el->type, event_callback, el);
+  if (el->timeout > 0) {
+    struct timeval tv;
+    tv.tv_sec = el->timeout / 1000;
+    tv.tv_usec = 1000 * (el->timeout % 1000);
+    event_add(*ev, &tv);
+  } else {
+    event_add(*ev, NULL);
+  }
+}
+
+static void onion_poller_loop_wakeup(evutil_socket_t fd, short evtype,
+                                     void *l) {
+  onion_poller_loop *loop = l;
+  if (loop->poller->stop)
+    event_base_loopbreak(loop->base);
+}
+
+/// Gets a stopped base, or a new one, for a new polling thread. Must have the poller mutex.
+static onion_poller_loop *onion_poller_loop_get(onion_poller * p) {
+  int i;
+  for (i = 0; i < p->nloops; i++)
+    if (!p->loops[i].running)
+      return &p->loops[i];
+  if (p->nloops == ONION_POLLER_MAX_LOOPS)
+    return NULL;
+
+  onion_poller_loop *loop = &p->loops[p->nloops];
+  loop->poller = p;
+  loop->base = event_base_new();
+  if (!loop->base)
+    return NULL;
+  loop->wakeup = event_new(loop->base, -1, 0, onion_poller_loop_wakeup, loop);
+  int index = p->nloops++;
+
+  // Slots for all, and the ones added before any thread polled.
+  onion_poller_slot *el;
+  for (el = p->head; el; el = el->next) {
+    if (el->all_loops)
+      onion_poller_slot_attach(el, loop, &el->evs[index]);
+    else if (!el->ev)
+      onion_poller_slot_attach(el, loop, &el->ev);
+  }
+  return loop;
 }
 
 /// Create a new poller
@@ -94,69 +217,153 @@ onion_poller *onion_poller_new(int aprox_n) {
   evthread_use_pthreads();
 
   onion_poller *ret = onion_low_calloc(1, sizeof(onion_poller));
-  ret->base = event_base_new();
-  sem_init(&ret->sem, 0, 1);
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&ret->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
   return ret;
 }
 
 /// Frees the poller. It first stops it.
 void onion_poller_free(onion_poller * p) {
-  event_base_free(p->base);
-  onion_low_free(p);
-}
-
-static void event_callback(evutil_socket_t fd, short evtype, void *e) {
-  onion_poller_slot *s = e;
-  int res = s->f(s->data);
-  if (res < 0) {
-    onion_poller_slot_free(s);
+  p->stop = 1;
+  pthread_mutex_lock(&p->mutex);
+  if (p->npollers > 0) {
+    pthread_mutex_unlock(&p->mutex);
+    ONION_WARNING
+        ("When cleaning the poller object, some poller is still active; not freeing memory");
+    return;
+  }
+  onion_poller_slot *next = p->head;
+  p->head = NULL;
+  while (next) {
+    onion_poller_slot *tnext = next->next;
+    onion_poller_slot_free(next);
+    next = tnext;
   }
+  int i;
+  for (i = 0; i < p->nloops; i++) {
+    event_free(p->loops[i].wakeup);
+    event_base_free(p->loops[i].base);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  pthread_mutex_destroy(&p->mutex);
+  onion_low_free(p);
 }
 
-/// Adds a slot to the poller
+/// Adds a slot to the poller. From a polling thread, to its own base.
 int onion_poller_add(onion_poller * poller, onion_poller_slot * el) {
-  el->ev = event_new(poller->base, el->fd, el->type, event_callback, el);
-  if (el->timeout > 0) {
-    struct timeval tv;
-    tv.tv_sec = el->timeout / 1000;
-    tv.tv_usec = 1000 * (el->timeout % 1000);
-    event_add(el->ev, &tv);
+  el->poller = poller;
+  pthread_mutex_lock(&poller->mutex);
+  el->next = poller->head;
+  poller->head = el;
+  if (el->all_loops) {
+    el->evs = onion_low_calloc(ONION_POLLER_MAX_LOOPS, sizeof(struct event *));
+    int i;
+    for (i = 0; i < poller->nloops; i++)
+      onion_poller_slot_attach(el, &poller->loops[i], &el->evs[i]);
   } else {
-    event_add(el->ev, NULL);
+    onion_poller_loop *loop = onion_poller_current_loop;
+    if (!loop || loop->poller != poller) {
+      loop = NULL;
+      if (poller->nloops) {     // Else waits for the first polling thread.
+        loop = &poller->loops[poller->next_loop % poller->nloops];
+        poller->next_loop++;
+      }
+    }
+    if (loop)
+      onion_poller_slot_attach(el, loop, &el->ev);
   }
+  pthread_mutex_unlock(&poller->mutex);
   return 1;
 }
 
 /// Removes a fd from the poller
 int onion_poller_remove(onion_poller * poller, int fd) {
-  ONION_ERROR("FIXME!! not removing fd %d", fd);
-  return -1;
+  pthread_mutex_lock(&poller->mutex);
+  onion_poller_slot **prev = &poller->head;
+  while (*prev && (*prev)->fd != fd)
+    prev = &(*prev)->next;
+  onion_poller_slot *el = *prev;
+  if (el)
+    *prev = el->next;
+  pthread_mutex_unlock(&poller->mutex);
+
+  if (!el) {
+    ONION_WARNING("Trying to remove unknown fd from poller %d", fd);
+    return 0;
+  }
+  onion_poller_slot_free(el);
+  return 0;
 }
 
 /// Gets the poller to do some modifications as change shutdown
 onion_poller_slot *onion_poller_get(onion_poller * poller, int fd) {
-  ONION_ERROR("Not implemented! Use epoll poller.");
-  return NULL;
+  pthread_mutex_lock(&poller->mutex);
+  onion_poller_slot *el = poller->head;
+  while (el && el->fd != fd)
+    el = el->next;
+  pthread_mutex_unlock(&poller->mutex);
+  return el;
 }
 
-/// Do the polling. If on several threads, this is done in every thread.
+/// Do the polling. If on several threads, this is done in every thread, each with its own event base.
 void onion_poller_poll(onion_poller * poller) {
-  poller->stop = 0;
-  while (!poller->stop) {
-    sem_wait(&poller->sem);
-    event_base_loop(poller->base, EVLOOP_ONCE);
-    sem_post(&poller->sem);
+  pthread_mutex_lock(&poller->mutex);
+  onion_poller_loop *loop = onion_poller_loop_get(poller);
+  if (!loop) {
+    pthread_mutex_unlock(&poller->mutex);
+    ONION_ERROR("Could not create an event base for this thread");
+    return;
   }
+  if (poller->npollers++ == 0)
+    poller->stop = 0;
+  loop->running = 1;
+  pthread_mutex_unlock(&poller->mutex);
+
+  onion_poller_current_loop = loop;
+  while (!poller->stop)
+    event_base_loop(loop->base, EVLOOP_NO_EXIT_ON_EMPTY);
+  onion_poller_current_loop = NULL;
+
+  pthread_mutex_lock(&poller->mutex);
+  loop->running = 0;
+  poller->npollers--;
+  pthread_mutex_unlock(&poller->mutex);
 }
 
-/// Stops the polling. This only marks the flag, and should be cancelled with pthread_cancel.
+/// Stops the polling at all the threads.
 void onion_poller_stop(onion_poller * poller) {
+  pthread_mutex_lock(&poller->mutex);
   poller->stop = 1;
-  event_base_loopbreak(poller->base);
+  int i;
+  for (i = 0; i < poller->nloops; i++)
+    event_active(poller->loops[i].wakeup, EV_READ, 0);
+  pthread_mutex_unlock(&poller->mutex);
+}
+
+/// Slots with a longer timeout get this one, counting from now. For idle connections when draining.
+void onion_poller_shorten_timeouts(onion_poller * poller, int timeout_ms) {
+  if (timeout_ms < 1)
+    timeout_ms = 1;
+  struct timeval tv;
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = 1000 * (timeout_ms % 1000);
+  pthread_mutex_lock(&poller->mutex);
+  onion_poller_slot *el;
+  for (el = poller->head; el; el = el->next) {
+    if (el->timeout <= timeout_ms)
+      continue;
+    el->timeout = timeout_ms;
+    if (el->ev)                 // Restarts its timeout
+      event_add(el->ev, &tv);
+  }
+  pthread_mutex_unlock(&poller->mutex);
 }
 
-// Not implemented for libev
+// Not implemented for libevent
 void onion_poller_set_queue_size_per_thread(onion_poller * poller, size_t count) {
   ONION_WARNING
-      ("onion_poller_queue_size_per_thread only used with epoll polling, not libev.");
+      ("onion_poller_queue_size_per_thread only used with epoll and io_uring polling, not libevent.");
 }
@@ -0,0 +1,1074 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "log.h"
+#include "types.h"
+#include "poller.h"
+#include "low.h"
+#include "metrics.h"
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#else                           // if no pthreads, ignore locks.
+#define pthread_mutex_init(...)
+#define pthread_mutex_lock(...)
+#define pthread_mutex_trylock(...) (0)
+#define pthread_mutex_unlock(...)
+#define pthread_mutex_destroy(...)
+#endif
+
+/**
+ * @short Poller implemented with io_uring
+ * @ingroup poller
+ *
+ * Each polling thread has its own io_uring, so it only waits for, and is only woken
+ * by, its own completions. Slots added from a polling thread stay at its ring, so
+ * the connections accepted by a thread are processed by it. Slots added from other
+ * threads go to the rings in turn, and are passed to the kernel at once.
+ *
+ * Each slot is a one shot IORING_OP_POLL_ADD. Polls armed again after the
+ * function returns are just queued at the submission ring, and passed to the
+ * kernel at the same io_uring_enter that waits for the next events, so there
+ * is no syscall per event as with epoll_ctl. Completions are read from the ring
+ * without a syscall before waiting again.
+ *
+ * O_POLL_LISTEN slots, the listen sockets, and the stop eventfd are at all
+ * the rings. Listen sockets with an accept function get a multishot IORING_OP_ACCEPT
+ * instead of a poll (Linux 5.19), so the kernel accepts and each completion is a new
+ * connection; only one ring gets each of them. On older kernels they fall back to polls.
+ */
+
+/// Entries at the submission ring. The completion ring is twice that.
+#define ONION_POLLER_URING_ENTRIES 1024
+/// Events per wait, if the queue size is automatic.
+#define ONION_POLLER_MAX_EVENTS 32
+/// Max number of rings, one per polling thread.
+#define ONION_POLLER_MAX_RINGS 256
+/// Max ms onion_poller_remove waits for the cancelled accepts of a listen socket.
+#define ONION_POLLER_URING_CANCEL_WAIT 1000
+/// At the user data of the accepts, so connections accepted for a removed slot still go to its accept function.
+#define ONION_POLLER_URING_ACCEPT (1u << 31)
+
+#ifndef IORING_ACCEPT_MULTISHOT
+#define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+
+typedef struct onion_poller_ring_t onion_poller_ring;
+
+/// io_uring of a polling thread.
+struct onion_poller_ring_t {
+  onion_poller *poller;
+  int fd;                       ///< io_uring fd
+  char running;                 ///< Some thread is polling it.
+#ifdef HAVE_PTHREADS
+  pthread_mutex_t mutex;        ///< Submission ring tail and completion ring head. Other threads queue polls and removes.
+#endif
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_entries;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned to_submit;           ///< At the submission ring, but not passed to the kernel yet.
+};
+
+struct onion_poller_t {
+  int eventfd;                  ///< fd to signal internal changes on poller.
+  int timerfd;                  ///< fd to set up timeouts
+  time_t current_timeout_limit; ///< Currently set limit in seconds
+  time_t last_timer_check;      ///< Last time the slots were checked for timeouts, at most once per second.
+
+  int n;
+  char stop;
+  size_t max_events;            ///< Events per wait and thread. 0 is automatic.
+#ifdef HAVE_PTHREADS
+  pthread_mutex_t mutex;
+  int npollers;
+#endif
+
+  onion_poller_ring *rings[ONION_POLLER_MAX_RINGS];
+  int nrings;
+  int next_ring;                ///< For slots added from other threads.
+
+  onion_poller_slot *head;
+};
+
+/// Each element of the poll
+/// @private
+struct onion_poller_slot_t {
+  int fd;
+  int (*f) (void *);
+  void *data;
+  int type;
+  int (*accepted) (void *, int);        ///< If set, multishot accepts instead of polls.
+  char no_accept;               ///< The kernel can not accept for it, so it is polled.
+  int accepts;                  ///< Multishot accepts at the kernel, until their last completion.
+
+  void (*shutdown) (void *);
+  void *shutdown_data;
+
+  time_t timeout;
+  time_t timeout_limit;         ///< Limit in seconds for use with time function.
+  unsigned int generation;      ///< Changes each time the slot is created or removed, to detect stale events.
+  char armed;                   ///< There is a poll at the kernel. Not used for all_rings slots.
+  char all_rings;               ///< O_POLL_LISTEN, at all the rings.
+  onion_poller_ring *ring;      ///< Where it is polled, if not all_rings.
+
+  onion_poller_slot *next;
+};
+
+/// Ring of the current thread, if it is polling.
+static __thread onion_poller_ring *onion_poller_current_ring = NULL;
+
+// Max number of polls, normally just 1024 as set by `ulimit -n` (fd count).
+static const int MAX_SLOTS = 1000000;
+
+static struct {
+  onion_poller_slot empty_slot;
+  onion_poller_slot *slots;
+  rlim_t max_slots;
+  int refcount;
+} onion_poller_static = { {
+}, NULL, 0, 0};
+
+/// Initializes static data. Init at onion_poller_new, deinit at _free.
+static void onion_poller_static_init() {
+  int16_t prevcount = __sync_fetch_and_add(&onion_poller_static.refcount, 1);
+  if (prevcount != 0)           // Only init first time
+    return;
+
+  memset(&onion_poller_static.empty_slot, 0,
+         sizeof(onion_poller_static.empty_slot));
+
+  struct rlimit rlim;
+  if (getrlimit(RLIMIT_NOFILE, &rlim)) {
+    ONION_ERROR("getrlimit: %s", strerror(errno));
+    return;
+  }
+  onion_poller_static.max_slots = rlim.rlim_cur;
+  if (onion_poller_static.max_slots > MAX_SLOTS)
+    onion_poller_static.max_slots = MAX_SLOTS;
+  onion_poller_static.slots =
+      (onion_poller_slot *) onion_low_calloc(onion_poller_static.max_slots,
+                                             sizeof(onion_poller_slot));
+}
+
+/// Deinits static data at onion_poller.
+static void onion_poller_static_deinit() {
+  int16_t nextcount = __sync_sub_and_fetch(&onion_poller_static.refcount, 1);
+  if (nextcount != 0)
+    return;
+
+  onion_low_free(onion_poller_static.slots);
+}
+
+/// Wrapper around clock_gettime(CLOCK_MONOTONIC_RAW, &t)
+/// It returns an unspecefified monotonic time in seconds. used for intervals.
+static time_t onion_time() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+  return t.tv_sec;
+}
+
+/// If the kernel accepts for the slot, instead of polling.
+static int onion_poller_slot_accepts(onion_poller_slot * el) {
+  return el->accepted && !el->no_accept;
+}
+
+/// User data for the slot polls: the fd and the generation, and ONION_POLLER_URING_ACCEPT for accepts. 0 for the removes.
+static uint64_t onion_poller_slot_event_data(onion_poller_slot * el) {
+  uint64_t data = ((uint64_t) el->generation << 32) | (uint32_t) el->fd;
+  if (onion_poller_slot_accepts(el))
+    data |= ONION_POLLER_URING_ACCEPT;
+  return data;
+}
+
+/// Slot for the given user data, or NULL if it was removed (or removed and reused).
+static onion_poller_slot *onion_poller_event_slot(uint64_t data) {
+  if (!data)
+    return NULL;
+  onion_poller_slot *el =
+      &onion_poller_static.slots[(uint32_t) data & ~ONION_POLLER_URING_ACCEPT];
+  if (__atomic_load_n(&el->generation, __ATOMIC_RELAXED) !=
+      (unsigned int)(data >> 32))
+    return NULL;
+  return el;
+}
+
+/// There is no glibc wrapper, and liburing is not required.
+static int onion_uring_setup(unsigned entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int onion_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                             unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL,
+                 0);
+}
+
+/// Unmaps the rings, closes the io_uring fd and frees it. Pending polls are cancelled.
+static void onion_poller_ring_free(onion_poller_ring * ring) {
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  pthread_mutex_destroy(&ring->mutex);
+  onion_low_free(ring);
+}
+
+/// Creates an io_uring and maps its rings. NULL on error, with errno set.
+static onion_poller_ring *onion_poller_ring_new(onion_poller * p) {
+  onion_poller_ring *ring = onion_low_calloc(1, sizeof(onion_poller_ring));
+  ring->poller = p;
+  pthread_mutex_init(&ring->mutex, NULL);
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = onion_uring_setup(ONION_POLLER_URING_ENTRIES, &params);
+  if (ring->fd < 0)
+    goto error;
+
+  ring->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    goto error;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      goto error;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto error;
+  }
+
+  char *sq = ring->sq_ring;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_entries = (unsigned *)(sq + params.sq_off.ring_entries);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  char *cq = ring->cq_ring;
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return ring;
+
+ error:;
+  int e = errno;
+  onion_poller_ring_free(ring);
+  errno = e;
+  return NULL;
+}
+
+/// Passes the queued entries to the kernel. Must have the ring mutex.
+static void onion_poller_submit(onion_poller_ring * ring) {
+  unsigned n = ring->to_submit;
+  if (!n)
+    return;
+  ring->to_submit = 0;
+  int r = onion_uring_enter(ring->fd, n, 0, 0);
+  if (r < 0) {
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      ONION_ERROR("Error submitting to io_uring: %s", strerror(errno));
+    ring->to_submit += n;
+  } else if ((unsigned)r < n)
+    ring->to_submit += n - r;
+}
+
+/// Gets a clean entry at the submission ring, to fill and onion_poller_push. Must have the ring mutex.
+static struct io_uring_sqe *onion_poller_sqe(onion_poller_ring * ring) {
+  unsigned tail = *ring->sq_tail;
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+      *ring->sq_entries) {
+    onion_poller_submit(ring);  // Full
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+        *ring->sq_entries) {
+      ONION_ERROR("io_uring submission ring is full");
+      return NULL;
+    }
+  }
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  return sqe;
+}
+
+/// Queues the entry got with onion_poller_sqe. Must have the ring mutex.
+static void onion_poller_push(onion_poller_ring * ring) {
+  // The kernel may be reading the ring, so only visible when complete.
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+}
+
+/// Queues the poll, or the accept, for the slot. Must have the ring mutex.
+static void onion_poller_arm(onion_poller_ring * ring, onion_poller_slot * el) {
+  struct io_uring_sqe *sqe = onion_poller_sqe(ring);
+  if (!sqe)
+    return;
+  if (onion_poller_slot_accepts(el)) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    __atomic_add_fetch(&el->accepts, 1, __ATOMIC_RELAXED);
+  } else {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll_events = el->type;        // The 16 bit field works on any kernel and endianness.
+  }
+  sqe->fd = el->fd;
+  sqe->user_data = onion_poller_slot_event_data(el);
+  onion_poller_push(ring);
+  if (!el->all_rings)
+    el->armed = 1;
+}
+
+/// Cancels the poll, or the accept, with the given user data at the ring, and passes it to the kernel.
+static void onion_poller_cancel(onion_poller_ring * ring, uint64_t data) {
+  pthread_mutex_lock(&ring->mutex);
+  struct io_uring_sqe *sqe = onion_poller_sqe(ring);
+  if (sqe) {
+    sqe->opcode =
+        (data & ONION_POLLER_URING_ACCEPT) ? IORING_OP_ASYNC_CANCEL :
+        IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = data;
+    onion_poller_push(ring);
+  }
+  onion_poller_submit(ring);
+  pthread_mutex_unlock(&ring->mutex);
+}
+
+/// Takes up to max completions. Must have the ring mutex.
+static int onion_poller_reap(onion_poller_ring * ring,
+                             struct io_uring_cqe *event, size_t max) {
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  int n = 0;
+  while (head != tail && (size_t)n < max) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    head++;
+    onion_poller_slot *el = onion_poller_event_slot(cqe->user_data);
+    if (!el && !(cqe->user_data & ONION_POLLER_URING_ACCEPT))
+      continue;                 // Removes, and removed slots. Accepts are always passed.
+    if (el && !el->all_rings && !(cqe->flags & IORING_CQE_F_MORE))
+      el->armed = 0;
+    event[n++] = *cqe;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+/// Gets a stopped ring, or a new one, for a new polling thread. Must have the poller mutex.
+static onion_poller_ring *onion_poller_ring_get(onion_poller * p) {
+  int i;
+  for (i = 0; i < p->nrings; i++)
+    if (!p->rings[i]->running)
+      return p->rings[i];
+  if (p->nrings == ONION_POLLER_MAX_RINGS)
+    return NULL;
+  onion_poller_ring *ring = onion_poller_ring_new(p);
+  if (!ring)
+    return NULL;
+  p->rings[p->nrings++] = ring;
+
+  // Slots for all, passed to the kernel at the first wait.
+  onion_poller_slot *el;
+  pthread_mutex_lock(&ring->mutex);
+  for (el = p->head; el; el = el->next)
+    if (el->all_rings)
+      onion_poller_arm(ring, el);
+  pthread_mutex_unlock(&ring->mutex);
+  return ring;
+}
+
+/**
+ * @short Creates a new slot for the poller, for input data to be ready.
+ * @memberof onion_poller_slot_t
+ * @ingroup poller
+  *
+ * @param fd File descriptor to watch
+ * @param f Function to call when data is ready. If function returns <0, the slot will be removed.
+ * @param data Data to pass to the function.
+ *
+ * @returns A new poller slot, ready to be added (onion_poller_add) or modified (onion_poller_slot_set_shutdown, onion_poller_slot_set_timeout).
+ */
+onion_poller_slot *onion_poller_slot_new(int fd, int (*f) (void *), void *data) {
+  if (fd < 0 || fd >= onion_poller_static.max_slots) {
+    ONION_ERROR
+        ("Trying to add an invalid file descriptor to the poller (%d). Please check. Must be (0-%d)",
+         fd, onion_poller_static.max_slots);
+    return NULL;
+  }
+  onion_poller_slot *el = &onion_poller_static.slots[fd];
+  unsigned int generation = el->generation + 1;
+  *el = onion_poller_static.empty_slot;
+  __atomic_store_n(&el->generation, generation, __ATOMIC_RELAXED);
+  el->fd = fd;
+  el->f = f;
+  el->data = data;
+  el->timeout = -1;
+  el->timeout_limit = INT_MAX;
+  el->type = POLLIN | POLLHUP;
+
+  return el;
+}
+
+/**
+ * @short Free the data for the given slot, calling shutdown if any.
+ * @memberof onion_poller_slot_t
+ * @ingroup poller
+ */
+void onion_poller_slot_free(onion_poller_slot * el) {
+  if (el->shutdown)
+    el->shutdown(el->shutdown_data);
+}
+
+/**
+ * @short Sets a function to be called when the slot is removed, for example because the file is closed.
+ * @memberof onion_poller_slot_t
+ * @ingroup poller
+ *
+ * @param el slot
+ * @param sd Function to call
+ * @param data Parameter for the function
+ */
+void onion_poller_slot_set_shutdown(onion_poller_slot * el, void (*sd) (void *),
+                                    void *data) {
+  el->shutdown = sd;
+  el->shutdown_data = data;
+}
+
+/**
+ * @short Sets the timeout for the slot
+ * @ingroup poller
+ *
+ * The timeout is passed in ms, but it is rounded to seconds.
+ * @memberof onion_poller_slot_t
+ *
+ * @param el Slot to modify
+ * @param timeout Time in milliseconds that this file can be waiting.
+ */
+void onion_poller_slot_set_timeout(onion_poller_slot * el, int timeout) {
+  el->timeout = timeout / 1000;
+  el->timeout_limit = onion_time() + el->timeout;
+}
+
+/**
+ * @short Sets the type of the poller
+ * @ingroup poller
+ *
+ * All slots are one shot, as arming them again costs no syscall, so O_POLL_EDGE
+ * slots are only called from one thread at a time. O_POLL_LISTEN slots are at all
+ * the rings, so their function may be called from several threads at the same time.
+ */
+void onion_poller_slot_set_type(onion_poller_slot * el,
+                                onion_poller_slot_type_e type) {
+  el->all_rings = (type & O_POLL_LISTEN) ? 1 : 0;
+  el->type = POLLHUP;
+  if (type & O_POLL_READ)
+    el->type |= POLLIN;
+  if (type & O_POLL_WRITE)
+    el->type |= POLLOUT;
+  if (type & O_POLL_OTHER)
+    el->type |= POLLERR | POLLPRI;
+}
+
+/**
+ * @short Sets a function to call with each accepted connection
+ * @ingroup poller
+ *
+ * The slot gets a multishot IORING_OP_ACCEPT instead of a poll, so the kernel accepts
+ * and accepted is called with each new connection, instead of f. If the kernel does
+ * not support it (before 5.19) it is polled, and f accepts.
+ */
+void onion_poller_slot_set_accept(onion_poller_slot * el,
+                                  int (*accepted) (void *data, int fd)) {
+  el->accepted = accepted;
+}
+
+static int onion_poller_stop_helper(void *p) {
+  onion_poller_stop(p);
+  return 1;
+}
+
+static int onion_poller_timer(void *p_);
+
+static void onion_poller_timer_check(onion_poller * p, time_t timelimit) {
+  // If maybe timeout limit (p->current_timeout_limit is used atomically)
+  if (timelimit < p->current_timeout_limit) {
+    // Recalculate with proper mutexes.
+    onion_poller_timer(p);
+  }
+}
+
+static int onion_poller_timer(void *p_) {
+  onion_poller *p = p_;
+
+  time_t ctime = onion_time();
+  time_t next_timeout = ctime + (24 * 60 * 60); // At least once per day
+
+  // Do this only once per second max.
+  if (ctime != p->last_timer_check) {
+    p->last_timer_check = ctime;
+    pthread_mutex_lock(&p->mutex);
+    onion_poller_slot *next = p->head;
+    while (next) {
+      onion_poller_slot *cur = next;
+      next = next->next;
+      if (cur->timeout_limit <= ctime) {
+        cur->timeout_limit = INT_MAX;
+        shutdown(cur->fd, SHUT_RD);
+      } else if (cur->timeout_limit < next_timeout) {
+        next_timeout = cur->timeout_limit;
+      }
+    }
+    pthread_mutex_unlock(&p->mutex);
+  } else {                      // Not checked now, so check again next second.
+    next_timeout = ctime + 1;
+  }
+  // Atomic store. Try until set if <= next_timeout.
+  time_t origval;
+  time_t oldval;
+  do {
+    origval = p->current_timeout_limit;
+    oldval =
+        __sync_val_compare_and_swap(&p->current_timeout_limit, origval,
+                                    next_timeout);
+  } while (origval != oldval && oldval > next_timeout);
+
+  struct itimerspec next = { {0, 0}, {next_timeout - ctime, 0} };
+  timerfd_settime(p->timerfd, 0, &next, NULL);
+
+  return 1;
+}
+
+/**
+ * @short Shortens the timeouts of the slots waiting for data.
+ * @memberof onion_poller_t
+ * @ingroup poller
+ *
+ * Slots with a longer timeout get this one, counting from now, so idle connections are
+ * closed soon, as when draining the server. Slots being processed now keep theirs, and
+ * slots without timeout are not affected. Rounded to seconds.
+ */
+void onion_poller_shorten_timeouts(onion_poller * p, int timeout_ms) {
+  time_t timeout = timeout_ms / 1000;
+  time_t limit = onion_time() + timeout;
+  pthread_mutex_lock(&p->mutex);
+  onion_poller_slot *el;
+  for (el = p->head; el; el = el->next) {
+    if (el->timeout <= 0)
+      continue;
+    if (el->timeout > timeout)
+      el->timeout = timeout > 0 ? timeout : 1;
+    time_t current = el->timeout_limit;
+    // Fails if a thread has just got an event for it, and set it to INT_MAX.
+    if (current != INT_MAX && current > limit)
+      __sync_bool_compare_and_swap(&el->timeout_limit, current, limit);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  p->last_timer_check = 0;      // Check now, even if already checked this second.
+  onion_poller_timer(p);
+}
+
+/**
+ * @short Returns a poller object that helps polling on sockets and files
+ * @memberof onion_poller_t
+ * @ingroup poller
+ *
+ * This poller is implemented through io_uring. Needs Linux 5.1 or later.
+ *
+ * The first ring is created now, so it fails here if io_uring is not available. It is
+ * used by the first polling thread.
+ */
+onion_poller *onion_poller_new(int n) {
+  onion_poller *p = onion_low_calloc(1, sizeof(onion_poller));
+  p->rings[0] = onion_poller_ring_new(p);
+  if (!p->rings[0]) {
+    ONION_ERROR("Error creating the io_uring poller. %s", strerror(errno));
+    onion_low_free(p);
+    return NULL;
+  }
+  p->nrings = 1;
+  p->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  p->head = NULL;
+  p->n = 0;
+  p->stop = 0;
+
+#ifdef HAVE_PTHREADS
+  p->npollers = 0;
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&p->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+#endif
+
+  onion_poller_static_init();
+
+  onion_poller_slot *ev =
+      onion_poller_slot_new(p->eventfd, onion_poller_stop_helper, p);
+  ev->all_rings = 1;            // Stops all the threads
+  onion_poller_add(p, ev);
+
+  p->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  ev = onion_poller_slot_new(p->timerfd, &onion_poller_timer, p);
+  onion_poller_add(p, ev);
+  onion_poller_timer(p);        // Force first timeout
+
+  return p;
+}
+
+/// @memberof onion_poller_t
+void onion_poller_free(onion_poller * p) {
+  p->stop = 1;
+
+  if (pthread_mutex_trylock(&p->mutex) > 0) {
+    ONION_WARNING
+        ("When cleaning the poller object, some poller is still active; not freeing memory");
+  } else {
+    int i;
+    for (i = 0; i < p->nrings; i++)     // Before the shutdowns, so polls do not keep the files open.
+      onion_poller_ring_free(p->rings[i]);
+    p->nrings = 0;
+
+    onion_poller_slot *next = p->head;
+    while (next) {
+      onion_poller_slot *tnext = next->next;
+      if (next->shutdown)
+        next->shutdown(next->shutdown_data);
+      next = tnext;
+    }
+    pthread_mutex_unlock(&p->mutex);
+
+    if (p->eventfd >= 0)
+      close(p->eventfd);
+    if (p->timerfd >= 0)
+      close(p->timerfd);
+
+    onion_poller_static_deinit();
+
+    pthread_mutex_destroy(&p->mutex);
+    onion_low_free(p);
+  }
+}
+
+/**
+ * @short Adds a file descriptor to poll.
+ * @memberof onion_poller_t
+ * @ingroup poller
+ *
+ * When new data is available (read/write/event) the given function
+ * is called with that data.
+ *
+ * From a polling thread the slot goes to its own ring, and the poll is passed to the
+ * kernel at its next wait. From other threads it goes to the rings in turn, and is
+ * passed at once, as their threads may be waiting.
+ */
+int onion_poller_add(onion_poller * poller, onion_poller_slot * el) {
+  pthread_mutex_lock(&poller->mutex);
+  // Keep the head, as onion_poller_remove and the timer expect it.
+  if (!poller->head)
+    poller->head = el;
+  else {
+    el->next = poller->head->next;
+    poller->head->next = el;
+    poller->n++;
+  }
+  onion_poller_ring *current = onion_poller_current_ring;
+  if (current && current->poller != poller)
+    current = NULL;
+  int i;
+  for (i = 0; i < poller->nrings; i++) {
+    onion_poller_ring *ring = poller->rings[i];
+    if (!el->all_rings) {
+      ring = current;
+      if (!ring)
+        ring = poller->rings[poller->next_ring++ % poller->nrings];
+      el->ring = ring;
+    }
+    pthread_mutex_lock(&ring->mutex);
+    onion_poller_arm(ring, el);
+    if (ring != current)
+      onion_poller_submit(ring);
+    pthread_mutex_unlock(&ring->mutex);
+    if (!el->all_rings)
+      break;
+  }
+  pthread_mutex_unlock(&poller->mutex);
+  onion_poller_timer_check(poller, el->timeout_limit);
+
+  return 1;
+}
+
+/**
+ * Marks the slot as removed, and cancels its polls, if any. Must have the mutex.
+ *
+ * Marked first, so a polling thread does not arm it again after the cancel.
+ */
+static void onion_poller_disarm(onion_poller * poller, onion_poller_slot * el) {
+  uint64_t data = onion_poller_slot_event_data(el);
+  __atomic_add_fetch(&el->generation, 1, __ATOMIC_RELAXED);
+  if (el->all_rings) {
+    int i;
+    for (i = 0; i < poller->nrings; i++)
+      onion_poller_cancel(poller->rings[i], data);
+  } else if (el->armed) {
+    onion_poller_cancel(el->ring, data);
+    el->armed = 0;
+  }
+}
+
+/**
+ * Waits for the last completion of the cancelled accepts of a removed slot.
+ *
+ * Until then the kernel may still accept for it, and those connections go to its accept
+ * function, so the listen socket must not be closed before. Only the polling threads
+ * reap them, so it does not wait at one of them, nor if none is polling.
+ */
+static void onion_poller_wait_accepts(onion_poller * poller,
+                                      onion_poller_slot * el) {
+#ifdef HAVE_PTHREADS
+  if (onion_poller_current_ring)
+    return;
+  int i;
+  for (i = 0; i < ONION_POLLER_URING_CANCEL_WAIT; i++) {
+    if (__atomic_load_n(&el->accepts, __ATOMIC_ACQUIRE) <= 0)
+      return;
+    pthread_mutex_lock(&poller->mutex);
+    int npollers = poller->npollers;
+    pthread_mutex_unlock(&poller->mutex);
+    if (npollers == 0)
+      return;
+    usleep(1000);
+  }
+  ONION_WARNING("Accepts for fd %d still not cancelled", el->fd);
+#endif
+}
+
+/**
+ * @short Removes a file descriptor, and all related callbacks from the listening queue
+ * @memberof onion_poller_t
+ * @ingroup poller
+ */
+int onion_poller_remove(onion_poller * poller, int fd) {
+  pthread_mutex_lock(&poller->mutex);
+  onion_poller_slot *el = poller->head;
+  if (el && el->fd == fd) {
+    poller->head = el->next;
+    onion_poller_disarm(poller, el);
+    pthread_mutex_unlock(&poller->mutex);
+
+    onion_poller_wait_accepts(poller, el);
+    onion_poller_slot_free(el);
+    return 0;
+  }
+  while (el && el->next) {
+    if (el->next->fd == fd) {
+      onion_poller_slot *t = el->next;
+      el->next = t->next;
+      onion_poller_disarm(poller, t);
+
+      if (poller->head->next == NULL) { // This means only eventfd is here.
+        onion_poller_stop(poller);
+      }
+
+      pthread_mutex_unlock(&poller->mutex);
+
+      onion_poller_wait_accepts(poller, t);
+      onion_poller_slot_free(t);
+      return 0;
+    }
+    el = el->next;
+  }
+  pthread_mutex_unlock(&poller->mutex);
+  ONION_WARNING("Trying to remove unknown fd from poller %d", fd);
+  return 0;
+}
+
+/**
+ * @short Gets the poller slot
+ * @ingroup poller
+ *
+ * This might be used for long polling, removing the default deleter.
+ */
+onion_poller_slot *onion_poller_get(onion_poller * poller, int fd) {
+  onion_poller_slot *next = poller->head;
+  while (next) {
+    if (next->fd == fd)
+      return next;
+    next = next->next;
+  }
+  return NULL;
+}
+
+/// Events to take each time. The ring is only for this thread, so all by default.
+static size_t onion_poller_queue_size(onion_poller * p) {
+  if (p->max_events)
+    return p->max_events;
+  return ONION_POLLER_MAX_EVENTS;
+}
+
+/**
+ * @short Do the event polling.
+ * @memberof onion_poller_t
+ * @ingroup poller
+ *
+ * It loops over polling. To exit polling call onion_poller_stop().
+ *
+ * Each thread polls its own ring, a free one or a new one.
+ *
+ * If no fd to poll, returns.
+ */
+void onion_poller_poll(onion_poller * p) {
+  struct io_uring_cqe *event = NULL;
+  size_t nevents = 0;
+  pthread_mutex_lock(&p->mutex);
+  onion_poller_ring *ring = onion_poller_ring_get(p);
+  if (!ring) {
+    pthread_mutex_unlock(&p->mutex);
+    ONION_ERROR("Could not create an io_uring for this thread. %s",
+                strerror(errno));
+    return;
+  }
+  ring->running = 1;
+#ifdef HAVE_PTHREADS
+  p->npollers++;
+#endif
+  p->stop = 0;
+  char stop = !p->stop && p->head;
+  pthread_mutex_unlock(&p->mutex);
+  onion_poller_current_ring = ring;
+
+  while (stop) {
+    size_t max_events = onion_poller_queue_size(p);
+    if (max_events != nevents) {        // This thread queue
+      onion_low_free(event);
+      event = onion_low_malloc(sizeof(struct io_uring_cqe) * max_events);
+      nevents = max_events;
+    }
+    pthread_mutex_lock(&ring->mutex);
+    int nfds = onion_poller_reap(ring, event, nevents);
+    unsigned to_submit = 0;
+    if (nfds == 0) {            // Submit the queued polls and wait, with one syscall.
+      to_submit = ring->to_submit;
+      ring->to_submit = 0;
+    }
+    pthread_mutex_unlock(&ring->mutex);
+
+    if (nfds == 0) {
+      int r = onion_uring_enter(ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+      if (r < 0 || (unsigned)r < to_submit) {
+        pthread_mutex_lock(&ring->mutex);
+        ring->to_submit += (r < 0) ? to_submit : to_submit - r;
+        pthread_mutex_unlock(&ring->mutex);
+      }
+      if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        ONION_ERROR("Error waiting at io_uring: %s", strerror(errno));
+        break;
+      }
+    } else {
+      onion_metrics_poller_wakeup(nfds);
+    }
+
+    int i;
+    // No timeout while waiting at this queue: the data is already here.
+    for (i = 0; i < nfds; i++) {
+      onion_poller_slot *el = onion_poller_event_slot(event[i].user_data);
+      if (el && !(event[i].user_data & ONION_POLLER_URING_ACCEPT))
+        el->timeout_limit = INT_MAX;
+    }
+    for (i = 0; i < nfds; i++) {
+      onion_poller_slot *el = onion_poller_event_slot(event[i].user_data);
+      if (event[i].user_data & ONION_POLLER_URING_ACCEPT) {
+        onion_poller_slot *accepting =
+            &onion_poller_static.slots[(uint32_t) event[i].user_data &
+                                       ~ONION_POLLER_URING_ACCEPT];
+        if (!el && event[i].res >= 0) {
+          // Accepted just before the cancel. The listen socket is still open, as
+          // onion_poller_remove waits for the last completion, so it is still served.
+          if (accepting->accepted)
+            accepting->accepted(accepting->data, event[i].res);
+          else
+            close(event[i].res);
+        }
+        if (!(event[i].flags & IORING_CQE_F_MORE))
+          __atomic_sub_fetch(&accepting->accepts, 1, __ATOMIC_RELEASE);
+      }
+      if (!el)                  // Removed by a previous handler
+        continue;
+      unsigned int generation = el->generation;
+      int n = -1;
+      if (event[i].user_data & ONION_POLLER_URING_ACCEPT) {
+        if (event[i].res >= 0)
+          n = el->accepted(el->data, event[i].res);
+        else if (event[i].res == -EINVAL) {
+          // No multishot accept at this kernel, or not listening anymore. Poll it.
+          ONION_DEBUG("No io_uring accept for fd %d, polling it", el->fd);
+          el->no_accept = 1;
+          n = 0;
+        } else {
+          if (event[i].res != -ECANCELED && event[i].res != -EINTR
+              && event[i].res != -EAGAIN)
+            ONION_ERROR("Error accepting connection: %s",
+                        strerror(-event[i].res));
+          n = 0;
+        }
+      } else if (event[i].res == -ECANCELED) {
+        n = 0;                  // The thread that armed it exited. Arm again from this one.
+      } else if (event[i].res < 0 || (event[i].res & POLLHUP)) {
+        n = -1;
+      } else {
+        n = el->f(el->data);
+
+        if (el->timeout > 0) {
+          el->timeout_limit = onion_time() + el->timeout;
+          onion_poller_timer_check(p, el->timeout_limit);
+        }
+      }
+      if (n < 0) {
+        onion_poller_remove(p, el->fd);
+      } else if (!(event[i].flags & IORING_CQE_F_MORE)) {       // Else the accept is still armed
+        pthread_mutex_lock(&ring->mutex);
+        if (el->generation == generation && (el->all_rings || !el->armed))
+          onion_poller_arm(ring, el);
+        pthread_mutex_unlock(&ring->mutex);
+      }
+    }
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&p->mutex);
+    stop = !p->stop && p->head;
+    pthread_mutex_unlock(&p->mutex);
+#else
+    stop = !p->stop && p->head;
+#endif
+  }
+  onion_low_free(event);
+  onion_poller_current_ring = NULL;
+  // The eventfd to stop the others may be queued.
+  pthread_mutex_lock(&ring->mutex);
+  onion_poller_submit(ring);
+  pthread_mutex_unlock(&ring->mutex);
+  pthread_mutex_lock(&p->mutex);
+  ring->running = 0;
+#ifdef HAVE_PTHREADS
+  p->npollers--;
+#endif
+  pthread_mutex_unlock(&p->mutex);
+}
+
+/**
+ * @short Marks the poller to stop ASAP
+ * @memberof onion_poller_t
+ * @ingroup poller
+ */
+void onion_poller_stop(onion_poller * p) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&p->mutex);
+  p->stop = 1;
+  pthread_mutex_unlock(&p->mutex);
+#else
+  p->stop = 1;
+#endif
+
+  char data[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+  int __attribute__ ((unused)) r = read(p->eventfd, data, 8);   // Flush eventfd data, discard data
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&p->mutex);
+  int n = p->npollers;
+  pthread_mutex_unlock(&p->mutex);
+
+  if (n > 0) {
+    int w = write(p->eventfd, data, 8); // Tell another thread to exit
+    if (w < 0) {
+      ONION_ERROR("Error signaling poller to stop!");
+    }
+  }
+#endif
+}
+
+/**
+ * @short Sets the max events per thread queue size.
+ * @ingroup poller
+ *
+ * Completions taken by a thread from its ring each time. Default: 0, automatic:
+ * ONION_POLLER_MAX_EVENTS (32), as the ring is only for this thread.
+ */
+void onion_poller_set_queue_size_per_thread(onion_poller * poller, size_t count) {
+  poller->max_events = count;
+}
@@ -22,9 +22,13 @@
 */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 #include "types_internal.h"
 #include "log.h"
@@ -39,12 +43,129 @@ static pthread_mutex_t onion_random_refcount_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define onion_random_refcount_mutex_unlock() ;
 #endif
 
+/// Bytes generated at once, 8 ChaCha20 blocks. The first 32 are used as the next key.
+#define ONION_RANDOM_BUFFER_SIZE 512
+/// Bytes generated before getting a new seed from the system.
+#define ONION_RANDOM_RESEED_BYTES (1024*1024)
+
 static size_t onion_random_refcount = 0;
+/// Changes at fork, so the child does not repeat the parent sequence.
+static volatile unsigned int onion_random_fork_generation = 1;
+
+/**
+ * @short State of the generator of each thread.
+ *
+ * It is ChaCha20 with fast key erasure: every refill the first bytes of output are the new key,
+ * so already generated data can not be recovered from the state.
+ */
+typedef struct onion_random_state_t {
+  uint32_t input[16];           ///< Constants, key, counter and nonce
+  unsigned char buffer[ONION_RANDOM_BUFFER_SIZE];
+  size_t available;             ///< Bytes still not used, at the end of buffer
+  size_t until_reseed;
+  unsigned int fork_generation;
+} onion_random_state;
+
+static __thread onion_random_state onion_random_thread_state;
+
+#define ONION_RANDOM_ROTL(a,b) (((a) << (b)) | ((a) >> (32 - (b))))
+#define ONION_RANDOM_QR(a, b, c, d) ( \
+  a += b, d ^= a, d = ONION_RANDOM_ROTL(d, 16), \
+  c += d, b ^= c, b = ONION_RANDOM_ROTL(b, 12), \
+  a += b, d ^= a, d = ONION_RANDOM_ROTL(d, 8), \
+  c += d, b ^= c, b = ONION_RANDOM_ROTL(b, 7))
+
+static void onion_random_chacha20_block(const uint32_t in[16],
+                                        uint32_t out[16]) {
+  uint32_t x[16];
+  int i;
+  memcpy(x, in, sizeof(x));
+  for (i = 0; i < 10; i++) {
+    ONION_RANDOM_QR(x[0], x[4], x[8], x[12]);
+    ONION_RANDOM_QR(x[1], x[5], x[9], x[13]);
+    ONION_RANDOM_QR(x[2], x[6], x[10], x[14]);
+    ONION_RANDOM_QR(x[3], x[7], x[11], x[15]);
+    ONION_RANDOM_QR(x[0], x[5], x[10], x[15]);
+    ONION_RANDOM_QR(x[1], x[6], x[11], x[12]);
+    ONION_RANDOM_QR(x[2], x[7], x[8], x[13]);
+    ONION_RANDOM_QR(x[3], x[4], x[9], x[14]);
+  }
+  for (i = 0; i < 16; i++)
+    out[i] = x[i] + in[i];
+}
+
+/// Reads a seed from the kernel. getrandom does not need a fd, and does not block once booted.
+static int onion_random_system_seed(void *data, size_t size) {
+#ifdef SYS_getrandom
+  if (syscall(SYS_getrandom, data, size, 0) == (long)size)
+    return 0;
+#endif
+  int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t n = read(fd, data, size);
+  close(fd);
+  return (n == (ssize_t) size) ? 0 : -1;
+}
+
+/// Sets a new key and nonce from the system.
+static void onion_random_reseed(onion_random_state * st) {
+  static const uint32_t sigma[4] =
+      { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+  uint32_t seed[10];            // Key and nonce
+  if (onion_random_system_seed(seed, sizeof(seed)) < 0) {
+    ONION_WARNING
+        ("Unsecure random number generation; could not read a seed from the system");
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    seed[0] ^= ts.tv_sec;
+    seed[1] ^= ts.tv_nsec;
+    seed[2] ^= getpid();
+    seed[3] ^= (uintptr_t) st;
+    seed[4] ^= clock();
+  }
+  memcpy(st->input, sigma, sizeof(sigma));
+  memcpy(st->input + 4, seed, 32);
+  st->input[12] = 0;
+  st->input[13] = 0;
+  st->input[14] = seed[8];
+  st->input[15] = seed[9];
+  memset(seed, 0, sizeof(seed));
+  memset(st->buffer, 0, sizeof(st->buffer));
+  st->available = 0;
+  st->until_reseed = ONION_RANDOM_RESEED_BYTES;
+  st->fork_generation = onion_random_fork_generation;
+}
+
+/// Fills the buffer, and uses the first 32 bytes as the new key.
+static void onion_random_refill(onion_random_state * st) {
+  uint32_t block[16];
+  int i;
+  for (i = 0; i < ONION_RANDOM_BUFFER_SIZE / 64; i++) {
+    onion_random_chacha20_block(st->input, block);
+    memcpy(st->buffer + i * 64, block, 64);
+    if (++st->input[12] == 0)
+      st->input[13]++;
+  }
+  memset(block, 0, sizeof(block));
+  memcpy(st->input + 4, st->buffer, 32);
+  memset(st->buffer, 0, 32);
+  st->available = ONION_RANDOM_BUFFER_SIZE - 32;
+  st->until_reseed -= (st->until_reseed > ONION_RANDOM_BUFFER_SIZE)
+      ? ONION_RANDOM_BUFFER_SIZE : st->until_reseed;
+}
+
+#ifdef HAVE_PTHREADS
+static void onion_random_atfork_child() {
+  onion_random_fork_generation++;
+}
+#endif
 
 /**
  * @short Initializes the global random number generator
  * 
- * Initializes the global random number generator with some random seed.
+ * Each thread has its own generator, seeded from the system on first use, so there is
+ * no lock at onion_random_generate.
  *
  * onion_random_free() must be called later to free up used memory.
  *
@@ -52,27 +173,13 @@ static size_t onion_random_refcount = 0;
  */
 void onion_random_init() {
   onion_random_refcount_mutex_lock();
-  if (onion_random_refcount == 0) {
-    int fd = open("/dev/random", O_RDONLY);
-    if (fd < 0) {
-      ONION_WARNING
-          ("Unsecure random number generation; could not open /dev/random to feed the seed");
-      // Just in case nobody elses do it... If somebody else do it, then no problem.
-      srand(time(NULL));
-    } else {
-      unsigned int sr;
-      ssize_t n;
-      n = read(fd, &sr, sizeof(sr));
-      if (n != sizeof(sr)) {
-        ONION_ERROR
-            ("Error reading seed value from /dev/random after file descriptor opened");
-        exit(1);
-      } else {
-        close(fd);
-        srand(sr);
-      }
-    }
+#ifdef HAVE_PTHREADS
+  static int atfork_registered = 0;
+  if (!atfork_registered) {
+    pthread_atfork(NULL, NULL, onion_random_atfork_child);
+    atfork_registered = 1;
   }
+#endif
   onion_random_refcount++;
   onion_random_refcount_mutex_unlock();
 }
@@ -92,18 +199,41 @@ void onion_random_free() {
   }
   onion_random_refcount_mutex_unlock();
 
-  //rand() based implementatio does nothing actually, just checks if refcount is ok
+  // Thread generators are not shared, nothing to do
 }
 
 /**
  * @short Generates random data
  *
- * Generate size bytes of random data and put on data
+ * Generate size bytes of cryptographically secure random data and put on data.
+ *
+ * Uses the generator of the current thread; it is reseeded from the system every
+ * ONION_RANDOM_RESEED_BYTES, and after fork.
  */
 void onion_random_generate(void *data, size_t size) {
+  onion_random_state *st = &onion_random_thread_state;
   unsigned char *data_char = data;
-  size_t i;
-  for (i = 0; i < size; ++i) {
-    data_char[i] = rand();
+#ifndef HAVE_PTHREADS
+  static pid_t pid = 0;         // Without atfork, check the pid.
+  if (pid != getpid()) {
+    pid = getpid();
+    onion_random_fork_generation++;
+  }
+#endif
+  if (st->fork_generation != onion_random_fork_generation)
+    onion_random_reseed(st);
+  while (size) {
+    if (!st->available) {
+      if (!st->until_reseed)
+        onion_random_reseed(st);
+      onion_random_refill(st);
+    }
+    size_t n = (size < st->available) ? size : st->available;
+    unsigned char *from = st->buffer + ONION_RANDOM_BUFFER_SIZE - st->available;
+    memcpy(data_char, from, n);
+    memset(from, 0, n);         // Not kept after returned
+    st->available -= n;
+    data_char += n;
+    size -= n;
   }
 }
@@ -38,10 +38,23 @@
 #include "ptr_list.h"
 #include "poller.h"
 #include "utils.h"
+#include "codecs.h"
+#include "headers.h"
+#include "metrics.h"
 
 /// @defgroup request Request. Access all information from client request: path, GET, POST, cookies, session...
 
 void onion_request_parser_data_free(void *token);       // At request_parser.c
+// Admission control, at onion.c
+int onion_admit_request(onion * server, onion_request * req);
+void onion_release_request(onion * server, onion_request * req);
+void onion_release_connection(onion * server, onion_request * req);
+int onion_http_write_batch_end(onion_request * req);    // At http.c
+
+/// Initial size of the raw headers block. Most requests headers fit, so there are no reallocs while parsing.
+#define ONION_REQUEST_HEADERS_DATA_SIZE 1024
+/// Initial number of entries at the headers index.
+#define ONION_REQUEST_HEADERS_INDEX_SIZE 16
 
 /**
  * @memberof onion_request_t
@@ -69,13 +82,17 @@ const char *onion_request_methods[16] = {
 onion_request *onion_request_new(onion_listen_point * op) {
   onion_request *req;
   req = onion_low_calloc(1, sizeof(onion_request));
+  onion_metrics_connection_opened();
 
   req->connection.listen_point = op;
   req->connection.fd = -1;
+  req->query_count = -1;
+  req->cookies_count = -1;
+  req->content_length = -1;
 
   //req->connection=con;
-  req->headers = onion_dict_new();
-  onion_dict_set_flags(req->headers, OD_ICASE);
+  req->headers_data = onion_block_new();
+  onion_block_min_maxsize(req->headers_data, ONION_REQUEST_HEADERS_DATA_SIZE);
   ONION_DEBUG0("Create request %p", req);
 
   if (op) {
@@ -85,8 +102,11 @@ onion_request *onion_request_new(onion_listen_point * op) {
         onion_request_free(req);
         return NULL;
       }
-    } else
-      onion_listen_point_request_init_from_socket(req);
+    } else if (onion_listen_point_request_init_from_socket(req) < 0) {
+      ONION_DEBUG("Could not accept, closing");
+      onion_request_free(req);
+      return NULL;
+    }
   }
   return req;
 }
@@ -113,6 +133,30 @@ static void unlink_files(void *p, const char *key, const char *value, int flags)
   unlink(value);
 }
 
+/**
+ * @short Saves the session if modified, and dereferences it.
+ * @memberof onion_request_t
+ * @ingroup request
+ *
+ * Empty sessions are removed. Sessions not modified since loaded are not saved
+ * again, so read only requests do not cost a write at the backend.
+ */
+static void onion_request_session_release(onion_request * req) {
+  if (onion_dict_count(req->session) == 0) {
+    onion_request_session_free(req);
+    return;
+  }
+  if (onion_dict_generation(req->session) != req->session_generation)
+    onion_sessions_save(req->connection.listen_point->server->sessions,
+                        req->session_id, req->session);
+  else
+    ONION_DEBUG0("Session %s not modified, not saving", req->session_id);
+  onion_dict_free(req->session);        // Not really remove, just dereference
+  req->session = NULL;
+  onion_low_free(req->session_id);
+  req->session_id = NULL;
+}
+
 /**
  * @short Deletes a request and all its data
  * @memberof onion_request_t
@@ -120,7 +164,15 @@ static void unlink_files(void *p, const char *key, const char *value, int flags)
  */
 void onion_request_free(onion_request * req) {
   ONION_DEBUG0("Free request %p", req);
-  onion_dict_free(req->headers);
+  if (req->connection.listen_point && req->connection.listen_point->server) {
+    onion_release_request(req->connection.listen_point->server, req);
+    onion_release_connection(req->connection.listen_point->server, req);
+  }
+  if (req->headers)
+    onion_dict_free(req->headers);
+  onion_block_free(req->headers_data);
+  if (req->headers_index)
+    onion_low_free(req->headers_index);
 
   if (req->connection.listen_point != NULL
       && req->connection.listen_point->close)
@@ -129,26 +181,24 @@ void onion_request_free(onion_request * req) {
     onion_low_free(req->fullpath);
   if (req->GET)
     onion_dict_free(req->GET);
+  if (req->query_slices)
+    onion_low_free(req->query_slices);
   if (req->POST)
     onion_dict_free(req->POST);
   if (req->FILES) {
     onion_dict_preorder(req->FILES, unlink_files, NULL);
     onion_dict_free(req->FILES);
   }
-  if (req->session) {
-    if (onion_dict_count(req->session) == 0)
-      onion_request_session_free(req);
-    else {
-      onion_sessions_save(req->connection.listen_point->server->sessions,
-                          req->session_id, req->session);
-      onion_dict_free(req->session);    // Not really remove, just dereference
-      onion_low_free(req->session_id);
-    }
-  }
+  if (req->session)
+    onion_request_session_release(req);
   if (req->data)
     onion_block_free(req->data);
   if (req->connection.cli_info)
     onion_low_free(req->connection.cli_info);
+  if (req->connection.read_buffer)
+    onion_low_free(req->connection.read_buffer);
+  if (req->connection.write_batch)
+    onion_block_free(req->connection.write_batch);
 
   if (req->websocket)
     onion_websocket_free(req->websocket);
@@ -158,11 +208,16 @@ void onion_request_free(onion_request * req) {
 
   if (req->cookies)
     onion_dict_free(req->cookies);
+  if (req->cookies_slices)
+    onion_low_free(req->cookies_slices);
+  if (req->cookies_data)
+    onion_low_free(req->cookies_data);
   if (req->free_list) {
     onion_ptr_list_foreach(req->free_list, onion_low_free);
     onion_ptr_list_free(req->free_list);
   }
   onion_low_free(req);
+  onion_metrics_connection_closed();
 }
 
 /**
@@ -172,9 +227,16 @@ void onion_request_free(onion_request * req) {
  */
 void onion_request_clean(onion_request * req) {
   ONION_DEBUG0("Clean request %p", req);
-  onion_dict_free(req->headers);
-  req->headers = onion_dict_new();
-  onion_dict_set_flags(req->headers, OD_ICASE);
+  if (req->headers) {
+    onion_dict_free(req->headers);
+    req->headers = NULL;
+  }
+  onion_block_clear(req->headers_data);       // Keep the memory for next request
+  req->headers_count = 0;
+  memset(req->known_headers, 0, sizeof(req->known_headers));
+  req->content_length = -1;
+  if (req->flags & OR_IN_FLIGHT)        // Yielded, and finished now.
+    onion_release_request(req->connection.listen_point->server, req);
   req->flags &= OR_NO_KEEP_ALIVE;       // I keep keep alive.
   if (req->parser_data) {
     onion_request_parser_data_free(req->parser_data);
@@ -188,6 +250,12 @@ void onion_request_clean(onion_request * req) {
     onion_dict_free(req->GET);
     req->GET = NULL;
   }
+  if (req->query_slices) {
+    onion_low_free(req->query_slices);
+    req->query_slices = NULL;
+  }
+  req->query = NULL;
+  req->query_count = -1;
   if (req->POST) {
     onion_dict_free(req->POST);
     req->POST = NULL;
@@ -197,18 +265,8 @@ void onion_request_clean(onion_request * req) {
     onion_dict_free(req->FILES);
     req->FILES = NULL;
   }
-  if (req->session_id) {
-    if (onion_dict_count(req->session) == 0) {
-      onion_request_session_free(req);
-    } else {
-      onion_sessions_save(req->connection.listen_point->server->sessions,
-                          req->session_id, req->session);
-      onion_dict_free(req->session);    // Not really remove, just dereference
-      req->session = NULL;
-      onion_low_free(req->session_id);
-      req->session_id = NULL;
-    }
-  }
+  if (req->session_id)
+    onion_request_session_release(req);
   if (req->data) {
     onion_block_free(req->data);
     req->data = NULL;
@@ -221,6 +279,17 @@ void onion_request_clean(onion_request * req) {
     onion_dict_free(req->cookies);
     req->cookies = NULL;
   }
+  if (req->cookies_slices) {
+    onion_low_free(req->cookies_slices);
+    req->cookies_slices = NULL;
+  }
+  if (req->cookies_data) {
+    onion_low_free(req->cookies_data);
+    req->cookies_data = NULL;
+  }
+  req->cookies_count = -1;
+  req->yield_callback = NULL;
+  req->yield_data = NULL;
   if (req->free_list) {
     onion_ptr_list_foreach(req->free_list, onion_low_free);
     onion_ptr_list_free(req->free_list);
@@ -266,24 +335,251 @@ void onion_request_advance_path(onion_request * req, off_t addtopos) {
     req->path = &req->path[addtopos];
 }
 
+/**
+ * @short Adds the key of a new header to the raw headers block
+ * @memberof onion_request_t
+ * @ingroup request
+ *
+ * Used by the parser, as the key is known before the value.
+ *
+ * @returns The offset of the key, to use at onion_request_header_add_value.
+ */
+int onion_request_header_add_key(onion_request * req, const char *key) {
+  int offset = onion_block_size(req->headers_data);
+  onion_block_add_data(req->headers_data, key, strlen(key) + 1);
+  return offset;
+}
+
+/**
+ * @short Adds the value for a key previously added with onion_request_header_add_key
+ * @memberof onion_request_t
+ * @ingroup request
+ */
+void onion_request_header_add_value(onion_request * req, int key,
+                                    const char *value) {
+  onion_header id = onion_header_id(&req->headers_data->data[key]);
+  if (id == OH_CONTENT_LENGTH && req->content_length < 0)
+    req->content_length = atol(value);
+
+  if (req->headers) {           // Already materialized, keep it up to date.
+    onion_dict_add(req->headers, &req->headers_data->data[key], value,
+                   OD_DUP_ALL);
+    return;
+  }
+  if (req->headers_count >= req->headers_index_size) {
+    req->headers_index_size = req->headers_index_size
+        ? req->headers_index_size * 2 : ONION_REQUEST_HEADERS_INDEX_SIZE;
+    req->headers_index =
+        onion_low_realloc(req->headers_index,
+                          req->headers_index_size *
+                          sizeof(onion_request_header_index));
+  }
+  onion_request_header_index *idx = &req->headers_index[req->headers_count++];
+  idx->key = key;
+  idx->value = onion_block_size(req->headers_data);
+  if (id != OH_UNKNOWN && !req->known_headers[id])      // First one wins, as on lookup
+    req->known_headers[id] = idx->value + 1;
+  onion_block_add_data(req->headers_data, value, strlen(value) + 1);
+}
+
+/**
+ * @short Adds a header to the request
+ * @memberof onion_request_t
+ * @ingroup request
+ *
+ * Normally headers are set by the parser, but this allows handlers (and
+ * tests) to set them too. Key and value are copied.
+ *
+ * Pointers previously returned by onion_request_get_header may be
+ * invalidated.
+ */
+void onion_request_add_header(onion_request * req, const char *key,
+                              const char *value) {
+  int k = onion_request_header_add_key(req, key);
+  onion_request_header_add_value(req, k, value);
+}
+
 /**
  * @short Gets a header data
  * @memberof onion_request_t
  * @ingroup request
+ *
+ * Looks at the raw headers index, so no dict is created. If there are
+ * repeated headers, returns the first one.
+ *
+ * For well known headers onion_request_get_header_id is faster.
  */
 const char *onion_request_get_header(onion_request * req, const char *header) {
-  return onion_dict_get(req->headers, header);
+  if (req->headers)
+    return onion_dict_get(req->headers, header);
+  onion_header id = onion_header_id(header);
+  if (id != OH_UNKNOWN)
+    return onion_request_get_header_id(req, id);
+  const char *data = req->headers_data->data;
+  int i;
+  for (i = 0; i < req->headers_count; i++) {
+    if (strcasecmp(&data[req->headers_index[i].key], header) == 0)
+      return &data[req->headers_index[i].value];
+  }
+  return NULL;
+}
+
+/**
+ * @short Gets a well known header data
+ * @memberof onion_request_t
+ * @ingroup request
+ *
+ * Well known headers are resolved while parsing, so this needs no string
+ * comparisons.
+ *
+ * @returns The header value, or NULL if not present.
+ */
+const char *onion_request_get_header_id(onion_request * req, onion_header id) {
+  if (id < 0 || id >= OH_COUNT)
+    return NULL;
+  if (req->headers)
+    return onion_dict_get(req->headers, onion_header_name(id));
+  if (!req->known_headers[id])
+    return NULL;
+  return &req->headers_data->data[req->known_headers[id] - 1];
+}
+
+/**
+ * @short Gets the Content-Length of the request, as a number
+ * @memberof onion_request_t
+ * @ingroup request
+ *
+ * @returns The length, or -1 if there is no Content-Length header.
+ */
+long onion_request_get_content_length(onion_request * req) {
+  return req->content_length;
+}
+
+/**
+ * @short Counts the slices needed for str, separated by sep
+ */
+static int onion_request_count_slices(const char *str, char sep) {
+  int n = 1;
+  while (*str) {
+    if (*str == sep)
+      n++;
+    str++;
+  }
+  return n;
+}
+
+/**
+ * @short Splits the query inplace into slices, the first time its needed.
+ * @memberof onion_request_t
+ * @ingroup request
+ *
+ * Its unquoted inplace and stored as key/value pointers into the original
+ * query string, so there is only one allocation for all the keys.
+ */
+static void onion_request_parse_query_slices(onion_request * req) {
+  if (req->query_count >= 0)
+    return;
+  req->query_count = 0;
+  if (!req->query || !*req->query)
+    return;
+
+  req->query_slices =
+      onion_low_malloc(onion_request_count_slices(req->query, '&') *
+                       sizeof(onion_request_slice));
+  char *p = req->query;
+  while (p) {
+    char *key = p;
+    p = strchr(p, '&');
+    if (p)
+      *p++ = '\0';
+    if (!*key)
+      continue;
+    onion_request_slice *slice = &req->query_slices[req->query_count++];
+    char *value = strchr(key, '=');
+    if (value) {
+      *value++ = '\0';
+      onion_unquote_inplace(value);
+      slice->value = value;
+    } else
+      slice->value = "";
+    onion_unquote_inplace(key);
+    slice->key = key;
+    ONION_DEBUG0("Query slice <%s>=<%s>", slice->key, slice->value);
+  }
+}
+
+/**
+ * @short Splits the Cookie header into slices, the first time its needed.
+ * @memberof onion_request_t
+ * @ingroup request
+ *
+ * The header is copied once, and split inplace on that copy.
+ */
+static void onion_request_parse_cookies_slices(onion_request * req) {
+  if (req->cookies_count >= 0)
+    return;
+  req->cookies_count = 0;
+  const char *ccookies = onion_request_get_header_id(req, OH_COOKIE);
+  if (!ccookies || !*ccookies)
+    return;
+
+  req->cookies_data = onion_low_strdup(ccookies);
+  req->cookies_slices =
+      onion_low_malloc(onion_request_count_slices(ccookies, ';') *
+                       sizeof(onion_request_slice));
+  char *p = req->cookies_data;
+  while (p) {
+    char *key = p;
+    p = strchr(p, ';');
+    if (p)
+      *p++ = '\0';
+    while (*key == ' ')
+      key++;
+    char *value = strchr(key, '=');
+    if (!value || value == key)
+      continue;
+    *value++ = '\0';
+    onion_request_slice *slice = &req->cookies_slices[req->cookies_count++];
+    slice->key = key;
+    slice->value = value;
+    ONION_DEBUG0("Add cookie <%s>=<%s>", key, value);
+  }
+}
+
+/// Looks for key at the slices. Linear, but normally there are only a few.
+static const char *onion_request_slices_get(const onion_request_slice * slices,
+                                            int count, const char *key) {
+  int i;
+  for (i = 0; i < count; i++) {
+    if (strcmp(slices[i].key, key) == 0)
+      return slices[i].value;
+  }
+  return NULL;
+}
+
+/// Creates a dict that points to the slices data, no copies.
+static onion_dict *onion_request_slices_to_dict(const onion_request_slice *
+                                                slices, int count) {
+  onion_dict *ret = onion_dict_new();
+  int i;
+  for (i = 0; i < count; i++)
+    onion_dict_add(ret, slices[i].key, slices[i].value, 0);
+  return ret;
 }
 
 /**
  * @short Gets a query data
  * @memberof onion_request_t
  * @ingroup request
+ *
+ * The query is parsed on first use, so requests that never check the query
+ * do not pay for it.
  */
 const char *onion_request_get_query(onion_request * req, const char *query) {
-  if (req->GET)
+  if (req->GET)                 // Once created, the dict may have more data (url groups)
     return onion_dict_get(req->GET, query);
-  return NULL;
+  onion_request_parse_query_slices(req);
+  return onion_request_slices_get(req->query_slices, req->query_count, query);
 }
 
 /**
@@ -336,8 +632,20 @@ const char *onion_request_get_session(onion_request * req, const char *key) {
  * @short Gets the header header data dict
  * @memberof onion_request_t
  * @ingroup request
+ *
+ * First call it generates the dict from the raw headers, and from then on
+ * it is used for all header access.
  */
 const onion_dict *onion_request_get_header_dict(onion_request * req) {
+  if (!req->headers) {
+    req->headers = onion_dict_new();
+    onion_dict_set_flags(req->headers, OD_ICASE);
+    const char *data = req->headers_data->data;
+    int i;
+    for (i = 0; i < req->headers_count; i++)
+      onion_dict_add(req->headers, &data[req->headers_index[i].key],
+                     &data[req->headers_index[i].value], OD_DUP_ALL);
+  }
   return req->headers;
 }
 
@@ -345,8 +653,15 @@ const onion_dict *onion_request_get_header_dict(onion_request * req) {
  * @short Gets request query dict
  * @memberof onion_request_t
  * @ingroup request
+ *
+ * First call it generates the dict. It might be empty.
  */
 const onion_dict *onion_request_get_query_dict(onion_request * req) {
+  if (!req->GET) {
+    onion_request_parse_query_slices(req);
+    req->GET =
+        onion_request_slices_to_dict(req->query_slices, req->query_count);
+  }
   return req->GET;
 }
 
@@ -376,7 +691,7 @@ const onion_dict *onion_request_get_file_dict(onion_request * req) {
 void onion_request_guess_session_id(onion_request * req) {
   if (req->session_id)          // already known.
     return;
-  const char *ov = onion_dict_get(req->headers, "Cookie");
+  const char *ov = onion_request_get_header_id(req, OH_COOKIE);
   const char *v = ov;
   ONION_DEBUG("Session ID, maybe from %s", v);
   char *r = NULL;
@@ -410,6 +725,7 @@ void onion_request_guess_session_id(onion_request * req) {
 
   req->session_id = r;
   req->session = session;
+  req->session_generation = onion_dict_generation(session);
   ONION_DEBUG("Session ID, from cookie, is %s", req->session_id);
 }
 
@@ -444,6 +760,7 @@ onion_dict *onion_request_get_session_dict(onion_request * req) {
       req->session =
           onion_sessions_get(req->connection.listen_point->server->sessions,
                              req->session_id);
+      req->session_generation = onion_dict_generation(req->session);
     }
   }
   return req->session;
@@ -467,17 +784,20 @@ void onion_request_set_no_keep_alive(onion_request * req) {
  * @ingroup request
  *
  * It is a complex set of circumstances: HTTP/1.1 and no connection: close, or HTTP/1.0 and connection: keep-alive
- * and no explicit set that no keep alive.
+ * and no explicit set that no keep alive, and the server not draining.
  */
 int onion_request_keep_alive(onion_request * req) {
   if (req->flags & OR_NO_KEEP_ALIVE)
     return 0;
+  onion_listen_point *op = req->connection.listen_point;
+  if (op && op->server && (op->server->flags & O_DRAINING))
+    return 0;
   if (req->flags & OR_HTTP11) {
-    const char *connection = onion_request_get_header(req, "Connection");
+    const char *connection = onion_request_get_header_id(req, OH_CONNECTION);
     if (!connection || strcasecmp(connection, "Close") != 0)    // Other side wants keep alive
       return 1;
   } else {                      // HTTP/1.0
-    const char *connection = onion_request_get_header(req, "Connection");
+    const char *connection = onion_request_get_header_id(req, OH_CONNECTION);
     if (connection && strcasecmp(connection, "Keep-Alive") == 0)        // Other side wants keep alive
       return 1;
   }
@@ -522,7 +842,7 @@ void onion_request_session_free(onion_request * req) {
  * @returns The language code for this request or C. Data must be freed.
  */
 const char *onion_request_get_language_code(onion_request * req) {
-  const char *lang = onion_dict_get(req->headers, "Accept-Language");
+  const char *lang = onion_request_get_header_id(req, OH_ACCEPT_LANGUAGE);
   if (lang) {
     char *l = onion_low_strdup(lang);
     char *p = l;
@@ -548,6 +868,26 @@ const onion_block *onion_request_get_data(onion_request * req) {
   return req->data;
 }
 
+/**
+ * @short Answers 503 Service Unavailable, as the server is over its limit of requests in process.
+ * @ingroup request
+ *
+ * The handlers are not called, and the connection is closed after the answer.
+ */
+static onion_connection_status onion_request_overloaded(onion_request * req,
+                                                        onion_response * res) {
+  onion *server = req->connection.listen_point->server;
+  onion_metrics_request_rejected();
+  onion_request_set_no_keep_alive(req);
+  onion_response_set_code(res, HTTP_SERVICE_UNAVAILABLE);
+  onion_response_set_header(res, "Retry-After", server->retry_after);
+  onion_response_set_header_id(res, OH_CONTENT_TYPE, "text/plain");
+  onion_response_write_headers(res);    // Now, so it says Connection: Close.
+  onion_response_write(res, ONION_OVERLOAD_MESSAGE,
+                       sizeof(ONION_OVERLOAD_MESSAGE) - 1);
+  return OCS_PROCESSED;
+}
+
 /**
  * @short Launches one handler for the given request
  * @ingroup request
@@ -557,14 +897,18 @@ const onion_block *onion_request_get_data(onion_request * req) {
  * @returns The connection status: if it should be closed, error codes...
  */
 onion_connection_status onion_request_process(onion_request * req) {
+  uint64_t start = req->process_start = onion_metrics_now();
+  onion *server = req->connection.listen_point->server;
   onion_response *res = onion_response_new(req);
   if (!req->path) {
     onion_request_polish(req);
   }
-  // Call the main handler.
-  onion_connection_status hs =
-      onion_handler_handle(req->connection.listen_point->server->root_handler,
-                           req, res);
+  // Call the main handler, if not over the limit of requests in process.
+  onion_connection_status hs;
+  if (onion_admit_request(server, req) < 0)
+    hs = onion_request_overloaded(req, res);
+  else
+    hs = onion_handler_handle(server->root_handler, req, res);
 
   if (hs == OCS_INTERNAL_ERROR ||
       hs == OCS_NOT_IMPLEMENTED || hs == OCS_NOT_PROCESSED) {
@@ -582,15 +926,28 @@ onion_connection_status onion_request_process(onion_request * req) {
   }
 
   if (hs == OCS_YIELD) {
+    // Pipelined output must be written before any other thread may write to this connection.
+    // On error the yielded writes fail too, and close it.
+    onion_http_write_batch_end(req);
     // Remove from the poller, and yield thread to poller. From now on it will be processed somewhere else (longpoll thread).
     onion_poller *poller =
         onion_get_poller(req->connection.listen_point->server);
     onion_poller_slot *slot = onion_poller_get(poller, req->connection.fd);
-    onion_poller_slot_set_shutdown(slot, NULL, NULL);
+    void (*yield_callback) (void *) = req->yield_callback;
+    void *yield_data = req->yield_data;
+    req->yield_callback = NULL;
+    req->yield_data = NULL;
+    if (slot)
+      onion_poller_slot_set_shutdown(slot, yield_callback, yield_data);
+    else if (yield_callback)    // Not polled (no fd), so it is already detached.
+      yield_callback(yield_data);
 
+    onion_metrics_request_done(start, 1);
     return hs;
   }
+  onion_release_request(server, req);
   int rs = onion_response_free(res);
+  onion_metrics_request_done(start, 0);
   if (hs >= 0 && rs == OCS_KEEP_ALIVE)  // if keep alive, reset struct to get the new request.
     onion_request_clean(req);
   return hs > 0 ? rs : hs;
@@ -633,6 +990,39 @@ const char *onion_request_get_client_description(onion_request * req) {
   return req->connection.cli_info;
 }
 
+/**
+ * @short Sets a function to be called when this request, after yielding, is detached from the poller.
+ * @memberof onion_request_t
+ * @ingroup request
+ *
+ * When a handler returns OCS_YIELD the request is still owned by the poller thread until
+ * it is removed from the poller, some time after the handler returns. Only after that it
+ * is safe to write to and free the request and response from another thread.
+ *
+ * The callback is called just once, at that moment. If the handler does not return OCS_YIELD
+ * it is never called.
+ *
+ * @param req Request that will yield
+ * @param f Function to call
+ * @param data Parameter for the function
+ */
+void onion_request_set_yield_callback(onion_request * req, void (*f) (void *),
+                                      void *data) {
+  req->yield_callback = f;
+  req->yield_data = data;
+}
+
+/**
+ * @short Returns the server this request arrived at.
+ * @memberof onion_request_t
+ * @ingroup request
+ */
+onion *onion_request_get_server(onion_request * req) {
+  if (!req->connection.listen_point)
+    return NULL;
+  return req->connection.listen_point->server;
+}
+
 /**
  * @short Returns the sockaddr_storage pointer to the data client data as stored here.
  * @memberof onion_request_t
@@ -664,49 +1054,11 @@ struct sockaddr_storage *onion_request_get_sockadd_storage(onion_request * req,
  * First call it generates the dict.
  */
 onion_dict *onion_request_get_cookies_dict(onion_request * req) {
-  if (req->cookies)
-    return req->cookies;
-
-  req->cookies = onion_dict_new();
-
-  const char *ccookies = onion_request_get_header(req, "Cookie");
-  if (!ccookies)
-    return req->cookies;
-  char *cookies = onion_low_strdup(ccookies);   // I prepare a temporary string, will modify it.
-  char *val = NULL;
-  char *key = NULL;
-  char *p = cookies;
-
-  int first = 1;
-  while (*p) {
-    if (*p != ' ' && !key && !val) {
-      key = p;
-    } else if (*p == '=' && key && !val) {
-      *p = 0;
-      val = p + 1;
-    } else if (*p == ';' && key && val) {
-      *p = 0;
-      if (first) {
-        // The first cookie is special as it is the pointer to the reserved area for all the keys and values
-        // for all th eother cookies, to free at dict free.
-        onion_dict_add(req->cookies, cookies, val, OD_FREE_KEY);
-        first = 0;
-      } else
-        onion_dict_add(req->cookies, key, val, 0);      /// Can use as static data as will be freed at first cookie free
-      ONION_DEBUG0("Add cookie <%s>=<%s> %d", key, val, first);
-      val = NULL;
-      key = NULL;
-    }
-    p++;
-  }
-  if (key && val && val < p) {  // A final element, with value.
-    if (first)
-      onion_dict_add(req->cookies, cookies, val, OD_FREE_KEY);
-    else
-      onion_dict_add(req->cookies, key, val, 0);
-    ONION_DEBUG0("Add cookie <%s>=<%s> %d", key, val, first);
+  if (!req->cookies) {
+    onion_request_parse_cookies_slices(req);
+    req->cookies =
+        onion_request_slices_to_dict(req->cookies_slices, req->cookies_count);
   }
-
   return req->cookies;
 }
 
@@ -722,8 +1074,11 @@ onion_dict *onion_request_get_cookies_dict(onion_request * req) {
  */
 const char *onion_request_get_cookie(onion_request * req,
                                      const char *cookiename) {
-  const onion_dict *cookies = onion_request_get_cookies_dict(req);
-  return onion_dict_get(cookies, cookiename);
+  if (req->cookies)
+    return onion_dict_get(req->cookies, cookiename);
+  onion_request_parse_cookies_slices(req);
+  return onion_request_slices_get(req->cookies_slices, req->cookies_count,
+                                  cookiename);
 }
 
 /// @ingroup request
@@ -60,6 +60,7 @@ extern "C" {
     /// Server flags are at 0x0F00.
     OR_NO_KEEP_ALIVE = 0x0100,
     OR_HEADER_SENT_ = 0x0200,   ///< Dup name from onion_response_flags, same meaning.
+    OR_IN_FLIGHT = 0x0400,      ///< Counted at the server limit of requests in process.
 
     /// Errors at 0x0F000.
     OR_INTERNAL_ERROR = 0x01000,
@@ -90,6 +91,12 @@ extern "C" {
   onion_connection_status onion_request_write(onion_request * req,
                                               const char *data, size_t length);
 
+/// As onion_request_write, but stops at the end of the request, to allow pipelining
+  onion_connection_status onion_request_write_partial(onion_request * req,
+                                                      const char *data,
+                                                      size_t length,
+                                                      size_t * consumed);
+
 /// Gets the current path
   const char *onion_request_get_path(onion_request * req);
 
@@ -104,9 +111,20 @@ extern "C" {
 
 /// @{ @name Get header, query, post, file data and session
 
+/// Adds a header to the request
+  void onion_request_add_header(onion_request * req, const char *key,
+                                const char *value);
+
 /// Gets a header data
   const char *onion_request_get_header(onion_request * req, const char *header);
 
+/// Gets a well known header data
+  const char *onion_request_get_header_id(onion_request * req,
+                                          onion_header id);
+
+/// Gets the Content-Length as a number, or -1
+  long onion_request_get_content_length(onion_request * req);
+
 /// Gets query data
   const char *onion_request_get_query(onion_request * req, const char *query);
 
@@ -182,6 +200,13 @@ extern "C" {
 
 /// Determine if the request was sent over a secure listen point
   bool onion_request_is_secure(onion_request * req);
+
+/// Sets a function to call when a request that returned OCS_YIELD is detached from the poller.
+  void onion_request_set_yield_callback(onion_request * req,
+                                        void (*f) (void *), void *data);
+
+/// Returns the server this request arrived at.
+  onion *onion_request_get_server(onion_request * req);
 #ifdef __cplusplus
 }
 #endif
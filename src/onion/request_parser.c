@@ -59,7 +59,8 @@ typedef struct onion_token_s {
   char str[256 * 4 * 8];
   off_t pos;
 
-  char *extra;                  // Only used when need some previous data, like at header value, i need the key
+  char *extra;                  // Only used when need some previous data, like POST data
+  int header_key;               // Offset of current header key at the raw headers, while reading the value
   size_t extra_size;
 } onion_token;
 
@@ -91,6 +92,8 @@ typedef struct onion_multipart_buffer_s {
   int fd;                       /// If file, the file descriptor.
 } onion_multipart_buffer;
 
+int onion_request_header_add_key(onion_request * req, const char *key);       // At request.c
+void onion_request_header_add_value(onion_request * req, int key, const char *value);  // At request.c
 static void onion_request_parse_query_to_dict(onion_dict * dict, char *p);
 static int onion_request_parse_query(onion_request * req);
 static onion_connection_status prepare_POST(onion_request * req);
@@ -231,7 +234,7 @@ int token_read_URLENCODE(onion_token * token, onion_buffer * data) {
 
   memcpy(&token->extra[token->pos], &data->data[data->pos], l);
   token->pos += l;
-  data->size -= l;
+  data->pos += l;
 
   if (token->extra_size == token->pos) {
     token->extra[token->pos] = '\0';
@@ -763,9 +766,9 @@ parse_headers_VALUE_multiline_if_space(onion_request * req,
   while (is_space(*p))
     p++;
 
-  ONION_DEBUG0("Adding header %s : %s", token->extra, p);
-  onion_dict_add(req->headers, token->extra, p, OD_DUP_VALUE | OD_FREE_KEY);
-  token->extra = NULL;          // It will be freed at onion_dict_free.
+  ONION_DEBUG0("Adding header %s : %s",
+               &req->headers_data->data[token->header_key], p);
+  onion_request_header_add_value(req, token->header_key, p);
 
   req->parser = parse_headers_KEY;
   return OCS_NEED_MORE_DATA;    // Get back recursion if any, to prevent too long callstack (on long headers) and stack overflow.
@@ -795,7 +798,8 @@ static onion_connection_status parse_headers_KEY(onion_request * req,
 
   if (res == NEW_LINE) {
     if ((req->flags & OR_METHODS) == OR_POST) {
-      const char *content_type = onion_request_get_header(req, "Content-Type");
+      const char *content_type =
+          onion_request_get_header_id(req, OH_CONTENT_TYPE);
       if (content_type
           && (strstr(content_type, "application/x-www-form-urlencoded")
               || strstr(content_type, "boundary")))
@@ -803,16 +807,12 @@ static onion_connection_status parse_headers_KEY(onion_request * req,
     }
     if ((req->flags & OR_METHODS) == OR_PUT)
       return prepare_PUT(req);
-    if (onion_request_get_header(req, "Content-Length")) {      // Some length, not POST, get data.
-      int n = atoi(onion_request_get_header(req, "Content-Length"));
-      if (n > 0)
-        return prepare_CONTENT_LENGTH(req);
-    }
+    if (req->content_length > 0)        // Some length, not POST, get data.
+      return prepare_CONTENT_LENGTH(req);
 
     return OCS_REQUEST_READY;
   }
-  assert(token->extra == NULL);
-  token->extra = onion_low_strdup(token->str);
+  token->header_key = onion_request_header_add_key(req, token->str);
 
   req->parser = parse_headers_VALUE;
   return parse_headers_VALUE(req, data);
@@ -841,9 +841,6 @@ static onion_connection_status parse_headers_VERSION(onion_request * req,
   if (strcmp(token->str, "HTTP/1.1") == 0)
     req->flags |= OR_HTTP11;
 
-  if (!req->GET)
-    req->GET = onion_dict_new();
-
   if (res == STRING) {
     req->parser = parse_headers_KEY_skip_NL;
     return parse_headers_KEY_skip_NL(req, data);
@@ -877,6 +874,14 @@ static onion_connection_status parse_headers_URL(onion_request * req,
 static onion_connection_status parse_headers_GET(onion_request * req,
                                                  onion_buffer * data) {
   onion_token *token = req->parser_data;
+  // Empty lines before the request line should be ignored (RFC 7230 3.5). Some clients send them after a POST body.
+  if (token->pos == 0) {
+    while (data->pos < data->size
+           && (data->data[data->pos] == '\r' || data->data[data->pos] == '\n'))
+      data->pos++;
+    if (data->pos >= data->size)
+      return OCS_NEED_MORE_DATA;
+  }
   int res = token_read_STRING(token, data);
 
   if (res <= 1000)
@@ -911,6 +916,26 @@ static onion_connection_status parse_headers_GET(onion_request * req,
  */
 onion_connection_status onion_request_write(onion_request * req,
                                             const char *data, size_t size) {
+  size_t consumed;
+  return onion_request_write_partial(req, data, size, &consumed);
+}
+
+/**
+ * @short Write some data into the request, and tells how much of it was used.
+ * @memberof onion_request_t
+ * @ingroup request
+ *
+ * As onion_request_write, but when a request is complete it sets at consumed
+ * where it ends. The rest of the data, if any, is the start of the next pipelined
+ * request, and should be written again after the request is processed.
+ *
+ * @param consumed Bytes used of data. Only valid if returns OCS_REQUEST_READY, on OCS_NEED_MORE_DATA it is always size.
+ */
+onion_connection_status onion_request_write_partial(onion_request * req,
+                                                    const char *data,
+                                                    size_t size,
+                                                    size_t * consumed) {
+  *consumed = size;
   if (!req->parser_data) {
     req->parser_data = onion_low_calloc(1, sizeof(onion_token));
     req->parser = parse_headers_GET;
@@ -924,6 +949,7 @@ onion_connection_status onion_request_write(onion_request * req,
     while (odata.size > odata.pos) {
       int r = parse(req, &odata);
       if (r != OCS_NEED_MORE_DATA) {
+        *consumed = odata.pos;
         return r;
       }
       parse = req->parser;
@@ -940,8 +966,6 @@ onion_connection_status onion_request_write(onion_request * req,
 static int onion_request_parse_query(onion_request * req) {
   if (!req->fullpath)
     return 0;
-  if (req->GET)                 // already done
-    return 1;
 
   char *p = req->fullpath;
   char have_query = 0;
@@ -954,11 +978,8 @@ static int onion_request_parse_query(onion_request * req) {
   }
   *p = '\0';
   onion_unquote_inplace(req->fullpath);
-  if (have_query) {             // There are querys.
-    p++;
-    req->GET = onion_dict_new();
-    onion_request_parse_query_to_dict(req->GET, p);
-  }
+  if (have_query)               // There are querys. Parsed lazily at onion_request_get_query.
+    req->query = p + 1;
   return 1;
 }
 
@@ -1019,14 +1040,13 @@ static void onion_request_parse_query_to_dict(onion_dict * dict, char *p) {
 static onion_connection_status prepare_POST(onion_request * req) {
   // ok post
   onion_token *token = req->parser_data;
-  const char *content_type = onion_dict_get(req->headers, "Content-Type");
-  const char *content_size = onion_dict_get(req->headers, "Content-Length");
+  const char *content_type = onion_request_get_header_id(req, OH_CONTENT_TYPE);
 
-  if (!content_size) {
+  if (req->content_length < 0) {
     ONION_ERROR("I need the content size header to support POST data");
     return OCS_INTERNAL_ERROR;
   }
-  size_t cl = atol(content_size);
+  size_t cl = req->content_length;
   if (cl == 0)
     return OCS_REQUEST_READY;
 
@@ -1090,12 +1110,11 @@ static onion_connection_status prepare_POST(onion_request * req) {
  */
 static onion_connection_status prepare_CONTENT_LENGTH(onion_request * req) {
   onion_token *token = req->parser_data;
-  const char *content_size = onion_dict_get(req->headers, "Content-Length");
-  if (!content_size) {
+  if (req->content_length < 0) {
     ONION_ERROR("I need the Content-Length header to get data");
     return OCS_INTERNAL_ERROR;
   }
-  size_t cl = atol(content_size);
+  size_t cl = req->content_length;
 
   if (cl > req->connection.listen_point->server->max_post_size) {
     ONION_ERROR("Trying to set more data at server than allowed %d",
@@ -1121,12 +1140,11 @@ static onion_connection_status prepare_CONTENT_LENGTH(onion_request * req) {
  */
 static onion_connection_status prepare_PUT(onion_request * req) {
   onion_token *token = req->parser_data;
-  const char *content_size = onion_dict_get(req->headers, "Content-Length");
-  if (!content_size) {
+  if (req->content_length < 0) {
     ONION_ERROR("I need the Content-Length header to get data");
     return OCS_INTERNAL_ERROR;
   }
-  size_t cl = atol(content_size);
+  size_t cl = req->content_length;
 
   if (cl > req->connection.listen_point->server->max_file_size) {
     ONION_ERROR("Trying to PUT a file bigger than allowed size");
@@ -29,32 +29,43 @@
 #include <stdarg.h>
 #include <assert.h>
 
-#ifdef HAVE_PTHREADS
-#include <pthread.h>
-#endif
-
 #include "dict.h"
 #include "request.h"
 #include "response.h"
 #include "types_internal.h"
 #include "log.h"
 #include "codecs.h"
+#include "headers.h"
+#include "block.h"
 #include "low.h"
+#include "metrics.h"
+#include "access_log.h"
 
 /// @defgroup response Response. Write response data to client: headers, content body...
 
 const char *onion_response_code_description(int code);
 
+/// Text sent as Server header, unless the handler sets its own.
+#define ONION_RESPONSE_SERVER_HEADER "Server: libonion v" ONION_VERSION " - coralbits.com\r\n"
+
 // DONT_USE_DATE_HEADER is not defined anywhere, but here just in case needed in the future.
 
 #ifndef DONT_USE_DATE_HEADER
-static volatile time_t onion_response_last_time = 0;
-static char *onion_response_last_date_header = NULL;
-#ifdef HAVE_PTHREADS
-pthread_rwlock_t onion_response_date_lock = PTHREAD_RWLOCK_INITIALIZER;
-#endif
+/// Per thread cache of the full Date header line. Regenerated at most once per second.
+static __thread time_t onion_response_date_time = 0;
+static __thread char onion_response_date_header[64];
+static __thread int onion_response_date_length = 0;
 #endif
 
+/**
+ * @short A block of constant headers already serialized, ready to be copied at write_headers.
+ * @memberof onion_response_template_t
+ * @ingroup response
+ */
+struct onion_response_template_t {
+  onion_block *data;
+};
+
 /**
  * @short Generates a new response object
  * @memberof onion_response_t
@@ -87,61 +98,9 @@ onion_response *onion_response_new(onion_request * req) {
   res->sent_bytes_total = res->length = res->sent_bytes = 0;
   res->buffer_pos = 0;
 
-#ifndef DONT_USE_DATE_HEADER
-  {
-    time_t t;
-    struct tm tmp;
-
-    t = time(NULL);
-
-    // onion_response_last_date_header is set to t later. It should be more or less atomic.
-    // If not no big deal, as we will just use slightly more CPU on those "ephemeral" moments.
-
-    time_t current = __sync_add_and_fetch(&onion_response_last_time, 0);
-
-    if (t != current) {
-      ONION_DEBUG("Recalculating date header");
-      char current_datetime[200];
-
-      if (localtime_r(&t, &tmp) == NULL) {
-        perror("localtime");
-        exit(EXIT_FAILURE);
-      }
-
-      if (strftime
-          (current_datetime, sizeof(current_datetime),
-           "%a, %d %b %Y %H:%M:%S %Z", &tmp) == 0) {
-        fprintf(stderr, "strftime returned 0");
-        exit(EXIT_FAILURE);
-      }
-#ifdef HAVE_PTHREADS
-      pthread_rwlock_wrlock(&onion_response_date_lock);
-#endif
-      __sync_bool_compare_and_swap(&onion_response_last_time, current, t);
-      if (onion_response_last_date_header)
-        onion_low_free(onion_response_last_date_header);
-      onion_response_last_date_header = onion_low_strdup(current_datetime);
-#ifdef HAVE_PTHREADS
-      pthread_rwlock_unlock(&onion_response_date_lock);
-#endif
-    }
-  }
-#ifdef HAVE_PTHREADS
-  pthread_rwlock_rdlock(&onion_response_date_lock);
-#endif
-  assert(onion_response_last_date_header);
-  onion_dict_add(res->headers, "Date", onion_response_last_date_header,
-                 OD_DUP_VALUE);
-#ifdef HAVE_PTHREADS
-  pthread_rwlock_unlock(&onion_response_date_lock);
-#endif
-#endif                          // USE_DATE_HEADER
-  // Sorry for the advertisment.
-  onion_dict_add(res->headers, "Server",
-                 "libonion v" ONION_VERSION " - coralbits.com", 0);
-  onion_dict_add(res->headers, "Content-Type", "text/html", 0); // Maybe not the best guess, but really useful.
-  //time_t t=time(NULL);
-  //onion_dict_add(res->headers, "Date", asctime(localtime(&t)), OD_DUP_VALUE);
+  res->header_template = NULL;
+  // Date and Server are written directly at onion_response_write_headers.
+  onion_dict_add(res->headers, onion_header_name(OH_CONTENT_TYPE), "text/html", 0);   // Maybe not the best guess, but really useful.
 
   return res;
 }
@@ -161,8 +120,13 @@ onion_connection_status onion_response_free(onion_response * res) {
   if (!(res->flags & OR_HEADER_SENT) && res->buffer_pos < sizeof(res->buffer))
     onion_response_set_length(res, res->buffer_pos);
 
-  if (!(res->flags & OR_HEADER_SENT))
-    onion_response_write_headers(res);
+  // If there is pending data, flush moves it after the headers; else just write them.
+  if (!(res->flags & OR_HEADER_SENT)) {
+    if (res->buffer_pos == 0)
+      onion_response_write_headers(res);
+    else
+      onion_response_flush(res);
+  }
 
   onion_response_flush(res);
   onion_request *req = res->request;
@@ -186,14 +150,19 @@ onion_connection_status onion_response_free(onion_response * res) {
         )
       r = OCS_KEEP_ALIVE;
 
-    if ((onion_log_flags & OF_NOINFO) != OF_NOINFO)
-      // FIXME! This is no proper logging at all. Maybe use a handler.
+    onion *server =
+        req->connection.listen_point ? req->connection.listen_point->
+        server : NULL;
+    if (server && server->access_log)
+      onion_access_log_response(server->access_log, req, res);
+    else if ((onion_log_flags & OF_NOINFO) != OF_NOINFO)
       ONION_INFO("[%s] \"%s %s\" %d %d (%s)",
                  onion_request_get_client_description(res->request),
                  onion_request_methods[res->request->flags & OR_METHODS],
                  res->request->fullpath, res->code, res->sent_bytes,
                  (r == OCS_KEEP_ALIVE) ? "Keep-Alive" : "Close connection");
   }
+  onion_metrics_response_done(res->code, res->sent_bytes_total);
 
   onion_dict_free(res->headers);
   onion_low_free(res);
@@ -212,6 +181,40 @@ void onion_response_set_header(onion_response * res, const char *key,
   onion_dict_add(res->headers, key, value, OD_DUP_ALL | OD_REPLACE);    // DUP_ALL not so nice on memory side...
 }
 
+/**
+ * @short Adds a well known header to the response object
+ * @memberof onion_response_t
+ * @ingroup response
+ *
+ * Same as onion_response_set_header, but the key is the static canonical
+ * name, so only the value is copied.
+ */
+void onion_response_set_header_id(onion_response * res, onion_header id,
+                                  const char *value) {
+  const char *key = onion_header_name(id);
+  if (!key) {
+    ONION_ERROR("Invalid header id %d", id);
+    return;
+  }
+  ONION_DEBUG0("Adding header %s = %s", key, value);
+  onion_dict_add(res->headers, key, value, OD_DUP_VALUE | OD_REPLACE);
+}
+
+/**
+ * @short Gets a well known header from the response object
+ * @memberof onion_response_t
+ * @ingroup response
+ *
+ * @returns The value, or NULL if not set.
+ */
+const char *onion_response_get_header_id(onion_response * res,
+                                         onion_header id) {
+  const char *key = onion_header_name(id);
+  if (!key)
+    return NULL;
+  return onion_dict_get(res->headers, key);
+}
+
 /**
  * @short Sets the header length. Normally it should be through set_header, but as its very common and needs some procesing here is a shortcut
  * @memberof onion_response_t
@@ -225,11 +228,24 @@ void onion_response_set_length(onion_response * res, size_t len) {
   }
   char tmp[16];
   sprintf(tmp, "%lu", (unsigned long)len);
-  onion_response_set_header(res, "Content-Length", tmp);
+  onion_response_set_header_id(res, OH_CONTENT_LENGTH, tmp);
   res->length = len;
   res->flags |= OR_LENGTH_SET;
 }
 
+/**
+ * @short Gets the length set with onion_response_set_length
+ * @memberof onion_response_t
+ * @ingroup response
+ *
+ * @returns The length, or -1 if not set yet.
+ */
+long onion_response_get_length(onion_response * res) {
+  if (!(res->flags & OR_LENGTH_SET))
+    return -1;
+  return res->length;
+}
+
 /**
  * @short Sets the return code
  * @memberof onion_response_t
@@ -243,17 +259,134 @@ void onion_response_set_code(onion_response * res, int code) {
  * @short Helper that is called on each header, and writes the header
  * @memberof onion_response_t
  * @ingroup response
+ *
+ * If it fits, it is copied directly at the buffer in one go.
  */
 static void write_header(onion_response * res, const char *key,
                          const char *value, int flags) {
   //ONION_DEBUG0("Response header: %s: %s",key, value);
+  size_t kl = strlen(key);
+  size_t vl = strlen(value);
+  if (res->buffer_pos + kl + vl + 4 <= sizeof(res->buffer)) {
+    char *p = &res->buffer[res->buffer_pos];
+    memcpy(p, key, kl);
+    p += kl;
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy(p, value, vl);
+    p += vl;
+    *p++ = '\r';
+    *p++ = '\n';
+    res->buffer_pos += kl + vl + 4;
+    return;
+  }
 
-  onion_response_write0(res, key);
+  onion_response_write(res, key, kl);
   onion_response_write(res, ": ", 2);
-  onion_response_write0(res, value);
+  onion_response_write(res, value, vl);
   onion_response_write(res, "\r\n", 2);
 }
 
+/**
+ * @short Helper that is called on each header, and marks the well known ones at set_headers
+ * @memberof onion_response_t
+ * @ingroup response
+ *
+ * Header names are case insensitive, so a handler setting "date" overrides the default Date.
+ */
+static void find_set_header(int *set_headers, const char *key,
+                            const char *value, int flags) {
+  onion_header id = onion_header_id(key);
+  if (id != OH_UNKNOWN)
+    *set_headers |= 1 << id;
+}
+
+/// Status lines for the known codes, so they are not formatted at each response.
+static const struct {
+  int code;
+  const char *description;
+  const char *line;             ///< Status line after the "HTTP/1.x ".
+  int length;
+} onion_response_status_lines[] = {
+#define S(code, description) { code, description, #code " " description "\r\n", sizeof(#code " " description "\r\n") - 1 }
+  S(200, "OK"),
+  S(201, "Created"),
+  S(206, "Partial Content"),
+  S(207, "Multi-Status"),
+  S(101, "Switching Protocols"),
+  S(301, "Moved Permanently"),
+  S(302, "Found"),
+  S(303, "See Other"),
+  S(304, "Not Modified"),
+  S(307, "Temporary Redirect"),
+  S(400, "Bad Request"),
+  S(401, "Unauthorized"),
+  S(403, "Forbidden"),
+  S(404, "Not Found"),
+  S(405, "Method Not Allowed"),
+  S(500, "Internal Server Error"),
+  S(501, "Not Implemented"),
+  S(502, "Bad Gateway"),
+  S(503, "Service Unavailable"),
+#undef S
+};
+
+/// Returns the index at onion_response_status_lines, or -1 if unknown code.
+static int onion_response_status_index(int code) {
+  int i;
+  for (i = 0;
+       i <
+       sizeof(onion_response_status_lines) /
+       sizeof(onion_response_status_lines[0]); i++) {
+    if (onion_response_status_lines[i].code == code)
+      return i;
+  }
+  return -1;
+}
+
+/// Writes the status line, from the static table if possible.
+static void onion_response_write_status_line(onion_response * res, int http11) {
+  onion_response_write(res, http11 ? "HTTP/1.1 " : "HTTP/1.0 ", 9);
+  int i = onion_response_status_index(res->code);
+  if (i >= 0)
+    onion_response_write(res, onion_response_status_lines[i].line,
+                         onion_response_status_lines[i].length);
+  else
+    onion_response_printf(res, "%d CODE UNKNOWN\r\n", res->code);
+}
+
+#ifndef DONT_USE_DATE_HEADER
+/**
+ * @short Writes the Date header, using the per thread cache.
+ * @memberof onion_response_t
+ * @ingroup response
+ *
+ * Names are not taken from the locale, as HTTP dates are always in english and GMT.
+ */
+static void onion_response_write_date(onion_response * res) {
+  static const char *days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri",
+    "Sat"
+  };
+  static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+  };
+  time_t t = time(NULL);
+  if (t != onion_response_date_time) {
+    struct tm tmp;
+    gmtime_r(&t, &tmp);
+    onion_response_date_length =
+        snprintf(onion_response_date_header,
+                 sizeof(onion_response_date_header),
+                 "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n",
+                 days[tmp.tm_wday], tmp.tm_mday, months[tmp.tm_mon],
+                 tmp.tm_year + 1900, tmp.tm_hour, tmp.tm_min, tmp.tm_sec);
+    onion_response_date_time = t;
+  }
+  onion_response_write(res, onion_response_date_header,
+                       onion_response_date_length);
+}
+#endif
+
 #define CONNECTION_CLOSE "Connection: Close\r\n"
 #define CONNECTION_KEEP_ALIVE "Connection: Keep-Alive\r\n"
 #define CONNECTION_CHUNK_ENCODING "Transfer-Encoding: chunked\r\n"
@@ -285,19 +418,18 @@ int onion_response_write_headers(onion_response * res) {
   res->request->flags |= OR_HEADER_SENT;
   char chunked = 0;
 
+  onion_response_write_status_line(res, res->request->flags & OR_HTTP11);
   if (res->request->flags & OR_HTTP11) {
-    onion_response_printf(res, "HTTP/1.1 %d %s\r\n", res->code,
-                          onion_response_code_description(res->code));
-    //ONION_DEBUG("Response header: HTTP/1.1 %d %s\n",res->code, onion_response_code_description(res->code));
-    if (!(res->flags & OR_LENGTH_SET) && onion_request_keep_alive(res->request)) {
+    int keep_alive = onion_request_keep_alive(res->request);
+    if (!(res->flags & OR_LENGTH_SET) && keep_alive) {
       onion_response_write(res, CONNECTION_CHUNK_ENCODING,
                            sizeof(CONNECTION_CHUNK_ENCODING) - 1);
       chunked = 1;
-    }
+    } else if ((res->flags & OR_LENGTH_SET) && !keep_alive
+               && !(res->flags & OR_CONNECTION_UPGRADE))
+      // Default on HTTP/1.1 is keep alive, so tell the client, as when draining.
+      onion_response_write(res, CONNECTION_CLOSE, sizeof(CONNECTION_CLOSE) - 1);
   } else {
-    onion_response_printf(res, "HTTP/1.0 %d %s\r\n", res->code,
-                          onion_response_code_description(res->code));
-    //ONION_DEBUG("Response header: HTTP/1.0 %d %s\n",res->code, onion_response_code_description(res->code));
     if (res->flags & OR_LENGTH_SET)     // On HTTP/1.0, i need to state it. On 1.1 it is default.
       onion_response_write(res, CONNECTION_KEEP_ALIVE,
                            sizeof(CONNECTION_KEEP_ALIVE) - 1);
@@ -311,11 +443,28 @@ int onion_response_write_headers(onion_response * res) {
     onion_response_write(res, CONNECTION_UPGRADE,
                          sizeof(CONNECTION_UPGRADE) - 1);
 
+  int set_headers = 0;
+  onion_dict_preorder(res->headers, find_set_header, &set_headers);
+#ifndef DONT_USE_DATE_HEADER
+  if (!(set_headers & (1 << OH_DATE)))
+    onion_response_write_date(res);
+#endif
+  // Sorry for the advertisment.
+  if (!(set_headers & (1 << OH_SERVER)))
+    onion_response_write(res, ONION_RESPONSE_SERVER_HEADER,
+                         sizeof(ONION_RESPONSE_SERVER_HEADER) - 1);
+
+  if (res->header_template)
+    onion_response_write(res, res->header_template->data->data,
+                         res->header_template->data->size);
+
   onion_dict_preorder(res->headers, write_header, res);
 
-  if (res->request->session_id && (onion_dict_count(res->request->session) > 0))        // I have session with something, tell user
-    onion_response_printf(res, "Set-Cookie: sessionid=%s; httponly; Path=/\n",
-                          res->request->session_id);
+  if (res->request->session_id && (onion_dict_count(res->request->session) > 0)) {      // I have session with something, tell user
+    onion_response_write(res, "Set-Cookie: sessionid=", 22);
+    onion_response_write0(res, res->request->session_id);
+    onion_response_write(res, "; httponly; Path=/\r\n", 20);
+  }
 
   onion_response_write(res, "\r\n", 2);
 
@@ -389,6 +538,46 @@ ssize_t onion_response_write(onion_response * res, const char *data,
   return w;
 }
 
+/**
+ * @short Gets the free space at the output buffer, to write directly into it.
+ * @memberof onion_response_t
+ * @ingroup response
+ *
+ * This avoids a copy when the data is generated in place, as with formatting. If the
+ * buffer is full it is flushed first.
+ *
+ * After writing, onion_response_buffer_commit must be called with the written bytes, before
+ * calling any other response function.
+ *
+ * @param available Where to store the free space size.
+ * @returns Pointer to the free space, or NULL if no content must be written, as on HEAD requests.
+ */
+char *onion_response_buffer_reserve(onion_response * res, size_t * available) {
+  *available = 0;
+  if (res->flags & OR_SKIP_CONTENT) {
+    if (!(res->flags & OR_HEADER_SENT)) // Automatic header write
+      onion_response_write_headers(res);
+    return NULL;
+  }
+  if (res->buffer_pos == sizeof(res->buffer) && onion_response_flush(res) < 0)
+    return NULL;
+  *available = sizeof(res->buffer) - res->buffer_pos;
+  return &res->buffer[res->buffer_pos];
+}
+
+/**
+ * @short Marks as written some bytes at the space returned by onion_response_buffer_reserve.
+ * @memberof onion_response_t
+ * @ingroup response
+ */
+void onion_response_buffer_commit(onion_response * res, size_t length) {
+  if (res->buffer_pos + length > sizeof(res->buffer)) {
+    ONION_ERROR("Commiting more data than reserved at the response buffer");
+    length = sizeof(res->buffer) - res->buffer_pos;
+  }
+  res->buffer_pos += length;
+}
+
 /**
  * @short Writes all buffered output waiting for sending.
  * @ingroup response
@@ -400,7 +589,6 @@ ssize_t onion_response_write(onion_response * res, const char *data,
  */
 int onion_response_flush(onion_response * res) {
   res->sent_bytes += res->buffer_pos;
-  res->sent_bytes_total += res->buffer_pos;
   if (res->buffer_pos == 0)     // Not used.
     return 0;
   if (!(res->flags & OR_HEADER_SENT)) { // Automatic header write
@@ -415,6 +603,7 @@ int onion_response_flush(onion_response * res) {
     onion_response_write(res, tmpb, tmpp);
     return 0;
   }
+  res->sent_bytes_total += res->buffer_pos;     // After the hack, or the body would count twice.
   if (res->flags & OR_SKIP_CONTENT)     // HEAD request
     return 0;
   ONION_DEBUG0("Flush %d bytes", res->buffer_pos);
@@ -502,6 +691,17 @@ ssize_t onion_response_vprintf(onion_response * res, const char *fmt,
   char temp[512];
   va_list argz;
   int l;
+  // Fast path, format straight into the output buffer if fits.
+  size_t available = sizeof(res->buffer) - res->buffer_pos;
+  if (!(res->flags & OR_SKIP_CONTENT) && available > 1) {
+    va_copy(argz, args);
+    l = vsnprintf(&res->buffer[res->buffer_pos], available, fmt, argz);
+    va_end(argz);
+    if (l >= 0 && l < available) {
+      res->buffer_pos += l;
+      return l;
+    }
+  }
   va_copy(argz, args);
   l = vsnprintf(temp, sizeof(temp), fmt, argz);
   va_end(argz);
@@ -532,51 +732,10 @@ ssize_t onion_response_vprintf(onion_response * res, const char *fmt,
  * @ingroup response
  */
 const char *onion_response_code_description(int code) {
-  switch (code) {
-  case HTTP_OK:
-    return "OK";
-  case HTTP_CREATED:
-    return "Created";
-  case HTTP_PARTIAL_CONTENT:
-    return "Partial Content";
-  case HTTP_MULTI_STATUS:
-    return "Multi-Status";
-
-  case HTTP_SWITCH_PROTOCOL:
-    return "Switching Protocols";
-
-  case HTTP_MOVED:
-    return "Moved Permanently";
-  case HTTP_REDIRECT:
-    return "Found";
-  case HTTP_SEE_OTHER:
-    return "See Other";
-  case HTTP_NOT_MODIFIED:
-    return "Not Modified";
-  case HTTP_TEMPORARY_REDIRECT:
-    return "Temporary Redirect";
-
-  case HTTP_BAD_REQUEST:
-    return "Bad Request";
-  case HTTP_UNAUTHORIZED:
-    return "Unauthorized";
-  case HTTP_FORBIDDEN:
-    return "Forbidden";
-  case HTTP_NOT_FOUND:
-    return "Not Found";
-  case HTTP_METHOD_NOT_ALLOWED:
-    return "Method Not Allowed";
-
-  case HTTP_INTERNAL_ERROR:
-    return "Internal Server Error";
-  case HTTP_NOT_IMPLEMENTED:
-    return "Not Implemented";
-  case HTTP_BAD_GATEWAY:
-    return "Bad Gateway";
-  case HTTP_SERVICE_UNAVAILABLE:
-    return "Service Unavailable";
-  }
-  return "CODE UNKNOWN";
+  int i = onion_response_status_index(code);
+  if (i < 0)
+    return "CODE UNKNOWN";
+  return onion_response_status_lines[i].description;
 }
 
 /**
@@ -590,6 +749,62 @@ onion_dict *onion_response_get_headers(onion_response * res) {
   return res->headers;
 }
 
+/**
+ * @short Sets a template of constant headers to write with the response headers
+ * @memberof onion_response_t
+ * @ingroup response
+ *
+ * The template is written as is, just after the Date and Server headers and
+ * before the headers from the dict, so it should not repeat them.
+ *
+ * The template is not copied, and must be valid until the response is freed.
+ * Normally its created once by the handler and freed with its private data.
+ */
+void onion_response_set_template(onion_response * res,
+                                 const onion_response_template * tpl) {
+  res->header_template = tpl;
+}
+
+/**
+ * @short Creates a new empty headers template
+ * @memberof onion_response_template_t
+ * @ingroup response
+ *
+ * Templates allow to serialize once constant headers (Cache-Control, CORS...),
+ * so at each response they are just copied to the output.
+ *
+ * @see onion_response_set_template
+ */
+onion_response_template *onion_response_template_new() {
+  onion_response_template *tpl =
+      onion_low_malloc(sizeof(onion_response_template));
+  tpl->data = onion_block_new();
+  return tpl;
+}
+
+/**
+ * @short Adds a header to the template
+ * @memberof onion_response_template_t
+ * @ingroup response
+ */
+void onion_response_template_add(onion_response_template * tpl,
+                                 const char *key, const char *value) {
+  onion_block_add_str(tpl->data, key);
+  onion_block_add_data(tpl->data, ": ", 2);
+  onion_block_add_str(tpl->data, value);
+  onion_block_add_data(tpl->data, "\r\n", 2);
+}
+
+/**
+ * @short Frees the template
+ * @memberof onion_response_template_t
+ * @ingroup response
+ */
+void onion_response_template_free(onion_response_template * tpl) {
+  onion_block_free(tpl->data);
+  onion_low_free(tpl);
+}
+
 /**
  * @short Sets a new cookie into the response.
  * @ingroup response
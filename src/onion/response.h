@@ -104,12 +104,33 @@ extern "C" {
 /// Adds a header to the response object
   void onion_response_set_header(onion_response * res, const char *key,
                                  const char *value);
+/// Adds a well known header to the response object
+  void onion_response_set_header_id(onion_response * res, onion_header id,
+                                    const char *value);
+/// Gets a well known header from the response object
+  const char *onion_response_get_header_id(onion_response * res,
+                                           onion_header id);
 /// Sets the header length. Normally it should be through set_header, but as its very common and needs some procesing here is a shortcut
   void onion_response_set_length(onion_response * res, size_t length);
+/// Gets the length set with onion_response_set_length, or -1
+  long onion_response_get_length(onion_response * res);
 /// Sets the return code
   void onion_response_set_code(onion_response * res, int code);
 /// Gets the headers dictionary
   onion_dict *onion_response_get_headers(onion_response * res);
+/// Sets a template of constant headers to write with the response headers
+  void onion_response_set_template(onion_response * res,
+                                   const onion_response_template * tpl);
+
+/// @{ @name Header templates
+/// Creates a new empty headers template
+  onion_response_template *onion_response_template_new();
+/// Adds a header to the template
+  void onion_response_template_add(onion_response_template * tpl,
+                                   const char *key, const char *value);
+/// Frees the template
+  void onion_response_template_free(onion_response_template * tpl);
+/// @}
 /// Sets a new cookie
   bool onion_response_add_cookie(onion_response * req, const char *cookiename,
                                  const char *cookievalue, time_t validity_t,
@@ -136,6 +157,10 @@ extern "C" {
       __attribute__ ((format(printf, 2, 0)));
 /// Flushes remaining data on the buffer to the listen point.
   int onion_response_flush(onion_response * res);
+/// Gets free space at the output buffer to write directly into it. Must be followed by onion_response_buffer_commit.
+  char *onion_response_buffer_reserve(onion_response * res, size_t * available);
+/// Marks as written length bytes at the space from onion_response_buffer_reserve.
+  void onion_response_buffer_commit(onion_response * res, size_t length);
 /// @}
 
 #ifdef __cplusplus
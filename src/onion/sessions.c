@@ -40,19 +40,27 @@
  *
  * This unique id is also dificult to guess, so that blind guessing will not work.
  *
- * Just now random 32 bytes string with alphanum chars. Not really safe as using simple C rand.
+ * It is a random 32 bytes string with alphanum chars, from the cryptographically secure
+ * onion_random_generate. Random bytes over the largest multiple of the alphabet size are
+ * discarded, so all chars have the same probability.
  *
  * The memory is malloc'ed and will be freed somewhere.
  */
 char *onion_sessions_generate_id() {
-  char allowed_chars[] =
+  static const char allowed_chars[] =
       "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  const unsigned int nchars = sizeof(allowed_chars) - 1;
+  const unsigned int limit = 256 - (256 % nchars);
 
   char *ret = onion_low_scalar_malloc(33);
-  onion_random_generate(ret, 32);
-  int i;
-  for (i = 0; i < 32; i++) {
-    ret[i] = allowed_chars[ret[i] % (sizeof(allowed_chars) - 1)];
+  unsigned char rnd[48];        // Only 1 in 32 discarded, so normally enough at once
+  int i = 0;
+  while (i < 32) {
+    onion_random_generate(rnd, sizeof(rnd));
+    size_t j;
+    for (j = 0; j < sizeof(rnd) && i < 32; j++)
+      if (rnd[j] < limit)
+        ret[i++] = allowed_chars[rnd[j] % nchars];
   }
   ret[i] = '\0';
   return ret;
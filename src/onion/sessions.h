@@ -39,6 +39,9 @@ extern "C" {
 /// Creates a session. Returns the session name. 
   char *onion_sessions_create(onion_sessions * sessions);
 
+/// Generates a random session id, without creating the session. Must be freed by user.
+  char *onion_sessions_generate_id();
+
 /// Returns the session object.
   onion_dict *onion_sessions_get(onion_sessions * sessions,
                                  const char *sessionId);
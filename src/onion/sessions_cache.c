@@ -0,0 +1,262 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdbool.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "sessions.h"
+#include "sessions_mem.h"
+#include "sessions_cache.h"
+#include "types_internal.h"
+#include "dict.h"
+#include "random.h"
+#include "log.h"
+#include "low.h"
+
+/// Time, in ms, saves wait on write behind mode, so several saves of the same session are written once.
+#define ONION_SESSIONS_CACHE_WRITE_BEHIND_MS 100
+
+typedef struct onion_sessions_cache_t {
+  onion_sessions *near;         ///< In process cache, an inmem backend.
+  onion_sessions *remote;       ///< The real storage.
+  int flags;
+#ifdef HAVE_PTHREADS
+  onion_dict *pending;          ///< Write behind queue. Session id to a copy of the session, or "" if removed.
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t writer;
+  bool stop;
+#endif
+} onion_sessions_cache;
+
+#ifdef HAVE_PTHREADS
+/// Writes one queued save to the remote backend.
+static void onion_sessions_cache_write_one(onion_sessions * remote,
+                                           const char *session_id,
+                                           const void *data, int flags) {
+  remote->save(remote, session_id,
+               (flags & OD_DICT) ? (onion_dict *) data : NULL);
+}
+
+/// Every ONION_SESSIONS_CACHE_WRITE_BEHIND_MS writes all the queued saves.
+static void *onion_sessions_cache_writer(void *_c) {
+  onion_sessions_cache *c = _c;
+  pthread_mutex_lock(&c->mutex);
+  for (;;) {
+    while (!c->stop && !c->pending->root)
+      pthread_cond_wait(&c->cond, &c->mutex);
+    if (!c->stop) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += ONION_SESSIONS_CACHE_WRITE_BEHIND_MS * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      while (!c->stop)
+        if (pthread_cond_timedwait(&c->cond, &c->mutex, &deadline) ==
+            ETIMEDOUT)
+          break;
+    }
+    if (!c->pending->root)      // Only when stopping
+      break;
+
+    onion_dict *batch = c->pending;
+    c->pending = onion_dict_new();
+    pthread_mutex_unlock(&c->mutex);
+
+    onion_dict_preorder(batch, onion_sessions_cache_write_one, c->remote);
+    onion_dict_free(batch);
+
+    pthread_mutex_lock(&c->mutex);
+  }
+  pthread_mutex_unlock(&c->mutex);
+  return NULL;
+}
+
+/**
+ * @short Looks at the write behind queue.
+ *
+ * @returns true if found, and at ret a copy of the session, or NULL if removed.
+ */
+static bool onion_sessions_cache_get_pending(onion_sessions_cache * c,
+                                             const char *session_id,
+                                             onion_dict ** ret) {
+  bool found = false;
+  pthread_mutex_lock(&c->mutex);
+  onion_dict *session = onion_dict_get_dict(c->pending, session_id);
+  if (session) {
+    *ret = onion_dict_hard_dup(session);
+    found = true;
+  } else if (onion_dict_get(c->pending, session_id)) {
+    *ret = NULL;
+    found = true;
+  }
+  pthread_mutex_unlock(&c->mutex);
+  return found;
+}
+#endif
+
+static onion_dict *onion_sessions_cache_get(onion_sessions * sessions,
+                                            const char *session_id) {
+  onion_sessions_cache *c = sessions->data;
+  onion_dict *ret = c->near->get(c->near, session_id);
+  if (ret)
+    return ret;
+
+#ifdef HAVE_PTHREADS
+  if ((c->flags & OSC_WRITE_BEHIND)
+      && onion_sessions_cache_get_pending(c, session_id, &ret)) {
+    if (ret)
+      c->near->save(c->near, session_id, ret);
+    return ret;
+  }
+#endif
+  ret = c->remote->get(c->remote, session_id);
+  if (ret)
+    c->near->save(c->near, session_id, ret);
+  return ret;
+}
+
+/**
+ * @short Saves at the cache and at the remote backend.
+ *
+ * On write through the remote save is done now, on write behind it is queued.
+ */
+static void onion_sessions_cache_save(onion_sessions * sessions,
+                                      const char *session_id,
+                                      onion_dict * data) {
+  onion_sessions_cache *c = sessions->data;
+  c->near->save(c->near, session_id, data);
+
+#ifdef HAVE_PTHREADS
+  if (c->flags & OSC_WRITE_BEHIND) {
+    // Copied now, as data may keep changing at the cache.
+    onion_dict *copy = data ? onion_dict_hard_dup(data) : NULL;
+    pthread_mutex_lock(&c->mutex);
+    if (copy)
+      onion_dict_add(c->pending, session_id, copy,
+                     OD_DUP_KEY | OD_DICT | OD_FREE_VALUE | OD_REPLACE);
+    else
+      onion_dict_add(c->pending, session_id, "", OD_DUP_KEY | OD_REPLACE);
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+    return;
+  }
+#endif
+  c->remote->save(c->remote, session_id, data);
+}
+
+static void onion_sessions_cache_free(onion_sessions * sessions) {
+  onion_sessions_cache *c = sessions->data;
+#ifdef HAVE_PTHREADS
+  if (c->flags & OSC_WRITE_BEHIND) {
+    pthread_mutex_lock(&c->mutex);
+    c->stop = true;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+    onion_low_pthread_join(c->writer, NULL);     // Writes all pending
+  }
+  onion_dict_free(c->pending);
+  pthread_cond_destroy(&c->cond);
+  pthread_mutex_destroy(&c->mutex);
+#endif
+  onion_sessions_free(c->near);
+  onion_sessions_free(c->remote);
+  onion_low_free(c);
+  onion_low_free(sessions);
+}
+
+/**
+ * @short Creates a sessions backend that caches in process another backend
+ * @ingroup sessions
+ *
+ * Gets are served from an in memory cache when possible, so requests of the same client
+ * do not need a round trip to the remote backend, for example redis or sqlite3. Saves are
+ * stored at both.
+ *
+ * As other processes may change the remote data, cached sessions are used for at most
+ * max_age seconds since they were loaded or saved.
+ *
+ * On OSC_WRITE_BEHIND mode saves are written to the remote backend by a background thread,
+ * every few milliseconds. Several saves of the same session are written only once.
+ * Without threads it always works as write through.
+ *
+ * The new backend owns the remote backend, and frees it when freed.
+ *
+ * @param remote The remote backend
+ * @param max_sessions Max sessions at the cache, or 0 for no limit. Least recently used are removed first.
+ * @param max_age Max time in seconds to use a cached session without loading it again, or 0 for no limit.
+ * @param flags Ored onion_sessions_cache_flags_e
+ *
+ * @see onion_set_session_backend
+ */
+onion_sessions *onion_sessions_cache_new(onion_sessions * remote,
+                                         size_t max_sessions, int max_age,
+                                         int flags) {
+  if (!remote)
+    return NULL;
+  onion_random_init();
+
+  onion_sessions_cache *c = onion_low_calloc(1, sizeof(onion_sessions_cache));
+  c->remote = remote;
+  c->near = onion_sessions_mem_new();
+  onion_sessions_mem_set_limits(c->near, max_sessions, max_age);
+  onion_sessions_mem_set_flags(c->near, OSM_EXPIRE_FROM_SAVE);
+  c->flags = flags;
+#ifdef HAVE_PTHREADS
+  c->pending = onion_dict_new();
+  pthread_mutex_init(&c->mutex, NULL);
+  pthread_cond_init(&c->cond, NULL);
+  if (flags & OSC_WRITE_BEHIND)
+    onion_low_pthread_create(&c->writer, NULL, onion_sessions_cache_writer, c);
+#else
+  c->flags &= ~OSC_WRITE_BEHIND;
+#endif
+
+  onion_sessions *ret = onion_low_malloc(sizeof(onion_sessions));
+  ret->data = c;
+  ret->get = onion_sessions_cache_get;
+  ret->save = onion_sessions_cache_save;
+  ret->free = onion_sessions_cache_free;
+
+  return ret;
+}
+
+/**
+ * @short Gets the usage statistics of the cache
+ * @ingroup sessions
+ *
+ * Hits are the gets served without using the remote backend.
+ */
+void onion_sessions_cache_get_stats(onion_sessions * sessions,
+                                    onion_sessions_mem_stats * stats) {
+  onion_sessions_cache *c = sessions->data;
+  onion_sessions_mem_get_stats(c->near, stats);
+}
@@ -0,0 +1,53 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+#ifndef ONION_SESSIONS_CACHE_H
+#define ONION_SESSIONS_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include "types.h"
+#include "sessions_mem.h"
+
+  /// Flags for onion_sessions_cache_new
+  enum onion_sessions_cache_flags_e {
+    OSC_WRITE_THROUGH = 0,      ///< Saves are written to the remote backend before returning.
+    OSC_WRITE_BEHIND = 1,       ///< Saves are queued, and written to the remote backend in the background.
+  };
+
+/// Creates a backend that caches in memory the remote one. Max age is in seconds.
+  onion_sessions *onion_sessions_cache_new(onion_sessions * remote,
+                                           size_t max_sessions, int max_age,
+                                           int flags);
+
+/// Gets the usage statistics of the in memory cache
+  void onion_sessions_cache_get_stats(onion_sessions * sessions,
+                                      onion_sessions_mem_stats * stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
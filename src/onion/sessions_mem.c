@@ -22,6 +22,11 @@
 */
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #include "sessions_mem.h"
 #include "types_internal.h"
@@ -30,34 +35,307 @@
 #include "random.h"
 #include "low.h"
 
-char *last_data = NULL;
+/// Number of shards. Each has its own lock, so different sessions do not contend.
+#define ONION_SESSIONS_MEM_SHARDS 16
+/// Initial buckets at each shard hash table. Grows as needed.
+#define ONION_SESSIONS_MEM_BUCKETS 64
+/// Max expired sessions removed on each operation, so there is never a full sweep.
+#define ONION_SESSIONS_MEM_EXPIRE_STEP 4
+/// Default idle time, in seconds, before a session is removed.
+#define ONION_SESSIONS_MEM_IDLE_TIMEOUT 3600
+
+/// A session at the store. It is at a hash chain and at the LRU list of its shard.
+typedef struct onion_sessions_mem_entry_t {
+  char *id;
+  onion_dict *data;
+  time_t last_access;
+  time_t last_save;
+  unsigned int hash;
+  struct onion_sessions_mem_entry_t *hnext;     ///< Next at the same bucket
+  struct onion_sessions_mem_entry_t *prev;      ///< More recently used
+  struct onion_sessions_mem_entry_t *next;      ///< Less recently used
+} onion_sessions_mem_entry;
+
+typedef struct onion_sessions_mem_shard_t {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_t mutex;
+#endif
+  onion_sessions_mem_entry **buckets;
+  size_t nbuckets;
+  size_t count;
+  onion_sessions_mem_entry *head;       ///< Most recently used
+  onion_sessions_mem_entry *tail;       ///< Least recently used, first to evict
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+  size_t expirations;
+} onion_sessions_mem_shard;
+
+typedef struct onion_sessions_mem_t {
+  size_t max_sessions;          ///< 0 is no limit
+  size_t count;                 ///< Sessions at all the shards. Atomic, as each shard has its own lock.
+  int idle_timeout;             ///< In seconds, 0 never expires
+  int flags;                    ///< @see onion_sessions_mem_flags_e
+  onion_sessions_mem_shard shards[ONION_SESSIONS_MEM_SHARDS];
+} onion_sessions_mem;
+
+/// FNV-1a. Session ids are random, so it is more than enough.
+static unsigned int onion_sessions_mem_hash(const char *id) {
+  unsigned int h = 2166136261u;
+  while (*id) {
+    h ^= (unsigned char)*id++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/// Bucket for the hash. The low bits choose the shard, so the bucket uses the bits above them.
+static size_t onion_sessions_mem_bucket(unsigned int hash, size_t nbuckets) {
+  return (hash / ONION_SESSIONS_MEM_SHARDS) & (nbuckets - 1);
+}
+
+static void onion_sessions_mem_lock(onion_sessions_mem_shard * shard) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&shard->mutex);
+#endif
+}
+
+static void onion_sessions_mem_unlock(onion_sessions_mem_shard * shard) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&shard->mutex);
+#endif
+}
+
+static void onion_sessions_mem_lru_unlink(onion_sessions_mem_shard * shard,
+                                          onion_sessions_mem_entry * e) {
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    shard->head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    shard->tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void onion_sessions_mem_lru_push(onion_sessions_mem_shard * shard,
+                                        onion_sessions_mem_entry * e) {
+  e->prev = NULL;
+  e->next = shard->head;
+  if (shard->head)
+    shard->head->prev = e;
+  else
+    shard->tail = e;
+  shard->head = e;
+}
+
+static onion_sessions_mem_entry
+    **onion_sessions_mem_find(onion_sessions_mem_shard * shard, const char *id,
+                              unsigned int hash) {
+  onion_sessions_mem_entry **e =
+      &shard->buckets[onion_sessions_mem_bucket(hash, shard->nbuckets)];
+  while (*e) {
+    if ((*e)->hash == hash && strcmp((*e)->id, id) == 0)
+      return e;
+    e = &(*e)->hnext;
+  }
+  return e;
+}
+
+/// Removes the entry from the shard and frees it, dereferencing the dict.
+static void onion_sessions_mem_remove(onion_sessions_mem * mem,
+                                      onion_sessions_mem_shard * shard,
+                                      onion_sessions_mem_entry * e) {
+  onion_sessions_mem_entry **p = onion_sessions_mem_find(shard, e->id, e->hash);
+  *p = e->hnext;
+  onion_sessions_mem_lru_unlink(shard, e);
+  shard->count--;
+  __atomic_sub_fetch(&mem->count, 1, __ATOMIC_RELAXED);
+  onion_dict_free(e->data);
+  onion_low_free(e->id);
+  onion_low_free(e);
+}
+
+/// Doubles the buckets when the load is over 1.
+static void onion_sessions_mem_grow(onion_sessions_mem_shard * shard) {
+  size_t nbuckets = shard->nbuckets * 2;
+  onion_sessions_mem_entry **buckets =
+      onion_low_calloc(nbuckets, sizeof(onion_sessions_mem_entry *));
+  size_t i;
+  for (i = 0; i < shard->nbuckets; i++) {
+    onion_sessions_mem_entry *e = shard->buckets[i];
+    while (e) {
+      onion_sessions_mem_entry *next = e->hnext;
+      size_t b = onion_sessions_mem_bucket(e->hash, nbuckets);
+      e->hnext = buckets[b];
+      buckets[b] = e;
+      e = next;
+    }
+  }
+  onion_low_free(shard->buckets);
+  shard->buckets = buckets;
+  shard->nbuckets = nbuckets;
+}
+
+/**
+ * @short Removes some of the least recently used sessions if expired.
+ *
+ * As the LRU list is sorted by access time, only the tail has to be checked. At most
+ * ONION_SESSIONS_MEM_EXPIRE_STEP are removed each time, so the cost is spread over
+ * normal operations.
+ */
+static void onion_sessions_mem_expire(onion_sessions_mem * mem,
+                                      onion_sessions_mem_shard * shard,
+                                      time_t now) {
+  if (mem->idle_timeout <= 0)
+    return;
+  int i;
+  for (i = 0; i < ONION_SESSIONS_MEM_EXPIRE_STEP && shard->tail; i++) {
+    if (now - shard->tail->last_access < mem->idle_timeout)
+      return;
+    ONION_DEBUG0("Session %s expired", shard->tail->id);
+    onion_sessions_mem_remove(mem, shard, shard->tail);
+    shard->expirations++;
+  }
+}
+
+static int onion_sessions_mem_over_limit(onion_sessions_mem * mem) {
+  return mem->max_sessions
+      && __atomic_load_n(&mem->count, __ATOMIC_RELAXED) > mem->max_sessions;
+}
+
+/**
+ * @short Evicts sessions from other shards until under the limit
+ *
+ * Only when the shard of the saved session had nothing else to evict. Takes the least
+ * recently used of each of the other shards in turn, locking just one shard at a time.
+ */
+static void onion_sessions_mem_evict_others(onion_sessions_mem * mem,
+                                            onion_sessions_mem_shard * own) {
+  int first = own - mem->shards;
+  int i, evicted = 1;
+  while (evicted && onion_sessions_mem_over_limit(mem)) {
+    evicted = 0;
+    for (i = 1; i < ONION_SESSIONS_MEM_SHARDS
+         && onion_sessions_mem_over_limit(mem); i++) {
+      onion_sessions_mem_shard *shard =
+          &mem->shards[(first + i) % ONION_SESSIONS_MEM_SHARDS];
+      onion_sessions_mem_lock(shard);
+      if (shard->tail) {
+        ONION_DEBUG0("Evicting session %s", shard->tail->id);
+        onion_sessions_mem_remove(mem, shard, shard->tail);
+        shard->evictions++;
+        evicted = 1;
+      }
+      onion_sessions_mem_unlock(shard);
+    }
+  }
+}
 
 static onion_dict *onion_sessions_mem_get(onion_sessions * sessions,
                                           const char *session_id) {
   ONION_DEBUG0("Accessing session '%s'", session_id);
-  onion_dict *sess = onion_dict_get_dict(sessions->data, session_id);
-  if (!sess) {
+  onion_sessions_mem *mem = sessions->data;
+  unsigned int hash = onion_sessions_mem_hash(session_id);
+  onion_sessions_mem_shard *shard =
+      &mem->shards[hash % ONION_SESSIONS_MEM_SHARDS];
+  time_t now = time(NULL);
+  onion_dict *ret = NULL;
+
+  onion_sessions_mem_lock(shard);
+  onion_sessions_mem_expire(mem, shard, now);
+  onion_sessions_mem_entry *e = *onion_sessions_mem_find(shard, session_id,
+                                                         hash);
+  time_t since = 0;
+  if (e)
+    since = (mem->flags & OSM_EXPIRE_FROM_SAVE) ? e->last_save : e->last_access;
+  if (e && mem->idle_timeout > 0 && now - since >= mem->idle_timeout) {
+    onion_sessions_mem_remove(mem, shard, e);
+    shard->expirations++;
+    e = NULL;
+  }
+  if (e) {
+    e->last_access = now;
+    onion_sessions_mem_lru_unlink(shard, e);
+    onion_sessions_mem_lru_push(shard, e);
+    ret = onion_dict_dup(e->data);
+    shard->hits++;
+  } else {
     ONION_DEBUG0("Unknown session '%s'.", session_id);
-    return NULL;
+    shard->misses++;
   }
-  return onion_dict_dup(sess);
+  onion_sessions_mem_unlock(shard);
+
+  return ret;
 }
 
 static void onion_sessions_mem_save(onion_sessions * sessions,
                                     const char *session_id, onion_dict * data) {
+  onion_sessions_mem *mem = sessions->data;
+  unsigned int hash = onion_sessions_mem_hash(session_id);
+  onion_sessions_mem_shard *shard =
+      &mem->shards[hash % ONION_SESSIONS_MEM_SHARDS];
+  time_t now = time(NULL);
+
+  onion_sessions_mem_lock(shard);
+  onion_sessions_mem_expire(mem, shard, now);
+  onion_sessions_mem_entry *e = *onion_sessions_mem_find(shard, session_id,
+                                                         hash);
   if (data == NULL) {
-    data = onion_dict_get_dict(sessions->data, session_id);
-    if (data) {
-      onion_dict_remove(sessions->data, session_id);
-    }
+    if (e)
+      onion_sessions_mem_remove(mem, shard, e);
+    onion_sessions_mem_unlock(shard);
     return;
   }
-  onion_dict_add(sessions->data, session_id, onion_dict_dup(data),
-                 OD_DUP_KEY | OD_FREE_VALUE | OD_DICT | OD_REPLACE);
+  if (e) {
+    if (e->data != data) {
+      onion_dict_free(e->data);
+      e->data = onion_dict_dup(data);
+    }
+    onion_sessions_mem_lru_unlink(shard, e);
+  } else {
+    e = onion_low_calloc(1, sizeof(onion_sessions_mem_entry));
+    e->id = onion_low_strdup(session_id);
+    e->hash = hash;
+    e->data = onion_dict_dup(data);
+    onion_sessions_mem_entry **bucket =
+        &shard->buckets[onion_sessions_mem_bucket(hash, shard->nbuckets)];
+    e->hnext = *bucket;
+    *bucket = e;
+    shard->count++;
+    __atomic_add_fetch(&mem->count, 1, __ATOMIC_RELAXED);
+    if (shard->count > shard->nbuckets)
+      onion_sessions_mem_grow(shard);
+  }
+  e->last_access = e->last_save = now;
+  onion_sessions_mem_lru_push(shard, e);
+
+  // Over the limit, evicts the least recently used of this shard, but never the just saved one.
+  while (onion_sessions_mem_over_limit(mem) && shard->tail != e) {
+    ONION_DEBUG0("Evicting session %s", shard->tail->id);
+    onion_sessions_mem_remove(mem, shard, shard->tail);
+    shard->evictions++;
+  }
+  onion_sessions_mem_unlock(shard);
+
+  if (onion_sessions_mem_over_limit(mem))
+    onion_sessions_mem_evict_others(mem, shard);
 }
 
 static void onion_sessions_mem_free(onion_sessions * sessions) {
-  onion_dict_free(sessions->data);
+  onion_sessions_mem *mem = sessions->data;
+  int i;
+  for (i = 0; i < ONION_SESSIONS_MEM_SHARDS; i++) {
+    onion_sessions_mem_shard *shard = &mem->shards[i];
+    while (shard->head)
+      onion_sessions_mem_remove(mem, shard, shard->head);
+    onion_low_free(shard->buckets);
+#ifdef HAVE_PTHREADS
+    pthread_mutex_destroy(&shard->mutex);
+#endif
+  }
+  onion_low_free(mem);
   onion_low_free(sessions);
 }
 
@@ -65,15 +343,31 @@ static void onion_sessions_mem_free(onion_sessions * sessions) {
  * @short Creates a inmem backend for sessions
  * @ingroup sessions
  *
- * This is the default and less interesting of the session backends. 
+ * This is the default and less interesting of the session backends.
+ *
+ * Sessions are split in shards by id, each with its own lock. Sessions not used
+ * for one hour are removed; it can be changed with onion_sessions_mem_set_limits.
  *
  * @see onion_set_session_backend
  */
 onion_sessions *onion_sessions_mem_new() {
   onion_random_init();
 
+  onion_sessions_mem *mem = onion_low_calloc(1, sizeof(onion_sessions_mem));
+  mem->idle_timeout = ONION_SESSIONS_MEM_IDLE_TIMEOUT;
+  int i;
+  for (i = 0; i < ONION_SESSIONS_MEM_SHARDS; i++) {
+    onion_sessions_mem_shard *shard = &mem->shards[i];
+#ifdef HAVE_PTHREADS
+    pthread_mutex_init(&shard->mutex, NULL);
+#endif
+    shard->nbuckets = ONION_SESSIONS_MEM_BUCKETS;
+    shard->buckets =
+        onion_low_calloc(shard->nbuckets, sizeof(onion_sessions_mem_entry *));
+  }
+
   onion_sessions *ret = onion_low_malloc(sizeof(onion_sessions));
-  ret->data = onion_dict_new();
+  ret->data = mem;
 
   ret->get = onion_sessions_mem_get;
   ret->save = onion_sessions_mem_save;
@@ -81,3 +375,61 @@ onion_sessions *onion_sessions_mem_new() {
 
   return ret;
 }
+
+/**
+ * @short Sets the limits of the inmem backend
+ * @ingroup sessions
+ *
+ * When there are more than max_sessions, the least recently used of the shard of
+ * the new session are removed. If there is no other there, the least recently used
+ * of the other shards, in turn. So the limit is exact, but the removed sessions are
+ * not always the least recently used overall.
+ *
+ * Sessions not used for idle_timeout seconds are removed. Expired sessions are removed
+ * a few at a time on each access, never all at once.
+ *
+ * @param max_sessions Maximum number of sessions, or 0 for no limit.
+ * @param idle_timeout Seconds without use to remove a session, or 0 to never expire.
+ */
+void onion_sessions_mem_set_limits(onion_sessions * sessions,
+                                   size_t max_sessions, int idle_timeout) {
+  onion_sessions_mem *mem = sessions->data;
+  mem->max_sessions = max_sessions;
+  mem->idle_timeout = idle_timeout;
+}
+
+/**
+ * @short Sets the behaviour flags of the inmem backend
+ * @ingroup sessions
+ *
+ * With OSM_EXPIRE_FROM_SAVE the timeout set at onion_sessions_mem_set_limits counts
+ * from the last save, so it is the max age of the data. Used when it is a cache of another
+ * backend.
+ *
+ * @see onion_sessions_mem_flags_e
+ */
+void onion_sessions_mem_set_flags(onion_sessions * sessions, int flags) {
+  onion_sessions_mem *mem = sessions->data;
+  mem->flags = flags;
+}
+
+/**
+ * @short Gets the usage statistics of the inmem backend
+ * @ingroup sessions
+ */
+void onion_sessions_mem_get_stats(onion_sessions * sessions,
+                                  onion_sessions_mem_stats * stats) {
+  onion_sessions_mem *mem = sessions->data;
+  memset(stats, 0, sizeof(*stats));
+  int i;
+  for (i = 0; i < ONION_SESSIONS_MEM_SHARDS; i++) {
+    onion_sessions_mem_shard *shard = &mem->shards[i];
+    onion_sessions_mem_lock(shard);
+    stats->count += shard->count;
+    stats->hits += shard->hits;
+    stats->misses += shard->misses;
+    stats->evictions += shard->evictions;
+    stats->expirations += shard->expirations;
+    onion_sessions_mem_unlock(shard);
+  }
+}
@@ -21,8 +21,8 @@
   <http://www.apache.org/licenses/LICENSE-2.0>.
 */
 
-#ifndef ONION_SESSIONS_SQLITE3_H
-#define ONION_SESSIONS_SQLITE3_H
+#ifndef ONION_SESSIONS_MEM_H
+#define ONION_SESSIONS_MEM_H
 
 #ifdef __cplusplus
 extern "C" {
@@ -30,8 +30,33 @@ extern "C" {
 
 #include "types.h"
 
+  /// Usage statistics of the inmem sessions backend
+  typedef struct onion_sessions_mem_stats_t {
+    size_t count;               ///< Current number of sessions
+    size_t hits;                ///< Gets of existing sessions
+    size_t misses;              ///< Gets of unknown or expired sessions
+    size_t evictions;           ///< Sessions removed as over the max count
+    size_t expirations;         ///< Sessions removed as idle for too long
+  } onion_sessions_mem_stats;
+
+  /// Flags for onion_sessions_mem_set_flags
+  enum onion_sessions_mem_flags_e {
+    OSM_EXPIRE_FROM_SAVE = 1,   ///< Timeout counts from the last save, not from the last access.
+  };
+
   onion_sessions *onion_sessions_mem_new();
 
+/// Sets the max number of sessions (0 no limit), and the idle timeout in seconds (0 never expire, by default one hour)
+  void onion_sessions_mem_set_limits(onion_sessions * sessions,
+                                     size_t max_sessions, int idle_timeout);
+
+/// Sets the flags, from onion_sessions_mem_flags_e
+  void onion_sessions_mem_set_flags(onion_sessions * sessions, int flags);
+
+/// Gets the usage statistics
+  void onion_sessions_mem_get_stats(onion_sessions * sessions,
+                                    onion_sessions_mem_stats * stats);
+
 #ifdef __cplusplus
 }
 #endif
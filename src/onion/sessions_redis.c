@@ -23,6 +23,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 #include <hiredis/hiredis.h>
 #ifdef HAVE_PTHREADS
 #include <pthread.h>
@@ -37,138 +38,300 @@
 #include "log.h"
 #include "low.h"
 
+/// Max connections to redis. Threads wait if all are in use.
+#define ONION_SESSIONS_REDIS_POOL_SIZE 8
+/// Default session idle time in seconds. Each access refreshes it.
+#define ONION_SESSIONS_REDIS_TTL 3600
+/// Connect and command timeout, in milliseconds.
+#define ONION_SESSIONS_REDIS_TIMEOUT 1000
+/// Prefix of the session keys. Each session is a key, so redis can expire it.
+#define ONION_SESSIONS_REDIS_PREFIX "onion:session:"
+/// Hash where older versions kept all the sessions, as JSON. Moved to their own keys when read.
+#define ONION_SESSIONS_REDIS_LEGACY_HASH "SESSIONS"
+
 typedef struct onion_session_redis_t {
-  redisContext *context;
+  char *server_ip;
+  int port;
+  int ttl;
+  redisContext *pool[ONION_SESSIONS_REDIS_POOL_SIZE];   ///< Free connections, NULL if not connected yet.
+  int nfree;                    ///< Connections at the pool, the rest are in use.
 #ifdef HAVE_PTHREADS
   pthread_mutex_t mutex;
+  pthread_cond_t cond;
 #endif
 } onion_session_redis;
 
+static redisContext *onion_sessions_redis_connect(onion_session_redis * p) {
+  struct timeval tv = { ONION_SESSIONS_REDIS_TIMEOUT / 1000,
+    (ONION_SESSIONS_REDIS_TIMEOUT % 1000) * 1000
+  };
+  redisContext *ctx = redisConnectWithTimeout(p->server_ip, p->port, tv);
+  if (!ctx) {
+    ONION_ERROR("Can't allocate redis context");
+    return NULL;
+  }
+  if (ctx->err) {
+    ONION_ERROR("Can't connect to redis. Error (%s)", ctx->errstr);
+    redisFree(ctx);
+    return NULL;
+  }
+  redisSetTimeout(ctx, tv);
+  return ctx;
+}
+
+/**
+ * @short Gets a connection from the pool, connecting if needed.
+ *
+ * Waits if all connections are in use. Returns NULL if can not connect.
+ */
+static redisContext *onion_sessions_redis_acquire(onion_session_redis * p) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&p->mutex);
+  while (p->nfree == 0)
+    pthread_cond_wait(&p->cond, &p->mutex);
+#endif
+  redisContext *ctx = p->pool[--p->nfree];
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&p->mutex);
+#endif
+  if (!ctx)
+    ctx = onion_sessions_redis_connect(p);
+  return ctx;
+}
+
+/// Returns the connection to the pool. Broken connections are closed, and reconnected on next use.
+static void onion_sessions_redis_release(onion_session_redis * p,
+                                         redisContext * ctx) {
+  if (ctx && ctx->err) {
+    ONION_WARNING("Redis connection error (%s). Will reconnect.", ctx->errstr);
+    redisFree(ctx);
+    ctx = NULL;
+  }
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&p->mutex);
+#endif
+  p->pool[p->nfree++] = ctx;
+#ifdef HAVE_PTHREADS
+  pthread_cond_signal(&p->cond);
+  pthread_mutex_unlock(&p->mutex);
+#endif
+}
+
 static void onion_sessions_redis_free(onion_sessions * sessions) {
   ONION_DEBUG0("Free onion sessions redis");
   onion_session_redis *p = sessions->data;
 
+  int i;
+  for (i = 0; i < p->nfree; i++)
+    if (p->pool[i])
+      redisFree(p->pool[i]);
 #ifdef HAVE_PTHREADS
   pthread_mutex_destroy(&p->mutex);
+  pthread_cond_destroy(&p->cond);
 #endif
 
-  redisFree(p->context);
+  onion_low_free(p->server_ip);
   onion_low_free(sessions->data);
   onion_low_free(sessions);
 }
 
+/**
+ * @short Loads a session saved by older versions, and moves it to its own key.
+ *
+ * Older versions kept all sessions at one hash, as JSON, without expiration. They are
+ * looked up only when the key is not found, so each miss costs one more round trip.
+ */
+static onion_dict *onion_sessions_redis_get_legacy(onion_session_redis * p,
+                                                   redisContext * ctx,
+                                                   const char *session_id,
+                                                   size_t l) {
+  redisReply *reply =
+      redisCommand(ctx, "HGET " ONION_SESSIONS_REDIS_LEGACY_HASH " %b",
+                   session_id, l);
+  if (!reply)
+    return NULL;
+  onion_dict *ret = NULL;
+  if (reply->type == REDIS_REPLY_STRING)
+    ret = onion_dict_from_json(reply->str);
+  freeReplyObject(reply);
+  if (!ret)
+    return NULL;
+
+  ONION_DEBUG("Moving session %s from the " ONION_SESSIONS_REDIS_LEGACY_HASH
+              " hash to its own key", session_id);
+  onion_block *bl = onion_dict_to_binary(ret);
+  if (p->ttl > 0)
+    redisAppendCommand(ctx, "SET " ONION_SESSIONS_REDIS_PREFIX "%b %b EX %d",
+                       session_id, l, bl->data, (size_t) bl->size, p->ttl);
+  else
+    redisAppendCommand(ctx, "SET " ONION_SESSIONS_REDIS_PREFIX "%b %b",
+                       session_id, l, bl->data, (size_t) bl->size);
+  redisAppendCommand(ctx, "HDEL " ONION_SESSIONS_REDIS_LEGACY_HASH " %b",
+                     session_id, l);
+  int i;
+  for (i = 0; i < 2 && redisGetReply(ctx, (void **)&reply) == REDIS_OK; i++) {
+    if (reply->type == REDIS_REPLY_ERROR)
+      ONION_ERROR("Error moving session: %s", reply->str);
+    freeReplyObject(reply);
+  }
+  onion_block_free(bl);
+  return ret;
+}
+
+/**
+ * @short Loads the session, and refreshes its TTL.
+ *
+ * GET and EXPIRE are pipelined, so it is just one round trip.
+ */
 static onion_dict *onion_sessions_redis_get(onion_sessions * sessions,
                                             const char *session_id) {
   onion_session_redis *p = sessions->data;
   ONION_DEBUG0("Load session %s", session_id);
   onion_dict *ret = NULL;
 
-#ifdef HAVE_PTHREADS
-  pthread_mutex_lock(&p->mutex);
-#endif
-
-  // When commands are sent via redisCommand, they are interpolated by the library
-  // so it will avoid any type of command injection. No need to worry about sending
-  // the session_id directly to redis.
-  redisReply *reply =
-      redisCommand(p->context, "HEXISTS SESSIONS %b", session_id,
-                   strlen(session_id));
+  redisContext *ctx = onion_sessions_redis_acquire(p);
+  if (!ctx) {
+    onion_sessions_redis_release(p, ctx);
+    return NULL;
+  }
+  // Arguments are sent as binary safe strings (%b), so there is no possible
+  // command injection from the session_id.
+  size_t l = strlen(session_id);
+  redisAppendCommand(ctx, "GET " ONION_SESSIONS_REDIS_PREFIX "%b", session_id,
+                     l);
+  if (p->ttl > 0)
+    redisAppendCommand(ctx, "EXPIRE " ONION_SESSIONS_REDIS_PREFIX "%b %d",
+                       session_id, l, p->ttl);
 
-  if (reply->type != REDIS_REPLY_INTEGER) {
-    ONION_ERROR("Error getting session_id");
-    freeReplyObject(reply);
-    goto exit;
+  redisReply *reply = NULL;
+  if (redisGetReply(ctx, (void **)&reply) != REDIS_OK) {
+    ONION_ERROR("Error loading session: %s", ctx->errstr);
   } else {
-    if (reply->integer == 1) {
-      freeReplyObject(reply);
-      reply =
-          redisCommand(p->context, "HGET SESSIONS %b", session_id,
-                       strlen(session_id));
-
-      if (reply->type != REDIS_REPLY_STRING) {
-        ONION_ERROR("Error loading session.");
-        freeReplyObject(reply);
-        goto exit;
-      } else {
+    int missing = (reply->type == REDIS_REPLY_NIL);
+    if (reply->type == REDIS_REPLY_STRING) {
+      ret = onion_dict_from_binary(reply->str, reply->len, OD_DUP_VALUE);
+      if (!ret && reply->str[0] == '{') // Saved as json, before the binary format
         ret = onion_dict_from_json(reply->str);
-        freeReplyObject(reply);
-        goto exit;
-      }
-    } else {
+    }
+    else if (reply->type == REDIS_REPLY_NIL)
       ONION_DEBUG0("No session found. Returning NULL");
+    else
+      ONION_ERROR("Error loading session.");
+    freeReplyObject(reply);
+    if (p->ttl > 0 && redisGetReply(ctx, (void **)&reply) == REDIS_OK)
       freeReplyObject(reply);
-      goto exit;
-    }
+    if (missing)
+      ret = onion_sessions_redis_get_legacy(p, ctx, session_id, l);
   }
- exit:
-#ifdef HAVE_PTHREADS
-  pthread_mutex_unlock(&p->mutex);
-#endif
+
+  onion_sessions_redis_release(p, ctx);
   return ret;
 }
 
-void onion_sessions_redis_save(onion_sessions * sessions,
-                               const char *session_id, onion_dict * data) {
-  onion_block *bl = onion_dict_to_json(data);
-
-  ONION_DEBUG0("Save session %s: %s", session_id, onion_block_data(bl));
-
+/**
+ * @short Saves the session, or removes it if data is NULL.
+ *
+ * If the connection was lost it retries once with a new connection.
+ */
+static void onion_sessions_redis_save(onion_sessions * sessions,
+                                      const char *session_id,
+                                      onion_dict * data) {
   onion_session_redis *p = sessions->data;
-#ifdef HAVE_PTHREADS
-  pthread_mutex_lock(&p->mutex);
-#endif
-
-  if (p == NULL) {
-    redisReply *reply = redisCommand(p->context, "HDEL SESSIONS %b", session_id,
-                                     strlen(session_id));
+  onion_block *bl = NULL;
+  if (data) {
+    bl = onion_dict_to_binary(data);
+    ONION_DEBUG0("Save session %s (%d bytes)", session_id, bl->size);
+  }
+  size_t l = strlen(session_id);
 
-    if (reply->type != REDIS_REPLY_INTEGER) {
-      ONION_ERROR("Error removing session");
+  int tries;
+  for (tries = 0; tries < 2; tries++) {
+    redisContext *ctx = onion_sessions_redis_acquire(p);
+    if (!ctx) {
+      onion_sessions_redis_release(p, ctx);
+      continue;
     }
-    freeReplyObject(reply);
-  } else {
-    const char *json = onion_block_data(bl);
-    redisReply *reply =
-        redisCommand(p->context, "HSET SESSIONS %b %b", session_id,
-                     strlen(session_id), json, strlen(json));
+    redisReply *reply;
+    if (!data)
+      reply =
+          redisCommand(ctx, "DEL " ONION_SESSIONS_REDIS_PREFIX "%b",
+                       session_id, l);
+    else if (p->ttl > 0)
+      reply =
+          redisCommand(ctx, "SET " ONION_SESSIONS_REDIS_PREFIX "%b %b EX %d",
+                       session_id, l, bl->data, (size_t) bl->size, p->ttl);
+    else
+      reply =
+          redisCommand(ctx, "SET " ONION_SESSIONS_REDIS_PREFIX "%b %b",
+                       session_id, l, bl->data, (size_t) bl->size);
 
-    if (reply->type != REDIS_REPLY_INTEGER) {
-      ONION_ERROR("Error saving session");
+    int retry = (reply == NULL);        // Connection error
+    if (reply) {
+      if (reply->type == REDIS_REPLY_ERROR)
+        ONION_ERROR("Error %s session: %s", data ? "saving" : "removing",
+                    reply->str);
+      freeReplyObject(reply);
     }
-    freeReplyObject(reply);
-    onion_block_free(bl);
+    onion_sessions_redis_release(p, ctx);
+    if (!retry)
+      break;
   }
+  if (tries == 2)
+    ONION_ERROR("Could not %s session %s", data ? "save" : "remove",
+                session_id);
 
-#ifdef HAVE_PTHREADS
-  pthread_mutex_unlock(&p->mutex);
-#endif
-  return;
+  if (bl)
+    onion_block_free(bl);
 }
 
 /**
  * @short Creates a redis backend for sessions
  * @ingroup sessions
+ *
+ * Each session is stored at its own key, with a TTL of one hour since last access.
+ * Several threads can use it at the same time, as it keeps a pool of connections.
+ * If a connection is lost, it reconnects on next use.
+ *
+ * @see onion_sessions_redis_set_ttl
  */
 onion_sessions *onion_sessions_redis_new(const char *server_ip, int port) {
   onion_random_init();
 
-  onion_sessions *ret = onion_low_malloc(sizeof(onion_sessions));
-  ret->data = onion_low_malloc(sizeof(onion_session_redis));
-  ret->free = onion_sessions_redis_free;
-  ret->get = onion_sessions_redis_get;
-  ret->save = onion_sessions_redis_save;
-
-  onion_session_redis *p = ret->data;
-  p->context = redisConnect(server_ip, port);
+  onion_session_redis *p = onion_low_calloc(1, sizeof(onion_session_redis));
+  p->server_ip = onion_low_strdup(server_ip);
+  p->port = port;
+  p->ttl = ONION_SESSIONS_REDIS_TTL;
 
-  if (p->context != NULL && p->context->err) {
-    ONION_ERROR("Can't connect to redis. Error (%s)", p->context->errstr);
-    redisFree(p->context);
+  // Connect one now, to report errors early.
+  redisContext *ctx = onion_sessions_redis_connect(p);
+  if (!ctx) {
+    onion_low_free(p->server_ip);
+    onion_low_free(p);
     return NULL;
   }
+  p->pool[ONION_SESSIONS_REDIS_POOL_SIZE - 1] = ctx;     // Top of the pool, used first.
+  p->nfree = ONION_SESSIONS_REDIS_POOL_SIZE;
 #ifdef HAVE_PTHREADS
   pthread_mutex_init(&p->mutex, NULL);
+  pthread_cond_init(&p->cond, NULL);
 #endif
 
+  onion_sessions *ret = onion_low_malloc(sizeof(onion_sessions));
+  ret->data = p;
+  ret->free = onion_sessions_redis_free;
+  ret->get = onion_sessions_redis_get;
+  ret->save = onion_sessions_redis_save;
+
   return ret;
 }
+
+/**
+ * @short Sets the time in seconds a session is kept after last access
+ * @ingroup sessions
+ *
+ * 0 means sessions never expire.
+ */
+void onion_sessions_redis_set_ttl(onion_sessions * sessions, int ttl) {
+  onion_session_redis *p = sessions->data;
+  p->ttl = ttl;
+}
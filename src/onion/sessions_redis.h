@@ -33,6 +33,9 @@ extern "C" {
 
   onion_sessions *onion_sessions_redis_new(const char *server_ip, int port);
 
+/// Sets the seconds a session is kept since last access. 0 never expires.
+  void onion_sessions_redis_set_ttl(onion_sessions * sessions, int ttl);
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,6 +23,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdbool.h>
 #include <sqlite3.h>
 #ifdef HAVE_PTHREADS
 #include <pthread.h>
@@ -37,26 +40,253 @@
 #include "log.h"
 #include "low.h"
 
-typedef struct onion_session_sqlite3_t {
+/// Max time, in ms, a save waits to be written, so it can be grouped with others.
+#define ONION_SESSIONS_SQLITE3_BATCH_MS 50
+/// Max saves grouped in one transaction.
+#define ONION_SESSIONS_SQLITE3_BATCH_ROWS 256
+/// Time to wait for locks at the database, in ms.
+#define ONION_SESSIONS_SQLITE3_BUSY_TIMEOUT 5000
+
+/// Read only connection of a thread.
+typedef struct onion_session_sqlite3_reader_t {
   sqlite3 *db;
-  sqlite3_stmt *save;
   sqlite3_stmt *get;
+  struct onion_session_sqlite3_t *sessions;     ///< To unlink from readers when the thread exits.
+  struct onion_session_sqlite3_reader_t *next;
+} onion_session_sqlite3_reader;
+
+typedef struct onion_session_sqlite3_t {
+  char *filename;
+  sqlite3 *db;                  ///< Write connection, only used by the writer.
+  sqlite3_stmt *save;
+  sqlite3_stmt *remove;
+  onion_session_sqlite3_reader shared;  ///< Used when per thread connections are not possible (no threads, in memory db).
+  bool shared_only;
+  onion_dict *pending;          ///< Saves waiting for the writer. Session id to a copy of the session, or "" if removed.
+  onion_dict *writing;          ///< Saves being written now.
+  int npending;
 #ifdef HAVE_PTHREADS
   pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t writer;
+  pthread_key_t reader_key;
+  onion_session_sqlite3_reader *readers;        ///< All per thread connections, to close them at free.
+  bool stop;
 #endif
 } onion_session_sqlite3;
 
+static void onion_sessions_sqlite3_lock(onion_session_sqlite3 * p) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&p->mutex);
+#endif
+}
+
+static void onion_sessions_sqlite3_unlock(onion_session_sqlite3 * p) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&p->mutex);
+#endif
+}
+
+/// Opens a connection with the WAL and timeout settings.
+static sqlite3 *onion_sessions_sqlite3_open(const char *filename, int flags) {
+  sqlite3 *db;
+  int rc = sqlite3_open_v2(filename, &db, flags, NULL);
+  if (rc != SQLITE_OK) {
+    ONION_ERROR("Can't open database: %s", sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+  sqlite3_busy_timeout(db, ONION_SESSIONS_SQLITE3_BUSY_TIMEOUT);
+  return db;
+}
+
+static int onion_sessions_sqlite3_prepare(sqlite3 * db, const char *sql,
+                                          sqlite3_stmt ** stmt) {
+  int rc = sqlite3_prepare_v2(db, sql, strlen(sql), stmt, NULL);
+  if (rc != SQLITE_OK)
+    ONION_ERROR("Cant prepare statement %s (%d)", sql, rc);
+  return rc;
+}
+
+/// Writes one pending save or remove. Called inside the writer transaction.
+static void onion_sessions_sqlite3_write_one(onion_session_sqlite3 * p,
+                                             const char *session_id,
+                                             const void *data, int flags) {
+  sqlite3_stmt *stmt = (flags & OD_DICT) ? p->save : p->remove;
+  onion_block *bl = NULL;
+  sqlite3_reset(stmt);
+  int rc = sqlite3_bind_text(stmt, 1, session_id, -1, SQLITE_STATIC);
+  if (rc == SQLITE_OK && (flags & OD_DICT)) {
+    bl = onion_dict_to_binary(data);
+    rc = sqlite3_bind_blob(stmt, 2, onion_block_data(bl), onion_block_size(bl),
+                           SQLITE_STATIC);
+  }
+  if (rc != SQLITE_OK)
+    ONION_ERROR("Error binding session data");
+  else if ((rc = sqlite3_step(stmt)) != SQLITE_DONE)
+    ONION_ERROR("Error saving session (%d)", rc);
+  if (bl)
+    onion_block_free(bl);
+}
+
+/// Writes all the given saves in one transaction.
+static void onion_sessions_sqlite3_write_batch(onion_session_sqlite3 * p,
+                                               onion_dict * batch) {
+  ONION_DEBUG0("Writing %d sessions", onion_dict_count(batch));
+  sqlite3_exec(p->db, "BEGIN", NULL, NULL, NULL);
+  onion_dict_preorder(batch, onion_sessions_sqlite3_write_one, p);
+  if (sqlite3_exec(p->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+    ONION_ERROR("Error commiting sessions: %s", sqlite3_errmsg(p->db));
+    sqlite3_exec(p->db, "ROLLBACK", NULL, NULL, NULL);
+  }
+}
+
+#ifdef HAVE_PTHREADS
+/**
+ * @short Background writer. Groups saves into transactions.
+ *
+ * When there is something to save, waits up to ONION_SESSIONS_SQLITE3_BATCH_MS
+ * or until there are ONION_SESSIONS_SQLITE3_BATCH_ROWS, and writes all at once.
+ */
+static void *onion_sessions_sqlite3_writer(void *_p) {
+  onion_session_sqlite3 *p = _p;
+  pthread_mutex_lock(&p->mutex);
+  for (;;) {
+    while (!p->stop && p->npending == 0)
+      pthread_cond_wait(&p->cond, &p->mutex);
+    if (!p->stop && p->npending < ONION_SESSIONS_SQLITE3_BATCH_ROWS) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += ONION_SESSIONS_SQLITE3_BATCH_MS * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      while (!p->stop && p->npending < ONION_SESSIONS_SQLITE3_BATCH_ROWS)
+        if (pthread_cond_timedwait(&p->cond, &p->mutex, &deadline) ==
+            ETIMEDOUT)
+          break;
+    }
+    if (p->npending == 0)       // Only when stopping
+      break;
+
+    p->writing = p->pending;
+    p->pending = onion_dict_new();
+    p->npending = 0;
+    pthread_mutex_unlock(&p->mutex);
+
+    onion_sessions_sqlite3_write_batch(p, p->writing);
+
+    pthread_mutex_lock(&p->mutex);
+    onion_dict_free(p->writing);
+    p->writing = NULL;
+  }
+  pthread_mutex_unlock(&p->mutex);
+  return NULL;
+}
+
+static void onion_sessions_sqlite3_reader_close(onion_session_sqlite3_reader *
+                                                r) {
+  sqlite3_finalize(r->get);
+  sqlite3_close(r->db);
+  onion_low_free(r);
+}
+
+/// Closes the read connection of a thread that exits, so short lived threads do not leak them.
+static void onion_sessions_sqlite3_reader_exit(void *data) {
+  onion_session_sqlite3_reader *r = data;
+  onion_session_sqlite3 *p = r->sessions;
+  pthread_mutex_lock(&p->mutex);
+  onion_session_sqlite3_reader **prev = &p->readers;
+  while (*prev && *prev != r)
+    prev = &(*prev)->next;
+  if (*prev)
+    *prev = r->next;
+  pthread_mutex_unlock(&p->mutex);
+  onion_sessions_sqlite3_reader_close(r);
+}
+
+/// Returns the read connection of this thread, opening it if needed.
+static onion_session_sqlite3_reader
+    * onion_sessions_sqlite3_reader(onion_session_sqlite3 * p) {
+  onion_session_sqlite3_reader *r = pthread_getspecific(p->reader_key);
+  if (r)
+    return r;
+  sqlite3 *db = onion_sessions_sqlite3_open(p->filename, SQLITE_OPEN_READONLY);
+  if (!db)
+    return NULL;
+  r = onion_low_calloc(1, sizeof(onion_session_sqlite3_reader));
+  r->db = db;
+  r->sessions = p;
+  if (onion_sessions_sqlite3_prepare(db, "SELECT data FROM sessions WHERE id=?",
+                                     &r->get) != SQLITE_OK) {
+    sqlite3_close(db);
+    onion_low_free(r);
+    return NULL;
+  }
+  pthread_mutex_lock(&p->mutex);
+  r->next = p->readers;
+  p->readers = r;
+  pthread_mutex_unlock(&p->mutex);
+  pthread_setspecific(p->reader_key, r);
+  return r;
+}
+#endif
+
+/**
+ * @short Looks for saves still not written.
+ *
+ * @returns true if found, and at ret a copy of the session, or NULL if removed.
+ */
+static bool onion_sessions_sqlite3_get_pending(onion_dict * batch,
+                                               const char *session_id,
+                                               onion_dict ** ret) {
+  if (!batch)
+    return false;
+  onion_dict *session = onion_dict_get_dict(batch, session_id);
+  if (session) {
+    *ret = onion_dict_hard_dup(session);
+    return true;
+  }
+  if (onion_dict_get(batch, session_id)) {
+    *ret = NULL;
+    return true;
+  }
+  return false;
+}
+
 static void onion_sessions_sqlite3_free(onion_sessions * sessions) {
   ONION_DEBUG0("Free onion sessions sqlite3");
   onion_session_sqlite3 *p = sessions->data;
 
 #ifdef HAVE_PTHREADS
+  if (!p->shared_only) {
+    pthread_mutex_lock(&p->mutex);
+    p->stop = true;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+    onion_low_pthread_join(p->writer, NULL);     // Writes all pending
+  }
+  pthread_key_delete(p->reader_key);   // No more exit destructors
+  pthread_mutex_lock(&p->mutex);
+  while (p->readers) {
+    onion_session_sqlite3_reader *r = p->readers;
+    p->readers = r->next;
+    onion_sessions_sqlite3_reader_close(r);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  pthread_cond_destroy(&p->cond);
   pthread_mutex_destroy(&p->mutex);
 #endif
+  if (onion_dict_count(p->pending))
+    onion_sessions_sqlite3_write_batch(p, p->pending);
+  onion_dict_free(p->pending);
   sqlite3_finalize(p->save);
-  sqlite3_finalize(p->get);
+  sqlite3_finalize(p->remove);
+  sqlite3_finalize(p->shared.get);
   sqlite3_close(p->db);
-  onion_low_free(sessions->data);
+  onion_low_free(p->filename);
+  onion_low_free(p);
 
   onion_low_free(sessions);
 }
@@ -67,16 +297,31 @@ static onion_dict *onion_sessions_sqlite3_get(onion_sessions * sessions,
   ONION_DEBUG0("Load session %s", session_id);
   onion_dict *ret = NULL;
 
+  // Maybe not written yet
+  onion_sessions_sqlite3_lock(p);
+  if (onion_sessions_sqlite3_get_pending(p->pending, session_id, &ret)
+      || onion_sessions_sqlite3_get_pending(p->writing, session_id, &ret)) {
+    onion_sessions_sqlite3_unlock(p);
+    return ret;
+  }
+
+  onion_session_sqlite3_reader *r = &p->shared;
 #ifdef HAVE_PTHREADS
-  pthread_mutex_lock(&p->mutex);
+  if (!p->shared_only) {
+    onion_sessions_sqlite3_unlock(p);   // Own connection, no lock needed
+    r = onion_sessions_sqlite3_reader(p);
+    if (!r)
+      return NULL;
+  }
 #endif
-  sqlite3_reset(p->get);
-  int rc = sqlite3_bind_text(p->get, 1, session_id, -1, SQLITE_STATIC);
+
+  sqlite3_reset(r->get);
+  int rc = sqlite3_bind_text(r->get, 1, session_id, -1, SQLITE_STATIC);
   if (rc != SQLITE_OK) {
     ONION_ERROR("Error binding session_id");
     goto exit;
   }
-  rc = sqlite3_step(p->get);
+  rc = sqlite3_step(r->get);
   if (rc == SQLITE_DONE) {
     ONION_DEBUG0("No session found. Returning NULL");
     goto exit;
@@ -84,114 +329,118 @@ static onion_dict *onion_sessions_sqlite3_get(onion_sessions * sessions,
     ONION_ERROR("Error loading session (%d)", rc);
     goto exit;
   }
-  const char *text;
-  text = (const char *)sqlite3_column_text(p->get, 0);
-
-  ret = onion_dict_from_json(text);
+  const char *blob;
+  blob = sqlite3_column_blob(r->get, 0);
+  ret = onion_dict_from_binary(blob, sqlite3_column_bytes(r->get, 0),
+                               OD_DUP_VALUE);
+  if (!ret && blob && *blob == '{')     // Saved as json by older versions
+    ret = onion_dict_from_json((const char *)sqlite3_column_text(r->get, 0));
   if (!ret) {
-    ONION_DEBUG0("Invalid session parsing for id %s: %s", session_id, text);
+    ONION_DEBUG0("Invalid session parsing for id %s", session_id);
     ONION_ERROR("Invalid session data");
   }
  exit:
-#ifdef HAVE_PTHREADS
-  pthread_mutex_unlock(&p->mutex);
-#endif
+  sqlite3_reset(r->get);        // Do not keep the read transaction open
+  if (p->shared_only)
+    onion_sessions_sqlite3_unlock(p);
 
   return ret;
 }
 
-void onion_sessions_sqlite3_save(onion_sessions * sessions,
-                                 const char *session_id, onion_dict * data) {
-  onion_block *bl = onion_dict_to_json(data);
-
-  ONION_DEBUG0("Save session %s: %s", session_id, onion_block_data(bl));
-  const char *json = onion_block_data(bl);
-
-  int rc;
+/**
+ * @short Queues the session to be saved, or removed if data is NULL.
+ *
+ * It is written by the background writer, but from now on get already returns the new data.
+ */
+static void onion_sessions_sqlite3_save(onion_sessions * sessions,
+                                        const char *session_id,
+                                        onion_dict * data) {
   onion_session_sqlite3 *p = sessions->data;
-#ifdef HAVE_PTHREADS
-  pthread_mutex_lock(&p->mutex);
-#endif
-  sqlite3_reset(p->save);
-  rc = sqlite3_bind_text(p->save, 1, session_id, -1, SQLITE_STATIC);
-  if (rc != SQLITE_OK) {
-    ONION_ERROR("Error binding session_id");
-    goto error;
-  }
-  rc = sqlite3_bind_text(p->save, 2, json, -1, SQLITE_STATIC);
-  if (rc != SQLITE_OK) {
-    ONION_ERROR("Error binding json data");
-    goto error;
-  }
-  rc = sqlite3_step(p->save);
-  if (rc != SQLITE_DONE) {
-    ONION_ERROR("Error saving session (%d)", rc);
-    goto error;
-  }
+  ONION_DEBUG0("%s session %s", data ? "Save" : "Remove", session_id);
+  // Copied now, as data may change; serialized at the writer.
+  onion_dict *copy = data ? onion_dict_hard_dup(data) : NULL;
 
-  ONION_DEBUG0("Session saved");
- error:
-  onion_block_free(bl);
+  onion_sessions_sqlite3_lock(p);
+  if (copy)
+    onion_dict_add(p->pending, session_id, copy,
+                   OD_DUP_KEY | OD_DICT | OD_FREE_VALUE | OD_REPLACE);
+  else
+    onion_dict_add(p->pending, session_id, "", OD_DUP_KEY | OD_REPLACE);
+  p->npending++;
+  if (p->shared_only) {         // No writer thread, write now.
+    onion_sessions_sqlite3_write_batch(p, p->pending);
+    onion_dict_free(p->pending);
+    p->pending = onion_dict_new();
+    p->npending = 0;
+  }
 #ifdef HAVE_PTHREADS
-  pthread_mutex_unlock(&p->mutex);
+  else
+    pthread_cond_signal(&p->cond);
 #endif
-  return;
+  onion_sessions_sqlite3_unlock(p);
 }
 
 /**
  * @short Creates a sqlite backend for sessions
  * @ingroup sessions
  *
+ * The database is set in WAL mode, so reads do not block writes. Each thread has its own
+ * read connection, and saves are grouped by a background thread and written in a single
+ * transaction every few milliseconds.
+ *
  * @see onion_set_session_backend
  */
 onion_sessions *onion_sessions_sqlite3_new(const char *database_filename) {
   onion_random_init();
 
-  int rc;
-  sqlite3 *db;
-  sqlite3_stmt *save;
-  sqlite3_stmt *get;
-  rc = sqlite3_open(database_filename, &db);
-  if (rc) {
-    ONION_ERROR("Can't open database: %s", sqlite3_errmsg(db));
-    sqlite3_close(db);
+  sqlite3 *db = onion_sessions_sqlite3_open(database_filename,
+                                            SQLITE_OPEN_READWRITE |
+                                            SQLITE_OPEN_CREATE);
+  if (!db)
     return NULL;
-  }
-  // I blindly try to create tables. If they exist, error, if not, create
-  sqlite3_exec(db, "CREATE TABLE sessions (id TEXT PRIMARY KEY, data TEXT)", 0,
-               0, 0);
+  sqlite3_exec(db, "PRAGMA journal_mode=WAL", 0, 0, 0);
+  sqlite3_exec(db, "PRAGMA synchronous=NORMAL", 0, 0, 0);
+  sqlite3_exec(db,
+               "CREATE TABLE IF NOT EXISTS sessions (id TEXT PRIMARY KEY, data TEXT)",
+               0, 0, 0);
 
-  const char *GET_SQL = "SELECT data FROM sessions WHERE id=?";
-  rc = sqlite3_prepare_v2(db, GET_SQL, strlen(GET_SQL), &get, NULL);
-  if (rc != SQLITE_OK) {
-    ONION_ERROR("Cant prepare statement to get (%d)", rc);
+  onion_session_sqlite3 *p = onion_low_calloc(1, sizeof(onion_session_sqlite3));
+  p->db = db;
+  if (onion_sessions_sqlite3_prepare(db, "SELECT data FROM sessions WHERE id=?",
+                                     &p->shared.get) != SQLITE_OK
+      || onion_sessions_sqlite3_prepare(db,
+                                        "INSERT OR REPLACE INTO sessions (id, data) VALUES (?, ?)",
+                                        &p->save) != SQLITE_OK
+      || onion_sessions_sqlite3_prepare(db, "DELETE FROM sessions WHERE id=?",
+                                        &p->remove) != SQLITE_OK) {
+    sqlite3_finalize(p->shared.get);
+    sqlite3_finalize(p->save);
     sqlite3_close(db);
+    onion_low_free(p);
     return NULL;
   }
+  p->filename = onion_low_strdup(database_filename);
+  p->pending = onion_dict_new();
 
-  const char *SAVE_SQL =
-      "INSERT OR REPLACE INTO sessions (id, data) VALUES (?, ?);";
-  rc = sqlite3_prepare_v2(db, SAVE_SQL, strlen(SAVE_SQL), &save, NULL);
-  if (rc != SQLITE_OK) {
-    ONION_ERROR("Cant prepare statement to save (%d)", rc);
-    sqlite3_close(db);
-    return NULL;
-  }
+  // In memory databases are private to the connection, so can not have more.
+  p->shared_only = (database_filename[0] == '\0'
+                    || strcmp(database_filename, ":memory:") == 0);
+#ifdef HAVE_PTHREADS
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  pthread_key_create(&p->reader_key, onion_sessions_sqlite3_reader_exit);
+  if (!p->shared_only)
+    onion_low_pthread_create(&p->writer, NULL, onion_sessions_sqlite3_writer,
+                             p);
+#else
+  p->shared_only = true;
+#endif
 
   onion_sessions *ret = onion_low_malloc(sizeof(onion_sessions));
-
-  ret->data = onion_low_malloc(sizeof(onion_session_sqlite3));
+  ret->data = p;
   ret->free = onion_sessions_sqlite3_free;
   ret->get = onion_sessions_sqlite3_get;
   ret->save = onion_sessions_sqlite3_save;
 
-  onion_session_sqlite3 *p = ret->data;
-  p->db = db;
-  p->save = save;
-  p->get = get;
-#ifdef HAVE_PTHREADS
-  pthread_mutex_init(&p->mutex, NULL);
-#endif
-
   return ret;
 }
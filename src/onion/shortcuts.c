@@ -58,6 +58,7 @@ int onion_use_sendfile = -1;
 
 // Import it here as I need it to know if can use sendfile.
 ssize_t onion_http_write(onion_request * req, const char *data, size_t len);
+int onion_http_write_batch_end(onion_request * req);
 
 /**
  * @short Shortcut for fast responses, like errors.
@@ -196,11 +197,11 @@ onion_connection_status onion_shortcut_response_file(const char *filename,
   char etag[64];
   onion_shortcut_etag(&st, etag);
 
-  const char *range = onion_request_get_header(request, "Range");
+  const char *range = onion_request_get_header_id(request, OH_RANGE);
   if (range) {
     strncat(etag, range, sizeof(etag) - 1);
   }
-  onion_response_set_header(res, "Etag", etag);
+  onion_response_set_header_id(res, OH_ETAG, etag);
 
   if (range && strncmp(range, "bytes=", 6) == 0) {
     onion_response_set_code(res, HTTP_PARTIAL_CONTENT);
@@ -236,11 +237,12 @@ onion_connection_status onion_shortcut_response_file(const char *filename,
   }
 
   onion_response_set_length(res, length);
-  onion_response_set_header(res, "Content-Type", onion_mime_get(filename));
+  onion_response_set_header_id(res, OH_CONTENT_TYPE, onion_mime_get(filename));
   ONION_DEBUG("Mime type is %s", onion_mime_get(filename));
 
   ONION_DEBUG0("Etag %s", etag);
-  const char *prev_etag = onion_request_get_header(request, "If-None-Match");
+  const char *prev_etag =
+      onion_request_get_header_id(request, OH_IF_NONE_MATCH);
   if (prev_etag && (strcmp(prev_etag, etag) == 0)) {
     ONION_DEBUG0("Not modified");
     onion_response_set_length(res, 0);
@@ -258,6 +260,10 @@ onion_connection_status onion_shortcut_response_file(const char *filename,
 #ifdef USE_SENDFILE
     if (use_sendfile && request->connection.listen_point->write == (void *)onion_http_write) {  // Lets have a house party! I can use sendfile!
       onion_response_write(res, NULL, 0);
+      if (onion_http_write_batch_end(request) < 0) {    // Pipelined responses must go before.
+        close(fd);
+        return OCS_CLOSE_CONNECTION;
+      }
       ONION_DEBUG("Using sendfile");
       int r = sendfile(request->connection.fd, fd, NULL, length);
       ONION_DEBUG("Wrote %d, should be %d (%s)", r, length,
@@ -315,7 +321,7 @@ onion_connection_status onion_shortcut_response_file(const char *filename,
 onion_connection_status onion_shortcut_response_json(onion_dict * d,
                                                      onion_request * req,
                                                      onion_response * res) {
-  onion_response_set_header(res, "Content-Type", "application/json");
+  onion_response_set_header_id(res, OH_CONTENT_TYPE, "application/json");
 
   onion_block *bl = onion_dict_to_json(d);
   onion_dict_free(d);
@@ -67,6 +67,13 @@ extern "C" {
  */
   struct onion_response_t;
   typedef struct onion_response_t onion_response;
+/**
+ * @struct onion_response_template_t
+ * @short Pre-serialized block of constant response headers
+ * @ingroup response
+ */
+  struct onion_response_template_t;
+  typedef struct onion_response_template_t onion_response_template;
 /**
  * @struct onion_server_t
  * @short Onion server that do not depend on specific IO structure.
@@ -108,6 +115,18 @@ extern "C" {
   struct onion_sessions_t;
   typedef struct onion_sessions_t onion_sessions;
 
+/**
+ * @struct onion_access_log_t
+ * @short Sink for the access log, where each finished request is written.
+ * @ingroup access_log
+ *
+ * Created with onion_access_log_file or onion_access_log_memory, and set with onion_set_access_log.
+ */
+  struct onion_access_log_t;
+  typedef struct onion_access_log_t onion_access_log;
+  struct onion_access_log_entry_t;
+  typedef struct onion_access_log_entry_t onion_access_log_entry;
+
 /**
  * @struct onion_block_t
  * @short Data type to store some raw data
@@ -214,6 +233,7 @@ extern "C" {
 
     O_DETACHED = 0x01000,       ///< Currently listening on another thread.
     O_LISTENING = 0x02000,      ///< Currently listening
+    O_DRAINING = 0x04000,       ///< Not accepting, and closing the connections after their current request. @see onion_drain
     /// @}
   };
 
@@ -279,6 +299,41 @@ extern "C" {
 
   typedef enum onion_websocket_opcode_e onion_websocket_opcode;
 
+/**
+ * @short Well known headers.
+ * @ingroup request
+ *
+ * Request headers with these names are resolved once while parsing, so they can be
+ * accessed without string comparisons. @see onion_request_get_header_id
+ */
+  enum onion_header_e {
+    OH_UNKNOWN = -1,
+    OH_HOST = 0,
+    OH_CONTENT_LENGTH,
+    OH_CONTENT_TYPE,
+    OH_CONNECTION,
+    OH_COOKIE,
+    OH_UPGRADE,
+    OH_AUTHORIZATION,
+    OH_ACCEPT_LANGUAGE,
+    OH_RANGE,
+    OH_IF_NONE_MATCH,
+    OH_SEC_WEBSOCKET_KEY,
+    OH_SEC_WEBSOCKET_PROTOCOL,
+    OH_SEC_WEBSOCKET_VERSION,
+    OH_DESTINATION,
+    OH_DEPTH,
+    OH_TRANSFER_ENCODING,
+    OH_DATE,
+    OH_SERVER,
+    OH_LOCATION,
+    OH_ETAG,
+    OH_SET_COOKIE,
+    OH_COUNT                    ///< Number of well known headers. Not a header.
+  };
+
+  typedef enum onion_header_e onion_header;
+
 /// Signature of request handlers.
 /// @ingroup handler
   typedef onion_connection_status(*onion_handler_handler) (void *privdata,
@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "types.h"
 
 #ifdef HAVE_GNUTLS
@@ -44,6 +45,12 @@ extern "C" {
 
 #define ONION_REQUEST_BUFFER_SIZE 256
 #define ONION_RESPONSE_BUFFER_SIZE 1500
+#define ONION_READ_BUFFER_SIZE 16384
+#define ONION_ACCEPT_BATCH 64
+/// Counters for the per client address connection limit. Addresses are hashed into them.
+#define ONION_ADMISSION_IP_SLOTS 4096
+/// Body of the 503 answers when over the server limits.
+#define ONION_OVERLOAD_MESSAGE "Service Unavailable\n"
 
   struct onion_dict_node_t;
 
@@ -54,6 +61,8 @@ extern "C" {
     pthread_mutex_t refmutex;
 #endif
     int refcount;
+    uint64_t generation;        ///< Set from a process wide counter on each modification. @see onion_dict_generation
+    char *binary_data;          ///< Data owned by the dict, that keys and values point into. @see onion_dict_from_binary
     int (*cmp) (const char *a, const char *b);
   };
 
@@ -69,7 +78,20 @@ extern "C" {
     onion_handler *internal_error_handler;      /// Root processing handler for this server.
     size_t max_post_size;       /// Maximum size of post data. This is the sum of posts, @see onion_request_write_post
     size_t max_file_size;       /// Maximum size of files. @see onion_request_write_post
+    size_t read_buffer_size;    /// Size of the read buffer of each connection. @see onion_set_read_buffer_size
+    int listen_backlog;         /// Backlog of the listen sockets; 0 for the system max. @see onion_set_listen_backlog
+    int accept_batch;           /// Max connections accepted on each listen socket wakeup. @see onion_set_accept_batch
     onion_sessions *sessions;   /// Storage for sessions.
+    onion_access_log *access_log;       /// Where to log each request, or NULL. @see onion_set_access_log
+    int max_connections;        /// Max open connections, 0 no limit. @see onion_set_max_connections
+    int max_connections_per_ip; /// Max open connections from a client address, 0 no limit.
+    int max_requests;           /// Max requests in process at once, 0 no limit. @see onion_set_max_requests
+    int connections;            /// Open connections accepted at the poller. Atomic.
+    int requests;               /// Requests in process counted for the limit. Atomic.
+    int *ip_connections;        /// Open connections per hashed client address, ONION_ADMISSION_IP_SLOTS. NULL if no per address limit.
+    char retry_after[12];       /// Retry-After of the 503 answers when over the limits.
+    char overload_response[192];        /// Pre-rendered 503 answer for connections over the limits.
+    int overload_response_length;
     void *client_data;
     onion_client_data_free_sig *client_data_free;
 #ifdef HAVE_PTHREADS
@@ -85,6 +107,18 @@ extern "C" {
     struct onion_ptr_list_t *next;
   };
 
+  /// A key/value pair pointing inside some request owned buffer. Used for lazily parsed query and cookies.
+  typedef struct onion_request_slice_t {
+    const char *key;
+    const char *value;
+  } onion_request_slice;
+
+  /// Position of a header key and value inside the raw headers block.
+  typedef struct onion_request_header_index_t {
+    int key;
+    int value;
+  } onion_request_header_index;
+
   struct onion_request_t {
     struct {
       onion_listen_point *listen_point;
@@ -93,22 +127,42 @@ extern "C" {
       struct sockaddr_storage cli_addr;
       socklen_t cli_len;
       char *cli_info;
+      char *read_buffer;        ///< Buffer for reads from the client, created on first read.
+      size_t read_buffer_size;
+      onion_block *write_batch; ///< While processing pipelined requests, output is stored here and written at once.
+      int admitted;             ///< Counted at the server connection limits: 0 no, else 1 + its client address slot.
     } connection;               /// Connection to the client.
     int flags;                  /// Flags for this response. Ored onion_request_flags_e
 
     char *fullpath;             /// Original path for the request
     char *path;                 /// Path at this level. Its actually a pointer inside fullpath, removing the leading parts already processed by handlers
-    onion_dict *headers;        /// Headers prepared for this response.
-    onion_dict *GET;            /// When the query (?q=query) is processed, the dict with the values @see onion_request_parse_query
+    onion_dict *headers;        /// Dict with the headers. Only created if asked by onion_request_get_header_dict, else NULL.
+    onion_block *headers_data;  /// Raw headers, as key\0value\0 strings. Reused on keep alive.
+    onion_request_header_index *headers_index;  /// Offsets of each header inside headers_data.
+    int headers_count;          /// Number of headers at headers_index.
+    int headers_index_size;     /// Allocated entries at headers_index.
+    int known_headers[OH_COUNT];        /// Offset (+1) of the value of well known headers at headers_data, 0 if not present.
+    long content_length;        /// Parsed Content-Length, or -1 if not present.
+    onion_dict *GET;            /// Dict with the query values. Only created if asked by onion_request_get_query_dict, else NULL.
+    char *query;                /// Raw query string (after ?), inside fullpath. Split and unquoted inplace the first time its needed.
+    onion_request_slice *query_slices;  /// Parsed query, as slices inside query.
+    int query_count;            /// Number of query slices, or -1 if still not parsed.
     onion_dict *POST;           /// Dictionary with POST values
     onion_dict *FILES;          /// Dictionary with files. They are automatically saved at /tmp/ and removed at request free. mapped string is full path.
     onion_dict *session;        /// Pointer to related session
+    uint64_t session_generation;    /// Generation of the session when loaded. If changes, it must be saved.
     onion_block *data;          /// Some extra data from PUT, normally PROPFIND.
-    onion_dict *cookies;        /// Data about cookies.
+    onion_dict *cookies;        /// Dict with the cookies. Only created if asked by onion_request_get_cookies_dict, else NULL.
+    char *cookies_data;         /// Copy of the Cookie header, split inplace.
+    onion_request_slice *cookies_slices;        /// Parsed cookies, as slices inside cookies_data.
+    int cookies_count;          /// Number of cookie slices, or -1 if still not parsed.
     char *session_id;           /// Session id of the request, if any.
     void *parser;               /// When recieving data, where to put it. Check at request_parser.c.
     void *parser_data;          /// Data necesary while parsing, muy be deleted when state changed. At free is simply freed.
     onion_websocket *websocket; /// Websocket handler. 
+    void (*yield_callback) (void *);    /// Called once the request, after OCS_YIELD, is detached from the poller. @see onion_request_set_yield_callback
+    void *yield_data;           /// Data for yield_callback.
+    uint64_t process_start;     /// When onion_request_process started, from onion_metrics_now. For latencies.
     onion_ptr_list *free_list;  /// Memory that should be freed when the request finishes. IT allows to have simpler onion_dict, which dont copy/free data, but just splits a long string inplace.
   };
 
@@ -122,6 +176,7 @@ extern "C" {
     unsigned int sent_bytes_total;      /// Total sent bytes, including headers.
     char buffer[ONION_RESPONSE_BUFFER_SIZE];    /// buffer of output data. This way its do not send small chunks all the time, but blocks, so better network use. Also helps to keep alive connections with less than block size bytes.
     off_t buffer_pos;           /// Position in the internal buffer. When sizeof(buffer) its flushed to the onion IO.
+    const onion_response_template *header_template;     /// Constant headers, already serialized, to write with the headers.
   };
 
   struct onion_handler_t {
@@ -145,6 +200,15 @@ extern "C" {
     void (*free) (onion_sessions * sessions);
   };
 
+  struct onion_access_log_t {
+    void *data;
+
+    void (*write) (onion_access_log * log,
+                   const onion_access_log_entry * entry);
+    void (*flush) (onion_access_log * log);
+    void (*free) (onion_access_log * log);
+  };
+
   struct onion_block_t {
     char *data;
     int size;
@@ -161,6 +225,7 @@ extern "C" {
     char *port;                 ///< Stated port, if none then 8080
     int listenfd;               ///< For socket listening listen points, the listen fd. For others may be -1 as not used, or an fd to watch and when changed calls the request_init with a new request.
     bool secure;                ///< Is this listen point secure?
+    int accepting;              ///< Threads at onion_listen_point_accept, so onion_drain closes the listenfd after them.
 
     /// Internal data used by the listen point, for example in HTTPS is the certificate loaded data.
     void *user_data;
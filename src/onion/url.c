@@ -30,6 +30,7 @@
 #include "log.h"
 #include "handler.h"
 #include "response.h"
+#include "request.h"
 #include "url.h"
 #include "types_internal.h"
 #include "dict.h"
@@ -87,10 +88,12 @@ int onion_url_handler(onion_url_data ** dd, onion_request * request,
             (&next->regexp, onion_request_get_path(request), 16, match,
              0) == 0) {
       //ONION_DEBUG("Ok,match");
-      onion_dict *reqheader = request->GET;
+      onion_dict *reqheader = NULL;
       for (i = 1; i < 16; i++) {
         regmatch_t *rm = &match[i];
         if (rm->rm_so != -1) {
+          if (!reqheader)       // Groups are stored at the query dict, so make sure it exists.
+            reqheader = (onion_dict *) onion_request_get_query_dict(request);
           char *tmp = onion_low_scalar_malloc(rm->rm_eo - rm->rm_so + 1);
           memcpy(tmp, &path[rm->rm_so], rm->rm_eo - rm->rm_so);
           tmp[rm->rm_eo - rm->rm_so] = '\0';    // proper finish string
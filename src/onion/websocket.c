@@ -79,17 +79,18 @@ onion_websocket *onion_websocket_new(onion_request * req, onion_response * res)
 
   onion_random_init();
 
-  const char *upgrade = onion_request_get_header(req, "Upgrade");
+  const char *upgrade = onion_request_get_header_id(req, OH_UPGRADE);
   if (!upgrade || strcasecmp(upgrade, "websocket") != 0)
     return NULL;
 
   ONION_DEBUG("Websockets!");
 
-  const char *ws_key = onion_request_get_header(req, "Sec-Websocket-Key");
+  const char *ws_key =
+      onion_request_get_header_id(req, OH_SEC_WEBSOCKET_KEY);
   const char *ws_protocol =
-      onion_request_get_header(req, "Sec-Websocket-Protocol");
+      onion_request_get_header_id(req, OH_SEC_WEBSOCKET_PROTOCOL);
   const char *ws_version =
-      onion_request_get_header(req, "Sec-Websocket-Version");
+      onion_request_get_header_id(req, OH_SEC_WEBSOCKET_VERSION);
 
   if (!ws_version || !ws_key) {
     ONION_ERROR("Websocket is missing some data: need key and version");
@@ -119,7 +120,7 @@ onion_websocket *onion_websocket_new(onion_request * req, onion_response * res)
   onion_response_set_code(res, HTTP_SWITCH_PROTOCOL);
   res->flags |= OR_CONNECTION_UPGRADE;
   res->flags |= OR_LENGTH_SET;  // Fix for Chrome to close cleanly websocket connections
-  onion_response_set_header(res, "Upgrade", "websocket");
+  onion_response_set_header_id(res, OH_UPGRADE, "websocket");
   if (ws_protocol)
     onion_response_set_header(res, "Sec-Websocket-Procotol", ws_protocol);
   onion_response_set_header(res, "Sec-Websocket-Accept", key_answer);
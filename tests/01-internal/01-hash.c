@@ -30,6 +30,7 @@
 #include "../ctest.h"
 #include <unistd.h>
 #include <onion/block.h>
+#include <onion/low.h>
 
 #ifdef HAVE_PTHREADS
 #include <pthread.h>
@@ -811,6 +812,119 @@ void t18_json_escape_codes() {
   END_LOCAL();
 }
 
+void t19_generation() {
+  INIT_LOCAL();
+
+  onion_dict *d = onion_dict_new();
+  uint64_t g = onion_dict_generation(d);
+
+  onion_dict_add(d, "a", "1", 0);
+  FAIL_IF_EQUAL(onion_dict_generation(d), g);
+  g = onion_dict_generation(d);
+
+  onion_dict_get(d, "a");
+  onion_dict_count(d);
+  FAIL_IF_NOT_EQUAL(onion_dict_generation(d), g);
+
+  onion_dict *sub = onion_dict_new();
+  onion_dict_add(d, "sub", sub, OD_DICT | OD_FREE_VALUE);
+  g = onion_dict_generation(d);
+  onion_dict_add(sub, "b", "2", 0);
+  FAIL_IF_EQUAL(onion_dict_generation(d), g);
+  g = onion_dict_generation(d);
+
+  onion_dict_remove(d, "a");
+  FAIL_IF_EQUAL(onion_dict_generation(d), g);
+
+  // Removing a modified subdict and adding as many keys must not go back to the same generation.
+  onion_dict_add(sub, "c", "3", 0);
+  onion_dict_add(sub, "d", "4", 0);
+  g = onion_dict_generation(d);
+  onion_dict_remove(d, "sub");
+  FAIL_IF_EQUAL(onion_dict_generation(d), g);
+  onion_dict_add(d, "e", "5", 0);
+  FAIL_IF_EQUAL(onion_dict_generation(d), g);
+  onion_dict_add(d, "f", "6", 0);
+  FAIL_IF_EQUAL(onion_dict_generation(d), g);
+  onion_dict_add(d, "g", "7", 0);
+  FAIL_IF_EQUAL(onion_dict_generation(d), g);
+
+  onion_dict_free(d);
+
+  END_LOCAL();
+}
+
+void t20_binary() {
+  INIT_LOCAL();
+
+  onion_dict *d = onion_dict_new();
+  onion_dict_add(d, "Hello", "World", 0);
+  onion_dict_add(d, "empty", "", 0);
+  onion_dict_add(d, "", "empty key", 0);
+  onion_dict *sub = onion_dict_new();
+  onion_dict_add(sub, "a", "1", 0);
+  onion_dict_add(sub, "sub", onion_dict_new(), OD_DICT | OD_FREE_VALUE);
+  onion_dict_add(d, "sub", sub, OD_DICT | OD_FREE_VALUE);
+
+  onion_block *bl = onion_dict_to_binary(d);
+  FAIL_IF_EQUAL(bl, NULL);
+
+  // Zero copy, points inside the block
+  onion_dict *r =
+      onion_dict_from_binary(onion_block_data(bl), onion_block_size(bl), 0);
+  FAIL_IF_EQUAL(r, NULL);
+  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(r), 4);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(r, "Hello"), "World");
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(r, "empty"), "");
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(r, ""), "empty key");
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(r, "sub", "a", NULL), "1");
+  FAIL_IF_EQUAL(onion_dict_rget_dict(r, "sub", "sub", NULL), NULL);
+  const char *hello = onion_dict_get(r, "Hello");
+  FAIL_IF(hello < onion_block_data(bl)
+          || hello >= onion_block_data(bl) + onion_block_size(bl));
+
+  // Same data as json
+  onion_block *j1 = onion_dict_to_json(d);
+  onion_block *j2 = onion_dict_to_json(r);
+  FAIL_IF_NOT_EQUAL_STR(onion_block_data(j1), onion_block_data(j2));
+  onion_block_free(j1);
+  onion_block_free(j2);
+
+  // Can be modified
+  onion_dict_add(r, "Hello", "Changed", OD_DUP_VALUE | OD_REPLACE);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(r, "Hello"), "Changed");
+  onion_dict_free(r);
+
+  // Owned data
+  r = onion_dict_from_binary(onion_block_data(bl), onion_block_size(bl),
+                             OD_DUP_VALUE);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(r, "Hello"), "World");
+  onion_dict_free(r);
+
+  char *owned = onion_low_malloc(onion_block_size(bl));
+  memcpy(owned, onion_block_data(bl), onion_block_size(bl));
+  r = onion_dict_from_binary(owned, onion_block_size(bl), OD_FREE_VALUE);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(r, "sub", "a", NULL), "1");
+  onion_dict_free(r);
+
+  // Any truncation is invalid
+  int i;
+  for (i = 0; i < onion_block_size(bl); i++)
+    FAIL_IF_NOT_EQUAL(onion_dict_from_binary(onion_block_data(bl), i, 0),
+                      NULL);
+  // Trailing data too
+  onion_block_add_char(bl, 0);
+  FAIL_IF_NOT_EQUAL(onion_dict_from_binary
+                    (onion_block_data(bl), onion_block_size(bl), 0), NULL);
+  // And json
+  FAIL_IF_NOT_EQUAL(onion_dict_from_binary("{\"a\":\"1\"}", 9, 0), NULL);
+
+  onion_block_free(bl);
+  onion_dict_free(d);
+
+  END_LOCAL();
+}
+
 int main(int argc, char **argv) {
   START();
   t01_create_add_free();
@@ -834,6 +948,8 @@ int main(int argc, char **argv) {
   t16_soft_dup_dict_in_dict();
   t17_merge();
   t18_json_escape_codes();
+  t19_generation();
+  t20_binary();
 
   END();
 }
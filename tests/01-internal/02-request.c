@@ -28,6 +28,7 @@
 #include <onion/onion.h>
 #include <onion/dict.h>
 #include <onion/request.h>
+#include <onion/headers.h>
 #include <onion/types_internal.h>
 #include <onion/listen_point.h>
 #include <onion/http.h>
@@ -129,9 +130,8 @@ void t03_create_add_free_full_flow() {
 
   FAIL_IF_EQUAL(req->flags, OR_GET | OR_HTTP11);
 
-  FAIL_IF_EQUAL(req->headers, NULL);
-  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->headers, "Host"), "127.0.0.1");
-  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->headers, "Other-Header"),
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req, "Host"), "127.0.0.1");
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req, "Other-Header"),
                         "My header is very long and with spaces...");
 
   FAIL_IF_NOT_EQUAL_STR(req->fullpath, "/myurl /is/very/deeply/nested");
@@ -139,10 +139,9 @@ void t03_create_add_free_full_flow() {
   onion_request_process(req);   // this should set the req->path.
   FAIL_IF_NOT_EQUAL_STR(req->path, "myurl /is/very/deeply/nested");
 
-  FAIL_IF_EQUAL(req->GET, NULL);
-  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->GET, "test"), "test");
-  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->GET, "query2"), "query 2");
-  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->GET, "more_query"),
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "test"), "test");
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "query2"), "query 2");
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "more_query"),
                         " more query 10");
   FAIL_IF_EQUAL(onion_request_get_query(req, "empty"), NULL);
   FAIL_IF_EQUAL(onion_request_get_query(req, "empty2"), NULL);
@@ -175,11 +174,13 @@ void t04_create_add_free_GET() {
     FAIL_IF_NOT_EQUAL_INT(ok, OCS_REQUEST_READY);
     FAIL_IF_EQUAL(req->flags, OR_GET | OR_HTTP11);
 
-    FAIL_IF_EQUAL(req->headers, NULL);
-    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->headers, "Host"), "127.0.0.1");
-    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->headers, "Other-Header"),
+    FAIL_IF_NOT_EQUAL(req->headers, NULL);   // Lazy, only on demand
+    FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req, "Host"), "127.0.0.1");
+    FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req, "Other-Header"),
                           "My header is very long and with spaces...");
-    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->headers, "other-heaDER"),
+    const onion_dict *headers = onion_request_get_header_dict(req);
+    FAIL_IF_EQUAL(headers, NULL);
+    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(headers, "other-heaDER"),
                           "My header is very long and with spaces...");
     FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req, "other-heaDER"),
                           "My header is very long and with spaces...");
@@ -189,10 +190,12 @@ void t04_create_add_free_GET() {
     onion_request_polish(req);
     FAIL_IF_NOT_EQUAL_STR(req->path, "myurl /is/very/deeply/nested");
 
-    FAIL_IF_EQUAL(req->GET, NULL);
-    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->GET, "test"), "test");
-    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->GET, "query2"), "query 2");
-    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->GET, "more_query"),
+    FAIL_IF_NOT_EQUAL(req->GET, NULL);       // Lazy, only on demand
+    const onion_dict *get = onion_request_get_query_dict(req);
+    FAIL_IF_EQUAL(get, NULL);
+    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(get, "test"), "test");
+    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(get, "query2"), "query 2");
+    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(get, "more_query"),
                           " more query 10");
 
     onion_request_clean(req);
@@ -227,9 +230,9 @@ void t05_create_add_free_POST() {
     FAIL_IF_NOT_EQUAL(ok, OCS_REQUEST_READY);
     FAIL_IF_EQUAL(req->flags, OR_GET | OR_HTTP11);
 
-    FAIL_IF_EQUAL(req->headers, NULL);
-    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->headers, "Host"), "127.0.0.1");
-    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->headers, "Other-Header"),
+    FAIL_IF_NOT_EQUAL(req->headers, NULL);   // Lazy, only on demand
+    FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req, "Host"), "127.0.0.1");
+    FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req, "Other-Header"),
                           "My header is very long and with spaces...");
 
     FAIL_IF_NOT_EQUAL_STR(req->fullpath, "/myurl /is/very/deeply/nested");
@@ -237,10 +240,12 @@ void t05_create_add_free_POST() {
     onion_request_polish(req);
     FAIL_IF_NOT_EQUAL_STR(req->path, "myurl /is/very/deeply/nested");
 
-    FAIL_IF_EQUAL(req->GET, NULL);
-    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->GET, "test"), "test");
-    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->GET, "query2"), "query 2");
-    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(req->GET, "more_query"),
+    FAIL_IF_NOT_EQUAL(req->GET, NULL);       // Lazy, only on demand
+    const onion_dict *get = onion_request_get_query_dict(req);
+    FAIL_IF_EQUAL(get, NULL);
+    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(get, "test"), "test");
+    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(get, "query2"), "query 2");
+    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(get, "more_query"),
                           " more query 10");
 
     const onion_dict *post = onion_request_get_post_dict(req);
@@ -538,6 +543,201 @@ void t11_cookies() {
   END_LOCAL();
 }
 
+void t12_lazy_query_and_cookies() {
+  INIT_LOCAL();
+
+  onion_request *req;
+  int ok;
+
+  req = onion_request_new(custom_io);
+  FAIL_IF_EQUAL(req, NULL);
+
+  {
+    const char *query =
+        "GET /path?a=1&b=%41%62c&&c&d=x=y&e=100%&f=%zz%4 HTTP/1.0\n"
+        "Cookie: one=1;  two=%20two ;three;=four; five=\n\n";
+
+    ok = onion_request_write(req, query, strlen(query));
+  }
+  FAIL_IF_NOT_EQUAL_INT(ok, OCS_REQUEST_READY);
+  FAIL_IF_NOT_EQUAL_STR(req->fullpath, "/path");
+  FAIL_IF_NOT_EQUAL(req->GET, NULL);
+  FAIL_IF_NOT_EQUAL(req->cookies, NULL);
+
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "a"), "1");
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "b"), "Abc");
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "c"), "");
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "d"), "x=y");
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "e"), "100%");
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "f"), "%zz%4");
+  FAIL_IF_NOT_EQUAL(onion_request_get_query(req, ""), NULL);
+  FAIL_IF_NOT_EQUAL(onion_request_get_query(req, "g"), NULL);
+  FAIL_IF_NOT_EQUAL(req->GET, NULL);
+
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_cookie(req, "one"), "1");
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_cookie(req, "two"), "%20two ");
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_cookie(req, "five"), "");
+  FAIL_IF_NOT_EQUAL(onion_request_get_cookie(req, "three"), NULL);
+  FAIL_IF_NOT_EQUAL(req->cookies, NULL);
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req, "Cookie"),
+                        "one=1;  two=%20two ;three;=four; five=");
+
+  const onion_dict *get = onion_request_get_query_dict(req);
+  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(get), 6);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(get, "b"), "Abc");
+  onion_dict *cookies = onion_request_get_cookies_dict(req);
+  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(cookies), 3);
+
+  onion_request_clean(req);
+  FAIL_IF_NOT_EQUAL(req->GET, NULL);
+  FAIL_IF_NOT_EQUAL(req->cookies, NULL);
+  FAIL_IF_NOT_EQUAL(onion_request_get_query(req, "a"), NULL);
+  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(onion_request_get_query_dict(req)),
+                        0);
+
+  onion_request_free(req);
+
+  END_LOCAL();
+}
+
+void t13_lazy_headers() {
+  INIT_LOCAL();
+
+  onion_request *req;
+  int ok;
+
+  req = onion_request_new(custom_io);
+  FAIL_IF_EQUAL(req, NULL);
+
+  const char *query = "GET / HTTP/1.1\n"
+      "Host: example.com\n"
+      "Accept: */*\n" "X-Multi: first\n second\n" "accept: other\n\n";
+
+  int i;
+  for (i = 0; i < 3; i++) {
+    ok = onion_request_write(req, query, strlen(query));
+    FAIL_IF_NOT_EQUAL_INT(ok, OCS_REQUEST_READY);
+
+    FAIL_IF_NOT_EQUAL_INT(req->headers_count, 4);
+    FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req, "HOST"),
+                          "example.com");
+    FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req, "Accept"), "*/*");
+    FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req, "x-multi"),
+                          "first second");
+    FAIL_IF_NOT_EQUAL(onion_request_get_header(req, "Cookie"), NULL);
+    FAIL_IF_NOT_EQUAL(req->headers, NULL);
+
+    onion_request_add_header(req, "Cookie", "a=b");
+    FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req, "cookie"), "a=b");
+    FAIL_IF_NOT_EQUAL(req->headers, NULL);
+
+    const onion_dict *headers = onion_request_get_header_dict(req);
+    FAIL_IF_EQUAL(headers, NULL);
+    FAIL_IF_NOT_EQUAL_INT(onion_dict_count(headers), 5);
+    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(headers, "host"), "example.com");
+
+    onion_request_add_header(req, "X-Late", "late");
+    FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req, "X-Late"), "late");
+    FAIL_IF_NOT_EQUAL_INT(onion_dict_count(headers), 6);
+
+    onion_request_clean(req);
+    FAIL_IF_NOT_EQUAL(req->headers, NULL);
+    FAIL_IF_NOT_EQUAL(onion_request_get_header(req, "Host"), NULL);
+  }
+
+  onion_request_free(req);
+
+  END_LOCAL();
+}
+
+void t14_known_headers() {
+  INIT_LOCAL();
+
+  onion_request *req;
+  int ok;
+
+  FAIL_IF_NOT_EQUAL_INT(onion_header_id("content-LENGTH"), OH_CONTENT_LENGTH);
+  FAIL_IF_NOT_EQUAL_INT(onion_header_id("Content-Lengthx"), OH_UNKNOWN);
+  FAIL_IF_NOT_EQUAL_STR(onion_header_name(OH_HOST), "Host");
+  FAIL_IF_NOT_EQUAL(onion_header_name(OH_COUNT), NULL);
+  FAIL_IF_NOT_EQUAL_INT(onion_header_id("Content-Lenght"), OH_UNKNOWN);
+  FAIL_IF_NOT_EQUAL_INT(onion_header_id("Dates"), OH_UNKNOWN);
+  FAIL_IF_NOT_EQUAL_INT(onion_header_id(""), OH_UNKNOWN);
+  {
+    int i;
+    for (i = 0; i < OH_COUNT; i++)
+      FAIL_IF_NOT_EQUAL_INT(onion_header_id(onion_header_name(i)), i);
+  }
+
+  req = onion_request_new(custom_io);
+  FAIL_IF_EQUAL(req, NULL);
+  FAIL_IF_NOT_EQUAL_INT(onion_request_get_content_length(req), -1);
+
+  const char *query = "GET / HTTP/1.1\n"
+      "host: example.com\n"
+      "Connection: Close\n" "Content-Length: 4\n" "HOST: other\n\nabcd";
+
+  ok = onion_request_write(req, query, strlen(query));
+  FAIL_IF_NOT_EQUAL_INT(ok, OCS_REQUEST_READY);
+  FAIL_IF_NOT_EQUAL_INT(onion_request_get_content_length(req), 4);
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_header_id(req, OH_HOST),
+                        "example.com");
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_header_id(req, OH_CONNECTION),
+                        "Close");
+  FAIL_IF_NOT_EQUAL(onion_request_get_header_id(req, OH_COOKIE), NULL);
+  FAIL_IF_NOT_EQUAL(onion_request_get_header_id(req, OH_COUNT), NULL);
+  FAIL_IF(onion_request_keep_alive(req));
+
+  onion_request_get_header_dict(req);
+  FAIL_IF_EQUAL(onion_request_get_header_id(req, OH_HOST), NULL);
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_header_id(req, OH_CONNECTION),
+                        "Close");
+
+  onion_request_clean(req);
+  FAIL_IF_NOT_EQUAL_INT(onion_request_get_content_length(req), -1);
+  FAIL_IF_NOT_EQUAL(onion_request_get_header_id(req, OH_HOST), NULL);
+
+  onion_request_free(req);
+
+  END_LOCAL();
+}
+
+void t15_write_partial() {
+  INIT_LOCAL();
+
+  onion_request *req;
+  int ok;
+  size_t consumed;
+
+  req = onion_request_new(custom_io);
+  FAIL_IF_EQUAL(req, NULL);
+
+  const char *first = "POST /a HTTP/1.1\n"
+      "Content-Type: application/x-www-form-urlencoded\n"
+      "Content-Length: 3\n\n" "a=1";
+  const char *second = "\r\nGET /b?c=2 HTTP/1.1\n\n";
+  char query[256];
+  snprintf(query, sizeof(query), "%s%s", first, second);
+
+  ok = onion_request_write_partial(req, query, strlen(query), &consumed);
+  FAIL_IF_NOT_EQUAL_INT(ok, OCS_REQUEST_READY);
+  FAIL_IF_NOT_EQUAL_INT(consumed, strlen(first));
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_post(req, "a"), "1");
+
+  onion_request_clean(req);
+  ok = onion_request_write_partial(req, query + consumed,
+                                   strlen(query) - consumed, &consumed);
+  FAIL_IF_NOT_EQUAL_INT(ok, OCS_REQUEST_READY);
+  FAIL_IF_NOT_EQUAL_INT(consumed, strlen(second));
+  onion_request_polish(req);
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_path(req), "b");
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "c"), "2");
+
+  onion_request_free(req);
+
+  END_LOCAL();
+}
+
 int main(int argc, char **argv) {
   START();
 
@@ -553,6 +753,10 @@ int main(int argc, char **argv) {
   t09_very_long_header();
   t10_repeated_header();
   t11_cookies();
+  t12_lazy_query_and_cookies();
+  t13_lazy_headers();
+  t14_known_headers();
+  t15_write_partial();
 
   teardown();
   END();
@@ -299,6 +299,106 @@ void t07_large_printf() {
   END_LOCAL();
 }
 
+void t08_header_template() {
+  INIT_LOCAL();
+  onion *server = onion_new(0);
+  onion_add_listen_point(server, NULL, NULL, onion_buffer_listen_point_new());
+  onion_request *request;
+  char buffer[4096];
+  memset(buffer, 0, sizeof(buffer));
+
+  onion_response_template *tpl = onion_response_template_new();
+  onion_response_template_add(tpl, "Cache-Control", "no-cache");
+  onion_response_template_add(tpl, "Access-Control-Allow-Origin", "*");
+
+  request = onion_request_new(server->listen_points[0]);
+  FILL(request, "GET / HTTP/1.1\n");
+  onion_response *response = onion_response_new(request);
+  onion_response_set_template(response, tpl);
+  onion_response_set_code(response, HTTP_NOT_FOUND);
+  onion_response_set_header(response, "Server", "test");
+  onion_response_set_length(response, 2);
+  onion_response_write0(response, "ok");
+  onion_response_free(response);
+
+  strncpy(buffer, onion_buffer_listen_point_get_buffer_data(request),
+          sizeof(buffer) - 1);
+  onion_request_free(request);
+  onion_response_template_free(tpl);
+  onion_free(server);
+
+  FAIL_IF_NOT_STRSTR(buffer, "HTTP/1.1 404 Not Found\r\n");
+  FAIL_IF_NOT_STRSTR(buffer, "\r\nCache-Control: no-cache\r\n");
+  FAIL_IF_NOT_STRSTR(buffer, "\r\nAccess-Control-Allow-Origin: *\r\n");
+  FAIL_IF_NOT_STRSTR(buffer, "\r\nServer: test\r\n");
+  FAIL_IF_STRSTR(buffer, "libonion");
+  FAIL_IF_NOT_STRSTR(buffer, "\r\nDate: ");
+  FAIL_IF_NOT_STRSTR(buffer, " GMT\r\n");
+  FAIL_IF_NOT_STRSTR(buffer, "\r\n\r\nok");
+
+  FAIL_IF_NOT_EQUAL_STR(onion_response_code_description(HTTP_NOT_FOUND),
+                        "Not Found");
+  FAIL_IF_NOT_EQUAL_STR(onion_response_code_description(999), "CODE UNKNOWN");
+
+  END_LOCAL();
+}
+
+void t09_header_override_case() {
+  INIT_LOCAL();
+  onion *server = onion_new(0);
+  onion_add_listen_point(server, NULL, NULL, onion_buffer_listen_point_new());
+  onion_request *request;
+  char buffer[4096];
+  memset(buffer, 0, sizeof(buffer));
+
+  request = onion_request_new(server->listen_points[0]);
+  FILL(request, "GET / HTTP/1.1\n");
+  onion_response *response = onion_response_new(request);
+  onion_response_set_header(response, "server", "test");
+  onion_response_set_header(response, "DATE", "Thu, 01 Jan 1970 00:00:00 GMT");
+  onion_response_set_length(response, 2);
+  onion_response_write0(response, "ok");
+  onion_response_free(response);
+
+  strncpy(buffer, onion_buffer_listen_point_get_buffer_data(request),
+          sizeof(buffer) - 1);
+  onion_request_free(request);
+  onion_free(server);
+
+  FAIL_IF_NOT_STRSTR(buffer, "\r\nserver: test\r\n");
+  FAIL_IF_NOT_STRSTR(buffer, "\r\nDATE: Thu, 01 Jan 1970 00:00:00 GMT\r\n");
+  FAIL_IF_STRSTR(buffer, "libonion");
+  FAIL_IF_STRSTR(buffer, "\r\nDate: ");
+
+  END_LOCAL();
+}
+
+void t10_sent_bytes_total() {
+  INIT_LOCAL();
+  onion *server = onion_new(0);
+  onion_add_listen_point(server, NULL, NULL, onion_buffer_listen_point_new());
+  onion_request *request;
+
+  request = onion_request_new(server->listen_points[0]);
+  FILL(request, "GET / HTTP/1.1\n");
+  onion_response *response = onion_response_new(request);
+  onion_response_set_length(response, 2);
+  onion_response_write0(response, "ok");
+  onion_response_flush(response);       // Header not sent yet: sends it, and rebuffers the body
+  onion_response_flush(response);
+
+  const char *data = onion_buffer_listen_point_get_buffer_data(request);
+  FAIL_IF_NOT_STRSTR(data, "\r\n\r\nok");
+  FAIL_IF_NOT_EQUAL_INT(response->sent_bytes_total, strlen(data));
+  FAIL_IF_NOT_EQUAL_INT(response->sent_bytes, 2);
+
+  onion_response_free(response);
+  onion_request_free(request);
+  onion_free(server);
+
+  END_LOCAL();
+}
+
 int main(int argc, char **argv) {
   START();
 
@@ -309,6 +409,9 @@ int main(int argc, char **argv) {
   t05_printf();
   t06_empty();
   t07_large_printf();
+  t08_header_template();
+  t09_header_override_case();
+  t10_sent_bytes_total();
 
   END();
 }
@@ -412,6 +412,210 @@ void t06_timeouts() {
   END_LOCAL();
 }
 
+static int count_str(const char *haystack, const char *needle) {
+  int n = 0;
+  while ((haystack = strstr(haystack, needle))) {
+    n++;
+    haystack++;
+  }
+  return n;
+}
+
+void t07_pipelining() {
+  INIT_LOCAL();
+
+  o = onion_new(O_POOL | O_DETACH_LISTEN);
+  onion_set_read_buffer_size(o, 64);    // Small, so requests are split between reads
+  onion_set_root_handler(o,
+                         onion_handler_new((void *)process_request, NULL,
+                                           NULL));
+  onion_set_port(o, "8082");
+  onion_listen(o);
+  sleep(1);
+  processed = 0;
+
+  const char *requests =
+      "GET /a HTTP/1.1\r\nHost: localhost\r\n\r\n"
+      "POST /b HTTP/1.1\r\nContent-Type: application/x-www-form-urlencoded\r\nContent-Length: 3\r\n\r\na=1"
+      "GET /c HTTP/1.1\r\n\r\n" "GET /d HTTP/1.1\r\n\r\n";
+  int fd = connect_to("localhost", "8082");
+  int w = write(fd, requests, strlen(requests));
+  FAIL_IF_NOT_EQUAL_INT(w, strlen(requests));
+
+  char data[4096];
+  size_t pos = 0;
+  while (pos < sizeof(data) - 1) {
+    ssize_t n = read(fd, data + pos, sizeof(data) - 1 - pos);
+    if (n <= 0)
+      break;
+    pos += n;
+    data[pos] = 0;
+    if (count_str(data, "Done") == 4)
+      break;
+  }
+  data[pos] = 0;
+  close(fd);
+
+  FAIL_IF_NOT_EQUAL_INT(count_str(data, "HTTP/1.1 200 OK\r\n"), 4);
+  FAIL_IF_NOT_EQUAL_INT(count_str(data, "Done"), 4);
+  FAIL_IF_NOT_EQUAL_INT(processed, 4);
+
+  onion_free(o);
+
+  END_LOCAL();
+}
+
+typedef struct {
+  onion_request *req;
+  onion_response *res;
+} yielded_t;
+
+void *finish_yielded(yielded_t * y) {
+  onion_response_write0(y->res, "Yielded");
+  onion_response_free(y->res);
+  onion_request_free(y->req);
+  free(y);
+  return NULL;
+}
+
+/// Yield callback; the request is detached, so it is finished from another thread.
+void detach_yielded(yielded_t * y) {
+  pthread_t thread;
+  pthread_create(&thread, NULL, (void *)finish_yielded, y);
+  pthread_detach(thread);
+}
+
+onion_connection_status process_yield(void *_, onion_request * req,
+                                      onion_response * res) {
+  if (strcmp(onion_request_get_path(req), "yield") != 0)
+    return process_request(_, req, res);
+  yielded_t *y = malloc(sizeof(yielded_t));
+  y->req = req;
+  y->res = res;
+  onion_request_set_yield_callback(req, (void *)detach_yielded, y);
+  return OCS_YIELD;
+}
+
+void t08_pipelining_yield() {
+  INIT_LOCAL();
+
+  o = onion_new(O_POOL | O_DETACH_LISTEN);
+  onion_set_root_handler(o,
+                         onion_handler_new((void *)process_yield, NULL, NULL));
+  onion_set_port(o, "8082");
+  onion_listen(o);
+  sleep(1);
+  processed = 0;
+
+  // The yielded request closes the connection, so /c is not answered, and the client is told.
+  const char *requests =
+      "GET /a HTTP/1.1\r\n\r\n" "GET /yield HTTP/1.1\r\n\r\n"
+      "GET /c HTTP/1.1\r\n\r\n";
+  int fd = connect_to("localhost", "8082");
+  int w = write(fd, requests, strlen(requests));
+  FAIL_IF_NOT_EQUAL_INT(w, strlen(requests));
+
+  char data[4096];
+  size_t pos = 0;
+  while (pos < sizeof(data) - 1) {
+    ssize_t n = read(fd, data + pos, sizeof(data) - 1 - pos);
+    if (n <= 0)
+      break;
+    pos += n;
+  }
+  data[pos] = 0;
+  close(fd);
+
+  FAIL_IF_NOT_EQUAL_INT(count_str(data, "HTTP/1.1 200 OK\r\n"), 2);
+  FAIL_IF_NOT_EQUAL_INT(count_str(data, "Done"), 1);
+  FAIL_IF_NOT_STRSTR(data, "Connection: Close\r\n");
+  FAIL_IF_NOT_STRSTR(data, "\r\n\r\nYielded");
+  FAIL_IF_NOT_EQUAL_INT(processed, 1);
+
+  onion_free(o);
+
+  END_LOCAL();
+}
+
+#define YIELDED_WRITES 200
+
+/// Finishes the yielded request in many small writes, so they can not go unnoticed.
+void *write_yielded(yielded_t * y) {
+  int i;
+  for (i = 0; i < YIELDED_WRITES; i++) {
+    onion_response_write0(y->res, "Yielded\n");
+    onion_response_flush(y->res);
+  }
+  onion_response_free(y->res);
+  onion_request_free(y->req);
+  free(y);
+  return NULL;
+}
+
+/// Yield callback; the thread writes while the poller thread goes on.
+void detach_writing(yielded_t * y) {
+  pthread_t thread;
+  pthread_create(&thread, NULL, (void *)write_yielded, y);
+  pthread_detach(thread);
+}
+
+onion_connection_status process_yield_thread(void *_, onion_request * req,
+                                             onion_response * res) {
+  if (strcmp(onion_request_get_path(req), "yield") != 0)
+    return process_request(_, req, res);
+  yielded_t *y = malloc(sizeof(yielded_t));
+  y->req = req;
+  y->res = res;
+  onion_response_set_length(res, YIELDED_WRITES * strlen("Yielded\n"));
+  onion_request_set_yield_callback(req, (void *)detach_writing, y);
+  return OCS_YIELD;
+}
+
+void t09_pipelining_yield_thread() {
+  INIT_LOCAL();
+
+  o = onion_new(O_POOL | O_DETACH_LISTEN);
+  onion_set_root_handler(o,
+                         onion_handler_new((void *)process_yield_thread, NULL,
+                                           NULL));
+  onion_set_port(o, "8082");
+  onion_listen(o);
+  sleep(1);
+
+  // The pipelined output must be out, and not kept by the poller, when the yielded request writes.
+  const char *requests =
+      "GET /a HTTP/1.1\r\n\r\n" "GET /yield HTTP/1.1\r\n\r\n"
+      "GET /c HTTP/1.1\r\n\r\n";
+  int n;
+  for (n = 0; n < 20; n++) {
+    processed = 0;
+    int fd = connect_to("localhost", "8082");
+    int w = write(fd, requests, strlen(requests));
+    FAIL_IF_NOT_EQUAL_INT(w, strlen(requests));
+
+    char data[8192];
+    size_t pos = 0;
+    while (pos < sizeof(data) - 1) {
+      ssize_t r = read(fd, data + pos, sizeof(data) - 1 - pos);
+      if (r <= 0)
+        break;
+      pos += r;
+    }
+    data[pos] = 0;
+    close(fd);
+
+    FAIL_IF_NOT_EQUAL_INT(count_str(data, "HTTP/1.1 200 OK\r\n"), 2);
+    FAIL_IF_NOT_EQUAL_INT(count_str(data, "Done"), 1);
+    FAIL_IF_NOT_EQUAL_INT(count_str(data, "Yielded\n"), YIELDED_WRITES);
+    FAIL_IF_NOT(strstr(data, "Done") < strstr(data, "Yielded\n"));
+    FAIL_IF_NOT_EQUAL_INT(processed, 1);
+  }
+
+  onion_free(o);
+
+  END_LOCAL();
+}
+
 int main(int argc, char **argv) {
   START();
   pthread_t watchdog_thread;
@@ -423,6 +627,9 @@ int main(int argc, char **argv) {
   t04_server_timeout_threaded();
   t05_server_timeout_threaded_ssl();
   t06_timeouts();
+  t07_pipelining();
+  t08_pipelining_yield();
+  t09_pipelining_yield_thread();
 
   okexit = 1;
   pthread_cancel(watchdog_thread);
@@ -24,11 +24,19 @@
 #include <onion/onion.h>
 #include <onion/log.h>
 #include <onion/sessions.h>
+#include <onion/sessions_mem.h>
+#include <onion/sessions_cache.h>
 #include <onion/dict.h>
 #include "../ctest.h"
 #include "buffer_listen_point.h"
 #include <onion/types_internal.h>
 
+static int mem_sessions_count(onion_sessions * sessions) {
+  onion_sessions_mem_stats stats;
+  onion_sessions_mem_get_stats(sessions, &stats);
+  return stats.count;
+}
+
 void t01_test_session() {
   INIT_LOCAL();
 
@@ -128,7 +136,7 @@ void t02_cookies() {
 
   req = onion_request_new(lp);
   snprintf(tmp, sizeof(tmp), "sessionid=%s", cookieid);
-  onion_dict_add(req->headers, "Cookie", tmp, OD_DUP_VALUE);
+  onion_request_add_header(req, "Cookie", tmp);
   FAIL_IF_NOT_EQUAL(req->session_id, NULL);
   session = onion_request_get_session_dict(req);
   FAIL_IF_NOT_EQUAL_STR(req->session_id, cookieid);
@@ -139,7 +147,7 @@ void t02_cookies() {
   snprintf(tmp, sizeof(tmp),
            "trashthingish=nothing interesting; sessionid=%s; wtf=ianal",
            cookieid);
-  onion_dict_add(req->headers, "Cookie", tmp, OD_DUP_VALUE);
+  onion_request_add_header(req, "Cookie", tmp);
   FAIL_IF_NOT_EQUAL(req->session_id, NULL);
   session = onion_request_get_session_dict(req);
   FAIL_IF_NOT_EQUAL_STR(req->session_id, cookieid);
@@ -150,7 +158,7 @@ void t02_cookies() {
   snprintf(tmp, sizeof(tmp),
            "sessionid=nothing interesting; sessionid=%s; other_sessionid=ianal",
            cookieid);
-  onion_dict_add(req->headers, "Cookie", tmp, OD_DUP_VALUE);
+  onion_request_add_header(req, "Cookie", tmp);
   FAIL_IF_NOT_EQUAL(req->session_id, NULL);
   session = onion_request_get_session_dict(req);
   FAIL_IF_NOT_EQUAL_STR(req->session_id, cookieid);
@@ -161,7 +169,7 @@ void t02_cookies() {
   snprintf(tmp, sizeof(tmp),
            "sessionid=nothing interesting; xsessionid=%s; other_sessionid=ianal",
            cookieid);
-  onion_dict_add(req->headers, "Cookie", tmp, OD_DUP_VALUE);
+  onion_request_add_header(req, "Cookie", tmp);
   FAIL_IF_NOT_EQUAL(req->session_id, NULL);
   session = onion_request_get_session_dict(req);
   FAIL_IF_EQUAL_STR(req->session_id, cookieid);
@@ -226,23 +234,23 @@ void t03_bug_empty_session_is_new_session() {
   strcpy(sessionid, lastsessionid);
   req->fullpath = NULL;
   onion_request_free(req);
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->data), 1);
+  FAIL_IF_NOT_EQUAL_INT(mem_sessions_count(o->sessions), 1);
 
   req = onion_request_new(lp);
   req->fullpath = "/";
-  onion_dict_add(req->headers, "Cookie", "sessionid=xxx", 0);
+  onion_request_add_header(req, "Cookie", "sessionid=xxx");
   onion_request_process(req);
   FAIL_IF_EQUAL_STR(lastsessionid, "");
   FAIL_IF_EQUAL_STR(lastsessionid, sessionid);
   FAIL_IF_NOT(has_set_cookie);
   req->fullpath = NULL;
   onion_request_free(req);
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->data), 2);
+  FAIL_IF_NOT_EQUAL_INT(mem_sessions_count(o->sessions), 2);
 
   req = onion_request_new(lp);
   req->fullpath = "/";
   snprintf(tmp, sizeof(tmp), "sessionid=%s", lastsessionid);
-  onion_dict_add(req->headers, "Cookie", tmp, 0);
+  onion_request_add_header(req, "Cookie", tmp);
   onion_request_process(req);
   FAIL_IF_EQUAL_STR(lastsessionid, "");
   FAIL_IF_EQUAL_STR(lastsessionid, sessionid);
@@ -250,19 +258,19 @@ void t03_bug_empty_session_is_new_session() {
   strcpy(sessionid, lastsessionid);
   req->fullpath = NULL;
   onion_request_free(req);
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->data), 2);
+  FAIL_IF_NOT_EQUAL_INT(mem_sessions_count(o->sessions), 2);
 
   req = onion_request_new(lp);
   req->fullpath = "/";
   snprintf(tmp, sizeof(tmp), "sessionid=%sxx", lastsessionid);
-  onion_dict_add(req->headers, "Cookie", tmp, 0);
+  onion_request_add_header(req, "Cookie", tmp);
   onion_request_process(req);
   FAIL_IF_EQUAL_STR(lastsessionid, "");
   FAIL_IF_EQUAL_STR(lastsessionid, sessionid);
   FAIL_IF_NOT(has_set_cookie);
   req->fullpath = NULL;
   onion_request_free(req);
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->data), 3);
+  FAIL_IF_NOT_EQUAL_INT(mem_sessions_count(o->sessions), 3);
 
   // Ask for new, without session data, but I will not set data on session, so session is not created.
   set_data_on_session = 0;
@@ -272,9 +280,9 @@ void t03_bug_empty_session_is_new_session() {
   FAIL_IF_EQUAL_STR(lastsessionid, "");
   strcpy(sessionid, lastsessionid);
   req->fullpath = NULL;
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->data), 4);        // For a moment it exists, until onion realizes is not necesary.
+  FAIL_IF_NOT_EQUAL_INT(mem_sessions_count(o->sessions), 4);        // For a moment it exists, until onion realizes is not necesary.
   onion_request_free(req);
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->data), 3);
+  FAIL_IF_NOT_EQUAL_INT(mem_sessions_count(o->sessions), 3);
 
   onion_free(o);
 
@@ -302,7 +310,7 @@ void t04_lot_of_sessionid() {
   req = onion_request_new(lp);
   req->fullpath = "/";
   onion_request_process(req);
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->data), 1);
+  FAIL_IF_NOT_EQUAL_INT(mem_sessions_count(o->sessions), 1);
   FAIL_IF_EQUAL_STR(lastsessionid, "");
   strcpy(sessionid, lastsessionid);
   req->fullpath = NULL;
@@ -321,10 +329,10 @@ void t04_lot_of_sessionid() {
   onion_request_write(req, tmp, strlen(tmp));   // Here is the problem, at parsing too long headers
   onion_request_write(req, tmp2, strlen(tmp2)); // Here is the problem, at parsing too long headers
   onion_request_write(req, "\n", 1);
-  //onion_dict_add(req->headers, "Cookie", tmp2, 0);
+  //onion_request_add_header(req, "Cookie", tmp2);
 
   onion_request_process(req);
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->data), 1);
+  FAIL_IF_NOT_EQUAL_INT(mem_sessions_count(o->sessions), 1);
   FAIL_IF_EQUAL_STR(lastsessionid, "");
   FAIL_IF_NOT_EQUAL_STR(lastsessionid, sessionid);
   FAIL_IF_NOT(has_set_cookie);
@@ -335,6 +343,269 @@ void t04_lot_of_sessionid() {
   END_LOCAL();
 }
 
+static int t05_saves = 0;
+static void (*t05_mem_save) (onion_sessions * sessions, const char *sessionid,
+                             onion_dict * data);
+
+static void t05_counting_save(onion_sessions * sessions, const char *sessionid,
+                              onion_dict * data) {
+  t05_saves++;
+  t05_mem_save(sessions, sessionid, data);
+}
+
+void t05_save_only_modified() {
+  INIT_LOCAL();
+
+  onion *o = onion_new(O_ONE_LOOP);
+  onion_listen_point *lp = onion_buffer_listen_point_new();
+  onion_add_listen_point(o, NULL, NULL, lp);
+  onion_sessions *sessions = onion_sessions_new();
+  t05_mem_save = sessions->save;
+  sessions->save = t05_counting_save;
+  onion_set_session_backend(o, sessions);
+
+  onion_request *req;
+  onion_dict *session;
+  char tmp[256];
+
+  req = onion_request_new(lp);
+  session = onion_request_get_session_dict(req);
+  onion_dict_add(session, "Test", "tseT", 0);
+  snprintf(tmp, sizeof(tmp), "sessionid=%s", req->session_id);
+  t05_saves = 0;
+  onion_request_free(req);
+  FAIL_IF_NOT_EQUAL_INT(t05_saves, 1);
+
+  // Read only, not saved
+  req = onion_request_new(lp);
+  onion_request_add_header(req, "Cookie", tmp);
+  session = onion_request_get_session_dict(req);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(session, "Test"), "tseT");
+  onion_request_free(req);
+  FAIL_IF_NOT_EQUAL_INT(t05_saves, 1);
+
+  // Modified, saved
+  req = onion_request_new(lp);
+  onion_request_add_header(req, "Cookie", tmp);
+  session = onion_request_get_session_dict(req);
+  onion_dict_add(session, "Other", "value", 0);
+  onion_request_free(req);
+  FAIL_IF_NOT_EQUAL_INT(t05_saves, 2);
+
+  // A subdict modified several times
+  req = onion_request_new(lp);
+  onion_request_add_header(req, "Cookie", tmp);
+  session = onion_request_get_session_dict(req);
+  onion_dict *sub = onion_dict_new();
+  onion_dict_add(sub, "a", "1", 0);
+  onion_dict_add(sub, "b", "2", 0);
+  onion_dict_add(sub, "c", "3", 0);
+  onion_dict_add(session, "Sub", sub, OD_DICT | OD_FREE_VALUE);
+  onion_request_free(req);
+  FAIL_IF_NOT_EQUAL_INT(t05_saves, 3);
+
+  // Removed, and as many changes as it had, still saved
+  req = onion_request_new(lp);
+  onion_request_add_header(req, "Cookie", tmp);
+  session = onion_request_get_session_dict(req);
+  onion_dict_remove(session, "Sub");
+  onion_dict_add(session, "A", "1", 0);
+  onion_dict_add(session, "B", "2", 0);
+  onion_request_free(req);
+  FAIL_IF_NOT_EQUAL_INT(t05_saves, 4);
+  req = onion_request_new(lp);
+  onion_request_add_header(req, "Cookie", tmp);
+  session = onion_request_get_session_dict(req);
+  FAIL_IF_NOT_EQUAL(onion_dict_get_dict(session, "Sub"), NULL);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(session, "B"), "2");
+  onion_request_free(req);
+
+  onion_free(o);
+
+  END_LOCAL();
+}
+
+void t06_mem_limits() {
+  INIT_LOCAL();
+
+  onion_sessions *sessions = onion_sessions_new();
+  onion_sessions_mem_set_limits(sessions, 32, 0);
+  onion_sessions_mem_stats stats;
+
+  char *ids[100];
+  int i;
+  for (i = 0; i < 100; i++) {
+    ids[i] = onion_sessions_create(sessions);
+    onion_dict *ses = onion_sessions_get(sessions, ids[i]);
+    onion_dict_add(ses, "n", "x", 0);
+    onion_dict_free(ses);
+  }
+  onion_sessions_mem_get_stats(sessions, &stats);
+  FAIL_IF_NOT_EQUAL_INT(stats.count, 32);
+  FAIL_IF_NOT_EQUAL_INT(stats.count + stats.evictions, 100);
+  FAIL_IF_NOT_EQUAL_INT(stats.hits, 100);
+
+  // Last one is the most recently used, never evicted
+  onion_dict *ses = onion_sessions_get(sessions, ids[99]);
+  FAIL_IF_EQUAL(ses, NULL);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(ses, "n"), "x");
+  onion_dict_free(ses);
+  FAIL_IF_NOT_EQUAL(onion_sessions_get(sessions, "unknown"), NULL);
+  onion_sessions_mem_get_stats(sessions, &stats);
+  FAIL_IF_NOT_EQUAL_INT(stats.misses, 1);
+
+  // Idle sessions expire
+  onion_sessions_mem_set_limits(sessions, 0, 1);
+  sleep(2);
+  FAIL_IF_NOT_EQUAL(onion_sessions_get(sessions, ids[99]), NULL);
+  onion_sessions_mem_get_stats(sessions, &stats);
+  FAIL_IF(stats.expirations < 1);
+
+  for (i = 0; i < 100; i++)
+    free(ids[i]);
+  onion_sessions_free(sessions);
+
+  // Limits smaller than the number of shards are exact too
+  sessions = onion_sessions_new();
+  onion_sessions_mem_set_limits(sessions, 1, 0);
+  for (i = 0; i < 20; i++) {
+    ids[i] = onion_sessions_create(sessions);
+    onion_dict *ses = onion_sessions_get(sessions, ids[i]);
+    onion_dict_add(ses, "n", "x", 0);
+    onion_dict_free(ses);
+    onion_sessions_mem_get_stats(sessions, &stats);
+    FAIL_IF_NOT_EQUAL_INT(stats.count, 1);
+  }
+  ses = onion_sessions_get(sessions, ids[19]);
+  FAIL_IF_EQUAL(ses, NULL);
+  onion_dict_free(ses);
+  for (i = 0; i < 20; i++)
+    free(ids[i]);
+  onion_sessions_free(sessions);
+
+  END_LOCAL();
+}
+
+static int t07_remote_gets = 0;
+static int t07_remote_saves = 0;
+static onion_dict *(*t07_mem_get) (onion_sessions * sessions,
+                                   const char *sessionid);
+static void (*t07_mem_save) (onion_sessions * sessions, const char *sessionid,
+                             onion_dict * data);
+
+static onion_dict *t07_counting_get(onion_sessions * sessions,
+                                    const char *sessionid) {
+  t07_remote_gets++;
+  return t07_mem_get(sessions, sessionid);
+}
+
+static void t07_counting_save(onion_sessions * sessions, const char *sessionid,
+                              onion_dict * data) {
+  t07_remote_saves++;
+  t07_mem_save(sessions, sessionid, data);
+}
+
+/// A "remote" backend that counts the accesses
+static onion_sessions *t07_remote_new() {
+  onion_sessions *remote = onion_sessions_mem_new();
+  t07_mem_get = remote->get;
+  t07_mem_save = remote->save;
+  remote->get = t07_counting_get;
+  remote->save = t07_counting_save;
+  t07_remote_gets = t07_remote_saves = 0;
+  return remote;
+}
+
+void t07_cache() {
+  INIT_LOCAL();
+
+  onion_sessions *remote = t07_remote_new();
+  onion_sessions *sessions =
+      onion_sessions_cache_new(remote, 10, 1, OSC_WRITE_THROUGH);
+  char *id = onion_sessions_create(sessions);
+  FAIL_IF_NOT_EQUAL_INT(t07_remote_saves, 1);
+
+  // Repeated gets do not reach the remote
+  int i;
+  for (i = 0; i < 3; i++) {
+    onion_dict *ses = onion_sessions_get(sessions, id);
+    FAIL_IF_EQUAL(ses, NULL);
+    onion_dict_free(ses);
+  }
+  FAIL_IF_NOT_EQUAL_INT(t07_remote_gets, 0);
+  onion_sessions_mem_stats stats;
+  onion_sessions_cache_get_stats(sessions, &stats);
+  FAIL_IF_NOT_EQUAL_INT(stats.hits, 3);
+
+  // Saves are written through
+  onion_dict *ses = onion_sessions_get(sessions, id);
+  onion_dict_add(ses, "a", "1", 0);
+  onion_sessions_save(sessions, id, ses);
+  onion_dict_free(ses);
+  FAIL_IF_NOT_EQUAL_INT(t07_remote_saves, 2);
+  ses = t07_mem_get(remote, id);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(ses, "a"), "1");
+  onion_dict_free(ses);
+
+  // Changed by somebody else, seen after max age
+  ses = onion_dict_new();
+  onion_dict_add(ses, "a", "2", 0);
+  t07_mem_save(remote, id, ses);
+  onion_dict_free(ses);
+  ses = onion_sessions_get(sessions, id);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(ses, "a"), "1");
+  onion_dict_free(ses);
+  sleep(2);
+  ses = onion_sessions_get(sessions, id);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(ses, "a"), "2");
+  onion_dict_free(ses);
+  FAIL_IF_NOT_EQUAL_INT(t07_remote_gets, 1);
+
+  // Removes are also written through
+  onion_sessions_remove(sessions, id);
+  FAIL_IF_NOT_EQUAL(onion_sessions_get(sessions, id), NULL);
+  FAIL_IF_NOT_EQUAL(t07_mem_get(remote, id), NULL);
+
+  free(id);
+  onion_sessions_free(sessions);
+
+  END_LOCAL();
+}
+
+void t08_cache_write_behind() {
+  INIT_LOCAL();
+
+  onion_sessions *remote = t07_remote_new();
+  onion_sessions *sessions =
+      onion_sessions_cache_new(remote, 10, 0, OSC_WRITE_BEHIND);
+  char *id = onion_sessions_create(sessions);
+
+  // Many saves of the same session are written once
+  int i;
+  for (i = 0; i < 10; i++) {
+    onion_dict *ses = onion_sessions_get(sessions, id);
+    char tmp[8];
+    snprintf(tmp, sizeof(tmp), "%d", i);
+    onion_dict_add(ses, "n", tmp, OD_DUP_VALUE | OD_REPLACE);
+    onion_sessions_save(sessions, id, ses);
+    onion_dict_free(ses);
+  }
+  usleep(500000);
+  FAIL_IF(t07_remote_saves == 0 || t07_remote_saves > 5);
+  onion_dict *ses = t07_mem_get(remote, id);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(ses, "n"), "9");
+  onion_dict_free(ses);
+
+  // Not yet written, but not lost if out of the cache
+  onion_sessions_save(sessions, id, NULL);
+  FAIL_IF_NOT_EQUAL(onion_sessions_get(sessions, id), NULL);
+
+  free(id);
+  onion_sessions_free(sessions);
+
+  END_LOCAL();
+}
+
 int main(int argc, char **argv) {
   START();
 
@@ -342,6 +613,12 @@ int main(int argc, char **argv) {
   t02_cookies();
   t03_bug_empty_session_is_new_session();
   t04_lot_of_sessionid();
+  t05_save_only_modified();
+  t06_mem_limits();
+  t07_cache();
+#ifdef HAVE_PTHREADS
+  t08_cache_write_behind();
+#endif
 
   END();
 }
@@ -46,11 +46,11 @@ void websocket_data_buffer_write(onion_request * req, const char *data,
   if (!ws_data_tmp) {
     ws_data_length = len;
     ws_data_tmp = malloc(ws_data_length);
-    strncpy(ws_data_tmp, data, ws_data_length);
+    memcpy(ws_data_tmp, data, ws_data_length);
   } else {
     char *tmp = malloc(ws_data_length + len);
-    strncpy(tmp, ws_data_tmp, ws_data_length);
-    strncpy(tmp + ws_data_length, data, len);
+    memcpy(tmp, ws_data_tmp, ws_data_length);
+    memcpy(tmp + ws_data_length, data, len);
     ws_data_length += len;
     free(ws_data_tmp);
     ws_data_tmp = tmp;
@@ -66,8 +66,8 @@ int websocket_data_buffer_read(onion_request * req, char *data, size_t len) {
     if (i == len - 1)
       break;
   }
-  strncpy(ws_data_tmp, ws_data_tmp + i + 1, ws_data_length - i);
   ws_data_length -= i + 1;
+  memmove(ws_data_tmp, ws_data_tmp + i + 1, ws_data_length);
   return i + 1;
 }
 
@@ -24,7 +24,16 @@
 #include <onion/onion.h>
 #include <onion/log.h>
 #include <onion/random.h>
+#include <onion/sessions.h>
+#include <onion/sessions_mem.h>
+#include <onion/dict.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include "../ctest.h"
 
 // this is a simple test to check the implementation, not the algorithm
@@ -56,10 +65,101 @@ void t01_test_random() {
   END_LOCAL();
 }
 
+void t02_fork_differs() {
+  INIT_LOCAL();
+
+  onion_random_init();
+  unsigned char parent[32], child[32];
+  onion_random_generate(parent, 8);     // Already seeded before fork
+
+  int fds[2];
+  FAIL_IF(pipe(fds) < 0);
+  pid_t pid = fork();
+  if (pid == 0) {
+    onion_random_generate(child, sizeof(child));
+    if (write(fds[1], child, sizeof(child)) < 0)
+      _exit(1);
+    _exit(0);
+  }
+  onion_random_generate(parent, sizeof(parent));
+  FAIL_IF_NOT_EQUAL_INT(read(fds[0], child, sizeof(child)), sizeof(child));
+  waitpid(pid, NULL, 0);
+  close(fds[0]);
+  close(fds[1]);
+  FAIL_IF_EQUAL_INT(memcmp(parent, child, sizeof(parent)), 0);
+
+  onion_random_free();
+
+  END_LOCAL();
+}
+
+#define T03_THREADS 4
+#define T03_IDS 1000
+
+static int t03_valid_id(const char *id) {
+  if (strlen(id) != 32)
+    return 0;
+  const char *c;
+  for (c = id; *c; c++)
+    if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z')
+          || (*c >= '0' && *c <= '9')))
+      return 0;
+  return 1;
+}
+
+static void *t03_create_sessions(void *sessions) {
+  long invalid = 0;
+  int i;
+  for (i = 0; i < T03_IDS; i++) {
+    char *id = onion_sessions_create(sessions);
+    invalid += !t03_valid_id(id);
+    onion_sessions_remove(sessions, id);
+    free(id);
+  }
+  return (void *)invalid;
+}
+
+/// Session ids are unique and valid, also when created from several threads as with O_POOL.
+void t03_session_ids() {
+  INIT_LOCAL();
+
+  onion_sessions *sessions = onion_sessions_mem_new();
+
+  // Ids are unique
+  onion_dict *seen = onion_dict_new();
+  int i;
+  for (i = 0; i < 1000; i++) {
+    char *id = onion_sessions_generate_id();
+    FAIL_IF_NOT(t03_valid_id(id));
+    FAIL_IF_NOT_EQUAL(onion_dict_get(seen, id), NULL);
+    onion_dict_add(seen, id, "", OD_FREE_KEY);
+  }
+  onion_dict_free(seen);
+
+#ifdef HAVE_PTHREADS
+  pthread_t threads[T03_THREADS];
+  for (i = 0; i < T03_THREADS; i++)
+    pthread_create(&threads[i], NULL, t03_create_sessions, sessions);
+  for (i = 0; i < T03_THREADS; i++) {
+    void *invalid;
+    pthread_join(threads[i], &invalid);
+    FAIL_IF_NOT_EQUAL_INT((long)invalid, 0);
+  }
+#else
+  FAIL_IF_NOT_EQUAL_INT((long)t03_create_sessions(sessions), 0);
+#endif
+
+  onion_sessions_free(sessions);
+
+  END_LOCAL();
+}
+
 int main(int argc, char **argv) {
   START();
 
   t01_test_random();
+  t02_fork_differs();
+  t03_session_ids();
 
   END();
 }
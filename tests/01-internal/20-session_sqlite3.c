@@ -21,6 +21,9 @@
   <http://www.apache.org/licenses/LICENSE-2.0>.
 */
 
+#include <dirent.h>
+#include <pthread.h>
+
 #include <onion/onion.h>
 #include <onion/log.h>
 #include <onion/sessions.h>
@@ -105,11 +108,110 @@ void t02_server() {
   END_LOCAL();
 }
 
+void t03_remove_and_batch() {
+  INIT_LOCAL();
+
+  onion_sessions *sessions = onion_sessions_sqlite3_new("sessions.sqlite");
+  char *ids[32];
+  int i;
+  for (i = 0; i < 32; i++) {
+    ids[i] = onion_sessions_create(sessions);
+    onion_dict *data = onion_dict_new();
+    char tmp[16];
+    snprintf(tmp, sizeof(tmp), "%d", i);
+    onion_dict_add(data, "n", tmp, OD_DUP_VALUE);
+    onion_sessions_save(sessions, ids[i], data);
+    onion_dict_free(data);
+
+    // Read your writes, even if still not at the database
+    data = onion_sessions_get(sessions, ids[i]);
+    FAIL_IF_EQUAL(data, NULL);
+    if (data)
+      FAIL_IF_NOT_EQUAL_STR(onion_dict_get(data, "n"), tmp);
+    onion_dict_free(data);
+  }
+
+  onion_sessions_save(sessions, ids[0], NULL);
+  FAIL_IF_NOT_EQUAL(onion_sessions_get(sessions, ids[0]), NULL);
+  onion_sessions_free(sessions);
+
+  sessions = onion_sessions_sqlite3_new("sessions.sqlite");
+  FAIL_IF_NOT_EQUAL(onion_sessions_get(sessions, ids[0]), NULL);
+  for (i = 1; i < 32; i++) {
+    onion_dict *data = onion_sessions_get(sessions, ids[i]);
+    FAIL_IF_EQUAL(data, NULL);
+    if (data)
+      FAIL_IF_NOT_EQUAL_INT(atoi(onion_dict_get(data, "n")), i);
+    onion_dict_free(data);
+  }
+  onion_sessions_free(sessions);
+
+  for (i = 0; i < 32; i++)
+    free(ids[i]);
+
+  END_LOCAL();
+}
+
+static int count_fds() {
+  DIR *dir = opendir("/proc/self/fd");
+  if (!dir)
+    return -1;
+  int n = 0;
+  while (readdir(dir))
+    n++;
+  closedir(dir);
+  return n;
+}
+
+typedef struct {
+  onion_sessions *sessions;
+  const char *id;
+} reader_t;
+
+static void *read_session(reader_t * reader) {
+  onion_dict *data = onion_sessions_get(reader->sessions, reader->id);
+  onion_dict_free(data);
+  return NULL;
+}
+
+void t04_short_lived_readers() {
+  INIT_LOCAL();
+
+  onion_sessions *sessions = onion_sessions_sqlite3_new("sessions.sqlite");
+  char *id = onion_sessions_create(sessions);
+  onion_dict *data = onion_dict_new();
+  onion_dict_add(data, "n", "1", 0);
+  onion_sessions_save(sessions, id, data);
+  onion_dict_free(data);
+  onion_sessions_free(sessions);        // Written
+
+  sessions = onion_sessions_sqlite3_new("sessions.sqlite");
+  reader_t reader = { sessions, id };
+  int fds = 0;
+  int i;
+  // Each thread opens its read connection, that must be closed when it exits. SQLite may keep
+  // some fd open after the first, so count from there.
+  for (i = 0; i < 32; i++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, (void *)read_session, &reader);
+    pthread_join(thread, NULL);
+    if (i == 0)
+      fds = count_fds();
+  }
+  FAIL_IF_NOT_EQUAL_INT(count_fds(), fds);
+  onion_sessions_free(sessions);
+  free(id);
+
+  END_LOCAL();
+}
+
 int main(int argc, char **argv) {
   START();
 
   t01_test_sqlite_session();
   t02_server();
+  t03_remove_and_batch();
+  t04_short_lived_readers();
 
   END();
 }
@@ -0,0 +1,394 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <hiredis/hiredis.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/sessions.h>
+#include <onion/sessions_redis.h>
+#include <onion/dict.h>
+#include "../ctest.h"
+
+#define STANDIN_PORT 16379
+#define STANDIN_KEYS 64
+
+/// Port of the redis server. If ONION_TEST_REDIS_PORT is set, a real redis there, else the stand in.
+static int redis_port = STANDIN_PORT;
+static int standin = 1;
+
+/// Minimal redis stand in, knows GET, SET [EX], DEL, EXPIRE, HGET, HSET and HDEL. Enough for the sessions backend.
+static struct {
+  char *key;
+  char *value;
+  size_t size;
+  int ttl;
+} standin_data[STANDIN_KEYS];
+static pthread_mutex_t standin_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int standin_listenfd;
+static int standin_commands = 0;
+static int standin_close_after = -1;    ///< Close the connection after this command number, to test reconnect
+
+/// Hash fields are kept as keys "hash field".
+static void standin_hash_key(char *key, size_t size, const char *hash,
+                             const char *field) {
+  snprintf(key, size, "%s %s", hash, field);
+}
+
+static int standin_find(const char *key) {
+  int i;
+  for (i = 0; i < STANDIN_KEYS; i++)
+    if (standin_data[i].key && strcmp(standin_data[i].key, key) == 0)
+      return i;
+  return -1;
+}
+
+static int standin_del(const char *key) {
+  int i = standin_find(key);
+  if (i < 0)
+    return 0;
+  free(standin_data[i].key);
+  free(standin_data[i].value);
+  standin_data[i].key = NULL;
+  return 1;
+}
+
+static void standin_set(const char *key, const char *value, size_t size,
+                        int ttl) {
+  standin_del(key);
+  int n;
+  for (n = 0; n < STANDIN_KEYS - 1 && standin_data[n].key; n++);
+  standin_data[n].key = strdup(key);
+  standin_data[n].value = malloc(size);
+  memcpy(standin_data[n].value, value, size);
+  standin_data[n].size = size;
+  standin_data[n].ttl = ttl;
+}
+
+/// Reads a line ending in \r\n from fd.
+static int standin_readline(FILE * f, char *line, size_t size) {
+  if (!fgets(line, size, f))
+    return -1;
+  line[strcspn(line, "\r\n")] = 0;
+  return 0;
+}
+
+static void *standin_connection(void *_fd) {
+  int fd = (long)_fd;
+  FILE *f = fdopen(fd, "r");
+  char line[1024];
+  char *argv[8];
+  size_t argl[8];
+  while (standin_readline(f, line, sizeof(line)) == 0) {
+    int argc = atoi(line + 1), i;
+    for (i = 0; i < argc && i < 8; i++) {
+      standin_readline(f, line, sizeof(line));
+      int l = atoi(line + 1);
+      argl[i] = l;
+      argv[i] = calloc(1, l + 3);
+      fread(argv[i], 1, l + 2, f);
+      argv[i][l] = 0;
+    }
+    const char *reply = "+OK\r\n";
+    size_t reply_size = 0;      ///< If 0, strlen(reply)
+    char tmp[1100];
+    const char *cmd = argv[0];
+    const char *key = argv[1];
+    char hash_key[256];
+    int hash = (cmd[0] == 'H' && argc >= 3);
+    if (hash) {                 // HGET, HSET and HDEL as GET, SET and DEL
+      standin_hash_key(hash_key, sizeof(hash_key), argv[1], argv[2]);
+      key = hash_key;
+      cmd++;
+    }
+    pthread_mutex_lock(&standin_mutex);
+    standin_commands++;
+    int close_now = (standin_commands == standin_close_after);
+    if (close_now)              // Drop the command, as a lost connection.
+      ;
+    else if (strcmp(cmd, "GET") == 0) {
+      int n = standin_find(key);
+      if (n < 0)
+        reply = "$-1\r\n";
+      else {                    // Values are binary
+        int hl = snprintf(tmp, sizeof(tmp), "$%d\r\n",
+                          (int)standin_data[n].size);
+        memcpy(tmp + hl, standin_data[n].value, standin_data[n].size);
+        memcpy(tmp + hl + standin_data[n].size, "\r\n", 2);
+        reply = tmp;
+        reply_size = hl + standin_data[n].size + 2;
+      }
+    } else if (strcmp(cmd, "SET") == 0) {
+      if (hash)
+        standin_set(key, argv[3], argl[3], 0);
+      else
+        standin_set(key, argv[2], argl[2], (argc == 5) ? atoi(argv[4]) : 0);
+    } else if (strcmp(cmd, "DEL") == 0) {
+      reply = standin_del(key) ? ":1\r\n" : ":0\r\n";
+    } else if (strcmp(cmd, "EXPIRE") == 0) {
+      int n = standin_find(key);
+      if (n >= 0)
+        standin_data[n].ttl = atoi(argv[2]);
+      reply = (n >= 0) ? ":1\r\n" : ":0\r\n";
+    } else
+      reply = "-ERR unknown command\r\n";
+    pthread_mutex_unlock(&standin_mutex);
+
+    for (i = 0; i < argc && i < 8; i++)
+      free(argv[i]);
+    if (close_now)
+      break;
+    if (!reply_size)
+      reply_size = strlen(reply);
+    if (write(fd, reply, reply_size) < 0)
+      break;
+  }
+  fclose(f);
+  return NULL;
+}
+
+static void *standin_listen(void *_) {
+  int fd;
+  while ((fd = accept(standin_listenfd, NULL, NULL)) >= 0) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, standin_connection, (void *)(long)fd);
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+static void standin_start() {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(STANDIN_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  standin_listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(standin_listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  FAIL_IF(bind(standin_listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0);
+  listen(standin_listenfd, 16);
+  pthread_t thread;
+  pthread_create(&thread, NULL, standin_listen, NULL);
+  pthread_detach(thread);
+}
+
+/// Runs a command at the real redis server, with a new connection.
+static redisReply *redis_command(const char *format, ...) {
+  struct timeval tv = { 1, 0 };
+  redisContext *ctx = redisConnectWithTimeout("127.0.0.1", redis_port, tv);
+  redisReply *reply = NULL;
+  if (ctx && !ctx->err) {
+    va_list ap;
+    va_start(ap, format);
+    reply = redisvCommand(ctx, format, ap);
+    va_end(ap);
+  }
+  if (ctx)
+    redisFree(ctx);
+  return reply;
+}
+
+/// TTL of the key in seconds, -1 if it has none and -2 if it does not exist.
+static int redis_ttl(const char *key) {
+  int ttl = -2;
+  if (standin) {
+    pthread_mutex_lock(&standin_mutex);
+    int n = standin_find(key);
+    if (n >= 0)
+      ttl = standin_data[n].ttl ? standin_data[n].ttl : -1;
+    pthread_mutex_unlock(&standin_mutex);
+    return ttl;
+  }
+  redisReply *reply = redis_command("TTL %s", key);
+  if (reply && reply->type == REDIS_REPLY_INTEGER)
+    ttl = reply->integer;
+  if (reply)
+    freeReplyObject(reply);
+  return ttl;
+}
+
+static int redis_hexists(const char *hash, const char *field) {
+  if (standin) {
+    char key[256];
+    standin_hash_key(key, sizeof(key), hash, field);
+    pthread_mutex_lock(&standin_mutex);
+    int n = standin_find(key);
+    pthread_mutex_unlock(&standin_mutex);
+    return n >= 0;
+  }
+  int ret = 0;
+  redisReply *reply = redis_command("HEXISTS %s %s", hash, field);
+  if (reply && reply->type == REDIS_REPLY_INTEGER)
+    ret = reply->integer;
+  if (reply)
+    freeReplyObject(reply);
+  return ret;
+}
+
+static void redis_hset(const char *hash, const char *field, const char *value) {
+  if (standin) {
+    char key[256];
+    standin_hash_key(key, sizeof(key), hash, field);
+    pthread_mutex_lock(&standin_mutex);
+    standin_set(key, value, strlen(value), 0);
+    pthread_mutex_unlock(&standin_mutex);
+    return;
+  }
+  redisReply *reply = redis_command("HSET %s %s %s", hash, field, value);
+  if (reply)
+    freeReplyObject(reply);
+}
+
+/// Breaks the open connections: the next command gets no answer.
+static void redis_drop_connections() {
+  if (standin) {
+    pthread_mutex_lock(&standin_mutex);
+    standin_close_after = standin_commands + 1;
+    pthread_mutex_unlock(&standin_mutex);
+    return;
+  }
+  redisReply *reply = redis_command("CLIENT KILL TYPE normal SKIPME yes");
+  if (reply)
+    freeReplyObject(reply);
+}
+
+void t01_get_save_remove() {
+  INIT_LOCAL();
+
+  onion_sessions *sessions =
+      onion_sessions_redis_new("127.0.0.1", redis_port);
+  FAIL_IF_EQUAL(sessions, NULL);
+  onion_sessions_redis_set_ttl(sessions, 100);
+
+  char *sessionid = onion_sessions_create(sessions);
+  onion_dict *data = onion_sessions_get(sessions, sessionid);
+  FAIL_IF_EQUAL(data, NULL);
+  onion_dict_add(data, "Hello", "World", 0);
+  onion_sessions_save(sessions, sessionid, data);
+  onion_dict_free(data);
+
+  char key[128];
+  snprintf(key, sizeof(key), "onion:session:%s", sessionid);
+  int ttl = redis_ttl(key);
+  FAIL_IF(ttl < 90 || ttl > 100);
+
+  data = onion_sessions_get(sessions, sessionid);
+  FAIL_IF_EQUAL(data, NULL);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(data, "Hello"), "World");
+  onion_dict_free(data);
+
+  FAIL_IF_NOT_EQUAL(onion_sessions_get(sessions, "unknown"), NULL);
+
+  onion_sessions_remove(sessions, sessionid);
+  FAIL_IF_NOT_EQUAL(onion_sessions_get(sessions, sessionid), NULL);
+
+  onion_sessions_free(sessions);
+  free(sessionid);
+
+  END_LOCAL();
+}
+
+void t02_reconnect() {
+  INIT_LOCAL();
+
+  onion_sessions *sessions =
+      onion_sessions_redis_new("127.0.0.1", redis_port);
+  FAIL_IF_EQUAL(sessions, NULL);
+
+  char *sessionid = onion_sessions_create(sessions);
+  onion_dict *data = onion_sessions_get(sessions, sessionid);
+  onion_dict_add(data, "Hello", "Again", 0);
+
+  redis_drop_connections();
+
+  // Connection is closed without answer, so it reconnects and retries.
+  onion_sessions_save(sessions, sessionid, data);
+  onion_dict_free(data);
+
+  data = onion_sessions_get(sessions, sessionid);
+  FAIL_IF_EQUAL(data, NULL);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(data, "Hello"), "Again");
+  onion_dict_free(data);
+
+  onion_sessions_remove(sessions, sessionid);
+  onion_sessions_free(sessions);
+  free(sessionid);
+
+  END_LOCAL();
+}
+
+void t03_legacy() {
+  INIT_LOCAL();
+
+  onion_sessions *sessions =
+      onion_sessions_redis_new("127.0.0.1", redis_port);
+  FAIL_IF_EQUAL(sessions, NULL);
+  onion_sessions_redis_set_ttl(sessions, 100);
+
+  // As saved by older versions
+  redis_hset("SESSIONS", "legacysession", "{\"Hello\":\"Legacy\"}");
+
+  onion_dict *data = onion_sessions_get(sessions, "legacysession");
+  FAIL_IF_EQUAL(data, NULL);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(data, "Hello"), "Legacy");
+  onion_dict_free(data);
+
+  // Moved to its own key
+  FAIL_IF(redis_hexists("SESSIONS", "legacysession"));
+  int ttl = redis_ttl("onion:session:legacysession");
+  FAIL_IF(ttl < 90 || ttl > 100);
+
+  data = onion_sessions_get(sessions, "legacysession");
+  FAIL_IF_EQUAL(data, NULL);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(data, "Hello"), "Legacy");
+  onion_dict_free(data);
+
+  onion_sessions_remove(sessions, "legacysession");
+  onion_sessions_free(sessions);
+
+  END_LOCAL();
+}
+
+int main(int argc, char **argv) {
+  START();
+
+  if (getenv("ONION_TEST_REDIS_PORT")) {
+    redis_port = atoi(getenv("ONION_TEST_REDIS_PORT"));
+    standin = 0;
+  } else
+    standin_start();
+  t01_get_save_remove();
+  t02_reconnect();
+  t03_legacy();
+
+  END();
+}
@@ -0,0 +1,176 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <onion/onion.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/handler.h>
+#include <onion/url.h>
+#include <onion/log.h>
+#include <onion/metrics.h>
+#include <onion/types_internal.h>
+#include <onion/handlers/static.h>
+#include <onion/handlers/internal_status.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+#define FILL(a,b) onion_request_write(a,b,strlen(b))
+
+void t01_histogram() {
+  INIT_LOCAL();
+
+  FAIL_IF_NOT_EQUAL_INT(onion_metrics_bucket_limit(0), 1);
+  FAIL_IF_NOT_EQUAL_INT(onion_metrics_bucket_limit(3), 4);
+  FAIL_IF_NOT_EQUAL_INT(onion_metrics_bucket_limit(4), 5);
+  FAIL_IF_NOT_EQUAL_INT(onion_metrics_bucket_limit(7), 8);
+  FAIL_IF_NOT_EQUAL_INT(onion_metrics_bucket_limit(8), 10);
+  FAIL_IF_NOT_EQUAL_INT(onion_metrics_bucket_limit(11), 16);
+  int i;
+  for (i = 1; i < ONION_METRICS_LATENCY_BUCKETS; i++)
+    FAIL_IF_NOT(onion_metrics_bucket_limit(i) >
+                onion_metrics_bucket_limit(i - 1));
+  // Covers at least a minute
+  FAIL_IF(onion_metrics_bucket_limit(ONION_METRICS_LATENCY_BUCKETS - 1) <
+          60 * 1000000ull);
+
+  onion_metrics m;
+  memset(&m, 0, sizeof(m));
+  FAIL_IF_NOT_EQUAL_INT(onion_metrics_percentile(&m, 0.5), 0);
+  m.latency[1] = 50;            // 1 us
+  m.latency[8] = 49;            // 8-10 us
+  m.latency[40] = 1;            // 2048-2560 us
+  FAIL_IF_NOT_EQUAL_INT(onion_metrics_percentile(&m, 0.5), 2);
+  FAIL_IF_NOT_EQUAL_INT(onion_metrics_percentile(&m, 0.9), 10);
+  FAIL_IF_NOT_EQUAL_INT(onion_metrics_percentile(&m, 0.999), 2560);
+
+  END_LOCAL();
+}
+
+static onion_request *process(onion * server, const char *data) {
+  onion_request *req = onion_request_new(server->listen_points[0]);
+  FILL(req, data);
+  onion_request_process(req);
+  return req;
+}
+
+void t02_requests() {
+  INIT_LOCAL();
+
+  onion *server = onion_new(0);
+  onion_add_listen_point(server, NULL, NULL, onion_buffer_listen_point_new());
+  onion_url *urls = onion_url_new();
+  onion_url_add_handler(urls, "ok", onion_handler_static("OK", 200));
+  onion_url_add_handler(urls, "status", onion_internal_status());
+  onion_set_root_handler(server, onion_url_to_handler(urls));
+
+  onion_metrics before, after;
+  onion_metrics_get(&before);
+
+  int i;
+  for (i = 0; i < 10; i++)
+    onion_request_free(process(server, "GET /ok HTTP/1.1\n\n"));
+  onion_request_free(process(server, "GET /none HTTP/1.1\n\n"));
+
+  onion_metrics_get(&after);
+  FAIL_IF_NOT_EQUAL_INT(after.requests - before.requests, 11);
+  FAIL_IF_NOT_EQUAL_INT(after.responses[2] - before.responses[2], 10);
+  FAIL_IF_NOT_EQUAL_INT(after.responses[4] - before.responses[4], 1);
+  FAIL_IF_NOT_EQUAL_INT(after.latency_count - before.latency_count, 11);
+  FAIL_IF_NOT_EQUAL_INT(after.connections_opened - before.connections_opened,
+                        11);
+  FAIL_IF_NOT_EQUAL_INT(after.connections_opened - after.connections_closed,
+                        before.connections_opened - before.connections_closed);
+  FAIL_IF_NOT(after.bytes_sent - before.bytes_sent > 10 * 2);
+
+  onion_request *req = process(server, "GET /status?format=json HTTP/1.1\n\n");
+  const char *out = onion_buffer_listen_point_get_buffer_data(req);
+  FAIL_IF_NOT_STRSTR(out, "application/json");
+  FAIL_IF_NOT_STRSTR(out, "\"requests\":");
+  FAIL_IF_NOT_STRSTR(out, "\"2xx\":");
+  FAIL_IF_NOT_STRSTR(out, "\"connections\":{\"active\":1,");
+  FAIL_IF_NOT_STRSTR(out, "\"p99\":");
+  onion_request_free(req);
+
+  req = process(server, "GET /status?format=prometheus HTTP/1.1\n\n");
+  out = onion_buffer_listen_point_get_buffer_data(req);
+  FAIL_IF_NOT_STRSTR(out, "# TYPE onion_requests_total counter\n");
+  FAIL_IF_NOT_STRSTR(out, "onion_responses_total{code=\"4xx\"} ");
+  FAIL_IF_NOT_STRSTR(out, "onion_request_duration_seconds_bucket{le=\"+Inf\"} ");
+  FAIL_IF_NOT_STRSTR(out, "onion_request_duration_seconds_count ");
+  onion_request_free(req);
+
+  onion_free(server);
+  END_LOCAL();
+}
+
+#define NLOOPS 1000000
+
+static void *count_responses(void *_) {
+  int i;
+  for (i = 0; i < NLOOPS; i++)
+    onion_metrics_response_done(200, 10);
+  return NULL;
+}
+
+void t03_threads() {
+  INIT_LOCAL();
+  onion_metrics before, after;
+  onion_metrics_get(&before);
+
+  int nthreads = 4;
+  pthread_t threads[nthreads];
+  int i;
+  uint64_t start = onion_metrics_now();
+  for (i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, count_responses, NULL);
+  for (i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  uint64_t ns = onion_metrics_now() - start;
+  ONION_INFO("%.2f ns per update, %d threads in parallel",
+             (double)ns / NLOOPS, nthreads);
+
+  onion_metrics_get(&after);
+  FAIL_IF_NOT_EQUAL_INT(after.responses[2] - before.responses[2],
+                        nthreads * NLOOPS);
+  FAIL_IF_NOT_EQUAL_INT(after.bytes_sent - before.bytes_sent,
+                        nthreads * NLOOPS * 10);
+  FAIL_IF(after.threads < 2);
+  FAIL_IF(after.threads > before.threads + nthreads);
+
+  END_LOCAL();
+}
+
+int main(int argc, char **argv) {
+  START();
+
+  t01_histogram();
+  t02_requests();
+  t03_threads();
+
+  END();
+}
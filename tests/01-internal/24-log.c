@@ -0,0 +1,221 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include <onion/log.h>
+
+#include "../ctest.h"
+
+static int stderr_copy = -1;
+
+/// Sends stderr to a new temporary file, and returns it.
+static FILE *capture_stderr() {
+  FILE *f = tmpfile();
+  stderr_copy = dup(2);
+  dup2(fileno(f), 2);
+  return f;
+}
+
+/// Restores stderr, and returns all that was written to the file. Must be freed.
+static char *release_stderr(FILE * f) {
+  dup2(stderr_copy, 2);
+  close(stderr_copy);
+  long size = lseek(fileno(f), 0, SEEK_END);
+  char *data = malloc(size + 1);
+  ssize_t r = pread(fileno(f), data, size, 0);
+  data[r < 0 ? 0 : r] = '\0';
+  fclose(f);
+  return data;
+}
+
+static int count(const char *haystack, const char *needle) {
+  int n = 0;
+  while ((haystack = strstr(haystack, needle))) {
+    n++;
+    haystack += strlen(needle);
+  }
+  return n;
+}
+
+#define NMESSAGES 200
+
+static void *log_messages(void *_) {
+  int i;
+  for (i = 0; i < NMESSAGES; i++)
+    ONION_WARNING("message %d", i);
+  return NULL;
+}
+
+void t01_async() {
+  INIT_LOCAL();
+  int flags = onion_log_flags;
+  onion_log_flags |= OF_NOCOLOR;
+  onion_log = onion_log_async;
+
+  FILE *f = capture_stderr();
+  int nthreads = 4;
+  pthread_t threads[nthreads];
+  int i;
+  for (i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, log_messages, NULL);
+  for (i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  char longmsg[1024];
+  memset(longmsg, 'x', sizeof(longmsg) - 1);
+  longmsg[sizeof(longmsg) - 1] = '\0';
+  ONION_ERROR("long %s", longmsg);
+  onion_log_async_flush();
+  char *out = release_stderr(f);
+
+  onion_log = onion_log_stderr;
+  onion_log_flags = flags;
+
+  FAIL_IF_NOT_EQUAL_INT(count(out, "] message "), nthreads * NMESSAGES);
+  FAIL_IF_NOT_EQUAL_INT(count(out, "\n"), nthreads * NMESSAGES + 1);
+  FAIL_IF_NOT_STRSTR(out, "[WARNING 24-log.c:");
+  FAIL_IF_NOT_STRSTR(out, "] message 199\n");
+  FAIL_IF_NOT_STRSTR(out, "[ERROR 24-log.c:");
+  FAIL_IF_NOT_STRSTR(out, "xxx...\n");
+  FAIL_IF_STRSTR(out, "\033[");
+  free(out);
+
+  END_LOCAL();
+}
+
+void t02_dropped() {
+  INIT_LOCAL();
+  int flags = onion_log_flags;
+  onion_log_flags |= OF_NOCOLOR;
+  onion_log = onion_log_async;
+
+  FILE *f = capture_stderr();
+  int i;
+  for (i = 0; i < 10000; i++)
+    ONION_WARNING("message %d", i);
+  onion_log_async_flush();
+  char *out = release_stderr(f);
+
+  onion_log = onion_log_stderr;
+  onion_log_flags = flags;
+
+  // All are written or reported as dropped
+  int dropped = 0;
+  const char *p = out;
+  while ((p = strstr(p, " log messages dropped"))) {
+    const char *n = p;
+    while (n > out && n[-1] != ' ')
+      n--;
+    dropped += atoi(n);
+    p++;
+  }
+  int written = count(out, "] message ");
+  ONION_INFO("%d messages written, %d dropped", written, dropped);
+  FAIL_IF_NOT_EQUAL_INT(written + dropped, 10000);
+  free(out);
+
+  END_LOCAL();
+}
+
+void t03_fork() {
+  INIT_LOCAL();
+  int flags = onion_log_flags;
+  onion_log_flags |= OF_NOCOLOR;
+  onion_log = onion_log_async;
+
+  FILE *f = capture_stderr();
+  ONION_WARNING("before fork");
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Without exit handlers, so only the logger thread can write it.
+    ONION_WARNING("from child");
+    usleep(200000);
+    _exit(0);
+  }
+  int status = -1;
+  waitpid(pid, &status, 0);
+  onion_log_async_flush();
+  char *out = release_stderr(f);
+
+  onion_log = onion_log_stderr;
+  onion_log_flags = flags;
+
+  FAIL_IF_NOT_EQUAL_INT(status, 0);
+  FAIL_IF_NOT_EQUAL_INT(count(out, "] from child\n"), 1);
+  // Written just by the parent
+  FAIL_IF_NOT_EQUAL_INT(count(out, "] before fork\n"), 1);
+  free(out);
+
+  END_LOCAL();
+}
+
+static double ns_per_message(void (*log) (onion_log_level level,
+                                          const char *filename, int lineno,
+                                          const char *fmt, ...)) {
+  struct timespec start, end;
+  int i;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < NMESSAGES; i++)
+    log(O_WARNING, __FILE__, __LINE__, "message %d of %s", i, "test");
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) /
+      NMESSAGES;
+}
+
+void t04_speed_and_stop() {
+  INIT_LOCAL();
+
+  FILE *f = capture_stderr();
+  double sync = ns_per_message(onion_log_stderr);
+  onion_log_async_flush();
+  double async = ns_per_message(onion_log_async);
+  onion_log_async_stop();
+  onion_log_async(O_WARNING, __FILE__, __LINE__, "after stop");
+  char *out = release_stderr(f);
+
+  ONION_INFO("%.0f ns per message at onion_log_stderr, %.0f ns at onion_log_async",
+             sync, async);
+  FAIL_IF_NOT_EQUAL_INT(count(out, "] message "), 2 * NMESSAGES);
+  // Synchronous after stop
+  FAIL_IF_NOT_STRSTR(out, "after stop");
+  free(out);
+
+  END_LOCAL();
+}
+
+int main(int argc, char **argv) {
+  START();
+
+  t01_async();
+  t02_dropped();
+  t03_fork();
+  t04_speed_and_stop();
+
+  END();
+}
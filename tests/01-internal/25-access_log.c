@@ -0,0 +1,277 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <onion/onion.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/url.h>
+#include <onion/log.h>
+#include <onion/access_log.h>
+#include <onion/types_internal.h>
+#include <onion/handlers/static.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+#define FILL(a,b) onion_request_write(a,b,strlen(b))
+
+void t01_format() {
+  INIT_LOCAL();
+  onion_access_log_entry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.time = 0;
+  entry.method = "GET";
+  entry.protocol = "HTTP/1.1";
+  entry.code = 404;
+  entry.bytes = 1234;
+  entry.latency_us = 87;
+  strcpy(entry.client, "127.0.0.1");
+  strcpy(entry.path, "/a\"b\\c\n");
+
+  char line[ONION_ACCESS_LOG_LINE_SIZE];
+  int length = onion_access_log_format(&entry, OAL_JSON, line);
+  FAIL_IF_NOT_EQUAL_INT(length, strlen(line));
+  FAIL_IF_NOT_EQUAL_STR(line,
+                        "{\"time\":\"1970-01-01T00:00:00Z\",\"client\":\"127.0.0.1\",\"method\":\"GET\","
+                        "\"path\":\"/a\\\"b\\\\c\\u000A\",\"protocol\":\"HTTP/1.1\",\"code\":404,"
+                        "\"bytes\":1234,\"latency_us\":87}\n");
+
+  length = onion_access_log_format(&entry, OAL_COMMON, line);
+  FAIL_IF_NOT_EQUAL_INT(length, strlen(line));
+  FAIL_IF_NOT(strncmp(line, "127.0.0.1 - - [", 15) == 0);
+  FAIL_IF_NOT_STRSTR(line, "] \"GET /a\\\"b\\\\c\\x0A HTTP/1.1\" 404 1234 87\n");
+
+  END_LOCAL();
+}
+
+static onion *new_server() {
+  onion *server = onion_new(0);
+  onion_add_listen_point(server, NULL, NULL, onion_buffer_listen_point_new());
+  onion_url *urls = onion_url_new();
+  onion_url_add_handler(urls, "^ok", onion_handler_static("OK", 200));
+  onion_set_root_handler(server, onion_url_to_handler(urls));
+  return server;
+}
+
+static void process(onion * server, const char *data) {
+  onion_request *req = onion_request_new(server->listen_points[0]);
+  FILL(req, data);
+  onion_request_process(req);
+  onion_request_free(req);
+}
+
+void t02_memory() {
+  INIT_LOCAL();
+  onion *server = new_server();
+  onion_access_log *log = onion_access_log_memory(4);
+  onion_set_access_log(server, log);
+
+  onion_access_log_entry entries[10];
+  FAIL_IF_NOT_EQUAL_INT(onion_access_log_memory_get(log, entries, 10), 0);
+
+  int i;
+  char req[64];
+  for (i = 0; i < 5; i++) {
+    snprintf(req, sizeof(req), "GET /ok%d HTTP/1.1\n\n", i);
+    process(server, req);
+  }
+  process(server, "POST /none HTTP/1.0\n\n");
+
+  FAIL_IF_NOT_EQUAL_INT(onion_access_log_memory_get(log, entries, 10), 4);
+  FAIL_IF_NOT_EQUAL_STR(entries[0].path, "/ok2");
+  FAIL_IF_NOT_EQUAL_STR(entries[2].path, "/ok4");
+  FAIL_IF_NOT_EQUAL_STR(entries[2].method, "GET");
+  FAIL_IF_NOT_EQUAL_STR(entries[2].protocol, "HTTP/1.1");
+  FAIL_IF_NOT_EQUAL_INT(entries[2].code, 200);
+  FAIL_IF(entries[2].bytes < 2);
+  FAIL_IF_NOT_EQUAL_STR(entries[3].path, "/none");
+  FAIL_IF_NOT_EQUAL_STR(entries[3].method, "POST");
+  FAIL_IF_NOT_EQUAL_STR(entries[3].protocol, "HTTP/1.0");
+  FAIL_IF_NOT_EQUAL_INT(entries[3].code, 404);
+  FAIL_IF_NOT_EQUAL_STR(entries[3].client, "-");
+
+  FAIL_IF_NOT_EQUAL_INT(onion_access_log_memory_get(log, entries, 1), 1);
+  FAIL_IF_NOT_EQUAL_STR(entries[0].path, "/none");
+
+  onion_free(server);
+  END_LOCAL();
+}
+
+static char *read_file(const char *filename) {
+  FILE *f = fopen(filename, "r");
+  if (!f)
+    return strdup("");
+  static char data[64 * 1024];
+  size_t r = fread(data, 1, sizeof(data) - 1, f);
+  data[r] = '\0';
+  fclose(f);
+  return strdup(data);
+}
+
+static int count_lines(const char *data) {
+  int n = 0;
+  for (; *data; data++)
+    if (*data == '\n')
+      n++;
+  return n;
+}
+
+void t03_file() {
+  INIT_LOCAL();
+  char filename[] = "/tmp/onion-access-log-XXXXXX";
+  close(mkstemp(filename));
+  char rotated[64];
+  snprintf(rotated, sizeof(rotated), "%s.1", filename);
+
+  onion *server = new_server();
+  onion_access_log *log = onion_access_log_file(filename, OAL_JSON);
+  FAIL_IF_EQUAL(log, NULL);
+  onion_set_access_log(server, log);
+
+  process(server, "GET /ok HTTP/1.1\n\n");
+  process(server, "GET /ok?a=1 HTTP/1.1\n\n");
+  // Buffered, until flushed or one second passes
+  char *data = read_file(filename);
+  FAIL_IF_NOT_EQUAL_INT(count_lines(data), 0);
+  free(data);
+  onion_access_log_flush(log);
+  data = read_file(filename);
+  FAIL_IF_NOT_EQUAL_INT(count_lines(data), 2);
+  FAIL_IF_NOT_STRSTR(data, "\"path\":\"/ok\",\"protocol\":\"HTTP/1.1\",\"code\":200,");
+  free(data);
+
+  // Rotation: moved away, and SIGHUP creates it again
+  rename(filename, rotated);
+  process(server, "GET /ok HTTP/1.1\n\n");
+  raise(SIGHUP);
+  process(server, "GET /after HTTP/1.1\n\n");
+  onion_access_log_flush(log);      // Writes to the old file, and reopens
+  data = read_file(rotated);
+  FAIL_IF_NOT_EQUAL_INT(count_lines(data), 4);
+  free(data);
+  process(server, "GET /new HTTP/1.1\n\n");
+  usleep(1500000);              // Written by the background thread
+  data = read_file(filename);
+  FAIL_IF_NOT_EQUAL_INT(count_lines(data), 1);
+  FAIL_IF_NOT_STRSTR(data, "\"path\":\"/new\"");
+  free(data);
+
+  onion_free(server);
+  unlink(filename);
+  unlink(rotated);
+  END_LOCAL();
+}
+
+#define NTHREADS 4
+#define NLINES 5000
+
+typedef struct {
+  onion_access_log *log;
+  onion_request *req;
+  onion_response *res;
+} writer_t;
+
+/// Fills its own buffer several times, so it is also written from this thread.
+static void *write_lines(void *_w) {
+  writer_t *w = _w;
+  int i;
+  for (i = 0; i < NLINES; i++)
+    onion_access_log_response(w->log, w->req, w->res);
+  return NULL;
+}
+
+void t04_threads() {
+  INIT_LOCAL();
+  char filename[] = "/tmp/onion-access-log-XXXXXX";
+  close(mkstemp(filename));
+  onion *server = new_server();
+  onion_access_log *log = onion_access_log_file(filename, OAL_COMMON);
+  FAIL_IF_EQUAL(log, NULL);
+
+  writer_t w[NTHREADS];
+  pthread_t threads[NTHREADS];
+  int i, round;
+  // Second round reuses the buffers of the exited threads
+  for (round = 0; round < 2; round++) {
+    for (i = 0; i < NTHREADS; i++) {
+      char path[64];
+      snprintf(path, sizeof(path), "GET /thread/%d HTTP/1.1\n\n", i);
+      w[i].log = log;
+      w[i].req = onion_request_new(server->listen_points[0]);
+      FILL(w[i].req, path);
+      w[i].res = onion_response_new(w[i].req);
+      pthread_create(&threads[i], NULL, write_lines, &w[i]);
+    }
+    for (i = 0; i < NTHREADS; i++) {
+      pthread_join(threads[i], NULL);
+      onion_response_free(w[i].res);
+      onion_request_free(w[i].req);
+    }
+  }
+  onion_access_log_flush(log);
+
+  // All lines, whole
+  FILE *f = fopen(filename, "r");
+  FAIL_IF_EQUAL(f, NULL);
+  int count[NTHREADS] = { 0 };
+  int total = 0, bad = 0;
+  char line[ONION_ACCESS_LOG_LINE_SIZE];
+  while (fgets(line, sizeof(line), f)) {
+    const char *get = strstr(line, "\"GET /thread/");
+    int n;
+    total++;
+    if (get && sscanf(get, "\"GET /thread/%d HTTP/1.1\"", &n) == 1 && n >= 0
+        && n < NTHREADS && line[strlen(line) - 1] == '\n')
+      count[n]++;
+    else
+      bad++;
+  }
+  fclose(f);
+  FAIL_IF_NOT_EQUAL_INT(total, 2 * NTHREADS * NLINES);
+  FAIL_IF_NOT_EQUAL_INT(bad, 0);
+  for (i = 0; i < NTHREADS; i++)
+    FAIL_IF_NOT_EQUAL_INT(count[i], 2 * NLINES);
+
+  onion_access_log_free(log);
+  onion_free(server);
+  unlink(filename);
+  END_LOCAL();
+}
+
+int main(int argc, char **argv) {
+  START();
+
+  t01_format();
+  t02_memory();
+  t03_file();
+  t04_threads();
+
+  END();
+}
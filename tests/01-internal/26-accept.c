@@ -0,0 +1,168 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/metrics.h>
+#include <onion/handlers/static.h>
+
+#include "../ctest.h"
+
+#define PORT "8083"
+#define NCONNECTIONS 512
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/// Starts a non blocking connect to localhost.
+static int connect_nonblocking(struct addrinfo *addr) {
+  int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK,
+                  addr->ai_protocol);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, addr->ai_addr, addr->ai_addrlen) < 0
+      && errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/// Opens all connections at once, then does a request on each. Returns how many succeeded.
+static int burst(int nconnections) {
+  struct addrinfo hints, *addr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo("127.0.0.1", PORT, &hints, &addr) != 0)
+    return 0;
+
+  struct pollfd *fds = calloc(nconnections, sizeof(struct pollfd));
+  int i;
+  for (i = 0; i < nconnections; i++) {
+    fds[i].fd = connect_nonblocking(addr);
+    fds[i].events = POLLOUT;
+  }
+  freeaddrinfo(addr);
+
+  // Wait until all are connected, and send the request
+  const char *request = "GET / HTTP/1.0\r\n\r\n";
+  int pending = nconnections;
+  while (pending > 0 && poll(fds, nconnections, 5000) > 0) {
+    for (i = 0; i < nconnections; i++) {
+      if (fds[i].fd >= 0 && fds[i].revents & POLLOUT) {
+        if (write(fds[i].fd, request, strlen(request)) != strlen(request)) {
+          close(fds[i].fd);
+          fds[i].fd = -1;
+        } else
+          fds[i].events = POLLIN;
+        pending--;
+      }
+    }
+  }
+
+  // And read the answers
+  int ok = 0;
+  for (i = 0; i < nconnections; i++) {
+    if (fds[i].fd < 0)
+      continue;
+    fcntl(fds[i].fd, F_SETFL, 0);
+    char data[1024];
+    ssize_t n, total = 0;
+    while ((n = read(fds[i].fd, data + total, sizeof(data) - 1 - total)) > 0)
+      total += n;
+    data[total] = '\0';
+    if (strstr(data, "\r\n\r\nOK"))
+      ok++;
+    close(fds[i].fd);
+  }
+  free(fds);
+  return ok;
+}
+
+static onion *start_server(int accept_batch) {
+  onion *o = onion_new(O_POOL | O_DETACH_LISTEN);
+  onion_set_port(o, PORT);
+  onion_set_hostname(o, "127.0.0.1");
+  onion_set_accept_batch(o, accept_batch);
+  onion_set_root_handler(o, onion_handler_static("OK", 200));
+  onion_listen(o);
+  usleep(100000);
+  return o;
+}
+
+void t01_burst() {
+  INIT_LOCAL();
+  onion *o = start_server(64);
+  onion_metrics before, after;
+  onion_metrics_get(&before);
+
+  // A full backlog drops connections, and they are retried after 1 s or more.
+  double start = now();
+  int ok = burst(NCONNECTIONS);
+  double elapsed = now() - start;
+  ONION_INFO("%d connections at once in %.3f s", NCONNECTIONS, elapsed);
+  FAIL_IF_NOT_EQUAL_INT(ok, NCONNECTIONS);
+  FAIL_IF(elapsed > 0.9);
+
+  // The last accept of each batch finds none pending, and is not a connection.
+  onion_metrics_get(&after);
+  FAIL_IF_NOT_EQUAL_INT(after.connections_opened - before.connections_opened,
+                        NCONNECTIONS);
+
+  onion_free(o);
+  END_LOCAL();
+}
+
+void t02_one_per_wakeup() {
+  INIT_LOCAL();
+  onion *o = start_server(1);
+
+  int ok = burst(64);
+  FAIL_IF_NOT_EQUAL_INT(ok, 64);
+
+  onion_free(o);
+  END_LOCAL();
+}
+
+int main(int argc, char **argv) {
+  START();
+
+  t01_burst();
+  t02_one_per_wakeup();
+
+  END();
+}
@@ -0,0 +1,216 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <onion/poller.h>
+#include <onion/metrics.h>
+#include <onion/log.h>
+
+#include "../ctest.h"
+
+#define NPAIRS 16
+
+static onion_poller *poller;
+static int fds[NPAIRS * 2][2];
+static volatile int called[NPAIRS * 2];
+static volatile int ncalls;
+
+static void *poll_thread(void *p) {
+  onion_poller_poll(p);
+  return NULL;
+}
+
+/// Waits up to timeout seconds for ncalls to be n.
+static void wait_calls(int n, int timeout) {
+  int i;
+  for (i = 0; i < timeout * 100 && ncalls < n; i++)
+    usleep(10000);
+}
+
+/// Reads, and removes the other slot of the pair, so it must not be called.
+static int read_and_remove_pair(void *data) {
+  int i = (int)(long)data;
+  char c;
+  if (read(fds[i][0], &c, 1) != 1)
+    ONION_ERROR("Could not read from %d", i);
+  called[i]++;
+  __sync_fetch_and_add(&ncalls, 1);
+  if (!called[i ^ 1])
+    onion_poller_remove(poller, fds[i ^ 1][0]);
+  return -1;
+}
+
+void t01_queue() {
+  INIT_LOCAL();
+  poller = onion_poller_new(NPAIRS * 2);
+  onion_poller_set_queue_size_per_thread(poller, NPAIRS * 4);
+  ncalls = 0;
+
+  int i;
+  for (i = 0; i < NPAIRS * 2; i++) {
+    FAIL_IF(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) < 0);
+    called[i] = 0;
+    FAIL_IF_NOT_EQUAL_INT(write(fds[i][1], "x", 1), 1);
+    onion_poller_slot *slot = onion_poller_slot_new(fds[i][0],
+                                                    read_and_remove_pair,
+                                                    (void *)(long)i);
+    onion_poller_add(poller, slot);
+  }
+
+  onion_metrics before, after;
+  onion_metrics_get(&before);
+  pthread_t thread;
+  pthread_create(&thread, NULL, poll_thread, poller);
+  wait_calls(NPAIRS, 5);
+  usleep(100000);
+  onion_poller_stop(poller);
+  pthread_join(thread, NULL);
+  onion_metrics_get(&after);
+
+  FAIL_IF_NOT_EQUAL_INT(ncalls, NPAIRS);
+  for (i = 0; i < NPAIRS; i++)
+    FAIL_IF_NOT_EQUAL_INT(called[i * 2] + called[i * 2 + 1], 1);
+#ifdef HAVE_POLLER_QUEUE
+  // All ready at once, so several per wait.
+  FAIL_IF_NOT(after.poller_events - before.poller_events >
+              after.poller_wakeups - before.poller_wakeups);
+#endif
+
+  onion_poller_free(poller);
+  for (i = 0; i < NPAIRS * 2; i++) {
+    close(fds[i][0]);
+    close(fds[i][1]);
+  }
+  END_LOCAL();
+}
+
+/// The first one called is slow; the other must not time out meanwhile.
+static int read_slow(void *data) {
+  int i = (int)(long)data;
+  if (__sync_fetch_and_add(&ncalls, 1) == 0)
+    sleep(3);
+  char c;
+  if (read(fds[i][0], &c, 1) == 1)      // Queued data is there even after a timeout
+    called[i] = (read(fds[i][0], &c, 1) < 0 && errno == EAGAIN);       // but then EOF
+  return -1;
+}
+
+void t02_timeout_at_queue() {
+  INIT_LOCAL();
+  poller = onion_poller_new(4);
+  onion_poller_set_queue_size_per_thread(poller, 8);
+  ncalls = 0;
+
+  int i;
+  for (i = 0; i < 2; i++) {
+    FAIL_IF(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) < 0);
+    called[i] = 0;
+    fcntl(fds[i][0], F_SETFL, fcntl(fds[i][0], F_GETFL) | O_NONBLOCK);
+    FAIL_IF_NOT_EQUAL_INT(write(fds[i][1], "x", 1), 1);
+    onion_poller_slot *slot =
+        onion_poller_slot_new(fds[i][0], read_slow, (void *)(long)i);
+    onion_poller_slot_set_timeout(slot, 1000);
+    onion_poller_add(poller, slot);
+  }
+
+  // The first thread gets both; the second one runs the timer meanwhile.
+  pthread_t threads[2];
+  pthread_create(&threads[0], NULL, poll_thread, poller);
+  usleep(100000);
+  pthread_create(&threads[1], NULL, poll_thread, poller);
+  wait_calls(2, 10);
+  usleep(100000);
+  onion_poller_stop(poller);
+  pthread_join(threads[0], NULL);
+  pthread_join(threads[1], NULL);
+
+  FAIL_IF_NOT_EQUAL_INT(called[0], 1);
+  FAIL_IF_NOT_EQUAL_INT(called[1], 1);
+
+  onion_poller_free(poller);
+  for (i = 0; i < 2; i++) {
+    close(fds[i][0]);
+    close(fds[i][1]);
+  }
+  END_LOCAL();
+}
+
+/// Reads all there is, once per edge.
+static int read_edge(void *data) {
+  int fd = (int)(long)data;
+  char buffer[16];
+  while (read(fd, buffer, sizeof(buffer)) > 0) ;
+  if (errno != EAGAIN)
+    return -1;
+  __sync_fetch_and_add(&ncalls, 1);
+  return 0;
+}
+
+void t03_edge() {
+  INIT_LOCAL();
+  poller = onion_poller_new(4);
+  ncalls = 0;
+
+  FAIL_IF(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[0]) < 0);
+  fcntl(fds[0][0], F_SETFL, fcntl(fds[0][0], F_GETFL) | O_NONBLOCK);
+  onion_poller_slot *slot =
+      onion_poller_slot_new(fds[0][0], read_edge, (void *)(long)fds[0][0]);
+  onion_poller_slot_set_type(slot, O_POLL_READ | O_POLL_EDGE);
+  onion_poller_add(poller, slot);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, poll_thread, poller);
+  int i;
+  for (i = 1; i <= 3; i++) {
+    FAIL_IF_NOT_EQUAL_INT(write(fds[0][1], "hello", 5), 5);
+    wait_calls(i, 2);
+    FAIL_IF_NOT_EQUAL_INT(ncalls, i);
+  }
+  usleep(100000);
+  FAIL_IF_NOT_EQUAL_INT(ncalls, 3);   // No more calls without new data
+  onion_poller_stop(poller);
+  pthread_join(thread, NULL);
+
+  onion_poller_free(poller);
+  close(fds[0][0]);
+  close(fds[0][1]);
+  END_LOCAL();
+}
+
+int main(int argc, char **argv) {
+  START();
+
+  t01_queue();
+  t02_timeout_at_queue();
+  t03_edge();
+
+  END();
+}
@@ -0,0 +1,194 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <onion/onion.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/url.h>
+#include <onion/log.h>
+#include <onion/metrics.h>
+#include <onion/shortcuts.h>
+#include <onion/types_internal.h>
+#include <onion/handlers/static.h>
+
+#include "../ctest.h"
+#include "utils.h"
+#include "buffer_listen_point.h"
+
+#define PORT "8084"
+#define FILL(a,b) onion_request_write(a,b,strlen(b))
+
+/// Sends a request, if given, and reads the answer until the server closes.
+static void request(int fd, const char *path, char *data, size_t size) {
+  if (path) {
+    char req[128];
+    snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\n\r\n", path);
+    if (write(fd, req, strlen(req)) != strlen(req))
+      data[0] = '\0';
+  }
+  ssize_t n, total = 0;
+  while ((n = read(fd, data + total, size - 1 - total)) > 0)
+    total += n;
+  data[total] = '\0';
+  close(fd);
+}
+
+static onion *start_server(int max, int per_ip) {
+  onion *o = onion_new(O_POOL | O_DETACH_LISTEN);
+  onion_set_port(o, PORT);
+  onion_set_hostname(o, "127.0.0.1");
+  onion_set_max_connections(o, max, per_ip);
+  onion_set_overload_retry_after(o, 3);
+  onion_set_root_handler(o, onion_handler_static("OK", 200));
+  onion_listen(o);
+  usleep(100000);
+  return o;
+}
+
+void t01_max_connections() {
+  INIT_LOCAL();
+  onion *o = start_server(4, 0);
+  onion_metrics before, after;
+  onion_metrics_get(&before);
+
+  int fds[4];
+  int i;
+  for (i = 0; i < 4; i++)
+    fds[i] = connect_to("127.0.0.1", PORT);
+  usleep(100000);
+
+  // Over the limit, answered at once without waiting for the request.
+  char data[1024];
+  request(connect_to("127.0.0.1", PORT), NULL, data, sizeof(data));
+  FAIL_IF_NOT_STRSTR(data, "HTTP/1.1 503 Service Unavailable\r\n");
+  FAIL_IF_NOT_STRSTR(data, "Retry-After: 3\r\n");
+  FAIL_IF_NOT_STRSTR(data, "\r\n\r\nService Unavailable\n");
+
+  // Closing one leaves room for another.
+  close(fds[0]);
+  usleep(100000);
+  request(connect_to("127.0.0.1", PORT), "/", data, sizeof(data));
+  FAIL_IF_NOT_STRSTR(data, "\r\n\r\nOK");
+
+  // The open ones are still served.
+  request(fds[1], "/", data, sizeof(data));
+  FAIL_IF_NOT_STRSTR(data, "\r\n\r\nOK");
+
+  onion_metrics_get(&after);
+  FAIL_IF_NOT_EQUAL_INT(after.connections_rejected -
+                        before.connections_rejected, 1);
+
+  for (i = 2; i < 4; i++)
+    close(fds[i]);
+  onion_free(o);
+  END_LOCAL();
+}
+
+void t02_max_connections_per_ip() {
+  INIT_LOCAL();
+  onion *o = start_server(0, 2);
+
+  int fd1 = connect_to("127.0.0.1", PORT);
+  int fd2 = connect_to("127.0.0.1", PORT);
+  usleep(100000);
+
+  char data[1024];
+  request(connect_to("127.0.0.1", PORT), NULL, data, sizeof(data));
+  FAIL_IF_NOT_STRSTR(data, "HTTP/1.1 503");
+
+  request(fd1, "/", data, sizeof(data));
+  FAIL_IF_NOT_STRSTR(data, "\r\n\r\nOK");
+  usleep(100000);
+  request(connect_to("127.0.0.1", PORT), "/", data, sizeof(data));
+  FAIL_IF_NOT_STRSTR(data, "\r\n\r\nOK");
+
+  close(fd2);
+  onion_free(o);
+  END_LOCAL();
+}
+
+static onion *server;
+static char inner_answer[1024];
+
+/// Processes another request while this one is in process, as other thread would.
+static int nested(void *_, onion_request * req, onion_response * res) {
+  onion_request *inner = onion_request_new(server->listen_points[0]);
+  FILL(inner, "GET /ok HTTP/1.1\n\n");
+  onion_request_process(inner);
+  strncpy(inner_answer, onion_buffer_listen_point_get_buffer_data(inner),
+          sizeof(inner_answer) - 1);
+  onion_request_free(inner);
+  return onion_shortcut_response("outer", 200, req, res);
+}
+
+void t03_max_requests() {
+  INIT_LOCAL();
+  server = onion_new(0);
+  onion_add_listen_point(server, NULL, NULL, onion_buffer_listen_point_new());
+  onion_url *urls = onion_url_new();
+  onion_url_add_handler(urls, "ok", onion_handler_static("OK", 200));
+  onion_url_add(urls, "nested", nested);
+  onion_set_root_handler(server, onion_url_to_handler(urls));
+  onion_set_max_requests(server, 1);
+
+  onion_metrics before, after;
+  onion_metrics_get(&before);
+
+  onion_request *req = onion_request_new(server->listen_points[0]);
+  FILL(req, "GET /nested HTTP/1.1\n\n");
+  onion_request_process(req);
+  FAIL_IF_NOT_STRSTR(onion_buffer_listen_point_get_buffer_data(req), "outer");
+  onion_request_free(req);
+
+  FAIL_IF_NOT_STRSTR(inner_answer, "HTTP/1.1 503 Service Unavailable\r\n");
+  FAIL_IF_NOT_STRSTR(inner_answer, "Retry-After: 1\r\n");
+  FAIL_IF_NOT_STRSTR(inner_answer, "Connection: Close\r\n");
+
+  // Once finished, there is room again.
+  req = onion_request_new(server->listen_points[0]);
+  FILL(req, "GET /ok HTTP/1.1\n\n");
+  onion_request_process(req);
+  FAIL_IF_NOT_STRSTR(onion_buffer_listen_point_get_buffer_data(req), "OK");
+  onion_request_free(req);
+
+  onion_metrics_get(&after);
+  FAIL_IF_NOT_EQUAL_INT(after.requests_rejected - before.requests_rejected, 1);
+
+  onion_free(server);
+  END_LOCAL();
+}
+
+int main(int argc, char **argv) {
+  START();
+
+  t01_max_connections();
+  t02_max_connections_per_ip();
+  t03_max_requests();
+
+  END();
+}
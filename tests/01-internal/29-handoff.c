@@ -0,0 +1,311 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/shortcuts.h>
+#include <onion/handlers/static.h>
+
+#include "../ctest.h"
+#include "utils.h"
+
+#define PORT "8085"
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/// Reads until the server closes, or the answer has a body of the given length.
+static void read_answer(int fd, char *data, size_t size) {
+  ssize_t n, total = 0;
+  while ((n = read(fd, data + total, size - 1 - total)) > 0) {
+    total += n;
+    data[total] = '\0';
+    char *body = strstr(data, "\r\n\r\n");
+    char *length = strstr(data, "Content-Length: ");
+    if (body && length && data + total - (body + 4) >= atoi(length + 16))
+      break;
+  }
+  data[total] = '\0';
+}
+
+static void request(int fd, const char *path, char *data, size_t size) {
+  char req[128];
+  snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+  if (write(fd, req, strlen(req)) != strlen(req))
+    data[0] = '\0';
+  else
+    read_answer(fd, data, size);
+}
+
+static int slow(void *_, onion_request * req, onion_response * res) {
+  usleep(500000);
+  return onion_shortcut_response("slow", 200, req, res);
+}
+
+static onion *start_server(const char *answer) {
+  onion *o = onion_new(O_POOL | O_DETACH_LISTEN | O_NO_SIGTERM);
+  onion_set_port(o, PORT);
+  onion_set_hostname(o, "127.0.0.1");
+  onion_set_timeout(o, 30000);
+  onion_url *urls = onion_root_url(o);
+  onion_url_add(urls, "slow", slow);
+  onion_url_add_handler(urls, "", onion_handler_static(answer, 200));
+  onion_listen(o);
+  usleep(100000);
+  return o;
+}
+
+void t01_drain() {
+  INIT_LOCAL();
+  onion *o = start_server("parent");
+  char data[1024];
+
+  int idle = connect_to("127.0.0.1", PORT);
+  request(idle, "/", data, sizeof(data));
+  FAIL_IF_NOT_STRSTR(data, "\r\n\r\nparent");
+  FAIL_IF_STRSTR(data, "Connection: Close");
+
+  int busy = connect_to("127.0.0.1", PORT);
+  const char *req = "GET /slow HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  FAIL_IF_NOT_EQUAL_INT(write(busy, req, strlen(req)), strlen(req));
+  usleep(100000);
+
+  // The request in process finishes, and the idle one is closed well before its timeout.
+  double start = now();
+  FAIL_IF_NOT_EQUAL_INT(onion_drain(o, 10000), 0);
+  double elapsed = now() - start;
+  ONION_INFO("Drained in %.3f s", elapsed);
+  FAIL_IF(elapsed < 0.3);
+  FAIL_IF(elapsed > 5);
+
+  read_answer(busy, data, sizeof(data));
+  FAIL_IF_NOT_STRSTR(data, "Connection: Close\r\n");
+  FAIL_IF_NOT_STRSTR(data, "\r\n\r\nslow");
+  FAIL_IF_NOT_EQUAL_INT(read(busy, data, sizeof(data)), 0);
+  FAIL_IF_NOT_EQUAL_INT(read(idle, data, sizeof(data)), 0);
+  close(busy);
+  close(idle);
+
+  FAIL_IF(connect_to("127.0.0.1", PORT) >= 0);
+
+  onion_free(o);
+  END_LOCAL();
+}
+
+void t02_handoff() {
+  INIT_LOCAL();
+  onion *o = start_server("parent");
+  char data[1024];
+
+  char *const argv[] = { "/proc/self/exe", "child", NULL };
+  pid_t pid = onion_handoff(o, argv);
+  FAIL_IF(pid <= 0);
+
+  // Both answer while the new one starts, and no connection is refused.
+  int i, parent = 0, child = 0;
+  for (i = 0; i < 50; i++) {
+    int fd = connect_to("127.0.0.1", PORT);
+    FAIL_IF(fd < 0);
+    request(fd, "/", data, sizeof(data));
+    close(fd);
+    if (strstr(data, "\r\n\r\nparent"))
+      parent++;
+    else if (strstr(data, "\r\n\r\nchild"))
+      child++;
+    usleep(10000);
+  }
+  FAIL_IF_NOT_EQUAL_INT(parent + child, 50);
+
+  FAIL_IF_NOT_EQUAL_INT(onion_drain(o, 5000), 0);
+  for (i = 0; i < 10; i++) {
+    int fd = connect_to("127.0.0.1", PORT);
+    request(fd, "/", data, sizeof(data));
+    close(fd);
+    FAIL_IF_NOT_STRSTR(data, "\r\n\r\nchild");
+  }
+
+  kill(pid, SIGTERM);
+  int status = -1;
+  waitpid(pid, &status, 0);
+  FAIL_IF_NOT_EQUAL_INT(status, 0);
+
+  onion_free(o);
+  END_LOCAL();
+}
+
+static int errors = 0;
+
+static void count_errors(onion_log_level level, const char *filename,
+                         int lineno, const char *fmt, ...) {
+  if (level != O_ERROR)
+    return;
+  __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "%s:%d ERROR ", filename, lineno);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+}
+
+static volatile int connecting;
+
+/// Connects and closes at once, until stopped. Refused after the drain, without logging.
+static void *connect_loop(void *_) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(atoi(PORT));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  while (connecting) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+      usleep(1000);
+    close(fd);
+  }
+  return NULL;
+}
+
+void t03_drain_while_accepting() {
+  INIT_LOCAL();
+  onion *o = start_server("parent");
+  void (*previous_log) (onion_log_level level, const char *filename,
+                        int lineno, const char *fmt, ...) = onion_log;
+  onion_log = count_errors;
+
+  // The listen socket is closed while the pool threads keep accepting.
+  connecting = 1;
+  pthread_t threads[4];
+  int i;
+  for (i = 0; i < 4; i++)
+    pthread_create(&threads[i], NULL, connect_loop, NULL);
+  usleep(200000);
+  FAIL_IF_NOT_EQUAL_INT(onion_drain(o, 5000), 0);
+  connecting = 0;
+  for (i = 0; i < 4; i++)
+    pthread_join(threads[i], NULL);
+
+  onion_log = previous_log;
+  FAIL_IF_NOT_EQUAL_INT(errors, 0);
+  FAIL_IF(connect_to("127.0.0.1", PORT) >= 0);
+
+  onion_free(o);
+  END_LOCAL();
+}
+
+static int answered = 0, dropped = 0;
+
+/// Requests until stopped, counting the connections closed without an answer.
+static void *request_loop(void *_) {
+  char data[1024];
+  while (connecting) {
+    int fd = connect_to("127.0.0.1", PORT);
+    if (fd < 0) {
+      __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    request(fd, "/", data, sizeof(data));
+    close(fd);
+    if (strstr(data, "\r\n\r\nparent") || strstr(data, "\r\n\r\nchild"))
+      __atomic_add_fetch(&answered, 1, __ATOMIC_RELAXED);
+    else
+      __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+void t04_drain_under_load() {
+  INIT_LOCAL();
+  onion *o = start_server("parent");
+
+  char *const argv[] = { "/proc/self/exe", "child", NULL };
+  pid_t pid = onion_handoff(o, argv);
+  FAIL_IF(pid <= 0);
+
+  // Connections accepted by this process while it drains are answered, by it or the child.
+  connecting = 1;
+  pthread_t threads[4];
+  int i;
+  for (i = 0; i < 4; i++)
+    pthread_create(&threads[i], NULL, request_loop, NULL);
+  usleep(200000);
+  FAIL_IF_NOT_EQUAL_INT(onion_drain(o, 5000), 0);
+  usleep(100000);
+  connecting = 0;
+  for (i = 0; i < 4; i++)
+    pthread_join(threads[i], NULL);
+
+  ONION_INFO("%d requests answered, %d dropped", answered, dropped);
+  FAIL_IF(answered == 0);
+  FAIL_IF_NOT_EQUAL_INT(dropped, 0);
+
+  kill(pid, SIGTERM);
+  int status = -1;
+  waitpid(pid, &status, 0);
+  FAIL_IF_NOT_EQUAL_INT(status, 0);
+
+  onion_free(o);
+  END_LOCAL();
+}
+
+/// The new process of t02_handoff and t04_drain_under_load. Listens with the inherited socket until SIGTERM.
+static int child() {
+  onion *o = onion_new(O_POOL);
+  onion_set_port(o, PORT);
+  onion_set_hostname(o, "127.0.0.1");
+  onion_set_root_handler(o, onion_handler_static("child", 200));
+  int ret = onion_listen(o);
+  onion_free(o);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "child") == 0)
+    return child();
+
+  START();
+
+  t01_drain();
+  t02_handoff();
+  t03_drain_while_accepting();
+  t04_drain_under_load();
+
+  END();
+}
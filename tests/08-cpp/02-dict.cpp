@@ -28,6 +28,12 @@
 #include <bindings/cpp/response.hpp>
 #include <bindings/cpp/url.hpp>
 #include <bindings/cpp/request.hpp>
+#include <onion/types_internal.h>
+#include <string.h>
+
+extern "C" {
+#include "../01-internal/buffer_listen_point.h"
+}
 
 
 void t01_basic(){ 
@@ -219,6 +225,74 @@ void t07_from_initializer_list(){
 	END_LOCAL();
 }
 
+void t08_views(){
+	INIT_LOCAL();
+#if __cplusplus >= 201703L
+	Onion::Dict d;
+	d.add("Hello", "World");
+	d.add("b", "2");
+	Onion::Dict sub;
+	sub.add("x", "y");
+	d.add("sub", sub);
+	
+	std::string_view v=d.getView("Hello");
+	FAIL_IF_NOT_EQUAL_STRING(std::string(v), "World");
+	FAIL_IF_NOT_EQUAL(v.data(), onion_dict_get(d.c_handler(), "Hello")); // No copy
+	FAIL_IF_NOT_EQUAL_STRING(std::string(d.getView(std::string_view("Hello, world").substr(0,5))), "World");
+	FAIL_IF_NOT_EQUAL_STRING(std::string(d.getView("none", "def")), "def");
+	FAIL_IF_NOT(d.has(std::string_view("b")));
+	FAIL_IF(d.has("none"));
+	FAIL_IF_NOT_EQUAL_STRING(d[std::string_view("b")], "2");
+	
+	std::string long_key(300, 'k');
+	d.add(long_key, "long");
+	FAIL_IF_NOT_EQUAL_STRING(std::string(d.getView(std::string_view(long_key))), "long");
+	
+	std::string keys;
+	int count=0;
+	d.forEach([&](std::string_view k, std::string_view v){
+		keys+=std::string(k.substr(0,5))+"="+std::string(v)+";";
+		count++;
+	});
+	FAIL_IF_NOT_EQUAL_INT(count, 3); // Subdicts are skipped
+	FAIL_IF_NOT_EQUAL_STRING(keys, "Hello=World;b=2;kkkkk=long;");
+#endif
+	END_LOCAL();
+}
+
+void t09_request_views(){
+	INIT_LOCAL();
+#if __cplusplus >= 201703L
+	onion *server=onion_new(0);
+	onion_add_listen_point(server, NULL, NULL, onion_buffer_listen_point_new());
+	onion_request *req=onion_request_new(server->listen_points[0]);
+	const char *data="GET /path/to?q=1&r=two HTTP/1.1\nHost: example.com\nCookie: c=3\n\n";
+	onion_request_write(req, data, strlen(data));
+	
+	Onion::Request r(req);
+	FAIL_IF_NOT_EQUAL_STRING(std::string(r.headerView("Host")), "example.com");
+	FAIL_IF_NOT_EQUAL_STRING(std::string(r.headerView("host")), "example.com");
+	FAIL_IF_NOT_EQUAL_STRING(std::string(r.headerView("None", "def")), "def");
+	FAIL_IF_NOT_EQUAL_STRING(r["Host"], "example.com");
+	FAIL_IF_NOT_EQUAL_STRING(std::string(r.queryView("r")), "two");
+	FAIL_IF_NOT_EQUAL_STRING(std::string(r.cookieView("c")), "3");
+	FAIL_IF_NOT_EQUAL_STRING(std::string(r.fullpathView()), "/path/to");
+	
+	bool thrown=false;
+	try{
+		r["None"];
+	}
+	catch(const Onion::Dict::key_not_found &e){
+		thrown=true;
+	}
+	FAIL_IF_NOT(thrown);
+	
+	onion_request_free(req);
+	onion_free(server);
+#endif
+	END_LOCAL();
+}
+
 int main(int argc, char **argv){
   START();
 	INFO("Remember to check with valgrind");
@@ -229,6 +303,8 @@ int main(int argc, char **argv){
 	t05_context();
 	t06_tomap();
 	t07_from_initializer_list();
+	t08_views();
+	t09_request_views();
 	
 	END();
 }
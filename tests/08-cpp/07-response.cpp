@@ -0,0 +1,119 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+#include <string>
+#include <string.h>
+
+#include "../ctest.h"
+
+#include <onion/onion.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/block.h>
+#include <onion/types_internal.h>
+#include <bindings/cpp/response.hpp>
+
+extern "C" {
+#include "../01-internal/buffer_listen_point.h"
+}
+
+#define FILL(a,b) onion_request_write(a,b,strlen(b))
+
+/// Runs fn with a response to the given request, and returns all the written data.
+template<typename F>
+std::string response_output(const char *request, F fn){
+  onion *server = onion_new(0);
+  onion_add_listen_point(server, NULL, NULL, onion_buffer_listen_point_new());
+  onion_request *req = onion_request_new(server->listen_points[0]);
+  FILL(req, request);
+  onion_response *cres = onion_response_new(req);
+  {
+    Onion::Response res(cres);
+    fn(res);
+  }
+  onion_response_free(cres);
+  std::string ret = onion_buffer_listen_point_get_buffer_data(req);
+  onion_request_free(req);
+  onion_free(server);
+  return ret;
+}
+
+void t01_stream(){
+  INIT_LOCAL();
+
+  std::string big(5000, 'x');
+  // HTTP/1.0, so its not chunked and the output is contiguous
+  std::string out = response_output("GET / HTTP/1.0\n\n", [&big](Onion::Response &res){
+    res<<"Hello "<<42<<' '<<std::hex<<255;
+#if __cplusplus >= 201703L
+    res.write(std::string_view(" view"));
+#else
+    res.write(std::string(" view"));
+#endif
+    res.printf(" %d-%s", 7, "x");
+    res<<big<<"end"<<std::endl;
+  });
+
+  FAIL_IF_NOT_STRSTR(out.c_str(), "HTTP/1.0 200 OK\r\n");
+  FAIL_IF_NOT_STRSTR(out.c_str(), "\r\n\r\nHello 42 ff view 7-x");
+  std::string tail = big + "end\n";  // Not a temporary, it must live while checked
+  FAIL_IF_NOT_STRSTR(out.c_str(), tail.c_str());
+
+  END_LOCAL();
+}
+
+void t02_mixed_with_c(){
+  INIT_LOCAL();
+
+  std::string out = response_output("GET / HTTP/1.1\n\n", [](Onion::Response &res){
+    res<<"a";
+    onion_response_write0(res.c_handler(), "b");
+    res<<"c";
+    res.write("d", 1);
+    res<<'e';
+  });
+  FAIL_IF_NOT_STRSTR(out.c_str(), "\r\n\r\nabcde");
+
+  END_LOCAL();
+}
+
+void t03_head(){
+  INIT_LOCAL();
+
+  std::string out = response_output("HEAD / HTTP/1.1\n\n", [](Onion::Response &res){
+    res<<"Not sent "<<1;
+    res.write("Neither", 7);
+  });
+  FAIL_IF_NOT_STRSTR(out.c_str(), "HTTP/1.1 200 OK\r\n");
+  FAIL_IF_STRSTR(out.c_str(), "sent");
+  FAIL_IF_STRSTR(out.c_str(), "Neither");
+
+  END_LOCAL();
+}
+
+int main(int argc, char **argv){
+  START();
+  t01_stream();
+  t02_mixed_with_c();
+  t03_head();
+  END();
+}
@@ -0,0 +1,150 @@
+/**
+  Onion HTTP server library
+  Copyright (C) 2010-2018 David Moreno Montero and others
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of, at your choice:
+
+  a. the Apache License Version 2.0.
+
+  b. the GNU General Public License as published by the
+  Free Software Foundation; either version 2.0 of the License,
+  or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of both licenses, if not see
+  <http://www.gnu.org/licenses/> and
+  <http://www.apache.org/licenses/LICENSE-2.0>.
+*/
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <string.h>
+#include <unistd.h>
+
+#include "../ctest.h"
+
+#include <onion/log.h>
+#include <bindings/cpp/onion.hpp>
+#include <bindings/cpp/url.hpp>
+#include <bindings/cpp/request.hpp>
+#include <bindings/cpp/response.hpp>
+#include <bindings/cpp/coroutine.hpp>
+
+extern "C" {
+#include "../01-internal/utils.h"
+}
+
+#define PORT "8089"
+
+using namespace std::chrono;
+
+/// Sends a request, if path is set, and returns the full answer, until the server closes.
+static std::string request(int fd, const char *path){
+  if (path){
+    std::string req = std::string("GET ") + path + " HTTP/1.0\r\n\r\n";
+    if (write(fd, req.data(), req.size()) != (ssize_t)req.size())
+      return "";
+  }
+  std::string ret;
+  char buffer[1024];
+  ssize_t r;
+  while ((r = read(fd, buffer, sizeof(buffer))) > 0)
+    ret.append(buffer, r);
+  close(fd);
+  return ret;
+}
+
+Onion::Task<int> answer(){
+  co_await Onion::sleep_for(milliseconds(10));
+  co_return 42;
+}
+
+Onion::Event event;
+
+void t01_coroutines(){
+  INIT_LOCAL();
+  // Just one poller thread, so all concurrent waits are done by it.
+  Onion::Onion o(O_POLL | O_DETACH_LISTEN);
+  o.setPort(PORT);
+  Onion::Url url(o);
+
+  url.add("sync", [](Onion::Request &req, Onion::Response &res) -> Onion::Coroutine {
+    res<<"sync";
+    co_return OCS_PROCESSED;
+  });
+  url.add("sleep", [](Onion::Request &req, Onion::Response &res) -> Onion::Coroutine {
+    res<<"before ";
+    co_await Onion::sleep_for(milliseconds(300));
+    res<<"after "<<req.fullpathView();
+    co_return OCS_PROCESSED;
+  });
+  url.add("task", [](Onion::Request &req, Onion::Response &res) -> Onion::Coroutine {
+    int a = co_await answer();
+    int b = co_await answer();
+    res<<"task "<<a+b;
+    co_return OCS_PROCESSED;
+  });
+  url.add("event", [](Onion::Request &req, Onion::Response &res) -> Onion::Coroutine {
+    co_await event.wait();
+    res<<"event";
+    co_return OCS_PROCESSED;
+  });
+  url.add("error", [](Onion::Request &req, Onion::Response &res) -> Onion::Coroutine {
+    throw Onion::HttpException("Not here", HTTP_NOT_FOUND);
+    co_return OCS_PROCESSED;
+  });
+  o.listen();
+  usleep(100000);
+
+  std::string out = request(connect_to("localhost", PORT), "/sync");
+  FAIL_IF_NOT_STRSTR(out.c_str(), "HTTP/1.0 200 OK");
+  FAIL_IF_NOT_STRSTR(out.c_str(), "\r\n\r\nsync");
+
+  out = request(connect_to("localhost", PORT), "/error");
+  FAIL_IF_NOT_STRSTR(out.c_str(), "HTTP/1.0 404");
+
+  out = request(connect_to("localhost", PORT), "/task");
+  FAIL_IF_NOT_STRSTR(out.c_str(), "task 84");
+
+  // Many concurrent sleeping handlers at a single thread; takes about the time of one.
+  auto start = steady_clock::now();
+  std::vector<int> fds;
+  for (int i = 0; i < 16; i++){
+    int fd = connect_to("localhost", PORT);
+    const char *req = "GET /sleep HTTP/1.0\r\n\r\n";
+    FAIL_IF_NOT_EQUAL_INT(write(fd, req, strlen(req)), strlen(req));
+    fds.push_back(fd);
+  }
+  int ok = 0;
+  for (int fd: fds){
+    out = request(fd, NULL);
+    if (out.find("before after /sleep") != std::string::npos)
+      ok++;
+  }
+  long ms = duration_cast<milliseconds>(steady_clock::now() - start).count();
+  ONION_INFO("16 requests waiting 300 ms each in %ld ms", ms);
+  FAIL_IF_NOT_EQUAL_INT(ok, 16);
+  FAIL_IF(ms > 1000);
+
+  int fd = connect_to("localhost", PORT);
+  const char *req = "GET /event HTTP/1.0\r\n\r\n";
+  FAIL_IF_NOT_EQUAL_INT(write(fd, req, strlen(req)), strlen(req));
+  usleep(100000);
+  event.set();
+  out = request(fd, NULL);
+  FAIL_IF_NOT_STRSTR(out.c_str(), "\r\n\r\nevent");
+
+  END_LOCAL();
+}
+
+int main(int argc, char **argv){
+  START();
+  t01_coroutines();
+  END();
+}